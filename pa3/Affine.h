@@ -0,0 +1,99 @@
+#pragma once
+#include <cmath>
+#include <wx/gdicmn.h>
+
+// 2x3 affine transform. Maps (x, y) to
+// (a * x + c * y + tx, b * x + d * y + ty).
+struct Affine
+{
+    Affine()
+        :a(1.0), b(0.0), c(0.0), d(1.0), tx(0.0), ty(0.0)
+    {
+    }
+    Affine(double a_, double b_, double c_, double d_, double tx_, double ty_)
+        :a(a_), b(b_), c(c_), d(d_), tx(tx_), ty(ty_)
+    {
+    }
+
+    static Affine Translate(double x, double y)
+    {
+        return Affine(1.0, 0.0, 0.0, 1.0, x, y);
+    }
+    // Scales about the point (x, y)
+    static Affine Scale(double sx, double sy, double x, double y)
+    {
+        return Affine(sx, 0.0, 0.0, sy, x - sx * x, y - sy * y);
+    }
+    // Rotates clockwise on screen (y points down) about (x, y)
+    static Affine Rotate(double radians, double x, double y)
+    {
+        double cs = std::cos(radians);
+        double sn = std::sin(radians);
+        return Affine(cs, sn, -sn, cs, x - cs * x + sn * y, y - sn * x - cs * y);
+    }
+
+    // This transform applied after other
+    Affine operator*(const Affine& other) const
+    {
+        return Affine(a * other.a + c * other.b,
+            b * other.a + d * other.b,
+            a * other.c + c * other.d,
+            b * other.c + d * other.d,
+            a * other.tx + c * other.ty + tx,
+            b * other.tx + d * other.ty + ty);
+    }
+    // Undoes this transform; a flattened one has no inverse, and gives
+    // the identity
+    Affine Inverse() const
+    {
+        double det = a * d - b * c;
+        if (det == 0.0)
+            return Affine();
+        double ia = d / det;
+        double ib = -b / det;
+        double ic = -c / det;
+        double id = a / det;
+        return Affine(ia, ib, ic, id, -(ia * tx + ic * ty), -(ib * tx + id * ty));
+    }
+
+    bool operator==(const Affine& other) const
+    {
+        return a == other.a && b == other.b && c == other.c && d == other.d &&
+            tx == other.tx && ty == other.ty;
+    }
+    bool operator!=(const Affine& other) const
+    {
+        return !(*this == other);
+    }
+
+    // Whether the transform only moves things, by a whole number of
+    // pixels, so integer geometry can just be offset
+    bool IsTranslation() const
+    {
+        return a == 1.0 && b == 0.0 && c == 0.0 && d == 1.0 &&
+            tx == std::floor(tx) && ty == std::floor(ty);
+    }
+    wxPoint GetTranslation() const
+    {
+        return wxPoint(static_cast<int>(tx), static_cast<int>(ty));
+    }
+
+    // How much lengths grow on average (the root of the area scale)
+    double GetScale() const
+    {
+        return std::sqrt(std::fabs(a * d - b * c));
+    }
+
+    wxPoint Apply(const wxPoint& point) const
+    {
+        return wxPoint(static_cast<int>(std::floor(a * point.x + c * point.y + tx + 0.5)),
+            static_cast<int>(std::floor(b * point.x + d * point.y + ty + 0.5)));
+    }
+    void Apply(double x, double y, double& outX, double& outY) const
+    {
+        outX = a * x + c * y + tx;
+        outY = b * x + d * y + ty;
+    }
+
+    double a, b, c, d, tx, ty;
+};
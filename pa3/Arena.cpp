@@ -0,0 +1,227 @@
+#include "Arena.h"
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+namespace
+{
+    std::atomic<std::size_t> sHeapAllocs(0);
+}
+
+// The global allocation functions are replaced only to count calls;
+// the array and nothrow forms go through these by default
+void* operator new(std::size_t bytes)
+{
+    sHeapAllocs.fetch_add(1, std::memory_order_relaxed);
+    if (bytes == 0)
+        bytes = 1;
+    for (;;)
+    {
+        void* ptr = std::malloc(bytes);
+        if (ptr)
+            return ptr;
+        std::new_handler handler = std::get_new_handler();
+        if (!handler)
+            throw std::bad_alloc();
+        handler();
+    }
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+std::size_t GetHeapAllocCount()
+{
+    return sHeapAllocs.load(std::memory_order_relaxed);
+}
+
+DocumentArena::DocumentArena()
+    :mCursor(nullptr)
+    ,mChunkEnd(nullptr)
+{
+    std::memset(mFreeLists, 0, sizeof(mFreeLists));
+    std::memset(&mStats, 0, sizeof(mStats));
+    for (int i = 0; i < MC_Count; i++)
+    {
+        mUsage[i] = 0;
+        mBudgets[i] = 0;
+    }
+}
+
+// Every allocator holds a reference, so by now each object has been
+// destroyed and handed back one at a time; this only returns the
+// chunks themselves to the heap
+DocumentArena::~DocumentArena()
+{
+    for (char* chunk : mChunks)
+    {
+        ::operator delete(chunk);
+    }
+}
+
+int DocumentArena::ClassIndex(std::size_t bytes)
+{
+    if (bytes == 0)
+        bytes = 1;
+    if (bytes <= kSmallMax)
+        return static_cast<int>((bytes + kSmallStep - 1) / kSmallStep) - 1;
+    if (bytes > kMediumMax)
+        return -1;
+
+    int index = kNumSmall;
+    std::size_t size = kSmallMax * 2;
+    while (size < bytes)
+    {
+        size *= 2;
+        ++index;
+    }
+    return index;
+}
+
+std::size_t DocumentArena::ClassSize(int index)
+{
+    if (index < kNumSmall)
+        return (index + 1) * kSmallStep;
+    return (kSmallMax * 2) << (index - kNumSmall);
+}
+
+void* DocumentArena::Carve(std::size_t bytes)
+{
+    // No pointer arithmetic on the null cursor of a fresh arena
+    if (mCursor == nullptr || bytes > static_cast<std::size_t>(mChunkEnd - mCursor))
+    {
+        // Whatever is left in the old chunk is abandoned; it is at most
+        // one medium block's worth
+        char* chunk = static_cast<char*>(::operator new(kChunkSize));
+        mChunks.push_back(chunk);
+        mCursor = chunk;
+        mChunkEnd = chunk + kChunkSize;
+        mStats.heapAllocs++;
+        mStats.bytesReserved += kChunkSize;
+    }
+    void* retVal = mCursor;
+    mCursor += bytes;
+    return retVal;
+}
+
+void* DocumentArena::Allocate(std::size_t bytes, MemoryCategory category)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    int index = ClassIndex(bytes);
+    if (index < 0)
+    {
+        mUsage[category] += bytes;
+        mStats.heapAllocs++;
+        mStats.bytesReserved += bytes;
+        mStats.bytesInUse += bytes;
+        return ::operator new(bytes);
+    }
+
+    std::size_t size = ClassSize(index);
+    mStats.poolAllocs++;
+    mStats.bytesInUse += size;
+    mUsage[category] += size;
+
+    FreeNode* node = mFreeLists[index];
+    if (node)
+    {
+        mFreeLists[index] = node->next;
+        return node;
+    }
+    return Carve(size);
+}
+
+void DocumentArena::Deallocate(void* ptr, std::size_t bytes, MemoryCategory category)
+{
+    if (ptr == nullptr)
+        return;
+
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    int index = ClassIndex(bytes);
+    if (index < 0)
+    {
+        mUsage[category] -= bytes;
+        mStats.bytesReserved -= bytes;
+        mStats.bytesInUse -= bytes;
+        ::operator delete(ptr);
+        return;
+    }
+
+    FreeNode* node = static_cast<FreeNode*>(ptr);
+    node->next = mFreeLists[index];
+    mFreeLists[index] = node;
+    mStats.poolFrees++;
+    mStats.bytesInUse -= ClassSize(index);
+    mUsage[category] -= ClassSize(index);
+}
+
+DocumentArena::Stats DocumentArena::GetStats() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mStats;
+}
+
+DocumentArena::Usage DocumentArena::GetUsage() const
+{
+    Usage usage;
+    for (int i = 0; i < MC_Count; i++)
+    {
+        usage.bytes[i] = mUsage[i];
+        usage.budgets[i] = mBudgets[i];
+    }
+    return usage;
+}
+
+std::size_t DocumentArena::Usage::Total() const
+{
+    std::size_t total = 0;
+    for (int i = 0; i < MC_Count; i++)
+    {
+        total += bytes[i];
+    }
+    return total;
+}
+
+const char* DocumentArena::CategoryName(MemoryCategory category)
+{
+    switch (category)
+    {
+        case MC_Geometry:
+            return "Geometry";
+        case MC_Styles:
+            return "Styles";
+        case MC_History:
+            return "History";
+        case MC_Rasters:
+            return "Rasters";
+        case MC_Caches:
+            return "Caches";
+        default:
+            return "";
+    }
+}
+
+void MemoryCharge::Set(const std::shared_ptr<DocumentArena>& arena, MemoryCategory category, std::size_t bytes)
+{
+    if (mArena)
+        mArena->Release(mCategory, mBytes);
+    mArena = arena;
+    mCategory = category;
+    mBytes = 0;
+    Set(bytes);
+}
+
+void MemoryCharge::Set(std::size_t bytes)
+{
+    // Charged before released, so readers never see the count wrap
+    if (mArena)
+    {
+        mArena->Charge(mCategory, bytes);
+        mArena->Release(mCategory, mBytes);
+    }
+    mBytes = mArena ? bytes : 0;
+}
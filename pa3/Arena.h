@@ -0,0 +1,257 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// What a document's memory is used for (see DocumentArena::GetUsage)
+enum MemoryCategory
+{
+    // Pencil points and fill rectangles
+    MC_Geometry,
+    // Shape records, which hold each shape's style, transform and bounds
+    MC_Styles,
+    // Undo and redo commands, including image tiles kept by filters
+    MC_History,
+    // The imported image and the copies made for display
+    MC_Rasters,
+    // Anything that's rebuilt on demand: render tiles, instance
+    // rasters and decimated strokes
+    MC_Caches,
+    MC_Count
+};
+
+// Per-document pool allocator. Shapes, commands and pencil point
+// storage are carved out of large chunks and recycled through
+// size-class free lists, so steady-state drawing rarely touches the heap.
+//
+// Every allocation is also counted against a MemoryCategory, along with
+// memory charged from outside the arena (see MemoryCharge), so the
+// document's usage can be read at any time without walking it. Soft
+// budgets don't stop anything being allocated; the model and renderer
+// check them and drop old history and caches to get back under.
+class DocumentArena
+{
+public:
+    // Bytes in use and budget (0 for none) per category
+    struct Usage
+    {
+        std::size_t bytes[MC_Count];
+        std::size_t budgets[MC_Count];
+        
+        std::size_t Total() const;
+        bool IsOverBudget(MemoryCategory category) const
+        {
+            return budgets[category] != 0 && bytes[category] > budgets[category];
+        }
+    };
+    
+    struct Stats
+    {
+        // Allocations that had to go to the system heap (new chunks,
+        // oversized blocks)
+        std::size_t heapAllocs;
+        // Allocations served from a pool (fresh carve or free list)
+        std::size_t poolAllocs;
+        // Blocks returned to a free list
+        std::size_t poolFrees;
+        // Total bytes obtained from the heap
+        std::size_t bytesReserved;
+        // Bytes currently handed out to callers
+        std::size_t bytesInUse;
+    };
+
+    DocumentArena();
+    ~DocumentArena();
+
+    void* Allocate(std::size_t bytes, MemoryCategory category);
+    void Deallocate(void* ptr, std::size_t bytes, MemoryCategory category);
+
+    Stats GetStats() const;
+    
+    // Counts memory held outside the arena, safe from any thread
+    void Charge(MemoryCategory category, std::size_t bytes)
+    {
+        mUsage[category] += bytes;
+    }
+    void Release(MemoryCategory category, std::size_t bytes)
+    {
+        mUsage[category] -= bytes;
+    }
+    std::size_t GetBytes(MemoryCategory category) const
+    {
+        return mUsage[category];
+    }
+    Usage GetUsage() const;
+    
+    void SetBudget(MemoryCategory category, std::size_t bytes)
+    {
+        mBudgets[category] = bytes;
+    }
+    std::size_t GetBudget(MemoryCategory category) const
+    {
+        return mBudgets[category];
+    }
+    bool IsOverBudget(MemoryCategory category) const
+    {
+        std::size_t budget = mBudgets[category];
+        return budget != 0 && mUsage[category] > budget;
+    }
+    
+    static const char* CategoryName(MemoryCategory category);
+
+    // Disallow copy/assignment
+    DocumentArena(const DocumentArena&) = delete;
+    DocumentArena& operator=(const DocumentArena&) = delete;
+private:
+    // Small blocks are pooled in 16 byte steps, medium blocks in
+    // power-of-two steps, anything larger goes straight to the heap
+    static const std::size_t kSmallStep = 16;
+    static const std::size_t kSmallMax = 256;
+    static const std::size_t kMediumMax = 64 * 1024;
+    static const std::size_t kChunkSize = 256 * 1024;
+    static const int kNumSmall = kSmallMax / kSmallStep;
+    static const int kNumMedium = 8; // 512 .. 64K
+    static const int kNumClasses = kNumSmall + kNumMedium;
+
+    struct FreeNode
+    {
+        FreeNode* next;
+    };
+
+    // Returns the size class for a request, or -1 if it is too big to pool
+    static int ClassIndex(std::size_t bytes);
+    static std::size_t ClassSize(int index);
+
+    void* Carve(std::size_t bytes);
+
+    FreeNode* mFreeLists[kNumClasses];
+    std::vector<char*> mChunks;
+    char* mCursor;
+    char* mChunkEnd;
+    Stats mStats;
+    mutable std::mutex mMutex;
+    std::atomic<std::size_t> mUsage[MC_Count];
+    std::atomic<std::size_t> mBudgets[MC_Count];
+};
+
+// Calls to the global operator new since the program started, from any
+// thread. Arena misses are only part of it; shared_ptr control blocks,
+// snapshots and wx's own objects all go through here too.
+std::size_t GetHeapAllocCount();
+
+// Charges memory the arena didn't allocate, like images and command
+// tiles, to a category of a document for as long as it's alive
+class MemoryCharge
+{
+public:
+    MemoryCharge()
+        :mCategory(MC_Caches)
+        ,mBytes(0)
+    {
+    }
+    ~MemoryCharge()
+    {
+        Set(0);
+    }
+    
+    // Moves the charge to this document and category
+    void Set(const std::shared_ptr<DocumentArena>& arena, MemoryCategory category, std::size_t bytes);
+    // Changes the amount charged to the same place
+    void Set(std::size_t bytes);
+    
+    std::size_t GetBytes() const
+    {
+        return mBytes;
+    }
+    
+    // Disallow copy/assignment
+    MemoryCharge(const MemoryCharge&) = delete;
+    MemoryCharge& operator=(const MemoryCharge&) = delete;
+private:
+    std::shared_ptr<DocumentArena> mArena;
+    MemoryCategory mCategory;
+    std::size_t mBytes;
+};
+
+// STL-compatible allocator backed by a DocumentArena. A default
+// constructed allocator (no arena) falls back to the global heap.
+// Rebound copies count against the same category unless given another.
+template <class T>
+class ArenaAllocator
+{
+public:
+    typedef T value_type;
+
+    ArenaAllocator()
+        :mCategory(MC_Styles)
+    {
+    }
+    ArenaAllocator(const std::shared_ptr<DocumentArena>& arena, MemoryCategory category)
+        :mArena(arena)
+        ,mCategory(category)
+    {
+    }
+    template <class U>
+    ArenaAllocator(const ArenaAllocator<U>& other)
+        :mArena(other.GetArena())
+        ,mCategory(other.GetCategory())
+    {
+    }
+    template <class U>
+    ArenaAllocator(const ArenaAllocator<U>& other, MemoryCategory category)
+        :mArena(other.GetArena())
+        ,mCategory(category)
+    {
+    }
+
+    T* allocate(std::size_t n)
+    {
+        if (mArena)
+            return static_cast<T*>(mArena->Allocate(n * sizeof(T), mCategory));
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T* ptr, std::size_t n)
+    {
+        if (mArena)
+            mArena->Deallocate(ptr, n * sizeof(T), mCategory);
+        else
+            ::operator delete(ptr);
+    }
+
+    template <class U>
+    struct rebind
+    {
+        typedef ArenaAllocator<U> other;
+    };
+
+    const std::shared_ptr<DocumentArena>& GetArena() const
+    {
+        return mArena;
+    }
+    MemoryCategory GetCategory() const
+    {
+        return mCategory;
+    }
+private:
+    std::shared_ptr<DocumentArena> mArena;
+    MemoryCategory mCategory;
+};
+
+template <class T, class U>
+bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b)
+{
+    return a.GetArena() == b.GetArena();
+}
+
+template <class T, class U>
+bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b)
+{
+    return !(a == b);
+}
+
+// Vector whose storage lives in the owning document's arena
+template <class T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
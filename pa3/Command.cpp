@@ -1,12 +1,19 @@
 #include "Command.h"
 #include "Shape.h"
 #include "PaintModel.h"
+#include "Layer.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <iostream>
 
 Command::Command(const wxPoint& start, std::shared_ptr<Shape> shape)
 	:mStartPoint(start)
 	,mEndPoint(start)
 	,mShape(shape)
+	,mShapeId(shape ? shape->GetId() : 0)
+	,mIndex(Layer::kNoShape)
 {
 
 }
@@ -23,51 +30,90 @@ std::shared_ptr<Command> CommandFactory::Create(std::shared_ptr<PaintModel> mode
 	std::shared_ptr<Command> retVal;
     std::shared_ptr<Shape> sharedShape;
     
-	// TODO: Actually create a command based on the type passed in
+    // Commands and shapes live in the document's arena, so the
+    // control block and the object come from a single pool block
+    ArenaAllocator<Command> alloc(model->GetArena(), MC_History);
+    ArenaAllocator<Shape> shapeAlloc(model->GetArena(), MC_Styles);
     
     switch (type) {
         case CM_DrawRect:
-            sharedShape = std::make_shared<RectShape>(start);
-            retVal = std::make_shared<DrawCommand> (start, sharedShape);
+            sharedShape = std::allocate_shared<RectShape>(shapeAlloc, start, shapeAlloc);
+            retVal = std::allocate_shared<DrawCommand> (alloc, start, sharedShape);
             model->AddShape(sharedShape);
             break;
         case CM_DrawEllipse:
-            sharedShape = std::make_shared<EllipseShape>(start);
-            retVal = std::make_shared<DrawCommand> (start, sharedShape);
+            sharedShape = std::allocate_shared<EllipseShape>(shapeAlloc, start, shapeAlloc);
+            retVal = std::allocate_shared<DrawCommand> (alloc, start, sharedShape);
             model->AddShape(sharedShape);
             break;
         case CM_DrawLine:
-            sharedShape = std::make_shared<LineShape>(start);
-            retVal = std::make_shared<DrawCommand> (start, sharedShape);
+            sharedShape = std::allocate_shared<LineShape>(shapeAlloc, start, shapeAlloc);
+            retVal = std::allocate_shared<DrawCommand> (alloc, start, sharedShape);
             model->AddShape(sharedShape);
             break;
         case CM_DrawPencil:
-            sharedShape = std::make_shared<PencilShape>(start);
-            retVal = std::make_shared<DrawCommand> (start, sharedShape);
+            sharedShape = std::allocate_shared<PencilShape>(shapeAlloc, start, shapeAlloc);
+            retVal = std::allocate_shared<DrawCommand> (alloc, start, sharedShape);
             model->AddShape(sharedShape);
             break;
+        case CM_Fill:
+        {
+            std::shared_ptr<FillShape> fill = std::allocate_shared<FillShape>(shapeAlloc, start, shapeAlloc);
+            std::vector<FillSpan> spans;
+            if (!model->FillRegion(start, spans))
+                break;
+            fill->SetSpans(spans);
+            sharedShape = fill;
+            retVal = std::allocate_shared<DrawCommand> (alloc, start, sharedShape);
+            model->AddShape(sharedShape);
+            break;
+        }
+        case CM_Filter:
+            retVal = std::allocate_shared<FilterCommand> (alloc, start, sharedShape);
+            break;
         case CM_SetPen:
-            retVal = std::make_shared<SetPenCommand> (start, sharedShape);
+            retVal = std::allocate_shared<SetPenCommand> (alloc, start, sharedShape);
             break;
         case CM_SetBrush:
-            retVal = std::make_shared<SetBrushCommand> (start, sharedShape);
+            retVal = std::allocate_shared<SetBrushCommand> (alloc, start, sharedShape);
             break;
         case CM_Delete:
-            retVal = std::make_shared<DeleteCommand> (start, sharedShape);
+            retVal = std::allocate_shared<DeleteCommand> (alloc, start, sharedShape);
+            break;
+        case CM_Group:
+            retVal = std::allocate_shared<GroupCommand> (alloc, start, sharedShape);
+            break;
+        case CM_Ungroup:
+            retVal = std::allocate_shared<UngroupCommand> (alloc, start, sharedShape);
+            break;
+        case CM_ZOrder:
+            retVal = std::allocate_shared<ZOrderCommand> (alloc, start, sharedShape);
+            break;
+        case CM_Paste:
+            retVal = std::allocate_shared<PasteCommand> (alloc, start, sharedShape);
+            break;
+        case CM_AddShapes:
+            retVal = std::allocate_shared<AddShapesCommand> (alloc, start, sharedShape);
             break;
         case CM_Move:
-            sharedShape = model->GetSelectedShape();
-            retVal = std::make_shared<MoveCommand> (start, sharedShape);
+        case CM_Transform:
+            sharedShape = std::const_pointer_cast<Shape>(model->GetSelectedShape());
+            retVal = std::allocate_shared<TransformCommand> (alloc, start, sharedShape);
             break;
         default:
             break;
     }
     
+    if (retVal)
+    {
+        retVal->SetLayer(model->GetActiveLayer());
+    }
 	return retVal;
 }
 
 
 DrawCommand::DrawCommand(const wxPoint& start, std::shared_ptr<Shape> shape) : Command::Command(start, shape)
+    ,mRemoved(false)
 {
 
 }
@@ -76,32 +122,50 @@ void DrawCommand::Update(const wxPoint &newPoint)
 {
     
     Command::Update(newPoint);
-    mShape->Update(newPoint);
+    // Someone in a live session may have removed it mid-stroke
+    mIndex = mLayer->Find(mShapeId, mIndex);
+    if (mIndex != Layer::kNoShape)
+        mLayer->Edit(mIndex).Update(newPoint);
     
 }
 
 void DrawCommand::Finalize(std::shared_ptr<PaintModel> model)
 {
-    mShape->Finalize();
-    model->undo.push_back(model->GetActiveCommand());
+    // Simplifying a long stroke can take a while, so it waits until
+    // nothing else is going on
+    model->FinalizeLater(mLayer, mShapeId);
+    model->GetHistory().Add(model->GetActiveCommand());
     model->GetActiveCommand().reset();
 }
 void DrawCommand::Undo(std::shared_ptr<PaintModel> model)
 {
    
-    model->GetShapes().pop_back();
+    // Keep the version being removed so redo puts back exactly that
+    mIndex = mLayer->Find(mShapeId, mIndex);
+    mRemoved = (mIndex != Layer::kNoShape);
+    if (mRemoved)
+    {
+        mShape = mLayer->At(mIndex);
+        mLayer->Erase(mIndex);
+    }
     model->Undo();
     
 }
 
 void DrawCommand::Redo(std::shared_ptr<PaintModel> model)
 {
-    model->GetShapes().push_back((*(model->redo.back())).getShape());
+    if (mRemoved)
+    {
+        mLayer->Insert(mIndex, mShape);
+        // In case it was undone before it was finalized
+        model->FinalizeLater(mLayer, mShapeId);
+    }
     model->Redo();
 
 }
 
 SetPenCommand::SetPenCommand(const wxPoint& start, std::shared_ptr<Shape> shape) : Command::Command(start, shape)
+    ,mHasShape(false)
 {
 
 }
@@ -109,40 +173,30 @@ SetPenCommand::SetPenCommand(const wxPoint& start, std::shared_ptr<Shape> shape)
 
 void SetPenCommand::Finalize(std::shared_ptr<PaintModel> model)
 {
-    model->undo.push_back(model->GetActiveCommand());
+    model->GetHistory().Add(model->GetActiveCommand());
     model->GetActiveCommand().reset();
     
-    if (model->GetSelectedShape())
+    std::shared_ptr<const Shape> selected = model->GetSelectedShape();
+    if (selected)
     {
-        model->GetSelectedShape()->undoPen.push_back(model->GetPen());
-        shape = model->GetSelectedShape();
-        
+        mHasShape = true;
+        mShapeId = selected->GetId();
+        mBefore = selected->GetStyle();
     }
 }
 void SetPenCommand::Undo(std::shared_ptr<PaintModel> model)
 {
-    model->redoPen.push_back(model->GetPen());
-
-    if (shape)
+    mIndex = mHasShape ? mLayer->Find(mShapeId, mIndex) : Layer::kNoShape;
+    if (mIndex != Layer::kNoShape)
     {
-        
-        auto iter = model->GetShapes().begin();
-        
-        for (; iter!= model->GetShapes().end(); ++iter){
-            if (*iter == shape)
-            {
-                (*iter)->redoPen.push_back( (*iter)->GetPen());
-                (*iter)->SetPenColor((*iter)->undoPen.back().GetColour());
-
-                (*iter)->SetWidth((*iter)->undoPen.back().GetWidth());
-                (*iter)->undoPen.pop_back();
-            }
-        }
+        Shape& shape = mLayer->Edit(mIndex);
+        mAfter = shape.GetStyle();
+        ShapeStyle style = mAfter;
+        style.penColor = mBefore.penColor;
+        style.penWidth = mBefore.penWidth;
+        shape.SetStyle(style);
     }
 
-    //model->SetWidth(model->undoPen.back().GetWidth());
-    //model->SetPenColor(model->undoPen.back().GetColour());
-    model->undoPen.pop_back();
     model->Undo();
     
     
@@ -150,33 +204,23 @@ void SetPenCommand::Undo(std::shared_ptr<PaintModel> model)
 
 void SetPenCommand::Redo(std::shared_ptr<PaintModel> model)
 {
-    model->undoPen.push_back(model->GetPen());
-    
-    if (shape)
+    mIndex = mHasShape ? mLayer->Find(mShapeId, mIndex) : Layer::kNoShape;
+    if (mIndex != Layer::kNoShape)
     {
-        auto iter = model->GetShapes().begin();
-        
-        for (; iter!= model->GetShapes().end(); ++iter){
-            if (*iter == shape)
-            {
-
-                (*iter)->undoPen.push_back( (*iter)->GetPen());
-                (*iter)->SetPenColor((*iter)->redoPen.back().GetColour());
-                (*iter)->SetWidth((*iter)->redoPen.back().GetWidth());
-                (*iter)->redoPen.pop_back();
-            }
-        }
+        Shape& shape = mLayer->Edit(mIndex);
+        ShapeStyle style = shape.GetStyle();
+        style.penColor = mAfter.penColor;
+        style.penWidth = mAfter.penWidth;
+        shape.SetStyle(style);
     }
 
-//    model->SetWidth(model->redoPen.back().GetWidth());
-  //  model->SetPenColor(model->redoPen.back().GetColour());
-    model->redoPen.pop_back();
     model->Redo();
    
 }
 
 
 SetBrushCommand::SetBrushCommand(const wxPoint& start, std::shared_ptr<Shape> shape) : Command::Command(start, shape)
+    ,mHasShape(false)
 {
     
 }
@@ -184,61 +228,46 @@ SetBrushCommand::SetBrushCommand(const wxPoint& start, std::shared_ptr<Shape> sh
 
 void SetBrushCommand::Finalize(std::shared_ptr<PaintModel> model)
 {
-    model->undo.push_back(model->GetActiveCommand());
+    model->GetHistory().Add(model->GetActiveCommand());
     model->GetActiveCommand().reset();
     
-    if (model->GetSelectedShape())
+    std::shared_ptr<const Shape> selected = model->GetSelectedShape();
+    if (selected)
     {
-        model->GetSelectedShape()->undoBrush.push_back(model->GetBrush());
-        shape = model->GetSelectedShape();
-
+        mHasShape = true;
+        mShapeId = selected->GetId();
+        mBefore = selected->GetStyle();
     }
 
 }
 void SetBrushCommand::Undo(std::shared_ptr<PaintModel> model)
 {
     
-    model->redoBrush.push_back(model->GetBrush());
-    if (shape)
+    mIndex = mHasShape ? mLayer->Find(mShapeId, mIndex) : Layer::kNoShape;
+    if (mIndex != Layer::kNoShape)
     {
-        auto iter = model->GetShapes().begin();
-        
-        for (; iter!= model->GetShapes().end(); ++iter){
-            if (*iter == shape)
-            {
-                (*iter)->redoBrush.push_back( (*iter)->GetBrush());
-                (*iter)->SetBColor((*iter)->undoBrush.back().GetColour());
-                (*iter)->undoBrush.pop_back();
-            }
-        }
+        Shape& shape = mLayer->Edit(mIndex);
+        mAfter = shape.GetStyle();
+        ShapeStyle style = mAfter;
+        style.brushColor = mBefore.brushColor;
+        shape.SetStyle(style);
     }
- //   model->SetBColor(model->undoBrush.back().GetColour());
 
-    model->undoBrush.pop_back();
     model->Undo();
     
 }
 
 void SetBrushCommand::Redo(std::shared_ptr<PaintModel> model)
 {
-    model->undoBrush.push_back(model->GetBrush());
-    if (shape)
+    mIndex = mHasShape ? mLayer->Find(mShapeId, mIndex) : Layer::kNoShape;
+    if (mIndex != Layer::kNoShape)
     {
-        auto iter = model->GetShapes().begin();
-        
-        for (; iter!= model->GetShapes().end(); ++iter){
-            if (*iter == shape)
-            {
-                (*iter)->undoBrush.push_back( (*iter)->GetBrush());
-                (*iter)->SetBColor((*iter)->redoBrush.back().GetColour());
-                (*iter)->redoBrush.pop_back();
-            }
-        }
+        Shape& shape = mLayer->Edit(mIndex);
+        ShapeStyle style = shape.GetStyle();
+        style.brushColor = mAfter.brushColor;
+        shape.SetStyle(style);
     }
-    
-  //  model->SetBColor(model->redoBrush.back().GetColour());
 
-    model->redoBrush.pop_back();
     model->Redo();
 
 }
@@ -251,56 +280,589 @@ DeleteCommand::DeleteCommand(const wxPoint& start, std::shared_ptr<Shape> shape)
 
 void DeleteCommand::Finalize(std::shared_ptr<PaintModel> model)
 {
-    model->undoShape.push_back(model->GetSelectedShape());
-    model->RemoveShape(model->GetSelectedShape());
-    model->GetSelectedShape().reset();
+    std::shared_ptr<const Shape> selected = model->GetSelectedShape();
+    if (selected)
+    {
+        mShapeId = selected->GetId();
+        mIndex = mLayer->Find(mShapeId);
+        mShape = mLayer->At(mIndex);
+        mLayer->Erase(mIndex);
+    }
+    model->ClearSelection();
     
-    model->undo.push_back(model->GetActiveCommand());
+    model->GetHistory().Add(model->GetActiveCommand());
     model->GetActiveCommand().reset();
 }
 void DeleteCommand::Undo(std::shared_ptr<PaintModel> model)
 {
-    model->AddShape(model->undoShape.back());
-    model->redoShape.push_back(model->undoShape.back());
-    model->undoShape.pop_back();
+    // Back where it was, pen and brush included
+    if (mShape)
+        mLayer->Insert(mIndex, mShape);
     model->Undo();
 }
 
 void DeleteCommand::Redo(std::shared_ptr<PaintModel> model)
 {
-    model->RemoveShape(model->redoShape.back());
-    model->undoShape.push_back(model->redoShape.back());
-    model->redoShape.pop_back();
+    mIndex = mShape ? mLayer->Find(mShapeId, mIndex) : Layer::kNoShape;
+    if (mIndex != Layer::kNoShape)
+    {
+        mShape = mLayer->At(mIndex);
+        mLayer->Erase(mIndex);
+    }
+    model->Redo();
+    
+}
+
+
+TransformCommand::TransformCommand(const wxPoint& start, std::shared_ptr<Shape> shape) : Command::Command(start, shape)
+    ,mHandle(HD_Move)
+{
+    if (shape)
+    {
+        mBefore = mAfter = shape->GetTransform();
+        shape->GetBounds(mTopLeft, mBotRight);
+    }
+}
+
+Affine TransformCommand::Dragged(const wxPoint& point) const
+{
+    double left = mTopLeft.x;
+    double top = mTopLeft.y;
+    double right = mBotRight.x;
+    double bottom = mBotRight.y;
+    
+    if (mHandle == HD_Move)
+    {
+        return Affine::Translate(point.x - mStartPoint.x, point.y - mStartPoint.y) * mBefore;
+    }
+    
+    if (mHandle == HD_Rotate)
+    {
+        double x = (left + right) / 2.0;
+        double y = (top + bottom) / 2.0;
+        double angle = std::atan2(point.y - y, point.x - x) -
+            std::atan2(mStartPoint.y - y, mStartPoint.x - x);
+        return Affine::Rotate(angle, x, y) * mBefore;
+    }
+    
+    // The dragged side follows the pointer and the opposite one stays;
+    // sides the handle doesn't touch keep their scale
+    double anchorX = (mHandle == HD_TopLeft || mHandle == HD_Left || mHandle == HD_BotLeft) ? right : left;
+    double anchorY = (mHandle == HD_TopLeft || mHandle == HD_Top || mHandle == HD_TopRight) ? bottom : top;
+    double scaleX = 1.0;
+    double scaleY = 1.0;
+    if (mHandle != HD_Top && mHandle != HD_Bot && right > left)
+    {
+        double from = (anchorX == right) ? left - right : right - left;
+        scaleX = (point.x - anchorX) / from;
+    }
+    if (mHandle != HD_Left && mHandle != HD_Right && bottom > top)
+    {
+        double from = (anchorY == bottom) ? top - bottom : bottom - top;
+        scaleY = (point.y - anchorY) / from;
+    }
+    
+    // Dragging past the anchor mirrors the shape, but it never
+    // collapses to nothing
+    const double kMinScale = 0.01;
+    if (std::fabs(scaleX) < kMinScale)
+        scaleX = (scaleX < 0.0) ? -kMinScale : kMinScale;
+    if (std::fabs(scaleY) < kMinScale)
+        scaleY = (scaleY < 0.0) ? -kMinScale : kMinScale;
+    return Affine::Scale(scaleX, scaleY, anchorX, anchorY) * mBefore;
+}
+
+void TransformCommand::Apply(const Affine& transform)
+{
+    mIndex = mShape ? mLayer->Find(mShapeId, mIndex) : Layer::kNoShape;
+    if (mIndex != Layer::kNoShape)
+        mLayer->Edit(mIndex).SetTransform(transform);
+}
+
+void TransformCommand::Update(const wxPoint &newPoint)
+{
+    Command::Update(newPoint);
+    mAfter = Dragged(newPoint);
+    Apply(mAfter);
+    
+}
+
+
+void TransformCommand::Finalize(std::shared_ptr<PaintModel> model)
+{
+    // A click without a drag changes nothing worth undoing
+    if (mShape && mAfter != mBefore)
+        model->GetHistory().Add(model->GetActiveCommand());
+    model->GetActiveCommand().reset();
+}
+void TransformCommand::Undo(std::shared_ptr<PaintModel> model)
+{
+    Apply(mBefore);
+    model->Undo();
+}
+
+void TransformCommand::Redo(std::shared_ptr<PaintModel> model)
+{
+    Apply(mAfter);
+    model->Redo();
+    
+}
+
+
+GroupCommand::GroupCommand(const wxPoint& start, std::shared_ptr<Shape> shape) : Command::Command(start, shape)
+    ,mHasGroup(true)
+{
+    
+}
+
+void GroupCommand::Finalize(std::shared_ptr<PaintModel> model)
+{
+    mIndices = model->GetSelectedIndices();
+    if (mIndices.size() < 2)
+    {
+        model->GetActiveCommand().reset();
+        return;
+    }
+    
+    // The group gets copies of its own, which nothing edits in place
+    std::vector<std::shared_ptr<Shape>> copies;
+    for (size_t index : mIndices)
+    {
+        mChildren.push_back(mLayer->At(index));
+        copies.push_back(mLayer->At(index)->Clone());
+    }
+    ArenaAllocator<Shape> alloc(model->GetArena(), MC_Styles);
+    mShape = std::allocate_shared<GroupShape>(alloc, copies, alloc);
+    mShapeId = mShape->GetId();
+    Join();
+    model->Select(mShapeId);
+    
+    model->GetHistory().Add(model->GetActiveCommand());
+    model->GetActiveCommand().reset();
+}
+
+void GroupCommand::Join()
+{
+    // Children a peer removed are dropped, so Split won't restore them
+    size_t kept = mChildren.size();
+    for (size_t i = mChildren.size(); i > 0; i--)
+    {
+        size_t index = mLayer->Find(mChildren[i - 1]->GetId(), mIndices[i - 1]);
+        if (index != Layer::kNoShape)
+        {
+            mLayer->Erase(index);
+            continue;
+        }
+        mChildren.erase(mChildren.begin() + (i - 1));
+        mIndices.erase(mIndices.begin() + (i - 1));
+        kept--;
+    }
+    if (mHasGroup)
+    {
+        size_t top = mIndices.empty() ? mLayer->GetCount() : mIndices.back() + 1 - kept;
+        mIndex = std::min(top, mLayer->GetCount());
+        mLayer->Insert(mIndex, mShape);
+    }
+}
+
+void GroupCommand::Split()
+{
+    mIndex = mLayer->Find(mShapeId, mIndex);
+    mHasGroup = (mIndex != Layer::kNoShape);
+    if (mHasGroup)
+        mLayer->Erase(mIndex);
+    for (size_t i = 0; i < mChildren.size(); i++)
+    {
+        mLayer->Insert(std::min(mIndices[i], mLayer->GetCount()), mChildren[i]);
+    }
+}
+
+void GroupCommand::Undo(std::shared_ptr<PaintModel> model)
+{
+    Split();
+    model->Undo();
+}
+
+void GroupCommand::Redo(std::shared_ptr<PaintModel> model)
+{
+    Join();
+    model->Redo();
+}
+
+UngroupCommand::UngroupCommand(const wxPoint& start, std::shared_ptr<Shape> shape) : Command::Command(start, shape)
+    ,mHasGroup(false)
+{
+    
+}
+
+void UngroupCommand::Finalize(std::shared_ptr<PaintModel> model)
+{
+    std::shared_ptr<const GroupShape> group =
+        std::dynamic_pointer_cast<const GroupShape>(model->GetSelectedShape());
+    if (!group)
+    {
+        model->GetActiveCommand().reset();
+        return;
+    }
+    
+    mShapeId = group->GetId();
+    mIndex = mLayer->Find(mShapeId);
+    mShape = mLayer->At(mIndex);
+    mChildren = group->Ungroup();
+    Split();
+    model->ClearSelection();
+    
+    model->GetHistory().Add(model->GetActiveCommand());
+    model->GetActiveCommand().reset();
+}
+
+void UngroupCommand::Split()
+{
+    size_t index = mLayer->Find(mShapeId, mIndex);
+    mHasGroup = (index != Layer::kNoShape);
+    if (mHasGroup)
+    {
+        mIndex = index;
+        mLayer->Erase(mIndex);
+    }
+    mIndex = std::min(mIndex, mLayer->GetCount());
+    for (size_t i = 0; i < mChildren.size(); i++)
+    {
+        mLayer->Insert(mIndex + i, mChildren[i]);
+    }
+}
+
+void UngroupCommand::Join()
+{
+    // Children a peer removed are dropped, so Split won't restore them
+    for (size_t i = mChildren.size(); i > 0; i--)
+    {
+        size_t index = mLayer->Find(mChildren[i - 1]->GetId(), mIndex + i - 1);
+        if (index != Layer::kNoShape)
+            mLayer->Erase(index);
+        else
+            mChildren.erase(mChildren.begin() + (i - 1));
+    }
+    if (mHasGroup)
+        mLayer->Insert(std::min(mIndex, mLayer->GetCount()), mShape);
+}
+
+void UngroupCommand::Undo(std::shared_ptr<PaintModel> model)
+{
+    Join();
+    model->Undo();
+}
+
+void UngroupCommand::Redo(std::shared_ptr<PaintModel> model)
+{
+    Split();
     model->Redo();
+}
+
+
+ZOrderCommand::ZOrderCommand(const wxPoint& start, std::shared_ptr<Shape> shape) : Command::Command(start, shape)
+    ,mType(ZO_Front)
+    ,mFrom(0)
+    ,mTo(0)
+{
+    
+}
+
+void ZOrderCommand::Finalize(std::shared_ptr<PaintModel> model)
+{
+    std::shared_ptr<const Shape> selected = model->GetSelectedShape();
+    size_t top = mLayer->GetCount() - 1;
+    if (selected)
+    {
+        mShapeId = selected->GetId();
+        mFrom = mLayer->Find(mShapeId);
+        switch (mType)
+        {
+            case ZO_Front:
+                mTo = top;
+                break;
+            case ZO_Back:
+                mTo = 0;
+                break;
+            case ZO_Forward:
+                mTo = std::min(mFrom + 1, top);
+                break;
+            case ZO_Backward:
+                mTo = (mFrom > 0) ? mFrom - 1 : 0;
+                break;
+            default:
+                mTo = std::min(mTo, top);
+                break;
+        }
+    }
     
+    // Nothing to move isn't worth an undo step
+    if (!selected || mTo == mFrom)
+    {
+        model->GetActiveCommand().reset();
+        return;
+    }
+    mLayer->Move(mFrom, mTo);
+    
+    model->GetHistory().Add(model->GetActiveCommand());
+    model->GetActiveCommand().reset();
+}
+
+void ZOrderCommand::Undo(std::shared_ptr<PaintModel> model)
+{
+    mIndex = mLayer->Find(mShapeId, mTo);
+    if (mIndex != Layer::kNoShape)
+        mLayer->Move(mIndex, mFrom);
+    model->Undo();
+}
+
+void ZOrderCommand::Redo(std::shared_ptr<PaintModel> model)
+{
+    mIndex = mLayer->Find(mShapeId, mFrom);
+    if (mIndex != Layer::kNoShape)
+        mLayer->Move(mIndex, mTo);
+    model->Redo();
 }
 
 
-MoveCommand::MoveCommand(const wxPoint& start, std::shared_ptr<Shape> shape) : Command::Command(start, shape)
+PasteCommand::PasteCommand(const wxPoint& start, std::shared_ptr<Shape> shape) : Command::Command(start, shape)
 {
     
 }
 
-void MoveCommand::Update(const wxPoint &newPoint)
+void PasteCommand::Finalize(std::shared_ptr<PaintModel> model)
 {
-    mShape->UpdateOffset(newPoint);
+    if (mSources.empty())
+    {
+        model->GetActiveCommand().reset();
+        return;
+    }
+    
+    Affine offset = Affine::Translate(mOffset.x, mOffset.y);
+    for (const std::shared_ptr<const Shape>& source : mSources)
+    {
+        std::shared_ptr<Shape> copy = source->Duplicate();
+        copy->SetTransform(offset * source->GetTransform());
+        mCopies.push_back(copy);
+    }
+    mIndex = mLayer->GetCount();
+    Place(model);
     
+    model->GetHistory().Add(model->GetActiveCommand());
+    model->GetActiveCommand().reset();
 }
 
+void PasteCommand::Undo(std::shared_ptr<PaintModel> model)
+{
+    // Copies a peer removed are dropped, so redo won't bring them back
+    for (size_t i = mCopies.size(); i > 0; i--)
+    {
+        size_t index = mLayer->Find(mCopies[i - 1]->GetId(), mIndex + i - 1);
+        if (index != Layer::kNoShape)
+            mLayer->Erase(index);
+        else
+            mCopies.erase(mCopies.begin() + (i - 1));
+    }
+    model->ClearSelection();
+    model->Undo();
+}
 
-void MoveCommand::Finalize(std::shared_ptr<PaintModel> model)
+void PasteCommand::Redo(std::shared_ptr<PaintModel> model)
 {
+    Place(model);
+    model->Redo();
+}
+
+void PasteCommand::Place(std::shared_ptr<PaintModel> model)
+{
+    mIndex = std::min(mIndex, mLayer->GetCount());
+    std::vector<ShapeId> ids;
+    for (size_t i = 0; i < mCopies.size(); i++)
+    {
+        mLayer->Insert(mIndex + i, mCopies[i]);
+        ids.push_back(mCopies[i]->GetId());
+    }
+    // The copies end up selected, ready to move or group
+    if (mLayer == model->GetActiveLayer())
+        model->Select(ids);
+}
+
+
+AddShapesCommand::AddShapesCommand(const wxPoint& start, std::shared_ptr<Shape> shape) : Command::Command(start, shape)
+{
+    
+}
+
+void AddShapesCommand::Finalize(std::shared_ptr<PaintModel> model)
+{
+    if (mShapes.empty())
+    {
+        model->GetActiveCommand().reset();
+        return;
+    }
+    
+    mIndex = mLayer->GetCount();
+    mLayer->InsertRange(mIndex, mShapes);
+    model->GetHistory().Add(model->GetActiveCommand());
     model->GetActiveCommand().reset();
 }
-void MoveCommand::Undo(std::shared_ptr<PaintModel> model)
+
+void AddShapesCommand::Undo(std::shared_ptr<PaintModel> model)
 {
+    // Keep the versions on the layer, so redo brings back the same ones
+    size_t first = mShapes.empty() ? Layer::kNoShape :
+        mLayer->Find(mShapes.front()->GetId(), mIndex);
+    bool intact = (first != Layer::kNoShape &&
+        first + mShapes.size() <= mLayer->GetCount());
+    for (size_t i = 0; intact && i < mShapes.size(); i++)
+    {
+        intact = (mLayer->At(first + i)->GetId() == mShapes[i]->GetId());
+    }
+    if (intact)
+    {
+        for (size_t i = 0; i < mShapes.size(); i++)
+        {
+            mShapes[i] = mLayer->At(first + i);
+        }
+        mLayer->EraseRange(first, mShapes.size());
+    }
+    else
+    {
+        // A peer's edit came between them; go one by one, and drop the
+        // shapes the peer removed so redo won't bring them back
+        for (size_t i = mShapes.size(); i > 0; i--)
+        {
+            size_t index = mLayer->Find(mShapes[i - 1]->GetId(), mIndex + i - 1);
+            if (index == Layer::kNoShape)
+            {
+                mShapes.erase(mShapes.begin() + (i - 1));
+                continue;
+            }
+            mShapes[i - 1] = mLayer->At(index);
+            mLayer->Erase(index);
+        }
+    }
+    model->ClearSelection();
     model->Undo();
 }
 
-void MoveCommand::Redo(std::shared_ptr<PaintModel> model)
+void AddShapesCommand::Redo(std::shared_ptr<PaintModel> model)
 {
+    mIndex = std::min(mIndex, mLayer->GetCount());
+    mLayer->InsertRange(mIndex, mShapes);
     model->Redo();
+}
+
+FilterCommand::FilterCommand(const wxPoint& start, std::shared_ptr<Shape> shape) : Command::Command(start, shape)
+{
+    
+}
+
+void FilterCommand::Finalize(std::shared_ptr<PaintModel> model)
+{
+    wxImage& image = model->GetImage();
+    wxImage result = mFilter(image);
+    
+    if (result.GetSize() != image.GetSize())
+    {
+        mSwapImage = image;
+        image = result;
+    }
+    else
+    {
+        int width = image.GetWidth();
+        int height = image.GetHeight();
+        int tilesX = (width + kTileSize - 1) / kTileSize;
+        int tilesY = (height + kTileSize - 1) / kTileSize;
+        const unsigned char* before = image.GetData();
+        const unsigned char* after = result.GetData();
+        
+        // Compare tile by tile, keeping the old pixels of changed tiles
+        std::vector<Tile> tiles(tilesX * tilesY);
+        ThreadPool::Get().ParallelFor(tilesX * tilesY, [&](int index)
+        {
+            wxRect rect((index % tilesX) * kTileSize, (index / tilesX) * kTileSize, kTileSize, kTileSize);
+            rect.width = std::min(rect.width, width - rect.x);
+            rect.height = std::min(rect.height, height - rect.y);
+            size_t rowBytes = static_cast<size_t>(rect.width) * 3;
+            
+            bool changed = false;
+            for (int y = rect.y; y < rect.GetBottom() + 1 && !changed; y++)
+            {
+                size_t offset = (static_cast<size_t>(y) * width + rect.x) * 3;
+                changed = std::memcmp(before + offset, after + offset, rowBytes) != 0;
+            }
+            if (!changed)
+                return;
+            
+            Tile& tile = tiles[index];
+            tile.rect = rect;
+            tile.rgb.resize(rowBytes * rect.height);
+            for (int y = 0; y < rect.height; y++)
+            {
+                size_t offset = (static_cast<size_t>(rect.y + y) * width + rect.x) * 3;
+                std::memcpy(tile.rgb.data() + y * rowBytes, before + offset, rowBytes);
+            }
+        });
+        
+        for (auto& tile : tiles)
+        {
+            if (!tile.rgb.empty())
+                mTiles.push_back(std::move(tile));
+        }
+        image = result;
+    }
     
+    size_t bytes = PaintModel::ImageBytes(mSwapImage);
+    for (auto& tile : mTiles)
+    {
+        bytes += tile.rgb.size();
+    }
+    mCharge.Set(model->GetArena(), MC_History, bytes);
+    model->ImageChanged();
+    model->GetHistory().Add(model->GetActiveCommand());
+    model->GetActiveCommand().reset();
+}
+
+void FilterCommand::Undo(std::shared_ptr<PaintModel> model)
+{
+    if (mSwapImage.IsOk())
+        SwapImage(model->GetImage());
+    else
+        SwapTiles(model->GetImage());
+    model->ImageChanged();
+    model->Undo();
+}
+
+void FilterCommand::Redo(std::shared_ptr<PaintModel> model)
+{
+    if (mSwapImage.IsOk())
+        SwapImage(model->GetImage());
+    else
+        SwapTiles(model->GetImage());
+    model->ImageChanged();
+    model->Redo();
 }
 
+void FilterCommand::SwapTiles(wxImage& image)
+{
+    unsigned char* data = image.GetData();
+    int width = image.GetWidth();
+    for (auto& tile : mTiles)
+    {
+        size_t rowBytes = static_cast<size_t>(tile.rect.width) * 3;
+        for (int y = 0; y < tile.rect.height; y++)
+        {
+            unsigned char* row = data + (static_cast<size_t>(tile.rect.y + y) * width + tile.rect.x) * 3;
+            std::swap_ranges(row, row + rowBytes, tile.rgb.data() + y * rowBytes);
+        }
+    }
+}
 
+void FilterCommand::SwapImage(wxImage& image)
+{
+    wxImage other = mSwapImage;
+    mSwapImage = image;
+    image = other;
+    mCharge.Set(PaintModel::ImageBytes(mSwapImage));
+}
@@ -2,7 +2,11 @@
 #include <wx/gdicmn.h>
 #include <wx/pen.h>
 #include <wx/brush.h>
+#include <wx/image.h>
+#include <functional>
 #include <memory>
+#include <vector>
+#include "Shape.h"
 
 enum CommandType
 {
@@ -14,11 +18,30 @@ enum CommandType
 	CM_Delete,
 	CM_SetPen,
 	CM_SetBrush,
+	CM_Fill,
+	CM_Filter,
+	CM_Transform,
+	CM_Group,
+	CM_Ungroup,
+	CM_ZOrder,
+	CM_Paste,
+	CM_AddShapes,
+};
+
+// Where a z-order command moves the selected shape
+enum ZOrderType
+{
+	ZO_Front,
+	ZO_Back,
+	ZO_Forward,
+	ZO_Backward,
+	// A given index from the bottom
+	ZO_Index,
 };
 
 // Forward declarations
 class PaintModel;
-class Shape;
+class Layer;
 
 // Abstract Base Command class
 // All actions that change the drawing (drawing, deleting, etc., are commands)
@@ -41,10 +64,26 @@ public:
         
         return mShape;
     }
+    
+    // Layer the command acts on, so undo/redo still hit the right
+    // layer after the user switches to another one
+    void SetLayer(std::shared_ptr<Layer> layer)
+    {
+        mLayer = layer;
+    }
+    const std::shared_ptr<Layer> & GetLayer() const
+    {
+        return mLayer;
+    }
 protected:
 	wxPoint mStartPoint;
 	wxPoint mEndPoint;
 	std::shared_ptr<Shape> mShape;
+    std::shared_ptr<Layer> mLayer;
+    // Shapes are copied when edited, so commands find theirs by id;
+    // mIndex is where it was last seen
+    ShapeId mShapeId;
+    size_t mIndex;
     
 };
 
@@ -71,6 +110,11 @@ public:
     void Redo(std::shared_ptr<PaintModel> model);
     // virtual ~Command() { }
     
+private:
+    // Whether undo found the shape to take off; if someone in a live
+    // session removed it first, redo leaves it gone
+    bool mRemoved;
+    
 };
 
 
@@ -89,7 +133,10 @@ public:
     
     
 private:
-    std::shared_ptr<Shape> shape;
+    // Style of the selected shape before and after the change
+    ShapeStyle mBefore;
+    ShapeStyle mAfter;
+    bool mHasShape;
 
 };
 
@@ -107,7 +154,10 @@ public:
     // virtual ~Command() { }
     
 private:
-    std::shared_ptr<Shape> shape;
+    // Style of the selected shape before and after the change
+    ShapeStyle mBefore;
+    ShapeStyle mAfter;
+    bool mHasShape;
     
 };
 
@@ -127,12 +177,20 @@ public:
 };
 
 
-class MoveCommand : public Command
+// Drags the selected shape or one of its handles: moving, scaling
+// about the opposite handle, or rotating about the middle. Only the
+// shape's transform changes, so undo just puts the old one back.
+class TransformCommand : public Command
 {
     
 public:
-    MoveCommand(const wxPoint& start, std::shared_ptr<Shape> shape);
-    // Called when the command is completed
+    TransformCommand(const wxPoint& start, std::shared_ptr<Shape> shape);
+    
+    // Handle being dragged; HD_Move (the default) moves the shape
+    void SetHandle(HandleType handle)
+    {
+        mHandle = handle;
+    }
     
     void Update(const wxPoint& newPoint) override;
 
@@ -141,10 +199,204 @@ public:
     void Undo(std::shared_ptr<PaintModel> model);
     // Used to "redo" the command
     void Redo(std::shared_ptr<PaintModel> model);
-    // virtual ~Command() { }
+    
+private:
+    // Transform for the pointer at point
+    Affine Dragged(const wxPoint& point) const;
+    void Apply(const Affine& transform);
+    
+    HandleType mHandle;
+    Affine mBefore;
+    Affine mAfter;
+    // Shape's bounds when the drag started
+    wxPoint mTopLeft;
+    wxPoint mBotRight;
     
 };
 
+// Replaces the picked shapes with one group, put where the topmost of
+// them was
+class GroupCommand : public Command
+{
+    
+public:
+    GroupCommand(const wxPoint& start, std::shared_ptr<Shape> shape);
+    // Called when the command is completed
+    void Finalize(std::shared_ptr<PaintModel> model);
+    // Used to "undo" the command
+    void Undo(std::shared_ptr<PaintModel> model);
+    // Used to "redo" the command
+    void Redo(std::shared_ptr<PaintModel> model);
+    
+private:
+    // Swaps the shapes on the layer for the group, and back. Each
+    // only puts back what the other took off: shapes a peer removed in
+    // between stay gone.
+    void Join();
+    void Split();
+    
+    // The grouped shapes and where they were, lowest first
+    std::vector<std::shared_ptr<Shape>> mChildren;
+    std::vector<size_t> mIndices;
+    // Whether the group is to go on the layer at the next Join
+    bool mHasGroup;
+    
+};
 
+// Puts the selected group's children back on the layer in its place,
+// with the group's transform applied to each
+class UngroupCommand : public Command
+{
+    
+public:
+    UngroupCommand(const wxPoint& start, std::shared_ptr<Shape> shape);
+    // Called when the command is completed
+    void Finalize(std::shared_ptr<PaintModel> model);
+    // Used to "undo" the command
+    void Undo(std::shared_ptr<PaintModel> model);
+    // Used to "redo" the command
+    void Redo(std::shared_ptr<PaintModel> model);
+    
+private:
+    // As for GroupCommand, each only puts back what the other took off
+    void Join();
+    void Split();
+    
+    std::vector<std::shared_ptr<Shape>> mChildren;
+    // Whether the group is to go back on the layer at the next Join
+    bool mHasGroup;
+    
+};
 
+// Restacks the selected shape on its layer
+class ZOrderCommand : public Command
+{
+    
+public:
+    ZOrderCommand(const wxPoint& start, std::shared_ptr<Shape> shape);
+    
+    // index is only used by ZO_Index
+    void SetTarget(ZOrderType type, size_t index = 0)
+    {
+        mType = type;
+        mTo = index;
+    }
+    
+    // Called when the command is completed
+    void Finalize(std::shared_ptr<PaintModel> model);
+    // Used to "undo" the command
+    void Undo(std::shared_ptr<PaintModel> model);
+    // Used to "redo" the command
+    void Redo(std::shared_ptr<PaintModel> model);
+    
+private:
+    ZOrderType mType;
+    // Index before and after
+    size_t mFrom;
+    size_t mTo;
+    
+};
+
+// Puts copies of some shapes on top of the layer, each moved by an
+// offset, and selects them. The copies share their geometry with the
+// originals, so this costs the same however big the shapes are.
+class PasteCommand : public Command
+{
+    
+public:
+    PasteCommand(const wxPoint& start, std::shared_ptr<Shape> shape);
+    
+    void SetSources(const std::vector<std::shared_ptr<const Shape>>& sources, const wxPoint& offset)
+    {
+        mSources = sources;
+        mOffset = offset;
+    }
+    
+    // Called when the command is completed
+    void Finalize(std::shared_ptr<PaintModel> model);
+    // Used to "undo" the command
+    void Undo(std::shared_ptr<PaintModel> model);
+    // Used to "redo" the command
+    void Redo(std::shared_ptr<PaintModel> model);
+    
+private:
+    // Puts the copies back on the layer and selects them
+    void Place(std::shared_ptr<PaintModel> model);
+    
+    std::vector<std::shared_ptr<const Shape>> mSources;
+    wxPoint mOffset;
+    // The pasted copies, lowest first; mIndex is where the first goes
+    std::vector<std::shared_ptr<Shape>> mCopies;
+    
+};
+
+// Puts shapes built elsewhere (see ShapeBatch) on top of the layer in
+// one step, and takes them off again in one
+class AddShapesCommand : public Command
+{
+    
+public:
+    AddShapesCommand(const wxPoint& start, std::shared_ptr<Shape> shape);
+    
+    void SetShapes(std::vector<std::shared_ptr<Shape>>& shapes)
+    {
+        mShapes.swap(shapes);
+    }
+    
+    // Called when the command is completed
+    void Finalize(std::shared_ptr<PaintModel> model);
+    // Used to "undo" the command
+    void Undo(std::shared_ptr<PaintModel> model);
+    // Used to "redo" the command
+    void Redo(std::shared_ptr<PaintModel> model);
+    
+private:
+    // The shapes, lowest first; mIndex is where the first goes
+    std::vector<std::shared_ptr<Shape>> mShapes;
+    
+};
 
+// Runs a raster filter over the imported image. Only the tiles the
+// filter actually changed are kept, and undo/redo swap them with the
+// image in place, so the command never holds a full copy.
+class FilterCommand : public Command
+{
+    
+public:
+    typedef std::function<wxImage(const wxImage&)> Filter;
+    
+    FilterCommand(const wxPoint& start, std::shared_ptr<Shape> shape);
+    
+    void SetFilter(const Filter& filter)
+    {
+        mFilter = filter;
+    }
+    
+    // Called when the command is completed
+    void Finalize(std::shared_ptr<PaintModel> model);
+    // Used to "undo" the command
+    void Undo(std::shared_ptr<PaintModel> model);
+    // Used to "redo" the command
+    void Redo(std::shared_ptr<PaintModel> model);
+    
+private:
+    struct Tile
+    {
+        wxRect rect;
+        std::vector<unsigned char> rgb;
+    };
+    
+    // Exchanges the stored tiles with the same areas of the image
+    void SwapTiles(wxImage& image);
+    // Exchanges the whole image (filters that change the size)
+    void SwapImage(wxImage& image);
+    
+    Filter mFilter;
+    std::vector<Tile> mTiles;
+    wxImage mSwapImage;
+    // The tiles or image kept, as history
+    MemoryCharge mCharge;
+    
+    // Pixels per side of a stored tile
+    static const int kTileSize = 64;
+};
@@ -10,6 +10,8 @@ CursorCache::CursorCache()
 	mMap.emplace(CU_SizeNS, new wxCursor(wxCURSOR_SIZENS));
 	mMap.emplace(CU_SizeEW, new wxCursor(wxCURSOR_SIZEWE));
 	mMap.emplace(CU_SizeNWSE, new wxCursor(wxCURSOR_SIZENWSE));
+	mMap.emplace(CU_SizeNESW, new wxCursor(wxCURSOR_SIZENESW));
+	mMap.emplace(CU_Rotate, new wxCursor(wxCURSOR_HAND));
 }
 
 CursorCache::~CursorCache()
@@ -11,6 +11,8 @@ enum CursorType
 	CU_SizeNS,
 	CU_SizeEW,
 	CU_SizeNWSE,
+	CU_SizeNESW,
+	CU_Rotate,
 };
 
 class CursorCache
@@ -12,5 +12,46 @@ enum EventID
 	ID_SetPenWidth,
 	ID_SetBrushColor,
 	ID_Unselect,
-	ID_Delete
+	ID_Delete,
+	ID_ExportScaled,
+	ID_PngFast,
+	ID_PngBalanced,
+	ID_PngSmall,
+	ID_NewLayer,
+	ID_LayerAbove,
+	ID_LayerBelow,
+	ID_ToggleLayer,
+	ID_LayerOpacity,
+	ID_BucketFill,
+	ID_GaussianBlur,
+	ID_BoxBlur,
+	ID_Sharpen,
+	ID_BrightnessContrast,
+	ID_Grayscale,
+	ID_ResizeImage,
+	ID_ZoomIn,
+	ID_ZoomOut,
+	ID_ActualSize,
+	ID_Group,
+	ID_Ungroup,
+	ID_BringToFront,
+	ID_BringForward,
+	ID_SendBackward,
+	ID_SendToBack,
+	ID_MoveToIndex,
+	ID_Duplicate,
+	ID_MemoryUsage,
+	ID_MemoryBudgets,
+	ID_ExportTimelapse,
+	ID_EarlierState,
+	ID_LaterState,
+	ID_NextBranch,
+	ID_PreviousBranch,
+	ID_HostSession,
+	ID_JoinSession,
+	ID_LeaveSession,
+	ID_Lasso,
+	ID_SnapToGrid,
+	ID_GridSize,
+	ID_SnapToShapes
 };
@@ -0,0 +1,154 @@
+#include "FloodFill.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PAINT_FILL_SSE2 1
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+    // Sets mask[i] to 1 for every pixel within tolerance of colour
+    void BuildMask(const unsigned char* rgb, size_t count, const unsigned char* colour,
+        int tolerance, unsigned char* mask)
+    {
+        size_t i = 0;
+#ifdef PAINT_FILL_SSE2
+        // 16 pixels (48 bytes) at a time; the seed colour repeats every
+        // 3 bytes, so three registers cover one block
+        unsigned char pattern[48];
+        for (int j = 0; j < 48; j++)
+        {
+            pattern[j] = colour[j % 3];
+        }
+        const __m128i p0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pattern));
+        const __m128i p1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pattern + 16));
+        const __m128i p2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pattern + 32));
+        const __m128i tol = _mm_set1_epi8(static_cast<char>(tolerance));
+        const __m128i zero = _mm_setzero_si128();
+        // Bit 3 * j for each of the 16 pixels
+        const uint64_t pixelBits = 0x249249249249ULL;
+
+        for (; i + 16 <= count; i += 16)
+        {
+            const __m128i* src = reinterpret_cast<const __m128i*>(rgb + i * 3);
+            __m128i a0 = _mm_loadu_si128(src);
+            __m128i a1 = _mm_loadu_si128(src + 1);
+            __m128i a2 = _mm_loadu_si128(src + 2);
+
+            // |a - p| <= tol  <=>  saturate(|a - p| - tol) == 0
+            __m128i d0 = _mm_or_si128(_mm_subs_epu8(a0, p0), _mm_subs_epu8(p0, a0));
+            __m128i d1 = _mm_or_si128(_mm_subs_epu8(a1, p1), _mm_subs_epu8(p1, a1));
+            __m128i d2 = _mm_or_si128(_mm_subs_epu8(a2, p2), _mm_subs_epu8(p2, a2));
+            uint64_t bits = static_cast<uint64_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_subs_epu8(d0, tol), zero))) |
+                (static_cast<uint64_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_subs_epu8(d1, tol), zero))) << 16) |
+                (static_cast<uint64_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_subs_epu8(d2, tol), zero))) << 32);
+
+            // A pixel matches when all three of its channel bits are set
+            uint64_t match = bits & (bits >> 1) & (bits >> 2) & pixelBits;
+            if (match == pixelBits)
+            {
+                std::memset(mask + i, 1, 16);
+            }
+            else if (match == 0)
+            {
+                std::memset(mask + i, 0, 16);
+            }
+            else
+            {
+                for (int j = 0; j < 16; j++)
+                {
+                    mask[i + j] = static_cast<unsigned char>((match >> (3 * j)) & 1);
+                }
+            }
+        }
+#endif
+        for (; i < count; i++)
+        {
+            const unsigned char* pixel = rgb + i * 3;
+            mask[i] = std::abs(pixel[0] - colour[0]) <= tolerance &&
+                std::abs(pixel[1] - colour[1]) <= tolerance &&
+                std::abs(pixel[2] - colour[2]) <= tolerance;
+        }
+    }
+
+    // Pushes the start of every fillable run in row[x1, x2)
+    void PushRuns(const unsigned char* row, int x1, int x2, int y, std::vector<wxPoint>& stack)
+    {
+        int x = x1;
+        while (x < x2)
+        {
+            if (row[x])
+            {
+                stack.push_back(wxPoint(x, y));
+                while (x < x2 && row[x])
+                {
+                    x++;
+                }
+            }
+            else
+            {
+                x++;
+            }
+        }
+    }
+}
+
+bool FloodFill(const unsigned char* rgb, int width, int height, const wxPoint& seed,
+    int tolerance, std::vector<FillSpan>& spans)
+{
+    spans.clear();
+    if (!rgb || seed.x < 0 || seed.y < 0 || seed.x >= width || seed.y >= height)
+        return false;
+
+    tolerance = std::max(0, std::min(255, tolerance));
+    size_t count = static_cast<size_t>(width) * height;
+    const unsigned char* colour = rgb + (static_cast<size_t>(seed.y) * width + seed.x) * 3;
+
+    // 1 marks a pixel that can still be filled; filled pixels are
+    // cleared, so the mask doubles as the visited set
+    std::vector<unsigned char> mask(count);
+    BuildMask(rgb, count, colour, tolerance, mask.data());
+
+    std::vector<wxPoint> stack;
+    stack.push_back(seed);
+    while (!stack.empty())
+    {
+        wxPoint pt = stack.back();
+        stack.pop_back();
+
+        unsigned char* row = mask.data() + static_cast<size_t>(pt.y) * width;
+        if (!row[pt.x])
+            continue;
+
+        // Extend to the whole run on this row
+        int x1 = pt.x;
+        while (x1 > 0 && row[x1 - 1])
+        {
+            x1--;
+        }
+        int x2 = pt.x + 1;
+        while (x2 < width && row[x2])
+        {
+            x2++;
+        }
+        std::memset(row + x1, 0, x2 - x1);
+
+        FillSpan span = { pt.y, x1, x2 };
+        spans.push_back(span);
+
+        if (pt.y > 0)
+            PushRuns(row - width, x1, x2, pt.y - 1, stack);
+        if (pt.y + 1 < height)
+            PushRuns(row + width, x1, x2, pt.y + 1, stack);
+    }
+
+    std::sort(spans.begin(), spans.end(), [](const FillSpan& a, const FillSpan& b)
+    {
+        return a.y < b.y || (a.y == b.y && a.x1 < b.x1);
+    });
+    return true;
+}
@@ -0,0 +1,19 @@
+#pragma once
+#include <vector>
+#include <wx/gdicmn.h>
+
+// A run of filled pixels on one row, covering [x1, x2)
+struct FillSpan
+{
+    int y;
+    int x1;
+    int x2;
+};
+
+// Finds the region 4-connected to seed whose colour is within tolerance
+// (per channel) of the seed pixel, using a scanline fill with a span
+// stack. rgb is packed 24-bit rows, as returned by wxImage::GetData.
+// Spans are returned sorted by row, then by x. Returns false if the
+// seed is outside the image.
+bool FloodFill(const unsigned char* rgb, int width, int height, const wxPoint& seed,
+    int tolerance, std::vector<FillSpan>& spans);
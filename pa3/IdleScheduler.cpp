@@ -0,0 +1,120 @@
+#include "IdleScheduler.h"
+#include <algorithm>
+#include <wx/evtloop.h>
+#include <wx/utils.h>
+#include <wx/window.h>
+
+IdleScheduler::IdleScheduler(wxWindow* window)
+    :mSequence(0)
+    ,mSliceEnd(0)
+    ,mQuietUntil(0)
+    ,mInterrupted(false)
+{
+    window->Bind(wxEVT_IDLE, &IdleScheduler::OnIdle, this);
+    window->Bind(wxEVT_LEFT_DOWN, &IdleScheduler::OnInput, this);
+    window->Bind(wxEVT_LEFT_UP, &IdleScheduler::OnInput, this);
+    window->Bind(wxEVT_MIDDLE_DOWN, &IdleScheduler::OnInput, this);
+    window->Bind(wxEVT_MIDDLE_UP, &IdleScheduler::OnInput, this);
+    window->Bind(wxEVT_RIGHT_DOWN, &IdleScheduler::OnInput, this);
+    window->Bind(wxEVT_RIGHT_UP, &IdleScheduler::OnInput, this);
+    window->Bind(wxEVT_MOTION, &IdleScheduler::OnInput, this);
+    window->Bind(wxEVT_MOUSEWHEEL, &IdleScheduler::OnInput, this);
+    window->Bind(wxEVT_KEY_DOWN, &IdleScheduler::OnInput, this);
+    mTimer.Bind(wxEVT_TIMER, &IdleScheduler::OnTimer, this);
+    mClock.Start();
+}
+
+void IdleScheduler::Post(Priority priority, const Work& work, unsigned long key)
+{
+    if (key != 0)
+    {
+        mItems.erase(std::remove_if(mItems.begin(), mItems.end(),
+            [key](const Item& item) { return item.key == key; }), mItems.end());
+    }
+    Item item = { priority, mSequence++, key, work };
+    mItems.push_back(item);
+    wxWakeUpIdle();
+}
+
+bool IdleScheduler::Expired() const
+{
+    if (mInterrupted || mClock.Time() >= mSliceEnd)
+        return true;
+    // Anything waiting in the queue goes first
+    wxEventLoopBase* loop = wxEventLoopBase::GetActive();
+    return loop && loop->Pending();
+}
+
+void IdleScheduler::Interrupt()
+{
+    mInterrupted = true;
+    mQuietUntil = mClock.Time() + kBackoffMs;
+}
+
+void IdleScheduler::OnInput(wxEvent& event)
+{
+    Interrupt();
+    event.Skip();
+}
+
+void IdleScheduler::OnTimer(wxTimerEvent& event)
+{
+    wxWakeUpIdle();
+}
+
+bool IdleScheduler::Waiting()
+{
+    long now = mClock.Time();
+    long wait = 0;
+    if (now < mQuietUntil)
+        wait = mQuietUntil - now;
+    else if (wxGetMouseState().ButtonIsDown(wxMOUSE_BTN_ANY))
+        wait = kBackoffMs;
+    if (wait == 0)
+        return false;
+
+    if (!mTimer.IsRunning())
+        mTimer.StartOnce(static_cast<int>(wait));
+    return true;
+}
+
+size_t IdleScheduler::Next() const
+{
+    size_t best = 0;
+    for (size_t i = 1; i < mItems.size(); i++)
+    {
+        const Item& item = mItems[i];
+        if (item.priority < mItems[best].priority ||
+            (item.priority == mItems[best].priority && item.sequence < mItems[best].sequence))
+            best = i;
+    }
+    return best;
+}
+
+void IdleScheduler::OnIdle(wxIdleEvent& event)
+{
+    event.Skip();
+    if (mItems.empty() || Waiting())
+        return;
+
+    mInterrupted = false;
+    mSliceEnd = mClock.Time() + kSliceMs;
+    do
+    {
+        // Taken out while it runs, so it can post more work
+        size_t index = Next();
+        Item item = mItems[index];
+        mItems.erase(mItems.begin() + index);
+        if (!item.work(*this))
+        {
+            // Unless it was posted again while it ran
+            bool replaced = item.key != 0 && std::any_of(mItems.begin(), mItems.end(),
+                [&item](const Item& other) { return other.key == item.key; });
+            if (!replaced)
+                mItems.push_back(item);
+        }
+    } while (!mItems.empty() && !Expired());
+
+    if (!mItems.empty())
+        event.RequestMore();
+}
@@ -0,0 +1,83 @@
+#pragma once
+#include <functional>
+#include <vector>
+#include <wx/event.h>
+#include <wx/stopwatch.h>
+#include <wx/timer.h>
+
+class wxWindow;
+
+// Runs housekeeping on the UI thread while the user isn't doing
+// anything. Work is posted as items that each do a little at a time:
+// an item is called repeatedly, should return as soon as Expired()
+// says its slice is up, and returns true once it's finished.
+//
+// Slices run from idle events and last at most kSliceMs. Any input to
+// the window ends the current slice at the next Expired() check and
+// holds work off for kBackoffMs, and nothing runs while a mouse button
+// is down, so input never queues behind maintenance. A timer picks the
+// work back up once things go quiet.
+class IdleScheduler
+{
+public:
+    // Higher priorities run first; equal ones in the order posted
+    enum Priority
+    {
+        IP_High,
+        IP_Normal,
+        IP_Low,
+    };
+
+    typedef std::function<bool(const IdleScheduler&)> Work;
+
+    // Milliseconds of work per idle event
+    static const long kSliceMs = 4;
+    // Milliseconds of quiet after input before work resumes
+    static const long kBackoffMs = 150;
+
+    // Watches the window's input, and runs on its idle events
+    explicit IdleScheduler(wxWindow* window);
+
+    // Queues work. A nonzero key replaces any pending item with the
+    // same key, so repeated requests for the same job don't pile up.
+    void Post(Priority priority, const Work& work, unsigned long key = 0);
+
+    // Whether the running item should stop and come back later
+    bool Expired() const;
+    // Ends the current slice and holds off for kBackoffMs
+    void Interrupt();
+
+    size_t GetPending() const
+    {
+        return mItems.size();
+    }
+
+    // Disallow copy/assignment
+    IdleScheduler(const IdleScheduler&) = delete;
+    IdleScheduler& operator=(const IdleScheduler&) = delete;
+private:
+    struct Item
+    {
+        Priority priority;
+        unsigned long sequence;
+        unsigned long key;
+        Work work;
+    };
+
+    void OnIdle(wxIdleEvent& event);
+    void OnInput(wxEvent& event);
+    void OnTimer(wxTimerEvent& event);
+    // Whether work has to wait; if so the timer is set to check again
+    bool Waiting();
+    // Index of the item to run next
+    size_t Next() const;
+
+    std::vector<Item> mItems;
+    unsigned long mSequence;
+    // Milliseconds on mClock
+    wxStopWatch mClock;
+    long mSliceEnd;
+    long mQuietUntil;
+    bool mInterrupted;
+    wxTimer mTimer;
+};
@@ -0,0 +1,24 @@
+#pragma once
+#include <wx/image.h>
+
+// Raster operations for the imported image. Each returns a new image
+// and leaves the source untouched; any alpha channel is carried over.
+// The convolutions are separable and run tile by tile on the shared
+// thread pool.
+namespace ImageFilters
+{
+    // Largest standard deviation the blurs use, in pixels; the kernel
+    // reaches three times as far. Larger values are clamped.
+    const int kMaxSigma = 50;
+    
+    // Gaussian blur with the given standard deviation in pixels
+    wxImage GaussianBlur(const wxImage& image, double sigma);
+    // Mean of the (2 * radius + 1)^2 neighbourhood
+    wxImage BoxBlur(const wxImage& image, int radius);
+    // Unsharp mask: adds amount times the difference from a blur
+    wxImage Sharpen(const wxImage& image, double amount, double sigma = 1.0);
+    // Both in -100 .. 100, with 0 leaving the image unchanged
+    wxImage BrightnessContrast(const wxImage& image, int brightness, int contrast);
+    wxImage Grayscale(const wxImage& image);
+    wxImage Resize(const wxImage& image, const wxSize& size);
+}
@@ -0,0 +1,696 @@
+#include "ImageWriter.h"
+#include "ThreadPool.h"
+#include <wx/wfstream.h>
+#include <wx/bufstrm.h>
+#include <zlib.h>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+namespace
+{
+    // Size of each IDAT chunk (and of the deflate output buffer)
+    const size_t kIdatSize = 64 * 1024;
+
+    void PutBE32(unsigned char* dst, unsigned int value)
+    {
+        dst[0] = static_cast<unsigned char>(value >> 24);
+        dst[1] = static_cast<unsigned char>(value >> 16);
+        dst[2] = static_cast<unsigned char>(value >> 8);
+        dst[3] = static_cast<unsigned char>(value);
+    }
+
+    void PutLE32(unsigned char* dst, unsigned int value)
+    {
+        dst[0] = static_cast<unsigned char>(value);
+        dst[1] = static_cast<unsigned char>(value >> 8);
+        dst[2] = static_cast<unsigned char>(value >> 16);
+        dst[3] = static_cast<unsigned char>(value >> 24);
+    }
+
+    void PutLE16(unsigned char* dst, unsigned int value)
+    {
+        dst[0] = static_cast<unsigned char>(value);
+        dst[1] = static_cast<unsigned char>(value >> 8);
+    }
+
+    // GIF palette: a 6x7x6 cube (green gets the extra level, as the
+    // eye is most sensitive to it), padded to 256 entries with black
+    const int kCubeRed = 6;
+    const int kCubeGreen = 7;
+    const int kCubeBlue = 6;
+    const int kLzwMinCodeSize = 8;
+    const int kLzwMaxCode = 4095;
+    // Open-addressed dictionary of (prefix code, byte) pairs; twice
+    // the most codes a table holds, so probes stay short
+    const int kLzwHashBits = 13;
+
+    inline int CubeLevel(int value, int levels)
+    {
+        return (value * (levels - 1) + 127) / 255;
+    }
+
+    // Packs variable-width codes LSB first into GIF's sub-blocks of at
+    // most 255 bytes
+    class LzwOutput
+    {
+    public:
+        explicit LzwOutput(std::vector<unsigned char>& out)
+            :mOut(out)
+            ,mBits(0)
+            ,mBitCount(0)
+            ,mBlockSize(0)
+        {
+        }
+        void Put(int code, int size)
+        {
+            mBits |= static_cast<unsigned long>(code) << mBitCount;
+            mBitCount += size;
+            while (mBitCount >= 8)
+            {
+                PutByte(static_cast<unsigned char>(mBits));
+                mBits >>= 8;
+                mBitCount -= 8;
+            }
+        }
+        void Finish()
+        {
+            if (mBitCount > 0)
+                PutByte(static_cast<unsigned char>(mBits));
+            FlushBlock();
+            mOut.push_back(0);
+        }
+    private:
+        void PutByte(unsigned char byte)
+        {
+            mBlock[mBlockSize++] = byte;
+            if (mBlockSize == 255)
+                FlushBlock();
+        }
+        void FlushBlock()
+        {
+            if (mBlockSize == 0)
+                return;
+            mOut.push_back(static_cast<unsigned char>(mBlockSize));
+            mOut.insert(mOut.end(), mBlock, mBlock + mBlockSize);
+            mBlockSize = 0;
+        }
+
+        std::vector<unsigned char>& mOut;
+        unsigned long mBits;
+        int mBitCount;
+        unsigned char mBlock[255];
+        int mBlockSize;
+    };
+
+    // PNG filter predictors for byte i of an RGB row: 0 none, 1 sub,
+    // 2 up, 3 average, 4 Paeth
+    inline int Predict(int filter, const unsigned char* row, const unsigned char* above, int i)
+    {
+        const int bpp = 3;
+        int a = (i >= bpp) ? row[i - bpp] : 0;
+        int b = above[i];
+        int c = (i >= bpp) ? above[i - bpp] : 0;
+        switch (filter)
+        {
+            case 1:
+                return a;
+            case 2:
+                return b;
+            case 3:
+                return (a + b) / 2;
+            case 4:
+            {
+                int p = a + b - c;
+                int pa = std::abs(p - a);
+                int pb = std::abs(p - b);
+                int pc = std::abs(p - c);
+                return (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+            }
+            default:
+                return 0;
+        }
+    }
+}
+
+ImageWriter::ImageWriter()
+    :mWidth(0)
+    ,mHeight(0)
+    ,mRowsWritten(0)
+{
+}
+
+ImageWriter::~ImageWriter()
+{
+}
+
+bool ImageWriter::Begin(const wxString& fileName, int width, int height)
+{
+    mWidth = width;
+    mHeight = height;
+    mRowsWritten = 0;
+
+    mFile.reset(new wxFileOutputStream(fileName));
+    if (!mFile->IsOk())
+    {
+        mFile.reset();
+        return false;
+    }
+    mStream.reset(new wxBufferedOutputStream(*mFile, 256 * 1024));
+    return true;
+}
+
+bool ImageWriter::End()
+{
+    if (!mStream)
+        return false;
+
+    bool ok = mStream->Close() && mFile->Close() && mRowsWritten == mHeight;
+    mStream.reset();
+    mFile.reset();
+    return ok;
+}
+
+bool ImageWriter::Write(const void* data, size_t size)
+{
+    if (!mStream)
+        return false;
+    mStream->Write(data, size);
+    return mStream->LastWrite() == size;
+}
+
+std::unique_ptr<ImageWriter> ImageWriter::Create(wxBitmapType type, Preset preset)
+{
+    std::unique_ptr<ImageWriter> retVal;
+    if (type == wxBITMAP_TYPE_PNG)
+        retVal.reset(new PngWriter(preset));
+    else if (type == wxBITMAP_TYPE_BMP)
+        retVal.reset(new BmpWriter());
+    return retVal;
+}
+
+bool BmpWriter::Begin(const wxString& fileName, int width, int height)
+{
+    if (!ImageWriter::Begin(fileName, width, height))
+        return false;
+
+    // Rows are padded out to a multiple of four bytes
+    size_t stride = (static_cast<size_t>(width) * 3 + 3) & ~static_cast<size_t>(3);
+    size_t imageSize = stride * height;
+    mRow.assign(stride, 0);
+
+    unsigned char header[54];
+    std::memset(header, 0, sizeof(header));
+    // BITMAPFILEHEADER
+    header[0] = 'B';
+    header[1] = 'M';
+    PutLE32(header + 2, static_cast<unsigned int>(sizeof(header) + imageSize));
+    PutLE32(header + 10, sizeof(header));
+    // BITMAPINFOHEADER, with a negative height so rows go top-down
+    // in the same order we render them
+    PutLE32(header + 14, 40);
+    PutLE32(header + 18, static_cast<unsigned int>(width));
+    PutLE32(header + 22, static_cast<unsigned int>(-height));
+    PutLE16(header + 26, 1);
+    PutLE16(header + 28, 24);
+    PutLE32(header + 34, static_cast<unsigned int>(imageSize));
+    PutLE32(header + 38, 2835); // 72 DPI
+    PutLE32(header + 42, 2835);
+    return Write(header, sizeof(header));
+}
+
+bool BmpWriter::WriteRows(const unsigned char* rgb, int count)
+{
+    for (int y = 0; y < count; y++)
+    {
+        const unsigned char* src = rgb + static_cast<size_t>(y) * mWidth * 3;
+        unsigned char* dst = mRow.data();
+        for (int x = 0; x < mWidth; x++)
+        {
+            dst[0] = src[2];
+            dst[1] = src[1];
+            dst[2] = src[0];
+            src += 3;
+            dst += 3;
+        }
+        if (!Write(mRow.data(), mRow.size()))
+            return false;
+    }
+    mRowsWritten += count;
+    return true;
+}
+
+PngWriter::PngWriter(Preset preset)
+    :mPreset(preset)
+    ,mLevel(Z_DEFAULT_COMPRESSION)
+    ,mStrategy(Z_FILTERED)
+    ,mSegmentRows(0)
+    ,mMaxPending(0)
+    ,mAdler(1)
+{
+    switch (preset)
+    {
+        case PR_Fast:
+            mLevel = 1;
+            mStrategy = Z_DEFAULT_STRATEGY;
+            break;
+        case PR_Small:
+            mLevel = 9;
+            break;
+        default:
+            break;
+    }
+}
+
+PngWriter::~PngWriter()
+{
+    // Don't leave workers writing into freed segments
+    for (auto& segment : mPending)
+    {
+        segment->done.wait();
+    }
+}
+
+bool PngWriter::Begin(const wxString& fileName, int width, int height)
+{
+    if (!ImageWriter::Begin(fileName, width, height))
+        return false;
+
+    static const unsigned char signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+    if (!Write(signature, sizeof(signature)))
+        return false;
+
+    unsigned char ihdr[13];
+    PutBE32(ihdr, static_cast<unsigned int>(width));
+    PutBE32(ihdr + 4, static_cast<unsigned int>(height));
+    ihdr[8] = 8;  // bit depth
+    ihdr[9] = 2;  // truecolour
+    ihdr[10] = 0; // deflate
+    ihdr[11] = 0; // adaptive filtering
+    ihdr[12] = 0; // no interlace
+    if (!WriteChunk("IHDR", ihdr, sizeof(ihdr)))
+        return false;
+
+    // Larger segments compress slightly better, smaller ones spread
+    // across more cores
+    size_t segmentBytes = (mPreset == PR_Small) ? 1024 * 1024 : 256 * 1024;
+    size_t rowBytes = static_cast<size_t>(width) * 3 + 1;
+    mSegmentRows = static_cast<int>(std::max<size_t>(1, segmentBytes / rowBytes));
+    // Keep every core busy while the caller renders the next band
+    mMaxPending = ThreadPool::Get().GetThreadCount() * 2;
+
+    mCurrent.reset();
+    mPending.clear();
+    mLastRow.assign(static_cast<size_t>(width) * 3, 0);
+    mAdler = adler32(0L, Z_NULL, 0);
+    mOut.clear();
+    mOut.reserve(kIdatSize * 2);
+
+    // zlib header: 32K window, deflate, compression level hint
+    unsigned char header[2] = { 0x78, 0x9C };
+    if (mLevel == 1)
+        header[1] = 0x01;
+    else if (mLevel == 9)
+        header[1] = 0xDA;
+    return WriteIdat(header, sizeof(header), false);
+}
+
+bool PngWriter::WriteRows(const unsigned char* rgb, int count)
+{
+    size_t rowBytes = static_cast<size_t>(mWidth) * 3;
+    for (int y = 0; y < count; y++)
+    {
+        if (!mCurrent)
+        {
+            mCurrent.reset(new Segment);
+            mCurrent->above = mLastRow;
+            mCurrent->raw.reserve(rowBytes * mSegmentRows);
+            mCurrent->rows = 0;
+        }
+
+        const unsigned char* row = rgb + y * rowBytes;
+        mCurrent->raw.insert(mCurrent->raw.end(), row, row + rowBytes);
+        mCurrent->rows++;
+
+        if (mCurrent->rows == mSegmentRows)
+        {
+            mLastRow.assign(row, row + rowBytes);
+            SubmitSegment();
+            if (!DrainSegments(mMaxPending))
+                return false;
+        }
+    }
+    mRowsWritten += count;
+    return true;
+}
+
+bool PngWriter::End()
+{
+    bool ok = true;
+    if (mCurrent)
+        SubmitSegment();
+    ok = DrainSegments(0);
+
+    // Every segment ended with a non-final block, so close the stream
+    // with an empty final fixed-Huffman block and the combined Adler-32
+    unsigned char trailer[6] = { 0x03, 0x00 };
+    PutBE32(trailer + 2, static_cast<unsigned int>(mAdler));
+    ok = ok && WriteIdat(trailer, sizeof(trailer), true) && WriteChunk("IEND", nullptr, 0);
+
+    return ImageWriter::End() && ok;
+}
+
+void PngWriter::SubmitSegment()
+{
+    Segment* segment = mCurrent.get();
+    segment->done = ThreadPool::Get().Submit([this, segment]() { CompressSegment(*segment); });
+    mPending.push_back(std::move(mCurrent));
+}
+
+bool PngWriter::DrainSegments(size_t keep)
+{
+    while (mPending.size() > keep)
+    {
+        Segment& segment = *mPending.front();
+        segment.done.wait();
+        if (!segment.ok)
+            return false;
+
+        mAdler = adler32_combine(mAdler, segment.adler, static_cast<z_off_t>(segment.filteredSize));
+        if (!WriteIdat(segment.compressed.data(), segment.compressed.size(), false))
+            return false;
+        mPending.pop_front();
+    }
+    return true;
+}
+
+// Runs on a worker: filter every row, then deflate the lot as raw
+// deflate data ending in a sync flush
+void PngWriter::CompressSegment(Segment& segment) const
+{
+    size_t rowBytes = static_cast<size_t>(mWidth) * 3;
+    std::vector<unsigned char> filtered((rowBytes + 1) * segment.rows);
+    for (int y = 0; y < segment.rows; y++)
+    {
+        const unsigned char* row = &segment.raw[y * rowBytes];
+        const unsigned char* above = (y == 0) ? segment.above.data() : row - rowBytes;
+        FilterRow(row, above, &filtered[y * (rowBytes + 1)]);
+    }
+    segment.raw.clear();
+    segment.raw.shrink_to_fit();
+
+    segment.filteredSize = filtered.size();
+    segment.adler = adler32(adler32(0L, Z_NULL, 0), filtered.data(), static_cast<uInt>(filtered.size()));
+
+    z_stream zs;
+    std::memset(&zs, 0, sizeof(zs));
+    segment.ok = deflateInit2(&zs, mLevel, Z_DEFLATED, -15, 8, mStrategy) == Z_OK;
+    if (!segment.ok)
+        return;
+
+    // A sync flush adds an empty stored block, which deflateBound
+    // doesn't account for
+    segment.compressed.resize(deflateBound(&zs, static_cast<uLong>(filtered.size())) + 16);
+    zs.next_in = filtered.data();
+    zs.avail_in = static_cast<uInt>(filtered.size());
+    size_t used = 0;
+    int result;
+    do
+    {
+        if (used == segment.compressed.size())
+            segment.compressed.resize(segment.compressed.size() * 2);
+        zs.next_out = segment.compressed.data() + used;
+        zs.avail_out = static_cast<uInt>(segment.compressed.size() - used);
+        result = deflate(&zs, Z_SYNC_FLUSH);
+        used = segment.compressed.size() - zs.avail_out;
+    } while (result == Z_OK && (zs.avail_in > 0 || zs.avail_out == 0));
+
+    segment.ok = (result == Z_OK || result == Z_BUF_ERROR) && zs.avail_in == 0;
+    segment.compressed.resize(used);
+    deflateEnd(&zs);
+}
+
+void PngWriter::FilterRow(const unsigned char* row, const unsigned char* above,
+    unsigned char* dst) const
+{
+    const int rowBytes = mWidth * 3;
+
+    // The fast preset always uses Sub, which is cheap and does well on
+    // flat drawings. Otherwise try all five filters and keep the one
+    // with the smallest sum of absolute (signed) residuals.
+    int best = 1;
+    if (mPreset != PR_Fast)
+    {
+        unsigned long bestSum = ~0UL;
+        for (int filter = 0; filter <= 4; filter++)
+        {
+            unsigned long sum = 0;
+            for (int i = 0; i < rowBytes && sum < bestSum; i++)
+            {
+                signed char residual = static_cast<signed char>(row[i] - Predict(filter, row, above, i));
+                sum += std::abs(static_cast<int>(residual));
+            }
+            if (sum < bestSum)
+            {
+                bestSum = sum;
+                best = filter;
+            }
+        }
+    }
+
+    dst[0] = static_cast<unsigned char>(best);
+    for (int i = 0; i < rowBytes; i++)
+    {
+        dst[i + 1] = static_cast<unsigned char>(row[i] - Predict(best, row, above, i));
+    }
+}
+
+// Buffers zlib stream bytes, emitting an IDAT chunk whenever a full
+// chunk's worth is waiting (or everything, when flushing)
+bool PngWriter::WriteIdat(const unsigned char* data, size_t size, bool flush)
+{
+    mOut.insert(mOut.end(), data, data + size);
+
+    size_t offset = 0;
+    while (mOut.size() - offset >= kIdatSize || (flush && offset < mOut.size()))
+    {
+        size_t length = std::min(kIdatSize, mOut.size() - offset);
+        if (!WriteChunk("IDAT", mOut.data() + offset, length))
+            return false;
+        offset += length;
+    }
+    mOut.erase(mOut.begin(), mOut.begin() + offset);
+    return true;
+}
+
+bool PngWriter::WriteChunk(const char* type, const unsigned char* data, size_t size)
+{
+    unsigned char header[8];
+    PutBE32(header, static_cast<unsigned int>(size));
+    std::memcpy(header + 4, type, 4);
+
+    uLong crc = crc32(0L, reinterpret_cast<const Bytef*>(type), 4);
+    if (size > 0)
+        crc = crc32(crc, data, static_cast<uInt>(size));
+    unsigned char footer[4];
+    PutBE32(footer, static_cast<unsigned int>(crc));
+
+    return Write(header, sizeof(header)) &&
+        (size == 0 || Write(data, size)) &&
+        Write(footer, sizeof(footer));
+}
+
+GifWriter::GifWriter(int delay)
+    :mDelay(delay)
+    ,mMaxPending(0)
+    ,mFrameCount(0)
+{
+}
+
+GifWriter::~GifWriter()
+{
+    // Don't leave workers writing into freed frames
+    for (auto& frame : mPending)
+    {
+        frame->done.wait();
+    }
+}
+
+bool GifWriter::Begin(const wxString& fileName, int width, int height)
+{
+    if (!ImageWriter::Begin(fileName, width, height))
+        return false;
+    mMaxPending = ThreadPool::Get().GetThreadCount() * 2;
+    mFrameCount = 0;
+    mRows.clear();
+    mPending.clear();
+
+    // Header and logical screen, with a 256 entry global colour table
+    unsigned char header[13] = { 'G', 'I', 'F', '8', '9', 'a' };
+    PutLE16(header + 6, static_cast<unsigned int>(width));
+    PutLE16(header + 8, static_cast<unsigned int>(height));
+    header[10] = 0xF7;
+    header[11] = 0;
+    header[12] = 0;
+
+    unsigned char palette[256 * 3];
+    std::memset(palette, 0, sizeof(palette));
+    for (int r = 0; r < kCubeRed; r++)
+    {
+        for (int g = 0; g < kCubeGreen; g++)
+        {
+            for (int b = 0; b < kCubeBlue; b++)
+            {
+                unsigned char* entry = palette + ((r * kCubeGreen + g) * kCubeBlue + b) * 3;
+                entry[0] = static_cast<unsigned char>(r * 255 / (kCubeRed - 1));
+                entry[1] = static_cast<unsigned char>(g * 255 / (kCubeGreen - 1));
+                entry[2] = static_cast<unsigned char>(b * 255 / (kCubeBlue - 1));
+            }
+        }
+    }
+
+    // Loop forever
+    static const unsigned char loop[19] = { 0x21, 0xFF, 0x0B,
+        'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0', 0x03, 0x01, 0x00, 0x00, 0x00 };
+    return Write(header, sizeof(header)) && Write(palette, sizeof(palette)) && Write(loop, sizeof(loop));
+}
+
+bool GifWriter::WriteRows(const unsigned char* rgb, int count)
+{
+    size_t rowBytes = static_cast<size_t>(mWidth) * 3;
+    mRows.insert(mRows.end(), rgb, rgb + rowBytes * count);
+    if (mRows.size() < rowBytes * mHeight)
+        return true;
+
+    bool ok = AddFrame(mRows.data(), wxRect(0, 0, mWidth, mHeight));
+    mRows.clear();
+    return ok;
+}
+
+bool GifWriter::AddFrame(const unsigned char* rgb, const wxRect& area)
+{
+    wxRect clipped = area.Intersect(wxRect(0, 0, mWidth, mHeight));
+    if (clipped.IsEmpty())
+        clipped = wxRect(0, 0, 1, 1);
+
+    std::unique_ptr<Frame> frame(new Frame);
+    frame->area = clipped;
+    size_t rowBytes = static_cast<size_t>(clipped.width) * 3;
+    frame->pixels.resize(rowBytes * clipped.height);
+    for (int y = 0; y < clipped.height; y++)
+    {
+        const unsigned char* row = rgb + ((static_cast<size_t>(clipped.y) + y) * mWidth + clipped.x) * 3;
+        std::memcpy(&frame->pixels[y * rowBytes], row, rowBytes);
+    }
+
+    Frame* pending = frame.get();
+    frame->done = ThreadPool::Get().Submit([pending]() { CompressFrame(*pending); });
+    mPending.push_back(std::move(frame));
+    mFrameCount++;
+    return DrainFrames(mMaxPending);
+}
+
+bool GifWriter::End()
+{
+    bool ok = DrainFrames(0) && mRows.empty() && mFrameCount > 0;
+    unsigned char trailer = 0x3B;
+    ok = ok && Write(&trailer, 1);
+    // Every frame covers the whole screen, drawn over the ones before
+    mRowsWritten = mHeight;
+    return ImageWriter::End() && ok;
+}
+
+bool GifWriter::DrainFrames(size_t keep)
+{
+    while (mPending.size() > keep)
+    {
+        Frame& frame = *mPending.front();
+        frame.done.wait();
+
+        // Graphic control: leave the frame in place for the next one
+        // to draw over, and show it for mDelay
+        unsigned char control[8] = { 0x21, 0xF9, 0x04, 0x04 };
+        PutLE16(control + 4, static_cast<unsigned int>((mDelay + 5) / 10));
+        control[6] = 0;
+        control[7] = 0;
+
+        unsigned char descriptor[11] = { 0x2C };
+        PutLE16(descriptor + 1, static_cast<unsigned int>(frame.area.x));
+        PutLE16(descriptor + 3, static_cast<unsigned int>(frame.area.y));
+        PutLE16(descriptor + 5, static_cast<unsigned int>(frame.area.width));
+        PutLE16(descriptor + 7, static_cast<unsigned int>(frame.area.height));
+        descriptor[9] = 0;
+        descriptor[10] = kLzwMinCodeSize;
+
+        if (!Write(control, sizeof(control)) || !Write(descriptor, sizeof(descriptor)) ||
+            !Write(frame.compressed.data(), frame.compressed.size()))
+            return false;
+        mPending.pop_front();
+    }
+    return true;
+}
+
+// Runs on a worker: map each pixel into the colour cube, then LZW
+// encode the indices
+void GifWriter::CompressFrame(Frame& frame)
+{
+    size_t count = frame.pixels.size() / 3;
+    for (size_t i = 0; i < count; i++)
+    {
+        const unsigned char* rgb = &frame.pixels[i * 3];
+        frame.pixels[i] = static_cast<unsigned char>(
+            (CubeLevel(rgb[0], kCubeRed) * kCubeGreen + CubeLevel(rgb[1], kCubeGreen)) * kCubeBlue +
+            CubeLevel(rgb[2], kCubeBlue));
+    }
+    frame.pixels.resize(count);
+
+    const int clearCode = 1 << kLzwMinCodeSize;
+    const int tableSize = 1 << kLzwHashBits;
+    std::vector<int> keys(tableSize, -1);
+    std::vector<short> codes(tableSize);
+    LzwOutput out(frame.compressed);
+
+    int codeSize = kLzwMinCodeSize + 1;
+    int maxCode = clearCode + 1;
+    out.Put(clearCode, codeSize);
+    int current = frame.pixels[0];
+    for (size_t i = 1; i < count; i++)
+    {
+        int next = frame.pixels[i];
+        int key = (current << 8) | next;
+        unsigned slot = (static_cast<unsigned>(key) * 2654435761u) >> (32 - kLzwHashBits);
+        while (keys[slot] != -1 && keys[slot] != key)
+        {
+            slot = (slot + 1) & (tableSize - 1);
+        }
+        if (keys[slot] == key)
+        {
+            current = codes[slot];
+            continue;
+        }
+
+        out.Put(current, codeSize);
+        keys[slot] = key;
+        codes[slot] = static_cast<short>(++maxCode);
+        if (maxCode >= (1 << codeSize))
+            codeSize++;
+        if (maxCode == kLzwMaxCode)
+        {
+            // The table is full: start a new one
+            out.Put(clearCode, codeSize);
+            std::fill(keys.begin(), keys.end(), -1);
+            codeSize = kLzwMinCodeSize + 1;
+            maxCode = clearCode + 1;
+        }
+        current = next;
+    }
+    out.Put(current, codeSize);
+    // The decoder adds one more entry on reading that code, and widens
+    // if it fills the current size; the end code has to match
+    if (maxCode + 1 == (1 << codeSize) && (1 << codeSize) <= kLzwMaxCode)
+        codeSize++;
+    out.Put(clearCode + 1, codeSize);
+    out.Finish();
+    frame.pixels.clear();
+    frame.pixels.shrink_to_fit();
+}
@@ -0,0 +1,152 @@
+#pragma once
+#include <deque>
+#include <future>
+#include <memory>
+#include <vector>
+#include <wx/bitmap.h>
+#include <wx/string.h>
+
+class wxFileOutputStream;
+class wxBufferedOutputStream;
+
+// Writes an RGB image to disk a band of rows at a time, so the whole
+// frame never has to be held in memory
+class ImageWriter
+{
+public:
+    virtual ~ImageWriter();
+    // Opens the file and writes the header for an image of this size
+    virtual bool Begin(const wxString& fileName, int width, int height);
+    // Appends count rows of tightly packed 8-bit RGB, top row first
+    virtual bool WriteRows(const unsigned char* rgb, int count) = 0;
+    // Flushes any pending data and closes the file
+    virtual bool End();
+
+    // Speed/size trade-off for compressed formats
+    enum Preset
+    {
+        // Single cheap filter, fastest deflate level
+        PR_Fast,
+        // Adaptive filters, default deflate level
+        PR_Balanced,
+        // Adaptive filters, maximum deflate level, larger blocks
+        PR_Small,
+    };
+
+    // Returns a writer for the given type, or nullptr if the type
+    // can't be streamed (e.g. JPEG)
+    static std::unique_ptr<ImageWriter> Create(wxBitmapType type,
+        Preset preset = PR_Balanced);
+protected:
+    ImageWriter();
+    bool Write(const void* data, size_t size);
+
+    int mWidth;
+    int mHeight;
+    int mRowsWritten;
+private:
+    std::unique_ptr<wxFileOutputStream> mFile;
+    std::unique_ptr<wxBufferedOutputStream> mStream;
+};
+
+// Uncompressed 24-bit top-down BMP
+class BmpWriter : public ImageWriter
+{
+public:
+    bool Begin(const wxString& fileName, int width, int height) override;
+    bool WriteRows(const unsigned char* rgb, int count) override;
+private:
+    std::vector<unsigned char> mRow;
+};
+
+// 8-bit RGB PNG. Rows are grouped into segments that are filtered and
+// deflated independently on the thread pool; each segment ends on a
+// byte boundary (sync flush) so the pieces concatenate into one valid
+// zlib stream, with the per-segment Adler-32s combined at the end.
+class PngWriter : public ImageWriter
+{
+public:
+    explicit PngWriter(Preset preset = PR_Balanced);
+    ~PngWriter();
+    bool Begin(const wxString& fileName, int width, int height) override;
+    bool WriteRows(const unsigned char* rgb, int count) override;
+    bool End() override;
+private:
+    struct Segment
+    {
+        // Unfiltered rows, plus the row just above the first one
+        std::vector<unsigned char> raw;
+        std::vector<unsigned char> above;
+        int rows;
+        // Filled in by the worker
+        std::vector<unsigned char> compressed;
+        unsigned long adler;
+        size_t filteredSize;
+        bool ok;
+        std::future<void> done;
+    };
+
+    // Hands the segment being filled to the thread pool
+    void SubmitSegment();
+    // Writes finished segments, in order, until at most keep are pending
+    bool DrainSegments(size_t keep);
+    void CompressSegment(Segment& segment) const;
+    // Picks a filter for one row and writes filter byte + filtered bytes
+    void FilterRow(const unsigned char* row, const unsigned char* above,
+        unsigned char* dst) const;
+
+    bool WriteIdat(const unsigned char* data, size_t size, bool flush);
+    bool WriteChunk(const char* type, const unsigned char* data, size_t size);
+
+    Preset mPreset;
+    int mLevel;
+    int mStrategy;
+    int mSegmentRows;
+    size_t mMaxPending;
+    std::unique_ptr<Segment> mCurrent;
+    std::deque<std::unique_ptr<Segment>> mPending;
+    std::vector<unsigned char> mLastRow;
+    unsigned long mAdler;
+    std::vector<unsigned char> mOut;
+};
+
+// Animated GIF, written a frame at a time. A frame only has to cover
+// the part that changed since the one before it; each is mapped to a
+// fixed 6x7x6 colour cube and LZW compressed on the thread pool while
+// the caller renders the next. WriteRows adds full-size frames.
+class GifWriter : public ImageWriter
+{
+public:
+    // Milliseconds each frame shows for by default
+    static const int kDefaultDelay = 100;
+    
+    explicit GifWriter(int delay = kDefaultDelay);
+    ~GifWriter();
+    bool Begin(const wxString& fileName, int width, int height) override;
+    bool WriteRows(const unsigned char* rgb, int count) override;
+    // Adds a frame showing area of rgb, a whole image the size of the
+    // animation, over what the frames before it left
+    bool AddFrame(const unsigned char* rgb, const wxRect& area);
+    bool End() override;
+private:
+    struct Frame
+    {
+        wxRect area;
+        // RGB on the way in, palette indices once the worker has them
+        std::vector<unsigned char> pixels;
+        // Filled in by the worker: LZW codes in length-prefixed blocks
+        std::vector<unsigned char> compressed;
+        std::future<void> done;
+    };
+    
+    // Writes finished frames, in order, until at most keep are pending
+    bool DrainFrames(size_t keep);
+    static void CompressFrame(Frame& frame);
+    
+    int mDelay;
+    size_t mMaxPending;
+    size_t mFrameCount;
+    // Rows passed to WriteRows for the frame being filled
+    std::vector<unsigned char> mRows;
+    std::deque<std::unique_ptr<Frame>> mPending;
+};
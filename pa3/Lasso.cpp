@@ -0,0 +1,178 @@
+#include "Lasso.h"
+#include <algorithm>
+#include <cstdlib>
+#include <wx/pen.h>
+#include <wx/brush.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PAINT_LASSO_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// std::min takes it by reference, so it needs a definition
+const size_t Lasso::kMaxBands;
+
+Lasso::Lasso()
+    :mBandHeight(1)
+    ,mFinished(false)
+{
+}
+
+void Lasso::Begin(const wxPoint& point)
+{
+    Clear();
+    mPoints.push_back(point);
+    mBounds = wxRect(point, wxSize(1, 1));
+}
+
+void Lasso::Extend(const wxPoint& point)
+{
+    if (mPoints.empty())
+    {
+        Begin(point);
+        return;
+    }
+    const wxPoint& last = mPoints.back();
+    if (std::abs(point.x - last.x) < kMinStep && std::abs(point.y - last.y) < kMinStep)
+        return;
+    mPoints.push_back(point);
+    mBounds.Union(wxRect(point, wxSize(1, 1)));
+    mFinished = false;
+}
+
+void Lasso::Clear()
+{
+    mPoints.clear();
+    mBounds = wxRect();
+    mX0.clear();
+    mY0.clear();
+    mY1.clear();
+    mSlope.clear();
+    mBandStart.clear();
+    mFinished = false;
+}
+
+void Lasso::Finish()
+{
+    mX0.clear();
+    mY0.clear();
+    mY1.clear();
+    mSlope.clear();
+    mBandStart.clear();
+    mFinished = true;
+    if (!IsArea())
+        return;
+
+    // About two edges a band, so a row's band holds little more than
+    // the edges that actually cross it
+    size_t edges = mPoints.size();
+    size_t bands = std::max<size_t>(1, std::min(kMaxBands, edges / 2));
+    mBandHeight = std::max(1, static_cast<int>((mBounds.height + bands - 1) / bands));
+    bands = (mBounds.height + mBandHeight - 1) / mBandHeight;
+
+    // Which bands each edge spans, counted first so every band's edges
+    // can go straight into place
+    std::vector<size_t> counts(bands, 0);
+    for (size_t i = 0; i < edges; i++)
+    {
+        const wxPoint& a = mPoints[i];
+        const wxPoint& b = mPoints[(i + 1) % edges];
+        int first = (std::min(a.y, b.y) - mBounds.y) / mBandHeight;
+        int last = (std::max(a.y, b.y) - mBounds.y) / mBandHeight;
+        for (int band = first; band <= last; band++)
+        {
+            counts[band]++;
+        }
+    }
+    mBandStart.resize(bands + 1, 0);
+    for (size_t band = 0; band < bands; band++)
+    {
+        mBandStart[band + 1] = mBandStart[band] + (counts[band] + 3) / 4 * 4;
+    }
+    // Padding edges have both ends at 0, so never straddle a row
+    mX0.assign(mBandStart.back(), 0.0f);
+    mY0.assign(mBandStart.back(), 0.0f);
+    mY1.assign(mBandStart.back(), 0.0f);
+    mSlope.assign(mBandStart.back(), 0.0f);
+
+    std::vector<size_t> next(mBandStart.begin(), mBandStart.end() - 1);
+    for (size_t i = 0; i < edges; i++)
+    {
+        const wxPoint& a = mPoints[i];
+        const wxPoint& b = mPoints[(i + 1) % edges];
+        float slope = (a.y != b.y) ? static_cast<float>(b.x - a.x) / (b.y - a.y) : 0.0f;
+        int first = (std::min(a.y, b.y) - mBounds.y) / mBandHeight;
+        int last = (std::max(a.y, b.y) - mBounds.y) / mBandHeight;
+        for (int band = first; band <= last; band++)
+        {
+            size_t slot = next[band]++;
+            mX0[slot] = static_cast<float>(a.x);
+            mY0[slot] = static_cast<float>(a.y);
+            mY1[slot] = static_cast<float>(b.y);
+            mSlope[slot] = slope;
+        }
+    }
+}
+
+bool Lasso::Contains(const wxPoint& point) const
+{
+    return ContainsAll(&point, 1);
+}
+
+bool Lasso::ContainsAll(const wxPoint* points, size_t count) const
+{
+    if (!mFinished || !IsArea())
+        return false;
+
+    for (size_t p = 0; p < count; p++)
+    {
+        const wxPoint& point = points[p];
+        if (!mBounds.Contains(point))
+            return false;
+
+        // Cast a ray to the right, counting the edges it crosses. An
+        // edge straddles the row if exactly one end is below it, which
+        // counts a vertex shared by two edges once.
+        size_t band = (point.y - mBounds.y) / mBandHeight;
+        size_t e = mBandStart[band];
+        size_t end = mBandStart[band + 1];
+        const float x = static_cast<float>(point.x);
+        const float y = static_cast<float>(point.y);
+        bool inside = false;
+#ifdef PAINT_LASSO_SSE2
+        const __m128 px = _mm_set1_ps(x);
+        const __m128 py = _mm_set1_ps(y);
+        __m128 odd = _mm_setzero_ps();
+        for (; e < end; e += 4)
+        {
+            __m128 y0 = _mm_loadu_ps(&mY0[e]);
+            __m128 y1 = _mm_loadu_ps(&mY1[e]);
+            __m128 straddles = _mm_xor_ps(_mm_cmpgt_ps(y0, py), _mm_cmpgt_ps(y1, py));
+            __m128 cross = _mm_add_ps(_mm_loadu_ps(&mX0[e]),
+                _mm_mul_ps(_mm_sub_ps(py, y0), _mm_loadu_ps(&mSlope[e])));
+            odd = _mm_xor_ps(odd, _mm_and_ps(straddles, _mm_cmplt_ps(px, cross)));
+        }
+        // Each lane kept its own parity; the total is theirs combined
+        int lanes = _mm_movemask_ps(odd);
+        inside = ((lanes ^ (lanes >> 1) ^ (lanes >> 2) ^ (lanes >> 3)) & 1) != 0;
+#endif
+        for (; e < end; e++)
+        {
+            if ((mY0[e] > y) != (mY1[e] > y) && x < mX0[e] + (y - mY0[e]) * mSlope[e])
+                inside = !inside;
+        }
+        if (!inside)
+            return false;
+    }
+    return true;
+}
+
+void Lasso::Draw(wxDC& dc) const
+{
+    if (mPoints.size() < 2)
+        return;
+    dc.SetPen(*wxBLACK_DASHED_PEN);
+    dc.SetBrush(*wxTRANSPARENT_BRUSH);
+    dc.DrawLines(static_cast<int>(mPoints.size()), mPoints.data());
+    dc.DrawLine(mPoints.back(), mPoints.front());
+}
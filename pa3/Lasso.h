@@ -0,0 +1,79 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+#include <wx/dc.h>
+#include <wx/gdicmn.h>
+
+// Freehand outline for picking shapes, captured a point at a time as
+// the mouse moves, the way a pencil stroke is. The outline closes back
+// to its first point, and insideness follows the even-odd rule, so a
+// lasso that crosses itself leaves a hole where it overlaps.
+//
+// Finish indexes the edges by horizontal band, so testing a point only
+// looks at the edges crossing its row, four at a time where SSE2 is
+// available. Lassoing around thousands of shapes, each with tens of
+// outline points, stays well inside a frame.
+class Lasso
+{
+public:
+    Lasso();
+
+    // Starts a new outline at point
+    void Begin(const wxPoint& point);
+    // Adds a point, unless it's within kMinStep of the last one
+    void Extend(const wxPoint& point);
+    // Closes the outline and builds the edge index; needed before the
+    // tests below
+    void Finish();
+    void Clear();
+
+    bool IsEmpty() const
+    {
+        return mPoints.empty();
+    }
+    // Whether it encloses anything: at least three points
+    bool IsArea() const
+    {
+        return mPoints.size() >= 3;
+    }
+    size_t GetPointCount() const
+    {
+        return mPoints.size();
+    }
+    const wxPoint* GetPoints() const
+    {
+        return mPoints.data();
+    }
+    const wxRect& GetBounds() const
+    {
+        return mBounds;
+    }
+
+    bool Contains(const wxPoint& point) const;
+    // Whether every one of the points is inside; stops at the first
+    // that isn't
+    bool ContainsAll(const wxPoint* points, size_t count) const;
+
+    // The outline as a dashed line, closed back to its start
+    void Draw(wxDC& dc) const;
+
+private:
+    // Document pixels between captured points
+    static const int kMinStep = 2;
+    // Most bands in the edge index
+    static const size_t kMaxBands = 256;
+
+    std::vector<wxPoint> mPoints;
+    wxRect mBounds;
+
+    // Edges grouped by band, each band padded with empty edges to a
+    // multiple of four; band b is [mBandStart[b], mBandStart[b + 1])
+    std::vector<float> mX0;
+    std::vector<float> mY0;
+    std::vector<float> mY1;
+    // dx/dy, so an edge crosses row y at mX0 + (y - mY0) * mSlope
+    std::vector<float> mSlope;
+    std::vector<size_t> mBandStart;
+    int mBandHeight;
+    bool mFinished;
+};
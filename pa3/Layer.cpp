@@ -0,0 +1,424 @@
+#include "Layer.h"
+#include "Shape.h"
+#include "SvgWriter.h"
+#include "Renderer.h"
+#include <algorithm>
+#include <atomic>
+
+namespace
+{
+    std::atomic<unsigned long> sNextLayerId(1);
+}
+
+// std::min takes it by reference, so it needs a definition
+const unsigned long long Layer::kOrderGap;
+
+Layer::Layer(const wxString& name)
+    :mName(name)
+    ,mVisible(true)
+    ,mOpacity(1.0)
+    ,mId(sNextLayerId++)
+    ,mVersion(0)
+    ,mDamageSince(0)
+    ,mJournal(false)
+{
+}
+
+void Layer::SetVisible(bool visible)
+{
+    mVisible = visible;
+}
+
+void Layer::SetOpacity(double opacity)
+{
+    opacity = std::max(0.0, std::min(1.0, opacity));
+    if (opacity != mOpacity)
+    {
+        mOpacity = opacity;
+        Invalidate();
+    }
+}
+
+void Layer::SetJournal(bool on)
+{
+    mJournal = on;
+    if (!on)
+        mChanges.clear();
+}
+
+std::vector<Layer::Change> Layer::TakeChanges()
+{
+    std::vector<Change> changes;
+    changes.swap(mChanges);
+    return changes;
+}
+
+void Layer::Record(ChangeType type, ShapeId id)
+{
+    if (!mJournal)
+        return;
+    Change change = { type, id };
+    mChanges.push_back(change);
+}
+
+void Layer::Invalidate()
+{
+    FlushEdit();
+    mVersion++;
+    mSnapshot.reset();
+    mDamage.reset();
+    mDamageSince = mVersion;
+}
+
+void Layer::Damage(const wxRect& area)
+{
+    mVersion++;
+    mSnapshot.reset();
+    if (mDamage && mDamage->depth >= kMaxDamage)
+    {
+        mDamage.reset();
+        mDamageSince = mVersion;
+        return;
+    }
+    
+    std::shared_ptr<LayerDamage> entry = std::make_shared<LayerDamage>();
+    entry->version = mVersion;
+    entry->area = area;
+    entry->depth = mDamage ? mDamage->depth + 1 : 1;
+    entry->previous = mDamage;
+    mDamage = entry;
+}
+
+void Layer::FlushEdit()
+{
+    if (!mEditing)
+        return;
+    
+    std::shared_ptr<Shape> shape;
+    shape.swap(mEditing);
+    Damage(ShapeArea(*shape));
+}
+
+wxRect Layer::ShapeArea(const Shape& shape)
+{
+    wxPoint topLeft, botRight;
+    shape.GetBounds(topLeft, botRight);
+    wxRect area(topLeft, botRight);
+    // Thick pens are centred on the outline
+    area.Inflate(shape.GetWidth() / 2 + 1);
+    return area;
+}
+
+wxRect Layer::GetBounds() const
+{
+    wxRect bounds;
+    mShapes.ForEach([&bounds](const std::shared_ptr<Shape>& shape)
+    {
+        bounds = bounds.IsEmpty() ? ShapeArea(*shape) : bounds.Union(ShapeArea(*shape));
+    });
+    return bounds;
+}
+
+size_t Layer::Find(ShapeId id, size_t hint) const
+{
+    if (hint < mShapes.Size() && mShapes.At(hint)->GetId() == id)
+        return hint;
+    
+    auto iter = mOrders.find(id);
+    if (iter == mOrders.end())
+        return kNoShape;
+    size_t index = mShapes.LowerBound(iter->second);
+    if (index < mShapes.Size() && mShapes.At(index)->GetId() == id)
+        return index;
+    return kNoShape;
+}
+
+void Layer::Append(const std::shared_ptr<Shape>& shape)
+{
+    Insert(mShapes.Size(), shape);
+}
+
+void Layer::Insert(size_t index, const std::shared_ptr<Shape>& shape)
+{
+    FlushEdit();
+    InsertOrdered(std::min(index, mShapes.Size()), shape);
+    Damage(ShapeArea(*shape));
+    Record(LC_Insert, shape->GetId());
+}
+
+void Layer::Erase(size_t index)
+{
+    FlushEdit();
+    Damage(ShapeArea(*mShapes.At(index)));
+    Record(LC_Erase, mShapes.At(index)->GetId());
+    mOrders.erase(mShapes.At(index)->GetId());
+    mShapes.Erase(index);
+}
+
+void Layer::InsertRange(size_t index, const std::vector<std::shared_ptr<Shape>>& shapes)
+{
+    FlushEdit();
+    if (shapes.empty())
+        return;
+    index = std::min(index, mShapes.Size());
+    
+    const unsigned long long kTop = ~0ULL;
+    unsigned long long below = (index > 0) ? mShapes.At(index - 1)->GetOrder() : 0;
+    unsigned long long above = (index < mShapes.Size()) ? mShapes.At(index)->GetOrder() : kTop;
+    // Shapes coming back (redo) keep their labels if they still fit,
+    // so none has to be copied
+    bool keep = true;
+    unsigned long long last = below;
+    for (auto& shape : shapes)
+    {
+        if (shape->GetEpoch() == 0 || shape->GetOrder() <= last || shape->GetOrder() >= above)
+        {
+            keep = false;
+            break;
+        }
+        last = shape->GetOrder();
+    }
+    unsigned long long step = (above - below) / (shapes.size() + 1);
+    if (above == kTop)
+        step = std::min(step, kOrderGap);
+    if (!keep && step < kMinSpread)
+    {
+        // No room between the neighbours; let Spread make it
+        for (size_t i = 0; i < shapes.size(); i++)
+        {
+            Insert(index + i, shapes[i]);
+        }
+        return;
+    }
+    
+    std::vector<std::shared_ptr<Shape>> items;
+    items.reserve(shapes.size());
+    mOrders.reserve(mOrders.size() + shapes.size());
+    wxRect area;
+    for (size_t i = 0; i < shapes.size(); i++)
+    {
+        // Copied as in InsertOrdered
+        std::shared_ptr<Shape> item = shapes[i];
+        unsigned long long order = keep ? item->GetOrder() : below + step * (i + 1);
+        if (item->GetEpoch() == 0)
+        {
+            item->SetEpoch(mShapes.GetEpoch());
+        }
+        else if (item->GetEpoch() != mShapes.GetEpoch() && item->GetOrder() != order)
+        {
+            item = item->Clone();
+            item->SetEpoch(mShapes.GetEpoch());
+        }
+        item->SetOrder(order);
+        mOrders[item->GetId()] = order;
+        area = area.IsEmpty() ? ShapeArea(*item) : area.Union(ShapeArea(*item));
+        Record(LC_Insert, item->GetId());
+        items.push_back(item);
+    }
+    mShapes.InsertRange(index, items);
+    Damage(area);
+}
+
+void Layer::EraseRange(size_t index, size_t count)
+{
+    FlushEdit();
+    count = std::min(count, mShapes.Size() - std::min(index, mShapes.Size()));
+    if (count == 0)
+        return;
+    
+    wxRect area;
+    for (size_t i = index; i < index + count; i++)
+    {
+        const Shape& shape = *mShapes.At(i);
+        area = area.IsEmpty() ? ShapeArea(shape) : area.Union(ShapeArea(shape));
+        Record(LC_Erase, shape.GetId());
+        mOrders.erase(shape.GetId());
+    }
+    mShapes.EraseRange(index, count);
+    Damage(area);
+}
+
+void Layer::Move(size_t from, size_t to)
+{
+    FlushEdit();
+    std::shared_ptr<Shape> shape = mShapes.At(from);
+    mShapes.Erase(from);
+    InsertOrdered(std::min(to, mShapes.Size()), shape);
+    // Restacking only changes pixels where the shape is
+    Damage(ShapeArea(*shape));
+    Record(LC_Move, shape->GetId());
+}
+
+void Layer::InsertOrdered(size_t index, const std::shared_ptr<Shape>& shape)
+{
+    unsigned long long order = NewOrder(index);
+    
+    // A shape that's never been in a layer can't be in any snapshot, so
+    // it's ours to change. One coming back (undo) may still be shared,
+    // and is copied if its label has to change.
+    std::shared_ptr<Shape> item = shape;
+    if (item->GetEpoch() == 0)
+    {
+        item->SetEpoch(mShapes.GetEpoch());
+    }
+    else if (item->GetEpoch() != mShapes.GetEpoch() && item->GetOrder() != order)
+    {
+        item = item->Clone();
+        item->SetEpoch(mShapes.GetEpoch());
+    }
+    item->SetOrder(order);
+    mShapes.Insert(index, item);
+    mOrders[item->GetId()] = order;
+}
+
+unsigned long long Layer::NewOrder(size_t index)
+{
+    const unsigned long long kTop = ~0ULL;
+    for (;;)
+    {
+        unsigned long long below = (index > 0) ? mShapes.At(index - 1)->GetOrder() : 0;
+        unsigned long long above = (index < mShapes.Size()) ? mShapes.At(index)->GetOrder() : kTop;
+        // Shapes mostly go on top, so leave a fixed gap there rather
+        // than halving what's left every time
+        if (above == kTop && above - below > kOrderGap)
+            return below + kOrderGap;
+        if (above - below >= 2)
+            return below + (above - below) / 2;
+        Spread(index);
+    }
+}
+
+void Layer::Spread(size_t index)
+{
+    const unsigned long long kTop = ~0ULL;
+    size_t size = mShapes.Size();
+    for (size_t half = 8; ; half *= 2)
+    {
+        size_t first = (index > half) ? index - half : 0;
+        size_t last = std::min(size, index + half);
+        unsigned long long below = (first > 0) ? mShapes.At(first - 1)->GetOrder() : 0;
+        unsigned long long above = (last < size) ? mShapes.At(last)->GetOrder() : kTop;
+        // One slot per shape, one for the newcomer and one spare
+        unsigned long long step = (above - below) / (last - first + 2);
+        if (step < kMinSpread && (first > 0 || last < size))
+            continue;
+        
+        for (size_t i = first; i < last; i++)
+        {
+            unsigned long long slot = i - first + 1 + ((i >= index) ? 1 : 0);
+            SetOrder(i, below + step * slot);
+        }
+        return;
+    }
+}
+
+void Layer::SetOrder(size_t index, unsigned long long order)
+{
+    std::shared_ptr<Shape> shape = mShapes.At(index);
+    if (shape->GetOrder() == order)
+        return;
+    if (shape->GetEpoch() != mShapes.GetEpoch())
+    {
+        shape = shape->Clone();
+        shape->SetEpoch(mShapes.GetEpoch());
+    }
+    shape->SetOrder(order);
+    mShapes.Set(index, shape);
+    mOrders[shape->GetId()] = order;
+}
+
+Shape& Layer::Edit(size_t index)
+{
+    FlushEdit();
+    std::shared_ptr<Shape>& shape = mShapes.Edit(index);
+    if (shape->GetEpoch() != mShapes.GetEpoch())
+    {
+        shape = shape->Clone();
+        shape->SetEpoch(mShapes.GetEpoch());
+    }
+    
+    // Where it was now, where it ends up once the caller is done
+    Damage(ShapeArea(*shape));
+    Record(LC_Edit, shape->GetId());
+    mEditing = shape;
+    return *shape;
+}
+
+std::shared_ptr<const LayerSnapshot> Layer::Snapshot(bool live)
+{
+    FlushEdit();
+    if (!live && mSnapshot)
+        return mSnapshot;
+    
+    std::shared_ptr<LayerSnapshot> snapshot = std::make_shared<LayerSnapshot>();
+    snapshot->id = mId;
+    snapshot->version = mVersion;
+    snapshot->live = live;
+    snapshot->opacity = mOpacity;
+    snapshot->shapes = mShapes.Snapshot();
+    snapshot->damage = mDamage;
+    snapshot->damageSince = mDamageSince;
+    
+    if (!live)
+        mSnapshot = snapshot;
+    return snapshot;
+}
+
+void Layer::Draw(wxDC& dc) const
+{
+    // Exports draw the same shapes as the screen, so they share its
+    // rasters of the expensive ones
+    double scaleX, scaleY;
+    dc.GetUserScale(&scaleX, &scaleY);
+    // Shapes off the DC are skipped, so each band of a banded export
+    // only draws (and stamps) what lands on it
+    ViewTransform view;
+    view.scale = scaleX;
+    view.origin = dc.GetDeviceOrigin();
+    wxRect visible = view.VisibleRect(dc.GetSize());
+    SpriteCache& sprites = SpriteCache::Get();
+    mShapes.ForEach([&dc, &sprites, scaleX, &visible](const std::shared_ptr<Shape>& shape)
+    {
+        if (!ShapeTouches(*shape, visible))
+            return;
+        if (!sprites.Stamp(*shape, dc, scaleX))
+            shape->Draw(dc);
+    });
+}
+
+void Layer::DrawComposited(wxDC& dc) const
+{
+    if (mOpacity >= 1.0)
+    {
+        Draw(dc);
+        return;
+    }
+
+    // Render to a transparent bitmap in device space and blend it in
+    double scaleX, scaleY;
+    dc.GetUserScale(&scaleX, &scaleY);
+    wxPoint origin = dc.GetDeviceOrigin();
+    wxBitmap bitmap = Rasterize(dc.GetSize(), scaleX, origin);
+
+    dc.SetUserScale(1.0, 1.0);
+    dc.SetDeviceOrigin(0, 0);
+    dc.DrawBitmap(bitmap, 0, 0, true);
+    dc.SetUserScale(scaleX, scaleY);
+    dc.SetDeviceOrigin(origin.x, origin.y);
+}
+
+void Layer::DrawSvg(SvgWriter& svg) const
+{
+    svg.BeginGroup(mOpacity);
+    mShapes.ForEach([&svg](const std::shared_ptr<Shape>& shape)
+    {
+        shape->DrawSvg(svg);
+    });
+    svg.EndGroup();
+}
+
+wxBitmap Layer::Rasterize(const wxSize& size, double scale, const wxPoint& origin) const
+{
+    return wxBitmap(RasterizeLayer(size, scale, origin, mOpacity,
+        [this](wxDC& dc) { Draw(dc); }));
+}
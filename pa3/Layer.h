@@ -0,0 +1,182 @@
+#pragma once
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <wx/bitmap.h>
+#include <wx/dc.h>
+#include <wx/string.h>
+#include "Shape.h"
+
+class SvgWriter;
+struct LayerSnapshot;
+struct LayerDamage;
+
+// A named stack of shapes with its own visibility and opacity. Layers
+// that aren't being edited are composited from a cached raster, which
+// is only rebuilt after the layer is invalidated (see FrameRenderer).
+//
+// The shapes live in a persistent sequence, so a snapshot is O(1) and
+// every change goes through the layer, which copies whatever a
+// snapshot still shares before touching it. Shapes carry order labels
+// that increase from bottom to top, so finding a shape's index by id,
+// and moving it up or down the stack, are O(log n).
+class Layer
+{
+public:
+    Layer(const wxString& name);
+
+    // Returned by Find when no shape has the id
+    static const size_t kNoShape = static_cast<size_t>(-1);
+    
+    // Kinds of change recorded while the layer keeps a journal
+    enum ChangeType
+    {
+        LC_Insert,
+        LC_Erase,
+        LC_Move,
+        LC_Edit,
+    };
+    struct Change
+    {
+        ChangeType type;
+        ShapeId id;
+    };
+
+    const ShapeSequence& GetShapes() const
+    {
+        return mShapes;
+    }
+    size_t GetCount() const
+    {
+        return mShapes.Size();
+    }
+    const std::shared_ptr<Shape>& At(size_t index) const
+    {
+        return mShapes.At(index);
+    }
+
+    // Index of the shape with this id, or kNoShape. hint is checked
+    // first; otherwise the shape's order label is looked up.
+    size_t Find(ShapeId id, size_t hint = kNoShape) const;
+
+    void Append(const std::shared_ptr<Shape>& shape);
+    void Insert(size_t index, const std::shared_ptr<Shape>& shape);
+    void Erase(size_t index);
+    // Inserts shapes, bottom to top, before index. The layer's damage
+    // and labels are worked out once for the lot, and a large batch is
+    // bulk-loaded rather than inserted a shape at a time.
+    void InsertRange(size_t index, const std::vector<std::shared_ptr<Shape>>& shapes);
+    void EraseRange(size_t index, size_t count);
+    // Restacks the shape at from so it ends up at index to
+    void Move(size_t from, size_t to);
+    // The shape at index, ready to change. It's copied first if a
+    // snapshot might still be reading it.
+    Shape& Edit(size_t index);
+
+    const wxString& GetName() const
+    {
+        return mName;
+    }
+    // Unique among the layers of every document in the process
+    unsigned long GetId() const
+    {
+        return mId;
+    }
+    
+    // With a journal on, each insert, erase, move and edit is noted by
+    // shape id, for mirroring the layer elsewhere (see LiveSession).
+    // Only ids are kept; whoever takes the changes reads the shapes as
+    // they are by then, so repeated edits cost nothing extra.
+    void SetJournal(bool on);
+    bool HasJournal() const
+    {
+        return mJournal;
+    }
+    // Changes since the last call, oldest first
+    std::vector<Change> TakeChanges();
+
+    bool IsVisible() const
+    {
+        return mVisible;
+    }
+    void SetVisible(bool visible);
+
+    // 0 (transparent) to 1 (opaque)
+    double GetOpacity() const
+    {
+        return mOpacity;
+    }
+    void SetOpacity(double opacity);
+
+    // Marks all of the layer's cached rasters and its snapshot as
+    // stale. The shape edits above mark just the area they touch.
+    void Invalidate();
+    
+    unsigned long GetVersion() const
+    {
+        return mVersion;
+    }
+    
+    // Read-only view for the renderer, safe to use from any thread.
+    // Unless live, it's reused until the layer is next invalidated.
+    std::shared_ptr<const LayerSnapshot> Snapshot(bool live);
+
+    // Draws the shapes that land on the DC straight to it, ignoring
+    // opacity; expensive ones come from the shared rasters (see
+    // SpriteCache)
+    void Draw(wxDC& dc) const;
+    // Draws the layer with its opacity, at whatever scale and origin
+    // the DC is currently using
+    void DrawComposited(wxDC& dc) const;
+    // Writes the layer's shapes to an SVG group
+    void DrawSvg(SvgWriter& svg) const;
+
+    // Renders the layer into a transparent bitmap of the given size,
+    // with opacity applied. scale and origin map document coordinates
+    // to bitmap pixels the same way wxDC user scale/device origin do.
+    wxBitmap Rasterize(const wxSize& size, double scale, const wxPoint& origin) const;
+    
+    // Area covered by the layer's shapes, pens included (empty if none)
+    wxRect GetBounds() const;
+    // Area a shape can paint on
+    static wxRect ShapeArea(const Shape& shape);
+private:
+    // Bumps the version, recording area as the part that changed
+    void Damage(const wxRect& area);
+    // Records where the shape last handed out by Edit ended up
+    void FlushEdit();
+    // Puts shape at index with a fresh order label
+    void InsertOrdered(size_t index, const std::shared_ptr<Shape>& shape);
+    // Order label for a shape going in at index, respreading its
+    // neighbours' labels if there's no room
+    unsigned long long NewOrder(size_t index);
+    // Evens out the labels around index, wider and wider until there's
+    // a gap of at least kMinSpread for every shape
+    void Spread(size_t index);
+    void SetOrder(size_t index, unsigned long long order);
+    void Record(ChangeType type, ShapeId id);
+    
+    // Longest damage chain kept before it's dropped and everything
+    // older counts as changed
+    static const size_t kMaxDamage = 1024;
+    // Label gap left after a shape appended at the top
+    static const unsigned long long kOrderGap = 1ULL << 32;
+    // Smallest gap Spread leaves between labels
+    static const unsigned long long kMinSpread = 64;
+
+    wxString mName;
+    ShapeSequence mShapes;
+    // Order label of every shape on the layer
+    std::unordered_map<ShapeId, unsigned long long> mOrders;
+    bool mVisible;
+    double mOpacity;
+
+    unsigned long mId;
+    unsigned long mVersion;
+    std::shared_ptr<const LayerSnapshot> mSnapshot;
+    std::shared_ptr<const LayerDamage> mDamage;
+    unsigned long mDamageSince;
+    std::shared_ptr<Shape> mEditing;
+    bool mJournal;
+    std::vector<Change> mChanges;
+};
@@ -0,0 +1,543 @@
+#include "LiveSession.h"
+#include "Layer.h"
+#include "PaintModel.h"
+#include <algorithm>
+#include <cstring>
+#include <unordered_set>
+#include <wx/stopwatch.h>
+
+namespace
+{
+    // Sent first by both sides, so a stray connection is dropped
+    const unsigned char kGreeting[] = { 'P', 'P', 'L', 'S', 1 };
+    // Bytes asked of the socket per read, and most reads per event
+    const size_t kReadSize = 64 * 1024;
+    const int kMaxReads = 16;
+    // Longest varint, in bytes
+    const size_t kMaxVarint = 10;
+}
+
+void LiveSession::IdMap::Add(unsigned long local, unsigned long remote)
+{
+    toLocal[remote] = local;
+    toRemote[local] = remote;
+}
+
+// std::min takes it by reference, so it needs a definition
+const size_t LiveSession::kMaxOp;
+
+LiveSession::LiveSession(const std::shared_ptr<PaintModel>& model, const std::function<void()>& changed)
+    :mModel(model)
+    ,mChanged(changed)
+    ,mServer(nullptr)
+    ,mSocket(nullptr)
+    ,mConnected(false)
+    ,mGreeted(false)
+    ,mOutgoingSent(0)
+    ,mIncomingRead(0)
+    ,mOpsSent(0)
+    ,mOpsReceived(0)
+{
+    Bind(wxEVT_SOCKET, &LiveSession::OnSocket, this);
+    mTimer.Bind(wxEVT_TIMER, &LiveSession::OnTimer, this);
+}
+
+LiveSession::~LiveSession()
+{
+    // Whoever is listening is going away too
+    mChanged = std::function<void()>();
+    Leave();
+}
+
+bool LiveSession::Host(unsigned short port)
+{
+    Leave();
+    wxIPV4address address;
+    address.AnyAddress();
+    address.Service(port);
+    mServer = new wxSocketServer(address, wxSOCKET_NOWAIT | wxSOCKET_REUSEADDR);
+    if (!mServer->IsOk())
+    {
+        mServer->Destroy();
+        mServer = nullptr;
+        return false;
+    }
+    mServer->SetEventHandler(*this);
+    mServer->SetNotify(wxSOCKET_CONNECTION_FLAG);
+    mServer->Notify(true);
+    return true;
+}
+
+bool LiveSession::Join(const wxString& host, unsigned short port)
+{
+    Leave();
+    wxIPV4address address;
+    if (!address.Hostname(host) || !address.Service(port))
+        return false;
+
+    wxSocketClient* client = new wxSocketClient(wxSOCKET_NOWAIT);
+    mSocket = client;
+    Watch(client);
+    // Ends in a connection event, or a lost one
+    client->Connect(address, false);
+    return true;
+}
+
+void LiveSession::Leave()
+{
+    mTimer.Stop();
+    if (mServer)
+    {
+        mServer->Destroy();
+        mServer = nullptr;
+    }
+    if (mSocket)
+    {
+        mSocket->Destroy();
+        mSocket = nullptr;
+    }
+    bool wasConnected = mConnected;
+    mConnected = false;
+    mGreeted = false;
+
+    for (auto& entry : mLayers)
+    {
+        entry.second->SetJournal(false);
+    }
+    mLayers.clear();
+    mLayerIds = IdMap();
+    mShapeIds = IdMap();
+    mSent.clear();
+    mOp.Clear();
+    mOutgoing.clear();
+    mOutgoingSent = 0;
+    mIncoming.clear();
+    mIncomingRead = 0;
+
+    if (wasConnected && mChanged)
+        mChanged();
+}
+
+void LiveSession::Watch(wxSocketBase* socket)
+{
+    socket->SetFlags(wxSOCKET_NOWAIT);
+    socket->SetEventHandler(*this);
+    socket->SetNotify(wxSOCKET_CONNECTION_FLAG | wxSOCKET_INPUT_FLAG |
+        wxSOCKET_OUTPUT_FLAG | wxSOCKET_LOST_FLAG);
+    socket->Notify(true);
+}
+
+void LiveSession::OnSocket(wxSocketEvent& event)
+{
+    switch (event.GetSocketEvent())
+    {
+        case wxSOCKET_CONNECTION:
+            if (mServer && event.GetSocket() == mServer)
+            {
+                // One peer a session, so the listener is done with
+                wxSocketBase* peer = mServer->Accept(false);
+                if (!peer)
+                    break;
+                mServer->Destroy();
+                mServer = nullptr;
+                mSocket = peer;
+                Watch(peer);
+                Start();
+            }
+            else if (event.GetSocket() == mSocket && !mConnected)
+            {
+                Start();
+            }
+            break;
+        case wxSOCKET_INPUT:
+            Receive();
+            break;
+        case wxSOCKET_OUTPUT:
+            Send();
+            break;
+        case wxSOCKET_LOST:
+            if (event.GetSocket() == mSocket)
+                Leave();
+            break;
+        default:
+            break;
+    }
+}
+
+void LiveSession::Start()
+{
+    mConnected = true;
+    mOutgoing.assign(kGreeting, kGreeting + sizeof(kGreeting));
+
+    // The peer starts with everything here, and sends back everything
+    // it has
+    for (auto& layer : mModel->GetLayers())
+    {
+        layer->SetJournal(true);
+        layer->TakeChanges();
+        Introduce(layer);
+        for (size_t i = 0; i < layer->GetCount(); i++)
+        {
+            SendShape(layer, i, false);
+        }
+    }
+    Send();
+    // A document too big to catch up on ends the session (see Send),
+    // and Leave has already said so
+    if (!mConnected)
+        return;
+    mTimer.Start(kBatchMs);
+
+    if (mChanged)
+        mChanged();
+}
+
+void LiveSession::OnTimer(wxTimerEvent& event)
+{
+    Receive();
+    // Ours go out first, so whatever the journals hold after Apply is
+    // the peer's own changes
+    Flush();
+    Apply();
+}
+
+void LiveSession::Flush()
+{
+    if (!mConnected)
+        return;
+
+    for (auto& layer : mModel->GetLayers())
+    {
+        if (mLayers.count(layer->GetId()) == 0)
+        {
+            // Made since the last batch
+            layer->SetJournal(true);
+            Introduce(layer);
+            for (size_t i = 0; i < layer->GetCount(); i++)
+            {
+                SendShape(layer, i, false);
+            }
+            continue;
+        }
+
+        // Each shape goes as it is now, so its edits go once a batch;
+        // inserts and moves each say where it went
+        std::unordered_set<ShapeId> edited;
+        for (const Layer::Change& change : layer->TakeChanges())
+        {
+            size_t index = layer->Find(change.id);
+            if (change.type == Layer::LC_Erase)
+            {
+                // Unless it came back later in the batch (undo, redo)
+                if (index == Layer::kNoShape && mSent.count(change.id) != 0)
+                    SendErase(layer, change.id);
+                continue;
+            }
+            if (index == Layer::kNoShape)
+                continue;
+            if (change.type == Layer::LC_Edit && !edited.insert(change.id).second)
+                continue;
+            SendShape(layer, index, change.type != Layer::LC_Edit);
+        }
+    }
+    Send();
+}
+
+void LiveSession::SendShape(const std::shared_ptr<Layer>& layer, size_t index, bool moved)
+{
+    const Shape& shape = *layer->At(index);
+    auto sent = mSent.find(shape.GetId());
+    if (sent == mSent.end())
+    {
+        OpWriter& out = BeginOp(OP_Insert, layer);
+        PutRef(out, mShapeIds, shape.GetId());
+        out.PutVarint(index);
+        shape.Encode(out);
+        EndOp();
+    }
+    else
+    {
+        OpWriter& out = BeginOp(OP_Change, layer);
+        PutRef(out, mShapeIds, shape.GetId());
+        if (shape.EncodeChanges(*sent->second, out))
+            EndOp();
+        else
+            DropOp();
+
+        if (moved)
+        {
+            OpWriter& move = BeginOp(OP_Move, layer);
+            PutRef(move, mShapeIds, shape.GetId());
+            move.PutVarint(index);
+            EndOp();
+        }
+    }
+    Remember(shape);
+}
+
+void LiveSession::SendErase(const std::shared_ptr<Layer>& layer, ShapeId id)
+{
+    OpWriter& out = BeginOp(OP_Erase, layer);
+    PutRef(out, mShapeIds, id);
+    EndOp();
+    // The ids stay mapped, so an undo puts back the peer's shape as the
+    // one it had
+    mSent.erase(id);
+}
+
+void LiveSession::Introduce(const std::shared_ptr<Layer>& layer)
+{
+    mLayers[layer->GetId()] = layer;
+    mOp.Clear();
+    mOp.PutVarint(OP_Layer);
+    PutRef(mOp, mLayerIds, layer->GetId());
+    mOp.PutString(std::string(layer->GetName().ToUTF8()));
+    EndOp();
+}
+
+OpWriter& LiveSession::BeginOp(OpType type, const std::shared_ptr<Layer>& layer)
+{
+    if (mLayers.count(layer->GetId()) == 0)
+        Introduce(layer);
+    mOp.Clear();
+    mOp.PutVarint(type);
+    PutRef(mOp, mLayerIds, layer->GetId());
+    return mOp;
+}
+
+void LiveSession::EndOp()
+{
+    OpWriter length;
+    length.PutVarint(mOp.GetSize());
+    mOutgoing.insert(mOutgoing.end(), length.GetData().begin(), length.GetData().end());
+    mOutgoing.insert(mOutgoing.end(), mOp.GetData().begin(), mOp.GetData().end());
+    mOp.Clear();
+    mOpsSent++;
+}
+
+void LiveSession::DropOp()
+{
+    mOp.Clear();
+}
+
+void LiveSession::PutRef(OpWriter& out, const IdMap& ids, unsigned long id)
+{
+    auto iter = ids.toRemote.find(id);
+    if (iter != ids.toRemote.end())
+        out.PutVarint((static_cast<unsigned long long>(iter->second) << 1) | 1);
+    else
+        out.PutVarint(static_cast<unsigned long long>(id) << 1);
+}
+
+unsigned long LiveSession::ToLocal(unsigned long long ref, const IdMap& ids)
+{
+    // The low bit is set when the sender used our id
+    unsigned long id = static_cast<unsigned long>(ref >> 1);
+    if (ref & 1)
+        return id;
+    auto iter = ids.toLocal.find(id);
+    return iter == ids.toLocal.end() ? 0 : iter->second;
+}
+
+void LiveSession::Send()
+{
+    if (!mConnected)
+        return;
+
+    while (mOutgoingSent < mOutgoing.size())
+    {
+        mSocket->Write(mOutgoing.data() + mOutgoingSent,
+            static_cast<wxUint32>(std::min<size_t>(mOutgoing.size() - mOutgoingSent, kMaxOp)));
+        size_t written = mSocket->LastWriteCount();
+        // The rest goes on the next output event
+        if (written == 0)
+            break;
+        mOutgoingSent += written;
+    }
+
+    if (mOutgoingSent == mOutgoing.size())
+    {
+        mOutgoing.clear();
+        mOutgoingSent = 0;
+    }
+    else if (mOutgoing.size() - mOutgoingSent > kMaxBacklog)
+    {
+        Leave();
+    }
+    else if (mOutgoingSent > mOutgoing.size() / 2)
+    {
+        mOutgoing.erase(mOutgoing.begin(), mOutgoing.begin() + mOutgoingSent);
+        mOutgoingSent = 0;
+    }
+}
+
+void LiveSession::Receive()
+{
+    if (!mConnected)
+        return;
+
+    // Only a copy into the buffer; Apply does the work, a slice at a time
+    for (int i = 0; i < kMaxReads; i++)
+    {
+        size_t size = mIncoming.size();
+        mIncoming.resize(size + kReadSize);
+        mSocket->Read(mIncoming.data() + size, static_cast<wxUint32>(kReadSize));
+        size_t read = mSocket->LastReadCount();
+        mIncoming.resize(size + read);
+        if (read < kReadSize)
+            break;
+    }
+
+    if (!mGreeted && mIncoming.size() - mIncomingRead >= sizeof(kGreeting))
+    {
+        if (std::memcmp(mIncoming.data() + mIncomingRead, kGreeting, sizeof(kGreeting)) != 0)
+        {
+            Leave();
+            return;
+        }
+        mIncomingRead += sizeof(kGreeting);
+        mGreeted = true;
+    }
+}
+
+void LiveSession::Apply()
+{
+    if (!mConnected || !mGreeted)
+        return;
+
+    wxStopWatch clock;
+    bool applied = false;
+    while (mIncomingRead < mIncoming.size() && clock.Time() < kApplyMs)
+    {
+        size_t available = mIncoming.size() - mIncomingRead;
+        OpReader header(mIncoming.data() + mIncomingRead, available);
+        unsigned long long length = header.GetVarint();
+        if (!header.IsOk() || length > kMaxOp)
+        {
+            // Either the length hasn't all arrived, or it's garbage
+            if (available >= kMaxVarint || length > kMaxOp)
+            {
+                Leave();
+                return;
+            }
+            break;
+        }
+        if (length > available - header.GetPosition())
+            break;
+
+        OpReader op(mIncoming.data() + mIncomingRead + header.GetPosition(), static_cast<size_t>(length));
+        mIncomingRead += header.GetPosition() + static_cast<size_t>(length);
+        mOpsReceived++;
+        // Ops that don't make sense here (a shape erased on this side
+        // meanwhile, or from a newer version) are skipped
+        if (ApplyOp(op))
+            applied = true;
+    }
+
+    if (mIncomingRead == mIncoming.size())
+    {
+        mIncoming.clear();
+        mIncomingRead = 0;
+    }
+    else if (mIncomingRead > mIncoming.size() / 2)
+    {
+        mIncoming.erase(mIncoming.begin(), mIncoming.begin() + mIncomingRead);
+        mIncomingRead = 0;
+    }
+    if (!applied)
+        return;
+
+    // The peer already has what it just did
+    for (auto& entry : mLayers)
+    {
+        entry.second->TakeChanges();
+    }
+    if (mChanged)
+        mChanged();
+}
+
+bool LiveSession::ApplyOp(OpReader& in)
+{
+    unsigned long long type = in.GetVarint();
+    unsigned long long layerRef = in.GetVarint();
+    if (type == OP_Layer)
+    {
+        std::string name = in.GetString();
+        // Only layers made over there get introduced
+        if (!in.IsOk() || (layerRef & 1) || ToLocal(layerRef, mLayerIds) != 0)
+            return false;
+        std::shared_ptr<Layer> layer = mModel->AppendLayer(wxString::FromUTF8(name.data(), name.size()));
+        layer->SetJournal(true);
+        mLayers[layer->GetId()] = layer;
+        mLayerIds.Add(layer->GetId(), static_cast<unsigned long>(layerRef >> 1));
+        return true;
+    }
+
+    std::shared_ptr<Layer> layer = FindLayer(ToLocal(layerRef, mLayerIds));
+    unsigned long long shapeRef = in.GetVarint();
+    if (!layer || !in.IsOk())
+        return false;
+    ShapeId id = ToLocal(shapeRef, mShapeIds);
+    size_t index = (id != 0) ? layer->Find(id) : Layer::kNoShape;
+
+    switch (type)
+    {
+        case OP_Insert:
+        {
+            size_t to = static_cast<size_t>(in.GetVarint());
+            // Under the id it had here before, if any
+            ArenaAllocator<Shape> alloc(mModel->GetArena(), MC_Styles);
+            std::shared_ptr<Shape> shape = Shape::Decode(in, alloc, id);
+            if (!shape)
+                return false;
+            if (index != Layer::kNoShape)
+                layer->Erase(index);
+            layer->Insert(std::min(to, layer->GetCount()), shape);
+            if (id == 0)
+                mShapeIds.Add(shape->GetId(), static_cast<unsigned long>(shapeRef >> 1));
+            Remember(*shape);
+            if (shape->GetKind() == SK_Pencil)
+                mModel->FinalizeLater(layer, shape->GetId());
+            return true;
+        }
+        case OP_Erase:
+            if (index == Layer::kNoShape)
+                return false;
+            layer->Erase(index);
+            mSent.erase(id);
+            return true;
+        case OP_Move:
+        {
+            size_t to = static_cast<size_t>(in.GetVarint());
+            if (index == Layer::kNoShape || !in.IsOk())
+                return false;
+            layer->Move(index, std::min(to, layer->GetCount() - 1));
+            return true;
+        }
+        case OP_Change:
+        {
+            if (index == Layer::kNoShape)
+                return false;
+            Shape& shape = layer->Edit(index);
+            bool ok = shape.DecodeChanges(in);
+            Remember(shape);
+            if (shape.GetKind() == SK_Pencil)
+                mModel->FinalizeLater(layer, id);
+            return ok;
+        }
+        default:
+            return false;
+    }
+}
+
+std::shared_ptr<Layer> LiveSession::FindLayer(unsigned long id) const
+{
+    auto iter = mLayers.find(id);
+    return iter == mLayers.end() ? std::shared_ptr<Layer>() : iter->second;
+}
+
+void LiveSession::Remember(const Shape& shape)
+{
+    // A copy, as the layer may go on changing its own in place
+    mSent[shape.GetId()] = shape.Clone();
+}
@@ -0,0 +1,166 @@
+#pragma once
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <wx/event.h>
+#include <wx/socket.h>
+#include <wx/timer.h>
+#include "OpStream.h"
+#include "Shape.h"
+
+class Layer;
+class PaintModel;
+
+// Draws on one document from two copies of the program: whatever
+// changes on either side's layers is sent over a TCP socket and made
+// to the other's.
+//
+// What goes over the wire is the effect of each command, not the
+// command: the layers keep a journal of which shapes were inserted,
+// erased, moved and edited (see Layer::SetJournal), and every kBatchMs
+// the session turns it into ops against the last version it sent of
+// each shape. Edits in between cost nothing, so a drag or a stroke
+// goes out as one change per batch however fast the mouse moves, and
+// a stroke being drawn sends only its new points (see
+// Shape::EncodeChanges). All of a batch goes out in one write.
+//
+// Each side gives shapes and layers its own ids, so ops name them by
+// whose id they use. Ops from the peer are applied on the UI thread
+// but only for kApplyMs a batch, the rest waiting for the next one,
+// so a flood of them can't hold up input. They bypass the undo
+// history: undo only takes back what was done on this side, and
+// commands whose shapes the peer removed leave them be. Both sides
+// are equals; if they change the same shape at once, whichever change
+// arrives last wins.
+class LiveSession : public wxEvtHandler
+{
+public:
+    // Ops on the wire. Each is a varint length and then the op, so a
+    // side can skip any it doesn't know.
+    enum OpType
+    {
+        // layer, name: a layer the peer hasn't heard of
+        OP_Layer,
+        // layer, shape, index, Shape::Encode
+        OP_Insert,
+        // layer, shape
+        OP_Erase,
+        // layer, shape, index
+        OP_Move,
+        // layer, shape, Shape::EncodeChanges
+        OP_Change,
+    };
+
+    static const unsigned short kDefaultPort = 7433;
+    // Milliseconds between batches
+    static const int kBatchMs = 16;
+    // Milliseconds a batch spends applying the peer's ops
+    static const long kApplyMs = 4;
+    // Longest op accepted, and most bytes waiting to go out before the
+    // peer counts as gone
+    static const size_t kMaxOp = 64 * 1024 * 1024;
+    static const size_t kMaxBacklog = 256 * 1024 * 1024;
+
+    // changed is called on the UI thread after the peer's ops change
+    // the document, and when the connection comes or goes
+    LiveSession(const std::shared_ptr<PaintModel>& model, const std::function<void()>& changed);
+    ~LiveSession();
+
+    // Waits for a peer to join on port. False if it can't listen.
+    bool Host(unsigned short port = kDefaultPort);
+    // Starts connecting to a peer that's hosting, without waiting
+    bool Join(const wxString& host, unsigned short port = kDefaultPort);
+    // Drops the connection; the document stays as it is
+    void Leave();
+
+    bool IsConnected() const
+    {
+        return mConnected;
+    }
+    // Listening or connecting, or connected
+    bool IsActive() const
+    {
+        return mServer != nullptr || mSocket != nullptr;
+    }
+    unsigned long GetOpsSent() const
+    {
+        return mOpsSent;
+    }
+    unsigned long GetOpsReceived() const
+    {
+        return mOpsReceived;
+    }
+
+    // Disallow copy/assignment
+    LiveSession(const LiveSession&) = delete;
+    LiveSession& operator=(const LiveSession&) = delete;
+private:
+    // Ids one side uses for the other's things, both ways round
+    struct IdMap
+    {
+        std::unordered_map<unsigned long, unsigned long> toLocal;
+        std::unordered_map<unsigned long, unsigned long> toRemote;
+
+        void Add(unsigned long local, unsigned long remote);
+    };
+
+    void OnSocket(wxSocketEvent& event);
+    void OnTimer(wxTimerEvent& event);
+    void Watch(wxSocketBase* socket);
+    // The connection is up: greet the peer and send it the document
+    void Start();
+
+    // Turns the layers' journals into ops, and sends them
+    void Flush();
+    // Ops for the shape now at index, against the version last sent
+    void SendShape(const std::shared_ptr<Layer>& layer, size_t index, bool moved);
+    void SendErase(const std::shared_ptr<Layer>& layer, ShapeId id);
+    // Tells the peer about a layer made on this side
+    void Introduce(const std::shared_ptr<Layer>& layer);
+    // Starts an op on layer, introducing the layer first if need be
+    OpWriter& BeginOp(OpType type, const std::shared_ptr<Layer>& layer);
+    // Queues the op, or forgets it
+    void EndOp();
+    void DropOp();
+    // Names a local id as the peer knows it: its own id if it made the
+    // thing, otherwise ours, with the low bit saying which
+    static void PutRef(OpWriter& out, const IdMap& ids, unsigned long id);
+    // The local id a ref names, or 0 if it's a peer's id not seen yet
+    static unsigned long ToLocal(unsigned long long ref, const IdMap& ids);
+
+    // Takes whatever the socket has, and gives it what's waiting
+    void Receive();
+    void Send();
+    // Applies whole ops that have arrived, until kApplyMs is up
+    void Apply();
+    bool ApplyOp(OpReader& in);
+    std::shared_ptr<Layer> FindLayer(unsigned long id) const;
+    // Notes a shape as the peer now has it
+    void Remember(const Shape& shape);
+
+    std::shared_ptr<PaintModel> mModel;
+    std::function<void()> mChanged;
+    wxSocketServer* mServer;
+    wxSocketBase* mSocket;
+    bool mConnected;
+    // Whether the peer's greeting has been checked
+    bool mGreeted;
+    wxTimer mTimer;
+
+    // Every layer the peer knows, by local id
+    std::unordered_map<unsigned long, std::shared_ptr<Layer>> mLayers;
+    IdMap mLayerIds;
+    IdMap mShapeIds;
+    // What the peer has of each shape, as of the last op about it
+    std::unordered_map<ShapeId, std::shared_ptr<const Shape>> mSent;
+
+    // Op being written
+    OpWriter mOp;
+    std::vector<unsigned char> mOutgoing;
+    size_t mOutgoingSent;
+    std::vector<unsigned char> mIncoming;
+    size_t mIncomingRead;
+    unsigned long mOpsSent;
+    unsigned long mOpsReceived;
+};
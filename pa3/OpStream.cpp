@@ -0,0 +1,151 @@
+#include "OpStream.h"
+#include <cstring>
+
+OpWriter::OpWriter()
+{
+}
+
+void OpWriter::PutByte(unsigned char value)
+{
+    mData.push_back(value);
+}
+
+void OpWriter::PutVarint(unsigned long long value)
+{
+    while (value >= 0x80)
+    {
+        mData.push_back(static_cast<unsigned char>(value | 0x80));
+        value >>= 7;
+    }
+    mData.push_back(static_cast<unsigned char>(value));
+}
+
+void OpWriter::PutSigned(long long value)
+{
+    // Small magnitudes of either sign end up small
+    unsigned long long bits = static_cast<unsigned long long>(value);
+    PutVarint((bits << 1) ^ (value < 0 ? ~0ULL : 0ULL));
+}
+
+void OpWriter::PutDouble(double value)
+{
+    unsigned long long bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    for (int i = 0; i < 8; i++)
+    {
+        mData.push_back(static_cast<unsigned char>(bits >> (i * 8)));
+    }
+}
+
+void OpWriter::PutPoint(const wxPoint& point)
+{
+    PutSigned(static_cast<long long>(point.x) - mLast.x);
+    PutSigned(static_cast<long long>(point.y) - mLast.y);
+    mLast = point;
+}
+
+void OpWriter::PutString(const std::string& value)
+{
+    PutVarint(value.size());
+    mData.insert(mData.end(), value.begin(), value.end());
+}
+
+void OpWriter::PutBytes(const OpWriter& other)
+{
+    mData.insert(mData.end(), other.mData.begin(), other.mData.end());
+}
+
+void OpWriter::Clear()
+{
+    mData.clear();
+    mLast = wxPoint(0, 0);
+}
+
+OpReader::OpReader(const unsigned char* data, size_t size)
+    :mData(data)
+    ,mSize(size)
+    ,mPos(0)
+    ,mFailed(false)
+{
+}
+
+void OpReader::Fail()
+{
+    mFailed = true;
+    mPos = mSize;
+}
+
+unsigned char OpReader::GetByte()
+{
+    if (mPos >= mSize)
+    {
+        Fail();
+        return 0;
+    }
+    return mData[mPos++];
+}
+
+unsigned long long OpReader::GetVarint()
+{
+    unsigned long long value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        unsigned char byte = GetByte();
+        if (mFailed)
+            return 0;
+        value |= static_cast<unsigned long long>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+            return value;
+    }
+    Fail();
+    return 0;
+}
+
+long long OpReader::GetSigned()
+{
+    unsigned long long bits = GetVarint();
+    return static_cast<long long>((bits >> 1) ^ (0ULL - (bits & 1)));
+}
+
+double OpReader::GetDouble()
+{
+    unsigned long long bits = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        bits |= static_cast<unsigned long long>(GetByte()) << (i * 8);
+    }
+    double value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return mFailed ? 0.0 : value;
+}
+
+wxPoint OpReader::GetPoint()
+{
+    long long x = mLast.x + GetSigned();
+    long long y = mLast.y + GetSigned();
+    if (mFailed)
+        return wxPoint(0, 0);
+    mLast = wxPoint(static_cast<int>(x), static_cast<int>(y));
+    return mLast;
+}
+
+std::string OpReader::GetString()
+{
+    size_t length = GetCount();
+    if (mFailed)
+        return std::string();
+    std::string value(reinterpret_cast<const char*>(mData + mPos), length);
+    mPos += length;
+    return value;
+}
+
+size_t OpReader::GetCount()
+{
+    unsigned long long count = GetVarint();
+    if (count > mSize - mPos)
+    {
+        Fail();
+        return 0;
+    }
+    return static_cast<size_t>(count);
+}
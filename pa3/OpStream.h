@@ -0,0 +1,92 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <wx/gdicmn.h>
+
+// Compact binary encoding for the collaboration stream (see
+// LiveSession). Counts and ids are LEB128 varints, and signed values
+// are zigzagged first, so small numbers take one byte. Points are
+// written relative to the last point, so a stroke costs a byte or two
+// per point; ResetPoint sets where the next one is measured from.
+class OpWriter
+{
+public:
+    OpWriter();
+
+    void PutByte(unsigned char value);
+    void PutVarint(unsigned long long value);
+    void PutSigned(long long value);
+    // Raw IEEE bits, little-endian
+    void PutDouble(double value);
+    void PutPoint(const wxPoint& point);
+    // Length, then the bytes
+    void PutString(const std::string& value);
+    // Appends another writer's bytes as they are
+    void PutBytes(const OpWriter& other);
+    void ResetPoint(const wxPoint& last = wxPoint(0, 0))
+    {
+        mLast = last;
+    }
+
+    const std::vector<unsigned char>& GetData() const
+    {
+        return mData;
+    }
+    size_t GetSize() const
+    {
+        return mData.size();
+    }
+    void Clear();
+
+private:
+    std::vector<unsigned char> mData;
+    wxPoint mLast;
+};
+
+// Reads what OpWriter wrote. Running off the end, or a varint that's
+// too long, leaves the reader failed and every getter returning 0, so
+// callers check IsOk once they're done rather than after each value.
+class OpReader
+{
+public:
+    OpReader(const unsigned char* data, size_t size);
+
+    unsigned char GetByte();
+    unsigned long long GetVarint();
+    long long GetSigned();
+    double GetDouble();
+    wxPoint GetPoint();
+    std::string GetString();
+    // A count of things that each take at least a byte. Counts past
+    // what's left fail, so bad data can't make a reader allocate much.
+    size_t GetCount();
+    void ResetPoint(const wxPoint& last = wxPoint(0, 0))
+    {
+        mLast = last;
+    }
+
+    bool IsOk() const
+    {
+        return !mFailed;
+    }
+    bool AtEnd() const
+    {
+        return mPos == mSize;
+    }
+    size_t GetPosition() const
+    {
+        return mPos;
+    }
+    // Leaves the reader failed, for data that reads fine but makes no
+    // sense to the caller
+    void Fail();
+
+private:
+
+    const unsigned char* mData;
+    size_t mSize;
+    size_t mPos;
+    bool mFailed;
+    wxPoint mLast;
+};
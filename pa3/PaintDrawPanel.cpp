@@ -3,14 +3,34 @@
 #include <wx/sizer.h>
 #include <wx/dcbuffer.h>
 #include "PaintModel.h"
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+	// Zoom limits, in screen pixels per document pixel
+	const double kMinZoom = 1.0 / 64.0;
+	const double kMaxZoom = 32.0;
+	// Zoom per wheel notch
+	const double kWheelZoom = 1.25;
+}
 
 BEGIN_EVENT_TABLE(PaintDrawPanel, wxPanel)
 	EVT_PAINT(PaintDrawPanel::PaintEvent)
+	EVT_THREAD(wxID_ANY, PaintDrawPanel::OnFrameReady)
+	EVT_SIZE(PaintDrawPanel::OnSize)
+	EVT_MOUSEWHEEL(PaintDrawPanel::OnMouseWheel)
+	EVT_MIDDLE_DOWN(PaintDrawPanel::OnMiddleButton)
+	EVT_MIDDLE_UP(PaintDrawPanel::OnMiddleButton)
+	EVT_MOTION(PaintDrawPanel::OnMotion)
+	EVT_MOUSE_CAPTURE_LOST(PaintDrawPanel::OnCaptureLost)
 END_EVENT_TABLE()
 
 
 PaintDrawPanel::PaintDrawPanel(wxFrame* parent)
 : wxPanel(parent)
+, mRenderThread(new RenderThread(this))
+, mPanning(false)
 {
 	
 }
@@ -23,9 +43,10 @@ void PaintDrawPanel::PaintEvent(wxPaintEvent & evt)
 
 void PaintDrawPanel::PaintNow()
 {
-	wxClientDC dc(this);
-	wxBufferedDC bdc(&dc, mBitmap);
-	Render(bdc);
+	if (mModel)
+	{
+		mRenderThread->Request(mModel->Snapshot(), GetClientSize(), mView);
+	}
 }
 
 void PaintDrawPanel::Render(wxDC& dc)
@@ -34,15 +55,104 @@ void PaintDrawPanel::Render(wxDC& dc)
 	dc.SetBackground(*wxWHITE_BRUSH);
 	dc.Clear();
 	
+	if (mFrameBitmap.IsOk())
+	{
+		dc.DrawBitmap(mFrameBitmap, 0, 0);
+	}
+	
+	// The selection outline is cheap, so it's drawn here from the live
+	// model rather than baked into the frame
 	if (mModel)
 	{
-        if (mModel->GetSelectedShape())
-            mModel->DrawShapes(dc, true);
-        else
-            mModel->DrawShapes(dc, false);
+		dc.SetUserScale(mView.scale, mView.scale);
+		dc.SetDeviceOrigin(mView.origin.x, mView.origin.y);
+		mModel->DrawSelection(dc);
+		dc.SetUserScale(1.0, 1.0);
+		dc.SetDeviceOrigin(0, 0);
 	}
 }
 
+void PaintDrawPanel::OnFrameReady(wxThreadEvent& event)
+{
+	if (!mRenderThread->SwapFrame(mFrame))
+		return;
+	
+	mFrameBitmap = wxBitmap(mFrame);
+	wxClientDC dc(this);
+	wxBufferedDC bdc(&dc, mBitmap);
+	Render(bdc);
+}
+
+void PaintDrawPanel::OnSize(wxSizeEvent& event)
+{
+	PaintNow();
+	event.Skip();
+}
+
+void PaintDrawPanel::ZoomAt(double factor, const wxPoint& pixel)
+{
+	double scale = std::max(kMinZoom, std::min(kMaxZoom, mView.scale * factor));
+	if (scale == mView.scale)
+		return;
+	
+	// The document point under pixel maps back to pixel
+	double ratio = scale / mView.scale;
+	mView.origin.x = static_cast<int>(std::floor(pixel.x - (pixel.x - mView.origin.x) * ratio + 0.5));
+	mView.origin.y = static_cast<int>(std::floor(pixel.y - (pixel.y - mView.origin.y) * ratio + 0.5));
+	mView.scale = scale;
+	PaintNow();
+}
+
+void PaintDrawPanel::Zoom(double factor)
+{
+	wxSize size = GetClientSize();
+	ZoomAt(factor, wxPoint(size.GetWidth() / 2, size.GetHeight() / 2));
+}
+
+void PaintDrawPanel::ResetView()
+{
+	mView = ViewTransform();
+	PaintNow();
+}
+
+void PaintDrawPanel::OnMouseWheel(wxMouseEvent& event)
+{
+	int notches = event.GetWheelRotation() / std::max(1, event.GetWheelDelta());
+	if (notches != 0)
+		ZoomAt(std::pow(kWheelZoom, notches), event.GetPosition());
+}
+
+void PaintDrawPanel::OnMiddleButton(wxMouseEvent& event)
+{
+	if (event.MiddleDown())
+	{
+		mPanning = true;
+		mPanFrom = event.GetPosition();
+		CaptureMouse();
+	}
+	else if (mPanning)
+	{
+		mPanning = false;
+		if (HasCapture())
+			ReleaseMouse();
+	}
+}
+
+void PaintDrawPanel::OnMotion(wxMouseEvent& event)
+{
+	if (!mPanning)
+		return;
+	
+	mView.origin += event.GetPosition() - mPanFrom;
+	mPanFrom = event.GetPosition();
+	PaintNow();
+}
+
+void PaintDrawPanel::OnCaptureLost(wxMouseCaptureLostEvent& event)
+{
+	mPanning = false;
+}
+
 void PaintDrawPanel::SetModel(std::shared_ptr<class PaintModel> model)
 {
 	mModel = model;
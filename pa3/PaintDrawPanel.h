@@ -3,8 +3,10 @@
 #include <wx/panel.h>
 #include <wx/frame.h>
 #include <wx/bitmap.h>
+#include <wx/image.h>
 #include <string>
 #include <memory>
+#include "Renderer.h"
 
 class PaintDrawPanel : public wxPanel
 {
@@ -12,6 +14,8 @@ public:
 	PaintDrawPanel(wxFrame* parent);
  
 	void PaintEvent(wxPaintEvent & evt);
+	// Hands the render thread a snapshot of the model; the panel is
+	// redrawn when the frame comes back
 	void PaintNow();
  
 	void Render(wxDC& dc);
@@ -19,6 +23,42 @@ public:
 	void SetModel(std::shared_ptr<class PaintModel> model);
 	void SetupBitmap();
 	
+	// A frame finished rendering
+	void OnFrameReady(wxThreadEvent& event);
+	void OnSize(wxSizeEvent& event);
+	
+	// Document coordinates of a point on the panel
+	wxPoint ToDocument(const wxPoint& pixel) const
+	{
+		return mView.ToDocument(pixel);
+	}
+	// Part of the document on screen
+	wxRect GetVisibleRect() const
+	{
+		return mView.VisibleRect(GetClientSize());
+	}
+	double GetZoom() const
+	{
+		return mView.scale;
+	}
+	// Zooms by factor, keeping the document point under pixel still
+	void ZoomAt(double factor, const wxPoint& pixel);
+	// Zooms about the middle of the panel
+	void Zoom(double factor);
+	// Back to 1:1 with the document's top left in the corner
+	void ResetView();
+	// Whether the middle button is dragging the view
+	bool IsPanning() const
+	{
+		return mPanning;
+	}
+	
+	// Mouse wheel zooms, middle button drag pans
+	void OnMouseWheel(wxMouseEvent& event);
+	void OnMiddleButton(wxMouseEvent& event);
+	void OnMotion(wxMouseEvent& event);
+	void OnCaptureLost(wxMouseCaptureLostEvent& event);
+	
 	DECLARE_EVENT_TABLE()
 	
 public:
@@ -26,5 +66,15 @@ public:
 	wxBitmap mBitmap;
 	// Variables here
 	std::shared_ptr<class PaintModel> mModel;
+	
+private:
+	std::unique_ptr<RenderThread> mRenderThread;
+	// Newest rendered frame, and the same as a bitmap for blitting
+	wxImage mFrame;
+	wxBitmap mFrameBitmap;
+	
+	ViewTransform mView;
+	bool mPanning;
+	// Where the last pan motion was
+	wxPoint mPanFrom;
 };
-
@@ -9,10 +9,16 @@
 #include <wx/image.h>
 #include <wx/colordlg.h>
 #include <wx/textdlg.h>
+#include <wx/numdlg.h>
+#include <wx/stopwatch.h>
+#include <wx/utils.h>
 #include <wx/filedlg.h>
 #include "PaintDrawPanel.h"
 #include "PaintModel.h"
+#include "ImageFilters.h"
+#include "Renderer.h"
 #include <iostream>
+#include <algorithm>
 
 wxBEGIN_EVENT_TABLE(PaintFrame, wxFrame)
 	EVT_MENU(wxID_EXIT, PaintFrame::OnExit)
@@ -21,21 +27,64 @@ wxBEGIN_EVENT_TABLE(PaintFrame, wxFrame)
 	EVT_TOOL(ID_Import, PaintFrame::OnImport)
 	EVT_MENU(ID_Export, PaintFrame::OnExport)
 	EVT_TOOL(ID_Export, PaintFrame::OnExport)
+	EVT_MENU(ID_ExportScaled, PaintFrame::OnExportScaled)
+	EVT_MENU(ID_ExportTimelapse, PaintFrame::OnExportTimelapse)
+	EVT_MENU(ID_HostSession, PaintFrame::OnSession)
+	EVT_MENU(ID_JoinSession, PaintFrame::OnSession)
+	EVT_MENU(ID_LeaveSession, PaintFrame::OnSession)
+	EVT_MENU(ID_PngFast, PaintFrame::OnSetPngPreset)
+	EVT_MENU(ID_PngBalanced, PaintFrame::OnSetPngPreset)
+	EVT_MENU(ID_PngSmall, PaintFrame::OnSetPngPreset)
 	EVT_MENU(wxID_UNDO, PaintFrame::OnUndo)
 	EVT_TOOL(wxID_UNDO, PaintFrame::OnUndo)
 	EVT_MENU(wxID_REDO, PaintFrame::OnRedo)
 	EVT_TOOL(wxID_REDO, PaintFrame::OnRedo)
+	EVT_MENU(ID_EarlierState, PaintFrame::OnHistory)
+	EVT_MENU(ID_LaterState, PaintFrame::OnHistory)
+	EVT_MENU(ID_NextBranch, PaintFrame::OnHistory)
+	EVT_MENU(ID_PreviousBranch, PaintFrame::OnHistory)
 	EVT_MENU(ID_Unselect, PaintFrame::OnUnselect)
 	EVT_MENU(ID_Delete, PaintFrame::OnDelete)
+	EVT_MENU(ID_Group, PaintFrame::OnGroup)
+	EVT_MENU(ID_Ungroup, PaintFrame::OnGroup)
+	EVT_MENU(ID_BringToFront, PaintFrame::OnZOrder)
+	EVT_MENU(ID_BringForward, PaintFrame::OnZOrder)
+	EVT_MENU(ID_SendBackward, PaintFrame::OnZOrder)
+	EVT_MENU(ID_SendToBack, PaintFrame::OnZOrder)
+	EVT_MENU(ID_MoveToIndex, PaintFrame::OnZOrder)
+	EVT_MENU(wxID_COPY, PaintFrame::OnCopy)
+	EVT_MENU(wxID_PASTE, PaintFrame::OnPaste)
+	EVT_MENU(ID_Duplicate, PaintFrame::OnPaste)
 	EVT_MENU(ID_SetPenColor, PaintFrame::OnSetPenColor)
 	EVT_MENU(ID_SetPenWidth, PaintFrame::OnSetPenWidth)
 	EVT_MENU(ID_SetBrushColor, PaintFrame::OnSetBrushColor)
+	EVT_MENU(ID_GaussianBlur, PaintFrame::OnImageFilter)
+	EVT_MENU(ID_BoxBlur, PaintFrame::OnImageFilter)
+	EVT_MENU(ID_Sharpen, PaintFrame::OnImageFilter)
+	EVT_MENU(ID_BrightnessContrast, PaintFrame::OnImageFilter)
+	EVT_MENU(ID_Grayscale, PaintFrame::OnImageFilter)
+	EVT_MENU(ID_ResizeImage, PaintFrame::OnImageFilter)
+	EVT_MENU(ID_NewLayer, PaintFrame::OnNewLayer)
+	EVT_MENU(ID_LayerAbove, PaintFrame::OnSelectLayer)
+	EVT_MENU(ID_LayerBelow, PaintFrame::OnSelectLayer)
+	EVT_MENU(ID_ToggleLayer, PaintFrame::OnToggleLayer)
+	EVT_MENU(ID_LayerOpacity, PaintFrame::OnLayerOpacity)
+	EVT_MENU(ID_ZoomIn, PaintFrame::OnZoom)
+	EVT_MENU(ID_ZoomOut, PaintFrame::OnZoom)
+	EVT_MENU(ID_ActualSize, PaintFrame::OnZoom)
+	EVT_MENU(ID_SnapToGrid, PaintFrame::OnSnap)
+	EVT_MENU(ID_GridSize, PaintFrame::OnSnap)
+	EVT_MENU(ID_SnapToShapes, PaintFrame::OnSnap)
+	EVT_MENU(ID_MemoryUsage, PaintFrame::OnMemory)
+	EVT_MENU(ID_MemoryBudgets, PaintFrame::OnMemory)
 	// The different draw modes
 	EVT_TOOL(ID_Selector, PaintFrame::OnSelectTool)
 	EVT_TOOL(ID_DrawLine, PaintFrame::OnSelectTool)
 	EVT_TOOL(ID_DrawEllipse, PaintFrame::OnSelectTool)
 	EVT_TOOL(ID_DrawRect, PaintFrame::OnSelectTool)
 	EVT_TOOL(ID_DrawPencil, PaintFrame::OnSelectTool)
+	EVT_TOOL(ID_BucketFill, PaintFrame::OnSelectTool)
+	EVT_TOOL(ID_Lasso, PaintFrame::OnSelectTool)
 wxEND_EVENT_TABLE()	
 
 PaintFrame::PaintFrame(const wxString& title, const wxPoint& pos, const wxSize& size)
@@ -51,7 +100,9 @@ PaintFrame::PaintFrame(const wxString& title, const wxPoint& pos, const wxSize&
 
 	SetupModelAndView();
     
-    moveCursor = false;
+    mHandle = HD_None;
+    mStrokeHeapAllocs = 0;
+    mStrokeEvents = 0;
     
 	Show(true);
 	
@@ -66,26 +117,79 @@ void PaintFrame::SetupMenu()
 	mFileMenu->Append(wxID_NEW);
 	mFileMenu->Append(ID_Export, "Export...",
 		"Export current drawing to image file.");
+	mFileMenu->Append(ID_ExportScaled, "Export at Scale...",
+		"Export current drawing scaled up to a larger image file.");
+	mFileMenu->Append(ID_ExportTimelapse, "Export Timelapse...",
+		"Export an animation of the drawing being made, step by step.");
+	wxMenu* pngMenu = new wxMenu();
+	pngMenu->AppendRadioItem(ID_PngFast, "Fastest", "Encode PNG files as fast as possible.");
+	pngMenu->AppendRadioItem(ID_PngBalanced, "Balanced", "Balance PNG encode time and file size.");
+	pngMenu->AppendRadioItem(ID_PngSmall, "Smallest", "Make PNG files as small as possible.");
+	pngMenu->Check(ID_PngBalanced, true);
+	mFileMenu->AppendSubMenu(pngMenu, "PNG Compression");
 	mFileMenu->AppendSeparator();
 	mFileMenu->Append(ID_Import, "Import...",
 		"Import image into file.");
+	mFileMenu->AppendSeparator();
+	mFileMenu->Append(ID_HostSession, "Host Live Session...",
+		"Let someone else draw on this document over the network.");
+	mFileMenu->Append(ID_JoinSession, "Join Live Session...",
+		"Draw together with someone hosting a session.");
+	mFileMenu->Append(ID_LeaveSession, "Leave Live Session",
+		"Stop sharing this document.");
+	mFileMenu->Enable(ID_LeaveSession, false);
+	mFileMenu->AppendSeparator();
 	mFileMenu->Append(wxID_EXIT);
 
 	// Edit menu
 	mEditMenu = new wxMenu();
 	mEditMenu->Append(wxID_UNDO);
 	mEditMenu->Append(wxID_REDO);
+	mEditMenu->Append(ID_EarlierState, "Earlier State\tCtrl+Alt+Z",
+		"Go to the state made before this one, on whatever branch");
+	mEditMenu->Append(ID_LaterState, "Later State\tCtrl+Alt+Y",
+		"Go to the state made after this one, on whatever branch");
+	mEditMenu->Append(ID_NextBranch, "Next Redo Branch\tAlt+]",
+		"Redo into the next of the changes made from this state");
+	mEditMenu->Append(ID_PreviousBranch, "Previous Redo Branch\tAlt+[",
+		"Redo into the previous of the changes made from this state");
 	mEditMenu->AppendSeparator();
 	mEditMenu->Append(ID_Unselect, "Unselect",
 		"Unselect the current selection");
 	mEditMenu->AppendSeparator();
 	mEditMenu->Append(ID_Delete, "Delete\tDel",
 		"Delete the current selection");
+	mEditMenu->AppendSeparator();
+	mEditMenu->Append(wxID_COPY);
+	mEditMenu->Append(wxID_PASTE);
+	mEditMenu->Append(ID_Duplicate, "Duplicate\tCtrl+D",
+		"Copy the selection in place, slightly offset");
+	mEditMenu->AppendSeparator();
+	mEditMenu->Append(ID_Group, "Group\tCtrl+G",
+		"Group the shapes picked with shift-click");
+	mEditMenu->Append(ID_Ungroup, "Ungroup\tCtrl+Shift+G",
+		"Split the selected group back into its shapes");
+	mEditMenu->AppendSeparator();
+	mEditMenu->Append(ID_BringToFront, "Bring to Front\tCtrl+Shift+]",
+		"Move the selection above every other shape");
+	mEditMenu->Append(ID_BringForward, "Bring Forward\tCtrl+]",
+		"Move the selection up one place");
+	mEditMenu->Append(ID_SendBackward, "Send Backward\tCtrl+[",
+		"Move the selection down one place");
+	mEditMenu->Append(ID_SendToBack, "Send to Back\tCtrl+Shift+[",
+		"Move the selection below every other shape");
+	mEditMenu->Append(ID_MoveToIndex, "Move to Position...",
+		"Move the selection to a given place in the stack");
 	
 	mEditMenu->Enable(wxID_UNDO, false);
 	mEditMenu->Enable(wxID_REDO, false);
+	mEditMenu->Enable(ID_EarlierState, false);
+	mEditMenu->Enable(ID_LaterState, false);
+	mEditMenu->Enable(ID_NextBranch, false);
+	mEditMenu->Enable(ID_PreviousBranch, false);
 	mEditMenu->Enable(ID_Unselect, false);
 	mEditMenu->Enable(ID_Delete, false);
+	mEditMenu->Enable(wxID_PASTE, false);
 
 	// Colors menu
 	mColorMenu = new wxMenu();
@@ -94,10 +198,48 @@ void PaintFrame::SetupMenu()
 	mColorMenu->AppendSeparator();
 	mColorMenu->Append(ID_SetBrushColor, "Brush Color...", "Set brush color");
 
+	// Image menu (filters on the imported image)
+	mImageMenu = new wxMenu();
+	mImageMenu->Append(ID_GaussianBlur, "Gaussian Blur...", "Blur the imported image.");
+	mImageMenu->Append(ID_BoxBlur, "Box Blur...", "Average the imported image over a square.");
+	mImageMenu->Append(ID_Sharpen, "Sharpen...", "Sharpen the imported image.");
+	mImageMenu->AppendSeparator();
+	mImageMenu->Append(ID_BrightnessContrast, "Brightness/Contrast...", "Adjust the imported image's brightness and contrast.");
+	mImageMenu->Append(ID_Grayscale, "Grayscale", "Convert the imported image to grayscale.");
+	mImageMenu->AppendSeparator();
+	mImageMenu->Append(ID_ResizeImage, "Resize...", "Resize the imported image.");
+
+	// Layers menu
+	mLayerMenu = new wxMenu();
+	mLayerMenu->Append(ID_NewLayer, "New Layer", "Add a layer above the current one.");
+	mLayerMenu->AppendSeparator();
+	mLayerMenu->Append(ID_LayerAbove, "Layer Above\tPgUp", "Edit the layer above.");
+	mLayerMenu->Append(ID_LayerBelow, "Layer Below\tPgDn", "Edit the layer below.");
+	mLayerMenu->AppendSeparator();
+	mLayerMenu->Append(ID_ToggleLayer, "Show/Hide Layer", "Show or hide the current layer.");
+	mLayerMenu->Append(ID_LayerOpacity, "Layer Opacity...", "Set the current layer's opacity.");
+
+	// View menu (mouse wheel zooms and middle drag pans too)
+	mViewMenu = new wxMenu();
+	mViewMenu->Append(ID_ZoomIn, "Zoom In\tCtrl+=", "Zoom in on the drawing.");
+	mViewMenu->Append(ID_ZoomOut, "Zoom Out\tCtrl+-", "Zoom out from the drawing.");
+	mViewMenu->Append(ID_ActualSize, "Actual Size\tCtrl+0", "Show the drawing at 1:1.");
+	mViewMenu->AppendSeparator();
+	mViewMenu->AppendCheckItem(ID_SnapToGrid, "Snap to Grid\tCtrl+'", "Show the grid and snap to it while drawing.");
+	mViewMenu->Append(ID_GridSize, "Grid Size...", "Set the distance between grid lines.");
+	mViewMenu->AppendCheckItem(ID_SnapToShapes, "Snap to Shapes\tCtrl+;",
+		"Snap to corners, midpoints and ends of nearby shapes while drawing.");
+	mViewMenu->AppendSeparator();
+	mViewMenu->Append(ID_MemoryUsage, "Memory Usage...", "Show how much memory the drawing uses.");
+	mViewMenu->Append(ID_MemoryBudgets, "Memory Budgets...", "Limit the memory kept for undo, imported images and caches.");
+
 	wxMenuBar* menuBar = new wxMenuBar();
 	menuBar->Append(mFileMenu, "&File");
 	menuBar->Append(mEditMenu, "&Edit");
 	menuBar->Append(mColorMenu, "&Colors");
+	menuBar->Append(mImageMenu, "&Image");
+	menuBar->Append(mLayerMenu, "&Layers");
+	menuBar->Append(mViewMenu, "&View");
 	SetMenuBar(menuBar);
 	CreateStatusBar();
 }
@@ -128,6 +270,9 @@ void PaintFrame::SetupToolbar()
 	mToolbar->AddTool(ID_Selector, "Selector",
 		wxBitmap("Icons/Cursor.png", wxBITMAP_TYPE_PNG),
 		"Selector", wxITEM_CHECK);
+	mToolbar->AddTool(ID_Lasso, "Lasso",
+		wxBitmap("Icons/Lasso.png", wxBITMAP_TYPE_PNG),
+		"Lasso", wxITEM_CHECK);
 	mToolbar->AddTool(ID_DrawLine, "Draw Line",
 		wxBitmap("Icons/Line.png", wxBITMAP_TYPE_PNG),
 		"Draw Line", wxITEM_CHECK);
@@ -140,6 +285,9 @@ void PaintFrame::SetupToolbar()
 	mToolbar->AddTool(ID_DrawPencil, "Pencil",
 		wxBitmap("Icons/Pencil.png", wxBITMAP_TYPE_PNG),
 		"Pencil", wxITEM_CHECK);
+	mToolbar->AddTool(ID_BucketFill, "Fill",
+		wxBitmap("Icons/Bucket.png", wxBITMAP_TYPE_PNG),
+		"Fill", wxITEM_CHECK);
 
 	mToolbar->Realize();
 
@@ -161,9 +309,12 @@ void PaintFrame::SetupModelAndView()
 	mPanel->Bind(wxEVT_LEFT_DOWN, &PaintFrame::OnMouseButton, this);
 	mPanel->Bind(wxEVT_LEFT_UP, &PaintFrame::OnMouseButton, this);
 	mPanel->Bind(wxEVT_MOTION, &PaintFrame::OnMouseMove, this);
+	// Bound last, so it sees input before the handlers above
+	mScheduler.reset(new IdleScheduler(mPanel));
 
 	// Create the model
 	mModel = std::make_shared<PaintModel>();
+	mModel->SetScheduler(mScheduler.get());
 	mPanel->SetModel(mModel);
 	SetSizer(sizer);
 
@@ -179,6 +330,7 @@ void PaintFrame::OnNew(wxCommandEvent& event)
 {
 	mModel->New();
     UpdateDo();
+    ReportLayer();
 	mPanel->PaintNow();
 }
 
@@ -186,13 +338,167 @@ void PaintFrame::OnExport(wxCommandEvent& event)
 {
 	// TODO
     wxFileDialog saveFileDialog(this, _("Save the file as"), "", "",
-                   "PNG files (*.png)|*.png|BMP files (*.bmp)|*.bmp|JPEG files (*.jpeg)|*.jpeg|JPG files (*.jpg)|*.jpg", wxFD_SAVE|wxFD_OVERWRITE_PROMPT);
+                   "PNG files (*.png)|*.png|BMP files (*.bmp)|*.bmp|JPEG files (*.jpeg)|*.jpeg|JPG files (*.jpg)|*.jpg|SVG files (*.svg)|*.svg", wxFD_SAVE|wxFD_OVERWRITE_PROMPT);
     if (saveFileDialog.ShowModal() == wxID_CANCEL)
         return;
-    mModel->Export(saveFileDialog.GetPath(), mPanel->GetSize());
+    
+    wxString path = saveFileDialog.GetPath();
+    if (path.substr(path.size() - 4, path.size() - 1) == ".svg")
+    {
+        // Ask how to handle an imported image
+        bool embed = true;
+        if (mModel->HasImage())
+        {
+            embed = wxMessageBox("Embed the imported image in the SVG file?\n"
+                "Choose No to save it as a separate PNG linked from the SVG.",
+                "Export SVG", wxYES_NO, this) == wxYES;
+        }
+        if (!mModel->ExportSvg(path, mModel->GetDocumentBounds(mPanel->GetSize()), embed))
+        {
+            wxMessageBox("Unable to write " + path, "Export SVG", wxOK | wxICON_ERROR, this);
+        }
+        return;
+    }
+    if (!mModel->Export(path, mModel->GetDocumentBounds(mPanel->GetSize())))
+    {
+        wxMessageBox("Unable to write " + path, "Export", wxOK | wxICON_ERROR, this);
+    }
   
 }
 
+void PaintFrame::OnExportScaled(wxCommandEvent& event)
+{
+    wxFileDialog saveFileDialog(this, _("Save the file as"), "", "",
+                   "PNG files (*.png)|*.png|BMP files (*.bmp)|*.bmp", wxFD_SAVE|wxFD_OVERWRITE_PROMPT);
+    if (saveFileDialog.ShowModal() == wxID_CANCEL)
+        return;
+    
+    wxTextEntryDialog dialog(this, "Please enter a scale factor (e.g. 4):  ", "Export at Scale", "4");
+    if (dialog.ShowModal() != wxID_OK)
+        return;
+    
+    double scale = 0.0;
+    if (!dialog.GetValue().ToDouble(&scale) || scale <= 0.0)
+    {
+        wxMessageBox("The scale factor must be a positive number.", "Export at Scale", wxOK | wxICON_ERROR, this);
+        return;
+    }
+    
+    wxRect area = mModel->GetDocumentBounds(mPanel->GetSize());
+    if (!mModel->ExportScaled(saveFileDialog.GetPath(), area, scale))
+    {
+        wxMessageBox("Unable to write " + saveFileDialog.GetPath(), "Export at Scale", wxOK | wxICON_ERROR, this);
+    }
+}
+
+void PaintFrame::OnExportTimelapse(wxCommandEvent& event)
+{
+    if (!mModel->CanUndo() || mModel->HasActiveCommand())
+    {
+        wxMessageBox("There is no history to export yet.", "Export Timelapse", wxOK | wxICON_INFORMATION, this);
+        return;
+    }
+    
+    wxFileDialog saveFileDialog(this, _("Save the timelapse as"), "", "",
+                   "Animated GIF (*.gif)|*.gif|PNG sequence (*.png)|*.png", wxFD_SAVE|wxFD_OVERWRITE_PROMPT);
+    if (saveFileDialog.ShowModal() == wxID_CANCEL)
+        return;
+    
+    long step = wxGetNumberFromUser("Commands between frames:", "Step:", "Export Timelapse",
+        std::max<long>(1, static_cast<long>(mModel->GetHistory().GetDepth()) / 100), 1, 100000, this);
+    if (step < 0)
+        return;
+    
+    wxBusyCursor busy;
+    wxStopWatch timer;
+    wxRect area = mModel->GetDocumentBounds(mPanel->GetSize());
+    if (!mModel->ExportTimelapse(saveFileDialog.GetPath(), area, static_cast<int>(step)))
+    {
+        wxMessageBox("Unable to write " + saveFileDialog.GetPath(), "Export Timelapse", wxOK | wxICON_ERROR, this);
+        return;
+    }
+    SetStatusText(wxString::Format("Timelapse of %d steps exported in %ld ms",
+        static_cast<int>(mModel->GetHistory().GetDepth()), timer.Time()));
+}
+
+void PaintFrame::OnSession(wxCommandEvent& event)
+{
+    if (!mSession)
+    {
+        mSession.reset(new LiveSession(mModel, [this]()
+        {
+            mPanel->PaintNow();
+            UpdateDo();
+            mFileMenu->Enable(ID_LeaveSession, mSession->IsActive());
+            if (mSession->IsConnected())
+                SetStatusText(wxString::Format("Live session: %lu ops sent, %lu received",
+                    mSession->GetOpsSent(), mSession->GetOpsReceived()));
+            else
+                SetStatusText("Live session ended");
+        }));
+    }
+    
+    switch (event.GetId())
+    {
+        case ID_HostSession:
+        {
+            long port = wxGetNumberFromUser("Port to wait for the other side on:", "Port:",
+                "Host Live Session", LiveSession::kDefaultPort, 1024, 65535, this);
+            if (port < 0)
+                return;
+            if (!mSession->Host(static_cast<unsigned short>(port)))
+            {
+                wxMessageBox(wxString::Format("Unable to listen on port %ld.", port),
+                    "Host Live Session", wxOK | wxICON_ERROR, this);
+                return;
+            }
+            SetStatusText(wxString::Format("Waiting for someone to join on port %ld...", port));
+            break;
+        }
+        case ID_JoinSession:
+        {
+            wxString address = wxGetTextFromUser("Host and port to join:", "Join Live Session",
+                wxString::Format("localhost:%d", static_cast<int>(LiveSession::kDefaultPort)), this);
+            if (address.IsEmpty())
+                return;
+            long port = LiveSession::kDefaultPort;
+            wxString host = address.BeforeLast(':');
+            if (host.IsEmpty())
+                host = address;
+            else if (!address.AfterLast(':').ToLong(&port) || port <= 0 || port > 65535)
+                port = LiveSession::kDefaultPort;
+            if (!mSession->Join(host, static_cast<unsigned short>(port)))
+            {
+                wxMessageBox("Unable to find " + host + ".", "Join Live Session", wxOK | wxICON_ERROR, this);
+                return;
+            }
+            SetStatusText("Connecting to " + address + "...");
+            break;
+        }
+        default:
+            mSession->Leave();
+            SetStatusText("Live session ended");
+            break;
+    }
+    mFileMenu->Enable(ID_LeaveSession, mSession->IsActive());
+}
+
+void PaintFrame::OnSetPngPreset(wxCommandEvent& event)
+{
+    switch (event.GetId())
+    {
+        case ID_PngFast:
+            mModel->SetPngPreset(ImageWriter::PR_Fast);
+            break;
+        case ID_PngSmall:
+            mModel->SetPngPreset(ImageWriter::PR_Small);
+            break;
+        default:
+            mModel->SetPngPreset(ImageWriter::PR_Balanced);
+            break;
+    }
+}
+
 void PaintFrame::OnImport(wxCommandEvent& event)
 {
 	// TODO
@@ -200,7 +506,22 @@ void PaintFrame::OnImport(wxCommandEvent& event)
                   "PNG files (*.png)|*.png|BMP files (*.bmp)|*.bmp|JPEG files (*.jpeg)|*.jpeg|JPG files (*.jpg)|*.jpg", wxFD_OPEN|wxFD_FILE_MUST_EXIST);
     if (openFileDialog.ShowModal() == wxID_CANCEL)
         return;
-    mModel->Import(openFileDialog.GetPath());
+    if (mModel->ImportExceedsBudget(openFileDialog.GetPath()))
+    {
+        wxSize size = PaintModel::ReadImageSize(openFileDialog.GetPath());
+        double megabytes = static_cast<double>(size.GetWidth()) * size.GetHeight() * 4 / (1024.0 * 1024.0);
+        wxString message = wxString::Format("This image is %d x %d, more than the raster budget allows. "
+            "It will be shrunk to fit, but has to be decoded at full size first, which takes "
+            "about %.0f MB. Import it anyway?", size.GetWidth(), size.GetHeight(), megabytes);
+        if (wxMessageBox(message, "Import", wxYES_NO | wxICON_WARNING, this) != wxYES)
+            return;
+    }
+    mModel->Import(openFileDialog.GetPath(), [this]()
+    {
+        mPanel->PaintNow();
+        SetStatusText(mModel->IsImporting() ? "Loading full image..." : "");
+    });
+    SetStatusText("Loading image...");
     mPanel->PaintNow();
     
 }
@@ -208,7 +529,7 @@ void PaintFrame::OnImport(wxCommandEvent& event)
 void PaintFrame::OnUndo(wxCommandEvent& event)
 {
 	// TODO
-    mModel->undo.back()->Undo(mModel);
+    mModel->GetHistory().GetUndo()->Undo(mModel);
     mPanel->PaintNow();
     UpdateDo();
 
@@ -217,7 +538,39 @@ void PaintFrame::OnUndo(wxCommandEvent& event)
 void PaintFrame::OnRedo(wxCommandEvent& event)
 {
 	// TODO
-    mModel->redo.back()->Redo(mModel);
+    mModel->GetHistory().GetRedo()->Redo(mModel);
+    mPanel->PaintNow();
+    UpdateDo();
+}
+
+void PaintFrame::OnHistory(wxCommandEvent& event)
+{
+    if (mModel->HasActiveCommand())
+        return;
+    
+    UndoTree& history = mModel->GetHistory();
+    if (event.GetId() == ID_EarlierState || event.GetId() == ID_LaterState)
+    {
+        const UndoTree::Node* state = event.GetId() == ID_EarlierState ?
+            history.GetEarlier() : history.GetLater();
+        if (state)
+            mModel->JumpTo(state);
+    }
+    else if (history.GetBranchCount() > 1)
+    {
+        size_t count = history.GetBranchCount();
+        size_t step = event.GetId() == ID_NextBranch ? 1 : count - 1;
+        history.SetBranch((history.GetBranch() + step) % count);
+    }
+    
+    wxString status = wxString::Format("Step %lu of the history (%lu states kept)",
+        static_cast<unsigned long>(history.GetDepth()), static_cast<unsigned long>(history.GetSize()));
+    if (history.GetBranchCount() > 1)
+    {
+        status += wxString::Format(", redo branch %lu of %lu",
+            static_cast<unsigned long>(history.GetBranch() + 1), static_cast<unsigned long>(history.GetBranchCount()));
+    }
+    SetStatusText(status);
     mPanel->PaintNow();
     UpdateDo();
 }
@@ -225,7 +578,7 @@ void PaintFrame::OnRedo(wxCommandEvent& event)
 void PaintFrame::OnUnselect(wxCommandEvent& event)
 {
 	// TODO
-    mModel->GetSelectedShape().reset();
+    mModel->ClearSelection();
     mEditMenu->Enable(ID_Unselect, false);
     mPanel->PaintNow();
 
@@ -242,6 +595,73 @@ void PaintFrame::OnDelete(wxCommandEvent& event)
 
 }
 
+void PaintFrame::OnGroup(wxCommandEvent& event)
+{
+    if (event.GetId() == ID_Group)
+        mModel->Group();
+    else
+        mModel->Ungroup();
+    mHandle = HD_None;
+    SetCursor(CU_Default);
+    mPanel->PaintNow();
+    UpdateDo();
+}
+
+void PaintFrame::OnZOrder(wxCommandEvent& event)
+{
+    switch (event.GetId())
+    {
+        case ID_BringToFront:
+            mModel->Reorder(ZO_Front);
+            break;
+        case ID_BringForward:
+            mModel->Reorder(ZO_Forward);
+            break;
+        case ID_SendBackward:
+            mModel->Reorder(ZO_Backward);
+            break;
+        case ID_SendToBack:
+            mModel->Reorder(ZO_Back);
+            break;
+        default:
+        {
+            if (!mModel->GetSelectedShape())
+                return;
+            long count = static_cast<long>(mModel->GetActiveLayer()->GetCount());
+            long position = wxGetNumberFromUser("Position from the bottom of the layer (1 is the bottom):",
+                "Position:", "Move to Position", 1, 1, count, this);
+            if (position < 1)
+                return;
+            mModel->Reorder(ZO_Index, static_cast<size_t>(position - 1));
+            break;
+        }
+    }
+    mPanel->PaintNow();
+    UpdateDo();
+}
+
+void PaintFrame::OnCopy(wxCommandEvent& event)
+{
+    mModel->Copy();
+    mEditMenu->Enable(wxID_PASTE, mModel->CanPaste());
+}
+
+void PaintFrame::OnPaste(wxCommandEvent& event)
+{
+    if (event.GetId() == ID_Duplicate)
+        mModel->Duplicate();
+    else
+        mModel->Paste();
+    // The copies come out selected
+    bool selected = static_cast<bool>(mModel->GetSelectedShape());
+    mEditMenu->Enable(ID_Unselect, selected);
+    mEditMenu->Enable(ID_Delete, selected);
+    mHandle = HD_None;
+    SetCursor(CU_Default);
+    mPanel->PaintNow();
+    UpdateDo();
+}
+
 void PaintFrame::OnSetPenColor(wxCommandEvent& event)
 {
 	// TODO
@@ -251,7 +671,6 @@ void PaintFrame::OnSetPenColor(wxCommandEvent& event)
     if (dialog.ShowModal() == wxID_OK)
     {
         
-        mModel->undoPen.push_back(mModel->GetPen());
         mModel->CreateCommand(CM_SetPen, wxPoint(1, 1));
         mModel->FinalizeCommand();
         mModel->SetPenColor(dialog.GetColourData().GetColour());
@@ -281,7 +700,6 @@ void PaintFrame::OnSetPenWidth(wxCommandEvent& event)
    
     if (dialog.ShowModal() == wxID_OK)
     {
-        mModel->undoPen.push_back(mModel->GetPen());
         mModel->CreateCommand(CM_SetPen, wxPoint(1, 1));
         mModel->FinalizeCommand();
         mModel->SetWidth(wxAtoi(dialog.GetValue()));
@@ -302,7 +720,6 @@ void PaintFrame::OnSetBrushColor(wxCommandEvent& event)
     if (dialog.ShowModal() == wxID_OK)
     {
        
-        mModel->undoBrush.push_back(mModel->GetBrush());
         mModel->CreateCommand(CM_SetBrush, wxPoint(1, 1));
         mModel->FinalizeCommand();
         mModel->SetBColor(dialog.GetColourData().GetColour());
@@ -313,42 +730,54 @@ void PaintFrame::OnSetBrushColor(wxCommandEvent& event)
 
 void PaintFrame::OnMouseButton(wxMouseEvent& event)
 {
+	// Shapes live in document coordinates, whatever the zoom
+	wxPoint pos = mPanel->ToDocument(event.GetPosition());
+	if (Snaps(event))
+		pos = mModel->Snap(pos, mPanel->GetZoom());
 	if (event.LeftDown())
 	{
+        mStrokeHeapAllocs = GetHeapAllocCount();
         
 		// TODO: This is when the left mouse button is pressed
         if (mCurrentTool == ID_DrawRect)
         {
             
-            mModel->CreateCommand(CM_DrawRect, event.GetPosition());
+            mModel->CreateCommand(CM_DrawRect, pos);
             mPanel->PaintNow();
         }
         else if (mCurrentTool == ID_DrawEllipse)
         {
             
-            mModel->CreateCommand(CM_DrawEllipse, event.GetPosition());
+            mModel->CreateCommand(CM_DrawEllipse, pos);
             mPanel->PaintNow();
         }
         else if (mCurrentTool == ID_DrawLine)
         {
-            mModel->CreateCommand(CM_DrawLine, event.GetPosition());
+            mModel->CreateCommand(CM_DrawLine, pos);
             mPanel->PaintNow();
         }
         else if (mCurrentTool == ID_DrawPencil)
         {
-            mModel->CreateCommand(CM_DrawPencil, event.GetPosition());
+            mModel->CreateCommand(CM_DrawPencil, pos);
+            mPanel->PaintNow();
+        }
+        else if (mCurrentTool == ID_BucketFill)
+        {
+            mModel->SetCanvasRect(mPanel->GetVisibleRect());
+            mModel->CreateCommand(CM_Fill, pos);
             mPanel->PaintNow();
         }
         else if (mCurrentTool == ID_SetPenColor)
         {
-            mModel->CreateCommand(CM_SetPen, event.GetPosition()); //doesnt get called
+            mModel->CreateCommand(CM_SetPen, pos); //doesnt get called
             mPanel->PaintNow();
         }
         else if (mCurrentTool == ID_Selector)
         {
-            if (moveCursor)
-                mModel->CreateCommand(CM_Move, event.GetPosition());
-            else if (mModel->SelectShape(event.GetPosition()))
+            // Shift-click picks more shapes for Edit>Group
+            if (mHandle != HD_None && !event.ShiftDown() && mModel->GetSelectedShape())
+                mModel->BeginTransform(pos, mHandle);
+            else if (mModel->SelectShape(pos, event.ShiftDown()))
             {
                 mEditMenu->Enable(ID_Unselect, true);
                 mEditMenu->Enable(ID_Delete, true);
@@ -361,31 +790,47 @@ void PaintFrame::OnMouseButton(wxMouseEvent& event)
             }
             mPanel->PaintNow();
         }
+        else if (mCurrentTool == ID_Lasso)
+        {
+            // Shift-lasso adds to what's picked
+            mModel->BeginLasso(pos);
+            mPanel->PaintNow();
+        }
         else if (mCurrentTool == ID_SetBrushColor)
         {
-            mModel->CreateCommand(CM_SetBrush, event.GetPosition());
+            mModel->CreateCommand(CM_SetBrush, pos);
             mPanel->PaintNow();
         }
         else if (mCurrentTool == ID_SetPenWidth)
         {
-            mModel->CreateCommand(CM_SetPen, event.GetPosition());
+            mModel->CreateCommand(CM_SetPen, pos);
             mPanel->PaintNow();
         }
         
         
-        mModel->redo.clear();
-        
+        mStrokeEvents = 1;
 	}
 	else if (event.LeftUp())
 	{
 		// TODO: This is when the left mouse button is released
         
-        if (mModel->HasActiveCommand())
+        if (mModel->IsLassoing())
+        {
+            mModel->ExtendLasso(pos);
+            bool selected = mModel->EndLasso(event.ShiftDown());
+            mEditMenu->Enable(ID_Unselect, selected);
+            mEditMenu->Enable(ID_Delete, selected);
+            mPanel->PaintNow();
+        }
+        else if (mModel->HasActiveCommand())
         {
-            mModel->UpdateCommand(event.GetPosition());
+            mModel->UpdateCommand(pos);
             mModel->FinalizeCommand();
+            mModel->GetSnapper().ClearGuide();
             mPanel->PaintNow();
             
+            mStrokeEvents++;
+            ReportStrokeAllocs();
         }
         UpdateDo();
     }
@@ -393,29 +838,89 @@ void PaintFrame::OnMouseButton(wxMouseEvent& event)
 
 void PaintFrame::OnMouseMove(wxMouseEvent& event)
 {
+	// The panel uses motion to pan the view
+	event.Skip();
+	if (mPanel->IsPanning())
+		return;
+	
+	wxPoint point = mPanel->ToDocument(event.GetPosition());
+	wxPoint pos = point;
+	bool snaps = Snaps(event);
+	if (snaps)
+		pos = mModel->Snap(point, mPanel->GetZoom());
 	// TODO: This is when the mouse is moved inside the drawable area
-    if (mModel->HasActiveCommand())
+    if (mModel->IsLassoing())
     {
-        mModel->UpdateCommand(event.GetPosition());
+        mModel->ExtendLasso(pos);
         mPanel->PaintNow();
+    }
+    else if (mModel->HasActiveCommand())
+    {
+        mModel->UpdateCommand(pos);
+        mPanel->PaintNow();
+        mStrokeEvents++;
 
     }
-    else if (mModel->GetSelectedShape())
+    else
     {
-        
-        if (mModel->GetSelectedShape()->Intersects(event.GetPosition()))
+        if (mModel->GetSelectedShape())
         {
-            SetCursor(CU_Move);
-            moveCursor = true;
-           
-        }
-        else if(moveCursor)
-        {
-            
-            moveCursor = false;
-            SetCursor(CU_Default);
-            
+            HandleType handle = mModel->GetSelectedShape()->HitHandle(point, mPanel->GetZoom());
+            if (handle != mHandle)
+            {
+                mHandle = handle;
+                SetCursor(HandleCursor(handle));
+            }
         }
+        // Show where a shape would start; the frame itself is unchanged
+        if (snaps)
+            mPanel->Refresh(false);
+    }
+}
+
+bool PaintFrame::Snaps(const wxMouseEvent& event) const
+{
+    if (!mModel->GetSnapper().IsOn())
+        return false;
+    switch (mCurrentTool)
+    {
+        case ID_DrawLine:
+        case ID_DrawEllipse:
+        case ID_DrawRect:
+            return true;
+        case ID_Selector:
+            if (mHandle == HD_None || mHandle == HD_Rotate)
+                return false;
+            // Mid-drag, or pressing on a handle of the selected shape
+            return mModel->HasActiveCommand() ||
+                (event.LeftDown() && !event.ShiftDown() && mModel->GetSelectedShape());
+        default:
+            return false;
+    }
+}
+
+CursorType PaintFrame::HandleCursor(HandleType handle)
+{
+    switch (handle)
+    {
+        case HD_TopLeft:
+        case HD_BotRight:
+            return CU_SizeNWSE;
+        case HD_TopRight:
+        case HD_BotLeft:
+            return CU_SizeNESW;
+        case HD_Top:
+        case HD_Bot:
+            return CU_SizeNS;
+        case HD_Left:
+        case HD_Right:
+            return CU_SizeEW;
+        case HD_Rotate:
+            return CU_Rotate;
+        case HD_Move:
+            return CU_Move;
+        default:
+            return CU_Default;
     }
 }
 
@@ -426,6 +931,8 @@ void PaintFrame::ToggleTool(EventID toolID)
 	{
 		mToolbar->ToggleTool(i, false);
 	}
+	mToolbar->ToggleTool(ID_BucketFill, false);
+	mToolbar->ToggleTool(ID_Lasso, false);
 
 	// Select the new tool
 	mToolbar->ToggleTool(toolID, true);
@@ -446,6 +953,8 @@ void PaintFrame::OnSelectTool(wxCommandEvent& event)
 {
 	EventID id = static_cast<EventID>(event.GetId());
 	ToggleTool(id);
+	mModel->GetSnapper().ClearGuide();
+	mPanel->Refresh(false);
 
 	// Select appropriate cursor
 	switch (id)
@@ -453,6 +962,8 @@ void PaintFrame::OnSelectTool(wxCommandEvent& event)
 	case ID_DrawLine:
 	case ID_DrawEllipse:
 	case ID_DrawRect:
+	case ID_BucketFill:
+	case ID_Lasso:
 		SetCursor(CU_Cross);
 		break;
 	case ID_DrawPencil:
@@ -475,6 +986,251 @@ void PaintFrame::UpdateDo()
         mToolbar->EnableTool(wxID_UNDO, true);
     else
         mToolbar->EnableTool(wxID_UNDO, false);
+    
+    const UndoTree& history = mModel->GetHistory();
+    mEditMenu->Enable(wxID_UNDO, mModel->CanUndo());
+    mEditMenu->Enable(wxID_REDO, mModel->CanRedo());
+    mEditMenu->Enable(ID_EarlierState, history.GetEarlier() != nullptr);
+    mEditMenu->Enable(ID_LaterState, history.GetLater() != nullptr);
+    mEditMenu->Enable(ID_NextBranch, history.GetBranchCount() > 1);
+    mEditMenu->Enable(ID_PreviousBranch, history.GetBranchCount() > 1);
+
+    
+}
+
+void PaintFrame::ReportStrokeAllocs()
+{
+    // Every heap allocation, not just the arena's misses: layer damage,
+    // persistent sequence nodes and snapshots for painting count too
+    size_t heapAllocs = GetHeapAllocCount() - mStrokeHeapAllocs;
+    double perEvent = static_cast<double>(heapAllocs) / std::max(mStrokeEvents, 1);
+    SetStatusText(wxString::Format("%lu heap allocations over %d events (%.3f per event)",
+        static_cast<unsigned long>(heapAllocs), mStrokeEvents, perEvent));
+}
 
+void PaintFrame::OnImageFilter(wxCommandEvent& event)
+{
+    if (!mModel->HasImage())
+    {
+        wxMessageBox("Import an image first.", "Image", wxOK | wxICON_INFORMATION, this);
+        return;
+    }
+    if (mModel->IsImporting())
+    {
+        wxMessageBox("The image is still loading.", "Image", wxOK | wxICON_INFORMATION, this);
+        return;
+    }
+    
+    FilterCommand::Filter filter;
+    switch (event.GetId())
+    {
+        case ID_GaussianBlur:
+        {
+            wxNumberEntryDialog dialog(this, wxString::Format("Please enter the blur radius (sigma) in pixels (1 - %d):  ",
+                ImageFilters::kMaxSigma), "", "Gaussian Blur", 2, 1, ImageFilters::kMaxSigma);
+            if (dialog.ShowModal() != wxID_OK)
+                return;
+            double sigma = static_cast<double>(dialog.GetValue());
+            filter = [sigma](const wxImage& image) { return ImageFilters::GaussianBlur(image, sigma); };
+            break;
+        }
+        case ID_BoxBlur:
+        {
+            wxNumberEntryDialog dialog(this, "Please enter the blur radius (1 - 50):  ", "", "Box Blur", 2, 1, 50);
+            if (dialog.ShowModal() != wxID_OK)
+                return;
+            int radius = static_cast<int>(dialog.GetValue());
+            filter = [radius](const wxImage& image) { return ImageFilters::BoxBlur(image, radius); };
+            break;
+        }
+        case ID_Sharpen:
+        {
+            wxNumberEntryDialog dialog(this, "Please enter the amount (1 - 500%):  ", "", "Sharpen", 100, 1, 500);
+            if (dialog.ShowModal() != wxID_OK)
+                return;
+            double amount = dialog.GetValue() / 100.0;
+            filter = [amount](const wxImage& image) { return ImageFilters::Sharpen(image, amount); };
+            break;
+        }
+        case ID_BrightnessContrast:
+        {
+            wxNumberEntryDialog brightnessDialog(this, "Please enter the brightness (-100 - 100):  ", "",
+                "Brightness/Contrast", 0, -100, 100);
+            if (brightnessDialog.ShowModal() != wxID_OK)
+                return;
+            wxNumberEntryDialog contrastDialog(this, "Please enter the contrast (-100 - 100):  ", "",
+                "Brightness/Contrast", 0, -100, 100);
+            if (contrastDialog.ShowModal() != wxID_OK)
+                return;
+            int brightness = static_cast<int>(brightnessDialog.GetValue());
+            int contrast = static_cast<int>(contrastDialog.GetValue());
+            filter = [brightness, contrast](const wxImage& image)
+            {
+                return ImageFilters::BrightnessContrast(image, brightness, contrast);
+            };
+            break;
+        }
+        case ID_Grayscale:
+            filter = [](const wxImage& image) { return ImageFilters::Grayscale(image); };
+            break;
+        case ID_ResizeImage:
+        {
+            wxNumberEntryDialog dialog(this, "Please enter the new size (1 - 400%):  ", "", "Resize", 50, 1, 400);
+            if (dialog.ShowModal() != wxID_OK)
+                return;
+            double scale = dialog.GetValue() / 100.0;
+            filter = [scale](const wxImage& image)
+            {
+                return ImageFilters::Resize(image, wxSize(static_cast<int>(image.GetWidth() * scale + 0.5),
+                    static_cast<int>(image.GetHeight() * scale + 0.5)));
+            };
+            break;
+        }
+        default:
+            return;
+    }
     
-}
\ No newline at end of file
+    wxStopWatch watch;
+    {
+        wxBusyCursor busy;
+        mModel->ApplyFilter(filter);
+    }
+    SetStatusText(wxString::Format("Filter took %ld ms", watch.Time()));
+    UpdateDo();
+    mPanel->PaintNow();
+}
+
+void PaintFrame::OnNewLayer(wxCommandEvent& event)
+{
+    mModel->AddLayer();
+    mEditMenu->Enable(ID_Unselect, false);
+    mEditMenu->Enable(ID_Delete, false);
+    ReportLayer();
+    mPanel->PaintNow();
+}
+
+void PaintFrame::OnSelectLayer(wxCommandEvent& event)
+{
+    size_t index = mModel->GetActiveLayerIndex();
+    if (event.GetId() == ID_LayerAbove)
+        index++;
+    else if (index > 0)
+        index--;
+    
+    mModel->SetActiveLayer(index);
+    mEditMenu->Enable(ID_Unselect, false);
+    mEditMenu->Enable(ID_Delete, false);
+    ReportLayer();
+    mPanel->PaintNow();
+}
+
+void PaintFrame::OnToggleLayer(wxCommandEvent& event)
+{
+    const std::shared_ptr<Layer>& layer = mModel->GetActiveLayer();
+    layer->SetVisible(!layer->IsVisible());
+    ReportLayer();
+    mPanel->PaintNow();
+}
+
+void PaintFrame::OnLayerOpacity(wxCommandEvent& event)
+{
+    const std::shared_ptr<Layer>& layer = mModel->GetActiveLayer();
+    wxNumberEntryDialog dialog(this, "Please enter the layer opacity (0 - 100):  ", "",
+        "Layer Opacity", static_cast<long>(layer->GetOpacity() * 100.0 + 0.5), 0, 100);
+    if (dialog.ShowModal() == wxID_OK)
+    {
+        layer->SetOpacity(dialog.GetValue() / 100.0);
+        ReportLayer();
+        mPanel->PaintNow();
+    }
+}
+
+void PaintFrame::OnZoom(wxCommandEvent& event)
+{
+    if (event.GetId() == ID_ZoomIn)
+        mPanel->Zoom(2.0);
+    else if (event.GetId() == ID_ZoomOut)
+        mPanel->Zoom(0.5);
+    else
+        mPanel->ResetView();
+    
+    SetStatusText(wxString::Format("Zoom %d%%", static_cast<int>(mPanel->GetZoom() * 100.0 + 0.5)));
+}
+
+void PaintFrame::OnSnap(wxCommandEvent& event)
+{
+    Snapper& snapper = mModel->GetSnapper();
+    switch (event.GetId())
+    {
+        case ID_SnapToGrid:
+            snapper.SetSnapToGrid(event.IsChecked());
+            break;
+        case ID_SnapToShapes:
+            snapper.SetSnapToShapes(event.IsChecked());
+            break;
+        case ID_GridSize:
+        {
+            long size = wxGetNumberFromUser("Distance between grid lines, in pixels:", "Size:", "Grid Size",
+                snapper.GetGridSize(), 1, 1000, this);
+            if (size < 0)
+                return;
+            snapper.SetGridSize(static_cast<int>(size));
+            break;
+        }
+        default:
+            break;
+    }
+    mPanel->Refresh(false);
+}
+
+void PaintFrame::OnMemory(wxCommandEvent& event)
+{
+    const double megabyte = 1024.0 * 1024.0;
+    DocumentArena::Usage usage = mModel->GetMemoryUsage();
+    if (event.GetId() == ID_MemoryUsage)
+    {
+        wxString report;
+        for (int i = 0; i < MC_Count; i++)
+        {
+            MemoryCategory category = static_cast<MemoryCategory>(i);
+            report += wxString::Format("%s: %.2f MB", DocumentArena::CategoryName(category),
+                usage.bytes[i] / megabyte);
+            if (usage.budgets[i] != 0)
+            {
+                report += wxString::Format(" of %.2f MB%s", usage.budgets[i] / megabyte,
+                    usage.IsOverBudget(category) ? " (over budget)" : "");
+            }
+            report += "\n";
+        }
+        report += wxString::Format("\nTotal: %.2f MB", usage.Total() / megabyte);
+        report += wxString::Format("\nShared shape rasters: %.2f MB of %.2f MB",
+            SpriteCache::Get().GetBytes() / megabyte, SpriteCache::Get().GetBudget() / megabyte);
+        wxMessageBox(report, "Memory Usage", wxOK | wxICON_INFORMATION, this);
+        return;
+    }
+    
+    // Only history and caches can be trimmed, and imports shrunk to fit,
+    // so only they get budgets
+    const MemoryCategory categories[] = { MC_History, MC_Rasters, MC_Caches };
+    for (MemoryCategory category : categories)
+    {
+        long current = static_cast<long>(usage.budgets[category] / (1024 * 1024));
+        long budget = wxGetNumberFromUser(wxString::Format("%s budget in MB (0 for none):",
+            DocumentArena::CategoryName(category)), "MB:", "Memory Budgets", current, 0, 65536, this);
+        if (budget < 0)
+            return;
+        mModel->SetMemoryBudget(category, static_cast<size_t>(budget) * 1024 * 1024);
+    }
+    mPanel->PaintNow();
+    UpdateDo();
+}
+
+void PaintFrame::ReportLayer()
+{
+    const std::shared_ptr<Layer>& layer = mModel->GetActiveLayer();
+    SetStatusText(wxString::Format("%s (%d of %d)%s, %d%% opacity", layer->GetName(),
+        static_cast<int>(mModel->GetActiveLayerIndex()) + 1,
+        static_cast<int>(mModel->GetLayers().size()),
+        layer->IsVisible() ? "" : " hidden",
+        static_cast<int>(layer->GetOpacity() * 100.0 + 0.5)));
+}
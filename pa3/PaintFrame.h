@@ -5,6 +5,9 @@
 #include <memory>
 #include "EventID.h"
 #include "Cursors.h"
+#include "Shape.h"
+#include "IdleScheduler.h"
+#include "LiveSession.h"
 
 class PaintFrame : public wxFrame
 {
@@ -23,6 +26,12 @@ private:
 	
 	// Export the drawing to an image
 	void OnExport(wxCommandEvent& event);
+	// Export the drawing scaled up (e.g. for print)
+	void OnExportScaled(wxCommandEvent& event);
+	// Export an animation of the drawing being built from the history
+	void OnExportTimelapse(wxCommandEvent& event);
+	// File>PNG Compression
+	void OnSetPngPreset(wxCommandEvent& event);
 	// Import an image into the drawing
 	void OnImport(wxCommandEvent& event);
 
@@ -30,10 +39,19 @@ private:
 	void OnUndo(wxCommandEvent& event);
 	// Edit>Redo
 	void OnRedo(wxCommandEvent& event);
+	// Edit>Earlier/Later State and Next/Previous Redo Branch
+	void OnHistory(wxCommandEvent& event);
 	// Edit>Unselect
 	void OnUnselect(wxCommandEvent& event);
 	// Edit>Delete
 	void OnDelete(wxCommandEvent& event);
+	// Edit>Group and Edit>Ungroup
+	void OnGroup(wxCommandEvent& event);
+	// Edit>Bring to Front and the other z-order items
+	void OnZOrder(wxCommandEvent& event);
+	// Edit>Copy, Edit>Paste and Edit>Duplicate
+	void OnCopy(wxCommandEvent& event);
+	void OnPaste(wxCommandEvent& event);
 
 	// Colors>Pen Color
 	void OnSetPenColor(wxCommandEvent& event);
@@ -41,6 +59,27 @@ private:
 	void OnSetPenWidth(wxCommandEvent& event);
 	// Colors>Brush Color
 	void OnSetBrushColor(wxCommandEvent& event);
+
+	// Image>(any filter)
+	void OnImageFilter(wxCommandEvent& event);
+
+	// Layers>New Layer
+	void OnNewLayer(wxCommandEvent& event);
+	// Layers>Layer Above/Below
+	void OnSelectLayer(wxCommandEvent& event);
+	// Layers>Show/Hide Layer
+	void OnToggleLayer(wxCommandEvent& event);
+	// Layers>Layer Opacity
+	void OnLayerOpacity(wxCommandEvent& event);
+	// View>Zoom In/Zoom Out/Actual Size
+	void OnZoom(wxCommandEvent& event);
+	// View>Snap to Grid, Grid Size and Snap to Shapes
+	void OnSnap(wxCommandEvent& event);
+	// View>Memory Usage and View>Memory Budgets
+	void OnMemory(wxCommandEvent& event);
+	
+	// File>Host, Join and Leave Live Session
+	void OnSession(wxCommandEvent& event);
 	
 	// Event when the mouse button is clicked
 	void OnMouseButton(wxMouseEvent& event);
@@ -52,8 +91,19 @@ private:
 	void ToggleTool(EventID toolID);
 
 	void SetCursor(CursorType type);
+	// Cursor shown over a handle of the selection
+	static CursorType HandleCursor(HandleType handle);
+	// Whether the pointer snaps for this event with the current tool:
+	// while drawing a shape or dragging a handle, but not rotating
+	bool Snaps(const wxMouseEvent& event) const;
     
     void UpdateDo();
+    
+    // Report how many heap allocations the last stroke needed
+    void ReportStrokeAllocs();
+    
+    // Show which layer is being edited
+    void ReportLayer();
 	
 	wxDECLARE_EVENT_TABLE();
 private:
@@ -65,11 +115,26 @@ private:
 	class wxMenu* mFileMenu;
 	class wxMenu* mEditMenu;
 	class wxMenu* mColorMenu;
+	class wxMenu* mLayerMenu;
+	class wxMenu* mImageMenu;
+	class wxMenu* mViewMenu;
 	// Toolbar
 	class wxToolBar* mToolbar;
 	// Panel for drawing
 	class PaintDrawPanel* mPanel;
+	// Runs housekeeping while the panel is idle
+	std::unique_ptr<IdleScheduler> mScheduler;
+	// Shares the document with another copy of the program; null
+	// until the first session
+	std::unique_ptr<LiveSession> mSession;
 
 	EventID mCurrentTool;
-    bool moveCursor; // if cursor has the move icon
+    // Part of the selection under the cursor
+    HandleType mHandle;
+    
+    // Heap allocation count (GetHeapAllocCount) at the start of the
+    // current stroke
+    size_t mStrokeHeapAllocs;
+    // Number of mouse events handled during the current stroke
+    int mStrokeEvents;
 };
@@ -1,65 +1,345 @@
 #include "PaintModel.h"
+#include "SvgWriter.h"
+#include "ThreadPool.h"
 #include <algorithm>
+#include <cmath>
+#include <unordered_set>
 #include <wx/dcmemory.h>
+#include <wx/image.h>
+#include <wx/filename.h>
+#include <wx/wfstream.h>
+#include <wx/app.h>
 #include <iostream>
 
+namespace
+{
+    // Finalizes the shape if it's still on the layer
+    void FinalizeShape(const std::weak_ptr<Layer>& layer, ShapeId id)
+    {
+        std::shared_ptr<Layer> target = layer.lock();
+        size_t index = target ? target->Find(id) : Layer::kNoShape;
+        if (index != Layer::kNoShape)
+            target->Edit(index).Finalize();
+    }
+    
+    // Bytes each pixel of the imported image costs: the image, its
+    // snapshot copy and the 32-bit display bitmap
+    const size_t kImagePixelBytes = 10;
+    
+    // Imported images are shrunk to fit this unless the user changes it:
+    // about 53 million pixels, more than any camera gives but well short
+    // of what a huge scan would take
+    const size_t kDefaultRasterBudget = 512 * 1024 * 1024;
+    
+    // Part of area that differs between two snapshots of the document,
+    // from the layers' damage; all of it when that can't tell
+    wxRect DamageBetween(const DocumentSnapshot* before, const DocumentSnapshot& after, const wxRect& area)
+    {
+        if (!before || before->image != after.image || before->imageScale != after.imageScale ||
+            before->layers.size() != after.layers.size())
+            return area;
+        
+        wxRect damage;
+        for (size_t i = 0; i < after.layers.size(); i++)
+        {
+            const LayerSnapshot& old = *before->layers[i];
+            const LayerSnapshot& now = *after.layers[i];
+            if (old.id != now.id || old.opacity != now.opacity || old.version < now.damageSince)
+                return area;
+            for (const LayerDamage* entry = now.damage.get(); entry && entry->version > old.version;
+                entry = entry->previous.get())
+            {
+                damage = damage.IsEmpty() ? entry->area : damage.Union(entry->area);
+            }
+        }
+        return damage.Intersect(area);
+    }
+    
+    typedef std::function<void(const std::shared_ptr<wxImage>&, double, bool)> ImageSink;
+    
+    unsigned long GetBE32(const unsigned char* bytes)
+    {
+        return (static_cast<unsigned long>(bytes[0]) << 24) | (static_cast<unsigned long>(bytes[1]) << 16) |
+            (static_cast<unsigned long>(bytes[2]) << 8) | bytes[3];
+    }
+    
+    unsigned long GetLE32(const unsigned char* bytes)
+    {
+        return (static_cast<unsigned long>(bytes[3]) << 24) | (static_cast<unsigned long>(bytes[2]) << 16) |
+            (static_cast<unsigned long>(bytes[1]) << 8) | bytes[0];
+    }
+    
+    // Loads an image, handing deliver each version along with the
+    // document pixels per image pixel and whether it's the last. A JPEG
+    // is first decoded at preview size through libjpeg's DCT scaling.
+    // The full image is shrunk to at most maxPixels (0 for no limit).
+    // JPEGs are decoded at the smaller size to begin with; other formats
+    // can only be decoded whole and shrunk afterwards, so the peak is
+    // the full image (see PaintModel::ImportExceedsBudget).
+    void DecodeImage(const wxString& fileName, wxBitmapType type, size_t maxPixels, const ImageSink& deliver)
+    {
+        wxSize original;
+        if (type == wxBITMAP_TYPE_JPEG)
+        {
+            std::shared_ptr<wxImage> preview = std::make_shared<wxImage>();
+            preview->SetOption(wxIMAGE_OPTION_MAX_WIDTH, PaintModel::kPreviewSize);
+            preview->SetOption(wxIMAGE_OPTION_MAX_HEIGHT, PaintModel::kPreviewSize);
+            if (preview->LoadFile(fileName, type))
+            {
+                original = wxSize(preview->GetOptionInt(wxIMAGE_OPTION_ORIGINAL_WIDTH),
+                    preview->GetOptionInt(wxIMAGE_OPTION_ORIGINAL_HEIGHT));
+                if (original.GetWidth() > preview->GetWidth())
+                    deliver(preview, static_cast<double>(original.GetWidth()) / preview->GetWidth(), false);
+            }
+        }
+        
+        std::shared_ptr<wxImage> image = std::make_shared<wxImage>();
+        double originalPixels = static_cast<double>(original.GetWidth()) * original.GetHeight();
+        if (maxPixels != 0 && originalPixels > maxPixels)
+        {
+            double shrink = std::sqrt(maxPixels / originalPixels);
+            image->SetOption(wxIMAGE_OPTION_MAX_WIDTH, std::max(1, static_cast<int>(original.GetWidth() * shrink)));
+            image->SetOption(wxIMAGE_OPTION_MAX_HEIGHT, std::max(1, static_cast<int>(original.GetHeight() * shrink)));
+        }
+        if (!image->LoadFile(fileName, type))
+        {
+            deliver(image, 1.0, true);
+            return;
+        }
+        if (original.GetWidth() == 0)
+            original = image->GetSize();
+        
+        // DCT scaling only goes in steps of two, and other formats not
+        // at all, so whatever's left over is scaled here
+        double pixels = static_cast<double>(image->GetWidth()) * image->GetHeight();
+        if (maxPixels != 0 && pixels > maxPixels)
+        {
+            double shrink = std::sqrt(maxPixels / pixels);
+            image->Rescale(std::max(1, static_cast<int>(image->GetWidth() * shrink)),
+                std::max(1, static_cast<int>(image->GetHeight() * shrink)), wxIMAGE_QUALITY_BOX_AVERAGE);
+        }
+        deliver(image, static_cast<double>(original.GetWidth()) / image->GetWidth(), true);
+    }
+}
+
 PaintModel::PaintModel()
+    :mImageScale(1.0)
+    ,mImportGeneration(0)
+    ,mImporting(false)
+    ,mSelectedId(0)
+    ,mSelectedIndex(Layer::kNoShape)
+    ,mPasteCount(0)
+    ,mActiveLayer(0)
+    ,mArena(std::make_shared<DocumentArena>())
+    ,mPngPreset(ImageWriter::PR_Balanced)
+    ,mScheduler(nullptr)
 {
     pen = *wxBLACK_PEN;
     brush = *wxWHITE_BRUSH;
+    mLayers.push_back(std::make_shared<Layer>("Layer 1"));
+    mArena->SetBudget(MC_Rasters, kDefaultRasterBudget);
 
 }
 
-// Draws any shapes in the model to the provided DC (draw context)
-void PaintModel::DrawShapes(wxDC& dc, bool showSelection)
+std::shared_ptr<const DocumentSnapshot> PaintModel::Snapshot(bool editing) const
 {
-	// TODO
-    if (bitmap.IsOk())
+    std::shared_ptr<DocumentSnapshot> snapshot = std::make_shared<DocumentSnapshot>();
+    snapshot->image = mImageSnapshot;
+    snapshot->imageScale = mImageScale;
+    snapshot->arena = mArena;
+    for (size_t i = 0; i < mLayers.size(); i++)
     {
-        dc.DrawBitmap(bitmap, 0, 0);
+        // Snapshots share structure with the layers, so this is cheap
+        // even for the layer being edited
+        if (mLayers[i]->IsVisible())
+            snapshot->layers.push_back(mLayers[i]->Snapshot(editing && i == mActiveLayer));
     }
+    return snapshot;
+}
+
+void PaintModel::DrawSelection(wxDC& dc)
+{
+    mSnapper.Draw(dc);
+    mLasso.Draw(dc);
     
+    size_t index = FindSelected();
+    if (index == Layer::kNoShape || !GetActiveLayer()->IsVisible())
+        return;
     
-    bool resetSelection = true;
-    
+    for (ShapeId id : mPicked)
+    {
+        size_t picked = GetActiveLayer()->Find(id);
+        if (picked != Layer::kNoShape)
+            GetActiveLayer()->At(picked)->DrawSelection(dc, false);
+    }
+    GetActiveLayer()->At(index)->DrawSelection(dc);
+}
+
+std::vector<size_t> PaintModel::GetSelectedIndices()
+{
+    std::vector<size_t> indices;
+    size_t index = FindSelected();
+    if (index == Layer::kNoShape)
+        return indices;
     
-    for (std::vector<std::shared_ptr<Shape>>::iterator it = mShapes.begin();
-         it != mShapes.end(); ++it)
+    indices.push_back(index);
+    for (ShapeId id : mPicked)
+    {
+        size_t picked = GetActiveLayer()->Find(id);
+        if (picked != Layer::kNoShape)
+            indices.push_back(picked);
+    }
+    std::sort(indices.begin(), indices.end());
+    return indices;
+}
+
+void PaintModel::BeginLasso(const wxPoint& point)
+{
+    mLasso.Begin(point);
+}
+
+void PaintModel::ExtendLasso(const wxPoint& point)
+{
+    mLasso.Extend(point);
+}
+
+bool PaintModel::EndLasso(bool add)
+{
+    mLasso.Finish();
+    std::vector<ShapeId> ids;
+    std::unordered_set<ShapeId> picked;
+    if (add)
     {
-        (*it)->Draw(dc);
-        if (selectedShape == (*it))
+        for (size_t index : GetSelectedIndices())
         {
-            resetSelection = false;
-            
-            if (showSelection)
-                selectedShape->DrawSelection(dc);
+            ids.push_back(GetActiveLayer()->At(index)->GetId());
+            picked.insert(ids.back());
         }
-        
     }
-    if (resetSelection && showSelection)
+    
+    if (mLasso.IsArea() && GetActiveLayer()->IsVisible())
     {
-        selectedShape.reset();
+        // Bounds first, then the outlines of whatever's left, which may
+        // have to be built, across the pool
+        std::vector<const Shape*> candidates;
+        const wxRect& area = mLasso.GetBounds();
+        GetActiveLayer()->GetShapes().ForEach([&candidates, &picked, &area](const std::shared_ptr<Shape>& shape)
+        {
+            wxPoint topLeft, botRight;
+            shape->GetBounds(topLeft, botRight);
+            if (area.Contains(wxRect(topLeft, botRight)) && picked.count(shape->GetId()) == 0)
+                candidates.push_back(shape.get());
+        });
+        std::vector<char> inside(candidates.size(), 0);
+        int chunks = static_cast<int>((candidates.size() + kLassoChunk - 1) / kLassoChunk);
+        ThreadPool::Get().ParallelFor(chunks, [this, &candidates, &inside](int chunk)
+        {
+            size_t end = std::min(candidates.size(), (chunk + 1) * kLassoChunk);
+            for (size_t i = chunk * kLassoChunk; i < end; i++)
+            {
+                inside[i] = candidates[i]->IsInside(mLasso);
+            }
+        });
+        for (size_t i = 0; i < candidates.size(); i++)
+        {
+            if (inside[i])
+                ids.push_back(candidates[i]->GetId());
+        }
     }
+    mLasso.Clear();
     
+    // The topmost shape lassoed gets the handles
+    Select(ids);
+    return !ids.empty();
+}
+
+wxPoint PaintModel::Snap(const wxPoint& point, double scale)
+{
+    // Mid-command, the layer only differs from the index by the shape
+    // being changed, which is left out anyway
+    ShapeId exclude = (activeCommand && activeCommand->getShape()) ? activeCommand->getShape()->GetId() : 0;
+    return mSnapper.Snap(point, scale, *GetActiveLayer(), exclude, !activeCommand);
+}
+
+void PaintModel::Select(const std::vector<ShapeId>& ids)
+{
+    ClearSelection();
+    if (ids.empty())
+        return;
+    mSelectedId = ids.back();
+    mSelectedIndex = Layer::kNoShape;
+    mPicked.assign(ids.begin(), ids.end() - 1);
+}
+
+std::shared_ptr<const Shape> PaintModel::GetSelectedShape()
+{
+    size_t index = FindSelected();
+    if (index == Layer::kNoShape)
+        return std::shared_ptr<const Shape>();
+    return GetActiveLayer()->At(index);
+}
+
+size_t PaintModel::FindSelected()
+{
+    if (mSelectedId == 0)
+        return Layer::kNoShape;
     
+    mSelectedIndex = GetActiveLayer()->Find(mSelectedId, mSelectedIndex);
+    if (mSelectedIndex == Layer::kNoShape)
+        mSelectedId = 0;
+    return mSelectedIndex;
+}
+
+void PaintModel::DrawDocument(wxDC& dc)
+{
+    if (bitmap.IsOk())
+    {
+        // A preview or shrunk image is stretched over its full area
+        double scaleX, scaleY;
+        dc.GetUserScale(&scaleX, &scaleY);
+        dc.SetUserScale(scaleX * mImageScale, scaleY * mImageScale);
+        dc.DrawBitmap(bitmap, 0, 0);
+        dc.SetUserScale(scaleX, scaleY);
+    }
+    
+    for (auto& layer : mLayers)
+    {
+        if (layer->IsVisible())
+            layer->DrawComposited(dc);
+    }
 }
 
 // Clear the current paint model and start fresh
 void PaintModel::New()
 {
 	// TODO
-    undo.clear();
-    redo.clear();
+    mHistory.Clear();
     activeCommand.reset();
-    mShapes.clear();
+    mLayers.clear();
+    mLayers.push_back(std::make_shared<Layer>("Layer 1"));
+    mActiveLayer = 0;
     pen = *wxBLACK_PEN;
     brush = *wxWHITE_BRUSH;
-    selectedShape.reset();
-    undoPen.clear();
-    redoPen.clear();
-    undoShape.clear();
-    redoShape.clear();
+    ClearSelection();
+    mSnapper.ClearGuide();
     bitmap = wxBitmap();
+    mImage = wxImage();
+    mImageScale = 1.0;
+    mImageSnapshot.reset();
+    mImportGeneration++;
+    mImporting = false;
+    // Everything above held the last references into the old arena.
+    // Clearing it still destroys each shape and command in turn (their
+    // pens, brushes and buffers need it), so this is O(n); dropping the
+    // arena afterwards only frees its chunks.
+    std::shared_ptr<DocumentArena> arena = std::make_shared<DocumentArena>();
+    for (int i = 0; i < MC_Count; i++)
+    {
+        MemoryCategory category = static_cast<MemoryCategory>(i);
+        arena->SetBudget(category, mArena->GetBudget(category));
+    }
+    mRasterCharge.Set(arena, MC_Rasters, 0);
+    mArena = arena;
 
 }
 
@@ -69,19 +349,54 @@ void PaintModel::AddShape(std::shared_ptr<Shape> shape)
     shape->SetPenColor(GetPenColor());
     shape->SetBColor(GetBrushColor());
     shape->SetWidth(GetWidth());
-    mShapes.emplace_back(shape);
+    GetActiveLayer()->Append(shape);
 }
 
 // Remove a shape from the paint model
 void PaintModel::RemoveShape(std::shared_ptr<Shape> shape)
 {
-	auto iter = std::find(mShapes.begin(), mShapes.end(), shape);
-	if (iter != mShapes.end())
+    RemoveShape(shape, GetActiveLayer());
+}
+
+void PaintModel::AddShape(std::shared_ptr<Shape> shape, const std::shared_ptr<Layer> &layer)
+{
+    shape->SetPenColor(GetPenColor());
+    shape->SetBColor(GetBrushColor());
+    shape->SetWidth(GetWidth());
+    layer->Append(shape);
+}
+
+void PaintModel::RemoveShape(std::shared_ptr<Shape> shape, const std::shared_ptr<Layer> &layer)
+{
+    size_t index = layer->Find(shape->GetId());
+	if (index != Layer::kNoShape)
 	{
-		mShapes.erase(iter);
+		layer->Erase(index);
 	}
 }
 
+void PaintModel::AddLayer()
+{
+    wxString name = wxString::Format("Layer %d", static_cast<int>(mLayers.size()) + 1);
+    mLayers.insert(mLayers.begin() + mActiveLayer + 1, std::make_shared<Layer>(name));
+    SetActiveLayer(mActiveLayer + 1);
+}
+
+const std::shared_ptr<Layer> & PaintModel::AppendLayer(const wxString &name)
+{
+    mLayers.push_back(std::make_shared<Layer>(name));
+    return mLayers.back();
+}
+
+void PaintModel::SetActiveLayer(size_t index)
+{
+    if (index >= mLayers.size() || index == mActiveLayer)
+        return;
+    
+    mActiveLayer = index;
+    mSelectedId = 0;
+}
+
 bool PaintModel::HasActiveCommand()
 {
     if (activeCommand)
@@ -99,11 +414,38 @@ void PaintModel::CreateCommand(CommandType type, const wxPoint &start)
 void PaintModel::FinalizeCommand()
 {
     activeCommand->Finalize(shared_from_this());
-   
+    TrimHistory();
     
     
 }
 
+void PaintModel::TrimHistory()
+{
+    mHistory.DropOldest([this]() { return mArena->IsOverBudget(MC_History); });
+}
+
+void PaintModel::FinalizeLater(const std::shared_ptr<Layer>& layer, ShapeId id)
+{
+    // Held weakly, so a job outliving its layer does nothing
+    std::weak_ptr<Layer> target = layer;
+    if (!mScheduler)
+    {
+        FinalizeShape(target, id);
+        return;
+    }
+    mScheduler->Post(IdleScheduler::IP_Normal, [target, id](const IdleScheduler&)
+    {
+        FinalizeShape(target, id);
+        return true;
+    }, id);
+}
+
+void PaintModel::SetMemoryBudget(MemoryCategory category, size_t bytes)
+{
+    mArena->SetBudget(category, bytes);
+    TrimHistory();
+}
+
 void PaintModel::UpdateCommand(const wxPoint &newPoint)
 {
     
@@ -115,31 +457,46 @@ void PaintModel::UpdateCommand(const wxPoint &newPoint)
 
 bool PaintModel::CanRedo()
 {
-    if (redo.empty())
-        return false;
-    else return true;
+    return mHistory.GetRedo() != nullptr;
 }
 
 bool PaintModel::CanUndo()
 {
-    if (undo.empty())
-        return false;
-    else return true;
-    
+    return mHistory.GetUndo() != nullptr;
 }
 
 void PaintModel::Undo()
 {    
-    redo.push_back(undo.back());
-    undo.pop_back();
-    
+    mHistory.StepBack();
 }
 
 void PaintModel::Redo()
 {
-    undo.push_back(redo.back());
-    redo.pop_back();
+    mHistory.StepForward();
+}
+
+void PaintModel::JumpTo(const UndoTree::Node* state)
+{
+    if (activeCommand)
+        return;
+    
+    std::shared_ptr<PaintModel> self = shared_from_this();
+    const UndoTree::Node* common = mHistory.CommonAncestor(mHistory.GetCurrent(), state);
+    while (mHistory.GetCurrent() != common)
+    {
+        mHistory.GetUndo()->Undo(self);
+    }
     
+    std::vector<const UndoTree::Node*> down;
+    for (const UndoTree::Node* node = state; node != common; node = node->parent)
+    {
+        down.push_back(node);
+    }
+    for (auto iter = down.rbegin(); iter != down.rend(); ++iter)
+    {
+        mHistory.SetBranchTo(*iter);
+        mHistory.GetRedo()->Redo(self);
+    }
 }
 
 int PaintModel::GetWidth()
@@ -165,11 +522,10 @@ void PaintModel::SetBColor(wxColour color)
 {
 
     
-    if (selectedShape)
+    size_t index = FindSelected();
+    if (index != Layer::kNoShape)
     {
-    
-        selectedShape->SetBColor(color);
-
+        GetActiveLayer()->Edit(index).SetBColor(color);
     }
     
 
@@ -181,10 +537,10 @@ void PaintModel::SetBColor(wxColour color)
 void PaintModel::SetPenColor(wxColour color)
 {
     
-    if (selectedShape)
+    size_t index = FindSelected();
+    if (index != Layer::kNoShape)
     {
-        selectedShape->SetPenColor(color);
-        
+        GetActiveLayer()->Edit(index).SetPenColor(color);
     }
     pen.SetColour(color);
     
@@ -193,10 +549,10 @@ void PaintModel::SetPenColor(wxColour color)
 
 void PaintModel::SetWidth(int width)
 {
-    if (selectedShape)
+    size_t index = FindSelected();
+    if (index != Layer::kNoShape)
     {
-        selectedShape->SetWidth(width);
-        
+        GetActiveLayer()->Edit(index).SetWidth(width);
     }
     pen.SetWidth(width);
     
@@ -214,58 +570,186 @@ wxBrush PaintModel::GetBrush() const
     return brush;
 }
 
-bool PaintModel::SelectShape(wxPoint pt)
+bool PaintModel::SelectShape(wxPoint pt, bool add)
 {
-    int size = static_cast<int>(mShapes.size()) -1;
-    for (int i = size; i > -1; i--)
+    ShapeId previous = (add && FindSelected() != Layer::kNoShape) ? mSelectedId : 0;
+    if (!add)
+        mPicked.clear();
+    
+    mSelectedId = 0;
+    GetActiveLayer()->GetShapes().ForEachReverse([this, pt](size_t index, const std::shared_ptr<Shape>& shape)
     {
-        if (mShapes.at(i) ->Intersects(pt))
-        {
-            selectedShape = mShapes.at(i);
-            return true;
-        }
-        selectedShape.reset();
+        if (!shape->Intersects(pt))
+            return false;
+        mSelectedId = shape->GetId();
+        mSelectedIndex = index;
+        return true;
+    });
+    
+    // Adding nothing keeps what was picked
+    if (mSelectedId == 0)
+    {
+        mSelectedId = previous;
+        return mSelectedId != 0;
     }
-    return false;
+    if (previous != 0 && previous != mSelectedId &&
+        std::find(mPicked.begin(), mPicked.end(), previous) == mPicked.end())
+        mPicked.push_back(previous);
+    mPicked.erase(std::remove(mPicked.begin(), mPicked.end(), mSelectedId), mPicked.end());
+    return true;
     
 }
 
-void PaintModel::Export(wxString fileName, wxSize bitSize)
+bool PaintModel::FillRegion(const wxPoint& pt, std::vector<FillSpan>& spans)
 {
-    wxString ext = fileName.substr(fileName.size() - 4, fileName.size() - 1);
+    wxRect area = mCanvasRect.Intersect(wxRect(pt.x - kMaxFillRadius, pt.y - kMaxFillRadius,
+        kMaxFillRadius * 2, kMaxFillRadius * 2));
+    if (area.IsEmpty() || !area.Contains(pt))
+        return false;
     
-    wxBitmapType type;
+    // Same renderer as the screen, but always at 1:1 so the spans are
+    // in document pixels whatever the view's zoom
+    FrameRenderer renderer;
+    wxImage image;
+    ViewTransform view;
+    view.origin = -area.GetTopLeft();
+    renderer.Render(*Snapshot(), area.GetSize(), view, image);
     
-    if (ext == ".bmp")
-        type = wxBITMAP_TYPE_BMP;
-    else if (ext == ".png")
-        type = wxBITMAP_TYPE_PNG;
-    else if (ext == ".jpg")
-        type = wxBITMAP_TYPE_JPEG;
-    else if (ext == "jpeg")
-        type = wxBITMAP_TYPE_JPEG;
+    if (!FloodFill(image.GetData(), image.GetWidth(), image.GetHeight(), pt - area.GetTopLeft(),
+        kFillTolerance, spans) || spans.empty())
+        return false;
     
-    wxBitmap bitmap;
-    // Create the bitmap of the specified wxSize
-    bitmap.Create(bitSize);
-    // Create a memory DC to draw to the bitmap
-    wxMemoryDC dc(bitmap);
-    // Clear the background color
-    dc.SetBackground(*wxWHITE_BRUSH);
-    dc.Clear();
-    // Draw all the shapes (make sure not the selection!)
-    DrawShapes(dc, false);
-    // Write the bitmap with the specified file name and wxBitmapType
-    bitmap.SaveFile(fileName, type);
+    for (auto& span : spans)
+    {
+        span.y += area.y;
+        span.x1 += area.x;
+        span.x2 += area.x;
+    }
+    return true;
+}
+
+wxRect PaintModel::GetDocumentBounds(const wxSize& minimum) const
+{
+    wxRect bounds(wxPoint(0, 0), minimum);
+    if (mImage.IsOk())
+        bounds = bounds.Union(wxRect(wxPoint(0, 0), GetImageSize()));
+    for (auto& layer : mLayers)
+    {
+        wxRect layerBounds = layer->IsVisible() ? layer->GetBounds() : wxRect();
+        if (!layerBounds.IsEmpty())
+            bounds = bounds.Union(layerBounds);
+    }
+    return bounds;
+}
+
+void PaintModel::ImageChanged()
+{
+    bitmap = mImage.IsOk() ? wxBitmap(mImage) : wxBitmap();
+    // A deep copy, so the render thread never touches mImage's refcount
+    if (mImage.IsOk())
+        mImageSnapshot = std::make_shared<wxImage>(mImage.Copy());
+    else
+        mImageSnapshot.reset();
+    // Image and snapshot, plus the bitmap at 32 bits a pixel
+    size_t bytes = ImageBytes(mImage) * 2;
+    if (bitmap.IsOk())
+        bytes += static_cast<size_t>(bitmap.GetWidth()) * bitmap.GetHeight() * 4;
+    mRasterCharge.Set(mArena, MC_Rasters, bytes);
+}
+
+size_t PaintModel::ImageBytes(const wxImage& image)
+{
+    if (!image.IsOk())
+        return 0;
+    size_t pixels = static_cast<size_t>(image.GetWidth()) * image.GetHeight();
+    return pixels * (image.HasAlpha() ? 4 : 3);
+}
+
+void PaintModel::ApplyFilter(const FilterCommand::Filter &filter)
+{
+    if (!mImage.IsOk())
+        return;
     
+    CreateCommand(CM_Filter, wxPoint(0, 0));
+    std::static_pointer_cast<FilterCommand>(activeCommand)->SetFilter(filter);
+    FinalizeCommand();
 }
 
-void PaintModel::Import(const wxString &fileName)
+void PaintModel::BeginTransform(const wxPoint &point, HandleType handle)
+{
+    CreateCommand(CM_Transform, point);
+    std::static_pointer_cast<TransformCommand>(activeCommand)->SetHandle(handle);
+}
+
+void PaintModel::Group()
+{
+    CreateCommand(CM_Group, wxPoint(0, 0));
+    FinalizeCommand();
+}
+
+void PaintModel::Ungroup()
+{
+    CreateCommand(CM_Ungroup, wxPoint(0, 0));
+    FinalizeCommand();
+}
+
+void PaintModel::Reorder(ZOrderType type, size_t index)
+{
+    CreateCommand(CM_ZOrder, wxPoint(0, 0));
+    std::static_pointer_cast<ZOrderCommand>(activeCommand)->SetTarget(type, index);
+    FinalizeCommand();
+}
+
+void PaintModel::Copy()
+{
+    std::vector<size_t> indices = GetSelectedIndices();
+    if (indices.empty())
+        return;
+    mClipboard.clear();
+    for (size_t index : indices)
+    {
+        mClipboard.push_back(GetActiveLayer()->At(index));
+    }
+    mPasteCount = 0;
+}
+
+void PaintModel::Paste()
+{
+    mPasteCount++;
+    int offset = kPasteOffset * mPasteCount;
+    PasteShapes(mClipboard, wxPoint(offset, offset));
+}
+
+void PaintModel::Duplicate()
+{
+    std::vector<std::shared_ptr<const Shape>> shapes;
+    for (size_t index : GetSelectedIndices())
+    {
+        shapes.push_back(GetActiveLayer()->At(index));
+    }
+    PasteShapes(shapes, wxPoint(kPasteOffset, kPasteOffset));
+}
+
+void PaintModel::PasteShapes(const std::vector<std::shared_ptr<const Shape>>& shapes, const wxPoint& offset)
+{
+    CreateCommand(CM_Paste, wxPoint(0, 0));
+    std::static_pointer_cast<PasteCommand>(activeCommand)->SetSources(shapes, offset);
+    FinalizeCommand();
+}
+
+void PaintModel::AddShapes(const ShapeBatch& batch)
+{
+    std::vector<std::shared_ptr<Shape>> shapes = batch.Build(ArenaAllocator<Shape>(mArena, MC_Styles));
+    CreateCommand(CM_AddShapes, wxPoint(0, 0));
+    std::static_pointer_cast<AddShapesCommand>(activeCommand)->SetShapes(shapes);
+    FinalizeCommand();
+}
+
+wxBitmapType PaintModel::TypeFromFileName(const wxString &fileName)
 {
-    New();
     wxString ext = fileName.substr(fileName.size() - 4, fileName.size() - 1);
     
-    wxBitmapType type;
+    wxBitmapType type = wxBITMAP_TYPE_INVALID;
     
     if (ext == ".bmp")
         type = wxBITMAP_TYPE_BMP;
@@ -276,8 +760,296 @@ void PaintModel::Import(const wxString &fileName)
     else if (ext == "jpeg")
         type = wxBITMAP_TYPE_JPEG;
     
+    return type;
+}
 
-    bitmap.LoadFile(fileName, type);
+bool PaintModel::Export(wxString fileName, const wxRect& area)
+{
+    if (fileName.substr(fileName.size() - 4, fileName.size() - 1) == ".svg")
+        return ExportSvg(fileName, area);
     
+    // PNG and BMP are streamed band by band; JPEG takes ExportScaled's
+    // full-frame path
+    return ExportScaled(fileName, area, 1.0);
 }
 
+bool PaintModel::ExportScaled(wxString fileName, const wxRect& area, double scale,
+    int bandHeight)
+{
+    wxSize targetSize(static_cast<int>(area.width * scale + 0.5), static_cast<int>(area.height * scale + 0.5));
+    int left = static_cast<int>(std::floor(area.x * scale + 0.5));
+    int top = static_cast<int>(std::floor(area.y * scale + 0.5));
+
+    wxBitmapType type = TypeFromFileName(fileName);
+    std::unique_ptr<ImageWriter> writer = ImageWriter::Create(type, mPngPreset);
+    if (!writer)
+    {
+        // JPEG has no streaming encoder here, so it needs the full frame
+        wxBitmap bitmap(targetSize);
+        wxMemoryDC dc(bitmap);
+        dc.SetBackground(*wxWHITE_BRUSH);
+        dc.Clear();
+        dc.SetUserScale(scale, scale);
+        dc.SetDeviceOrigin(-left, -top);
+        DrawDocument(dc);
+        dc.SelectObject(wxNullBitmap);
+        return bitmap.SaveFile(fileName, type);
+    }
+    
+    int width = targetSize.GetWidth();
+    int height = targetSize.GetHeight();
+    bandHeight = std::max(1, std::min(bandHeight, height));
+    if (width <= 0 || height <= 0 || !writer->Begin(fileName, width, height))
+        return false;
+    
+    // A single band-sized bitmap is reused for the whole export
+    wxBitmap band(width, bandHeight);
+    
+    for (int row = 0; row < height; row += bandHeight)
+    {
+        int rows = std::min(bandHeight, height - row);
+        
+        {
+            wxMemoryDC dc(band);
+            dc.SetBackground(*wxWHITE_BRUSH);
+            dc.Clear();
+            // Shift the drawing up so this band's rows land at the top
+            dc.SetUserScale(scale, scale);
+            dc.SetDeviceOrigin(-left, -top - row);
+            DrawDocument(dc);
+        }
+        wxImage image = band.ConvertToImage();
+        
+        if (!writer->WriteRows(image.GetData(), rows))
+        {
+            writer->End();
+            return false;
+        }
+    }
+    
+    return writer->End();
+}
+
+bool PaintModel::ExportTimelapse(const wxString& fileName, const wxRect& area, int step, int frameDelay)
+{
+    if (area.IsEmpty() || activeCommand)
+        return false;
+    step = std::max(1, step);
+    
+    bool gif = fileName.Lower().EndsWith(".gif");
+    wxFileName name(fileName);
+    wxString base = name.GetPathWithSep() + name.GetName();
+    GifWriter animation(frameDelay);
+    if (gif && !animation.Begin(fileName, area.width, area.height))
+        return false;
+    // Each PNG is finished only once the next frame is drawn, so it
+    // compresses in the meantime
+    std::unique_ptr<ImageWriter> still;
+    int frames = 0;
+    
+    FrameRenderer renderer;
+    ViewTransform view;
+    view.origin = -area.GetTopLeft();
+    wxImage frame(area.GetSize(), false);
+    std::shared_ptr<const DocumentSnapshot> previous;
+    auto emit = [&]() -> bool
+    {
+        // No layer is live, so all of them come from tiles, and only
+        // tiles the commands touched are redrawn
+        std::shared_ptr<const DocumentSnapshot> snapshot = Snapshot(false);
+        wxRect changed = DamageBetween(previous.get(), *snapshot, area);
+        previous = snapshot;
+        changed.Offset(-area.x, -area.y);
+        if (!changed.IsEmpty())
+        {
+            ViewTransform region = view;
+            region.origin -= changed.GetTopLeft();
+            wxImage part;
+            renderer.Render(*snapshot, changed.GetSize(), region, part);
+            frame.Paste(part, changed.x, changed.y);
+        }
+        
+        if (gif)
+            return animation.AddFrame(frame.GetData(), changed);
+        if (still && !still->End())
+            return false;
+        still = ImageWriter::Create(wxBITMAP_TYPE_PNG, mPngPreset);
+        return still->Begin(wxString::Format("%s_%05d.png", base, frames++), area.width, area.height) &&
+            still->WriteRows(frame.GetData(), area.height);
+    };
+    
+    // Back to the oldest step kept, then forwards a command at a time.
+    // Commands may select what they add, so the selection is put back.
+    std::shared_ptr<PaintModel> self = shared_from_this();
+    ShapeId selected = mSelectedId;
+    std::vector<ShapeId> picked = mPicked;
+    size_t count = mHistory.GetDepth();
+    while (mHistory.GetUndo())
+    {
+        mHistory.GetUndo()->Undo(self);
+    }
+    
+    bool ok = emit();
+    for (size_t i = 1; i <= count; i++)
+    {
+        mHistory.GetRedo()->Redo(self);
+        // After a failed write the rest is still redone
+        if (ok && (i % step == 0 || i == count))
+            ok = emit();
+    }
+    mSelectedId = selected;
+    mPicked = picked;
+    
+    if (gif)
+        ok = animation.End() && ok;
+    else if (still)
+        ok = still->End() && ok;
+    return ok;
+}
+
+bool PaintModel::ExportSvg(wxString fileName, const wxRect& area, bool embedImage)
+{
+    SvgWriter svg;
+    
+    // First pass only collects the styles in use
+    for (auto& layer : mLayers)
+    {
+        if (layer->IsVisible())
+            layer->DrawSvg(svg);
+    }
+    
+    if (!svg.Begin(fileName, area))
+        return false;
+    
+    bool ok = true;
+    if (bitmap.IsOk())
+    {
+        if (embedImage)
+        {
+            svg.EmbeddedImage(mImage, GetImageSize());
+        }
+        else
+        {
+            wxFileName imageName(fileName);
+            imageName.SetName(imageName.GetName() + "-image");
+            imageName.SetExt("png");
+            ok = mImage.SaveFile(imageName.GetFullPath(), wxBITMAP_TYPE_PNG);
+            svg.LinkedImage(imageName.GetFullName(), GetImageSize());
+        }
+    }
+    
+    for (auto& layer : mLayers)
+    {
+        if (layer->IsVisible())
+            layer->DrawSvg(svg);
+    }
+    
+    return svg.End() && ok;
+}
+
+void PaintModel::Import(const wxString &fileName, const std::function<void()>& updated)
+{
+    New();
+    wxBitmapType type = TypeFromFileName(fileName);
+    unsigned long generation = mImportGeneration;
+    mImporting = true;
+    
+    // With a raster budget the image is kept small enough to fit it
+    size_t maxPixels = mArena->GetBudget(MC_Rasters) / kImagePixelBytes;
+    std::weak_ptr<PaintModel> model = shared_from_this();
+    ImageSink deliver = [model, generation, updated](const std::shared_ptr<wxImage>& image, double scale, bool last)
+    {
+        wxTheApp->CallAfter([model, generation, updated, image, scale, last]()
+        {
+            std::shared_ptr<PaintModel> target = model.lock();
+            if (!target || generation != target->mImportGeneration)
+            {
+                image->Destroy();
+                return;
+            }
+            target->ImageLoaded(image, scale);
+            if (last)
+                target->mImporting = false;
+            if (updated)
+                updated();
+        });
+    };
+    wxString path = fileName;
+    ThreadPool::Get().Submit([path, type, maxPixels, deliver]()
+    {
+        DecodeImage(path, type, maxPixels, deliver);
+    });
+}
+
+wxSize PaintModel::ReadImageSize(const wxString& fileName)
+{
+    wxBitmapType type = TypeFromFileName(fileName);
+    if (type != wxBITMAP_TYPE_PNG && type != wxBITMAP_TYPE_BMP)
+        return wxSize(0, 0);
+    
+    unsigned char header[26];
+    wxFileInputStream in(fileName);
+    if (!in.IsOk() || in.Read(header, sizeof(header)).LastRead() != sizeof(header))
+        return wxSize(0, 0);
+    
+    unsigned long width = 0, height = 0;
+    if (type == wxBITMAP_TYPE_PNG)
+    {
+        // The signature, then IHDR, which always comes first
+        static const unsigned char kSignature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+        if (std::equal(kSignature, kSignature + 8, header) && std::equal(header + 12, header + 16, "IHDR"))
+        {
+            width = GetBE32(header + 16);
+            height = GetBE32(header + 20);
+        }
+    }
+    else if (header[0] == 'B' && header[1] == 'M')
+    {
+        // Old OS/2 headers have 16-bit sizes; the rest 32-bit, with a
+        // negative height for images stored top down
+        if (GetLE32(header + 14) == 12)
+        {
+            width = header[18] | (header[19] << 8);
+            height = header[20] | (header[21] << 8);
+        }
+        else
+        {
+            width = GetLE32(header + 18);
+            long rows = static_cast<int>(GetLE32(header + 22));
+            height = static_cast<unsigned long>(rows < 0 ? -rows : rows);
+        }
+    }
+    // wxImage sizes are ints
+    const unsigned long kMaxSide = 0x7fffffffUL;
+    if (width > kMaxSide || height > kMaxSide)
+        return wxSize(0, 0);
+    return wxSize(static_cast<int>(width), static_cast<int>(height));
+}
+
+bool PaintModel::ImportExceedsBudget(const wxString& fileName) const
+{
+    size_t budget = mArena->GetBudget(MC_Rasters);
+    wxSize size = ReadImageSize(fileName);
+    double pixels = static_cast<double>(size.GetWidth()) * size.GetHeight();
+    return budget != 0 && pixels > static_cast<double>(budget / kImagePixelBytes);
+}
+
+void PaintModel::ImageLoaded(const std::shared_ptr<wxImage>& image, double scale)
+{
+    if (!image->IsOk())
+        return;
+    // Taken rather than shared, since wx's reference counts aren't
+    // atomic and the worker may drop the last pointer to the image
+    mImage = *image;
+    image->Destroy();
+    mImageScale = scale;
+    ImageChanged();
+}
+
+wxSize PaintModel::GetImageSize() const
+{
+    if (!mImage.IsOk())
+        return wxSize(0, 0);
+    return wxSize(static_cast<int>(std::floor(mImage.GetWidth() * mImageScale + 0.5)),
+        static_cast<int>(std::floor(mImage.GetHeight() * mImageScale + 0.5)));
+}
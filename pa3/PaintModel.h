@@ -1,17 +1,39 @@
 #pragma once
+#include <functional>
 #include <memory>
 #include <vector>
 #include "Shape.h"
+#include "ShapeBatch.h"
 #include "Command.h"
+#include "Layer.h"
+#include "Lasso.h"
+#include "Snapper.h"
+#include "Renderer.h"
+#include "Arena.h"
+#include "ImageWriter.h"
+#include "IdleScheduler.h"
+#include "UndoTree.h"
 #include <wx/bitmap.h>
+#include <wx/image.h>
 
 class PaintModel : public std::enable_shared_from_this<PaintModel>
 {
 public:
 	PaintModel();
 	
-	// Draws any shapes in the model to the provided DC (draw context)
-	void DrawShapes(wxDC& dc, bool showSelection = true);
+	// Immutable copy of the visible document, safe to draw on another
+	// thread while the model keeps changing. With editing, the active
+	// layer is marked live (see LayerSnapshot).
+	std::shared_ptr<const DocumentSnapshot> Snapshot(bool editing = true) const;
+	
+	// Draws the selection outline (if the selected shape is still on the
+	// active layer; otherwise the selection is cleared), the lasso
+	// while one is being drawn, and the snapping grid and guides
+	void DrawSelection(wxDC& dc);
+    
+    // Draws the whole document without using any cached layer rasters,
+    // so it respects whatever scale/origin the DC has (used by export)
+    void DrawDocument(wxDC& dc);
 
 	// Clear the current paint model and start fresh
 	void New();
@@ -20,6 +42,29 @@ public:
 	void AddShape(std::shared_ptr<Shape> shape);
 	// Remove a shape from the paint model
 	void RemoveShape(std::shared_ptr<Shape> shape);
+    // Same as above, for a specific layer rather than the active one
+    void AddShape(std::shared_ptr<Shape> shape, const std::shared_ptr<Layer> &layer);
+    void RemoveShape(std::shared_ptr<Shape> shape, const std::shared_ptr<Layer> &layer);
+    
+    // Adds an empty layer above the active one and makes it active
+    void AddLayer();
+    // Adds an empty layer on top, leaving the active one alone, for
+    // layers made elsewhere (see LiveSession)
+    const std::shared_ptr<Layer> & AppendLayer(const wxString &name);
+    // Changes which layer new shapes go to and selection works on
+    void SetActiveLayer(size_t index);
+    size_t GetActiveLayerIndex() const
+    {
+        return mActiveLayer;
+    }
+    const std::shared_ptr<Layer> & GetActiveLayer() const
+    {
+        return mLayers[mActiveLayer];
+    }
+    const std::vector<std::shared_ptr<Layer>> & GetLayers() const
+    {
+        return mLayers;
+    }
     
     bool HasActiveCommand();
 
@@ -33,10 +78,26 @@ public:
     
     bool CanRedo();
     
+    // Move through the history once a command has undone or redone
+    // itself; the commands call these
     void Undo();
     
     void Redo();
     
+    // Every state the document has been in. Commands add themselves
+    // when they finish.
+    UndoTree & GetHistory()
+    {
+        return mHistory;
+    }
+    const UndoTree & GetHistory() const
+    {
+        return mHistory;
+    }
+    // Takes the document to another state in the history, undoing up
+    // to where the two branches meet and redoing down to it
+    void JumpTo(const UndoTree::Node* state);
+    
     int GetWidth();
     
     wxColour GetPenColor();
@@ -53,45 +114,265 @@ public:
     
     wxBrush GetBrush() const;
     
-    bool SelectShape(wxPoint pt);
+    // Selects the top shape at pt. With add, the shapes picked so far
+    // stay picked (for grouping) and the new one gets the handles.
+    bool SelectShape(wxPoint pt, bool add = false);
+    // Makes the shape with this id the only one selected
+    void Select(ShapeId id)
+    {
+        mSelectedId = id;
+        mPicked.clear();
+    }
+    // Makes these the selected shapes; the last one gets the handles
+    void Select(const std::vector<ShapeId>& ids);
+    // Indices of all picked shapes still on the active layer, lowest first
+    std::vector<size_t> GetSelectedIndices();
+    // Lasso selection: the outline follows the mouse from BeginLasso,
+    // and EndLasso selects the shapes on the active layer that lie
+    // wholly inside it, adding them to what's picked with add. Returns
+    // whether anything ends up selected.
+    void BeginLasso(const wxPoint& point);
+    void ExtendLasso(const wxPoint& point);
+    bool EndLasso(bool add = false);
+    bool IsLassoing() const
+    {
+        return !mLasso.IsEmpty();
+    }
+    
+    // Grid and shape snapping settings, and the guides they draw
+    Snapper& GetSnapper()
+    {
+        return mSnapper;
+    }
+    // Where a point being drawn or dragged to on the active layer
+    // snaps to, for a view at scale (see Snapper::Snap). The shape the
+    // active command is changing doesn't snap to itself.
+    wxPoint Snap(const wxPoint& point, double scale);
+    
+    // Part of the document on screen, used by tools that work on pixels
+    void SetCanvasRect(const wxRect& rect)
+    {
+        mCanvasRect = rect;
+    }
+    
+    // Flood fills the composited canvas (image plus all visible
+    // layers) from pt, within the part on screen but no further than
+    // kMaxFillRadius from pt. Returns false if there's nothing to fill.
+    bool FillRegion(const wxPoint& pt, std::vector<FillSpan>& spans);
+    
+    // The document has no fixed size: this is the area from the origin
+    // to at least minimum, grown to cover the image and every visible
+    // shape (which may be at negative coordinates)
+    wxRect GetDocumentBounds(const wxSize& minimum) const;
+    
+    // Writes the given area of the document. Returns false if the file
+    // couldn't be written.
+    bool Export(wxString fileName, const wxRect& area);
+    
+    // Export an area with the drawing scaled by the given factor. PNG
+    // and BMP are rendered and written one band of rows at a time, so
+    // memory use doesn't grow with the height. Returns false if the
+    // file couldn't be written.
+    bool ExportScaled(wxString fileName, const wxRect& area, double scale,
+        int bandHeight = kExportBandHeight);
+    
+    // Write the drawing as SVG. An imported image is either embedded
+    // as base64 or saved next to the SVG as a PNG and linked.
+    bool ExportSvg(wxString fileName, const wxRect& area, bool embedImage = true);
     
-    void Export(wxString fileName, wxSize bitSize);
+    // Replays the undo history, from the oldest step kept, into an
+    // animation of area with a frame every step commands: an animated
+    // GIF for a .gif name, otherwise numbered PNGs beside it
+    // (name_00000.png, ...). Each frame only redraws what the commands
+    // since the last one touched, and frames compress on the thread
+    // pool while the next is drawn. The document is left as it was.
+    // Returns false if a file couldn't be written.
+    bool ExportTimelapse(const wxString& fileName, const wxRect& area, int step,
+        int frameDelay = GifWriter::kDefaultDelay);
+    
+    // Whether an image has been imported into the drawing
+    bool HasImage() const
+    {
+        return bitmap.IsOk();
+    }
+    // Whether an import is still decoding
+    bool IsImporting() const
+    {
+        return mImporting;
+    }
+    // Area the imported image covers in the document. The image itself
+    // may be smaller (a preview, or shrunk to fit the raster budget),
+    // and is then drawn stretched over this.
+    wxSize GetImageSize() const;
+    
+    // Editable copy of the imported image; call ImageChanged after
+    // modifying it so the displayed bitmap is rebuilt
+    wxImage & GetImage()
+    {
+        return mImage;
+    }
+    void ImageChanged();
+    
+    // Bytes held by the imported image, its alpha included
+    static size_t ImageBytes(const wxImage& image);
+    
+    // Runs a filter over the imported image as an undoable command
+    void ApplyFilter(const FilterCommand::Filter &filter);
+    
+    // Starts dragging a handle of the selected shape
+    void BeginTransform(const wxPoint& point, HandleType handle);
+    
+    // Groups the picked shapes, or splits the selected group, as
+    // undoable commands
+    void Group();
+    void Ungroup();
+    // Restacks the selected shape as an undoable command
+    void Reorder(ZOrderType type, size_t index = 0);
+    
+    // Keeps the selected shapes to paste later. The clipboard only holds
+    // references: shapes are immutable once a snapshot can see them.
+    void Copy();
+    // Adds copies of the clipboard shapes, each paste kPasteOffset
+    // further along than the last, as an undoable command
+    void Paste();
+    bool CanPaste() const
+    {
+        return !mClipboard.empty();
+    }
+    // Copies the selected shapes in place of a copy and paste, leaving
+    // the clipboard alone
+    void Duplicate();
+    
+    // Adds the batch's shapes on top of the active layer as one
+    // undoable command
+    void AddShapes(const ShapeBatch& batch);
+    
+    // Bytes the document uses by category, kept up to date as it
+    // changes, so this is cheap enough to poll
+    DocumentArena::Usage GetMemoryUsage() const
+    {
+        return mArena->GetUsage();
+    }
+    // Soft limit for a category, 0 for none. Over the history budget
+    // the oldest states are dropped, and over the cache budget the
+    // renderer drops cached rasters; other categories are only reported.
+    void SetMemoryBudget(MemoryCategory category, size_t bytes);
+    
+    // Where housekeeping goes to wait for idle time; without one it's
+    // done straight away
+    void SetScheduler(IdleScheduler* scheduler)
+    {
+        mScheduler = scheduler;
+    }
+    // Finishes a shape drawn on layer (simplifying pencil strokes) once
+    // the UI is idle
+    void FinalizeLater(const std::shared_ptr<Layer>& layer, ShapeId id);
+    
+    // Speed/size trade-off used when writing PNG files
+    void SetPngPreset(ImageWriter::Preset preset)
+    {
+        mPngPreset = preset;
+    }
+    ImageWriter::Preset GetPngPreset() const
+    {
+        return mPngPreset;
+    }
 
-    void Import(const wxString &fileName);
+    // Starts replacing the document with an image, decoded on a worker
+    // thread. A JPEG shows a preview decoded at reduced size first.
+    // updated is called on the UI thread each time the image changes.
+    void Import(const wxString &fileName, const std::function<void()>& updated = std::function<void()>());
+    // Size of a PNG or BMP from its header, without decoding it; 0x0
+    // for other formats or a header that can't be read
+    static wxSize ReadImageSize(const wxString& fileName);
+    // Whether importing fileName would go over the raster budget before
+    // it could be shrunk to fit. Only JPEGs are shrunk while they're
+    // decoded; PNGs and BMPs are decoded at full size first.
+    bool ImportExceedsBudget(const wxString& fileName) const;
     
     std::shared_ptr<Command> & GetActiveCommand()
     {
         return activeCommand;
     }
     
-    std::vector<std::shared_ptr<Shape>> & GetShapes()
+    // Current version of the selected shape, or null. Changes to it
+    // go through the layer (see SetPenColor and the commands).
+    std::shared_ptr<const Shape> GetSelectedShape();
+    void ClearSelection()
     {
-        return mShapes;
+        mSelectedId = 0;
+        mPicked.clear();
     }
-    std::shared_ptr<Shape> & GetSelectedShape()
+    // Pool that owns this document's shapes and commands
+    const std::shared_ptr<DocumentArena> & GetArena() const
     {
-        return selectedShape;
+        return mArena;
     }
 
-    std::vector<std::shared_ptr<Command>> undo;
-    std::vector<std::shared_ptr<Command>> redo;
-    std::vector<wxPen> undoPen;
-    std::vector<wxPen> redoPen;
-    std::vector<wxBrush> undoBrush;
-    std::vector<wxBrush> redoBrush;
-    std::vector<std::shared_ptr<Shape>> undoShape;
-    std::vector<std::shared_ptr<Shape>> redoShape;
+    
+    // Default number of rows rendered per band when exporting
+    static const int kExportBandHeight = 256;
+    // Furthest the bucket tool reaches from where it's clicked
+    static const int kMaxFillRadius = 2048;
+    // Per-channel colour difference the bucket tool treats as the same
+    static const int kFillTolerance = 32;
+    // Longest side of the preview shown while an import decodes
+    static const int kPreviewSize = 1024;
+    // How far each paste or duplicate moves its copies
+    static const int kPasteOffset = 10;
+    // Shapes per job when testing them against a lasso
+    static const size_t kLassoChunk = 256;
     
 
 private:
-	// Vector of all the shapes in the model
+    // Works out the image type from a file name's extension
+    static wxBitmapType TypeFromFileName(const wxString &fileName);
+    
+    // Index of the selected shape on the active layer, or
+    // Layer::kNoShape (which also clears the selection)
+    size_t FindSelected();
+    // Shows an image decoded for import, scale being document pixels
+    // per image pixel
+    void ImageLoaded(const std::shared_ptr<wxImage>& image, double scale);
+    // Drops the oldest states while history is over budget (see
+    // UndoTree::DropOldest)
+    void TrimHistory();
+    // Runs a paste command for these shapes
+    void PasteShapes(const std::vector<std::shared_ptr<const Shape>>& shapes, const wxPoint& offset);
     
     wxPen pen;
     wxBrush brush;
     wxBitmap bitmap;
+    wxImage mImage;
+    // Document pixels per image pixel (see GetImageSize)
+    double mImageScale;
+    // Bumped by each import and New, so late results are ignored
+    unsigned long mImportGeneration;
+    bool mImporting;
+    // Private copy of mImage handed out in snapshots
+    std::shared_ptr<const wxImage> mImageSnapshot;
     std::shared_ptr<Command> activeCommand;
-    std::shared_ptr<Shape> selectedShape;
-    std::vector<std::shared_ptr<Shape>> mShapes;
+    // 0 when nothing is selected
+    ShapeId mSelectedId;
+    size_t mSelectedIndex;
+    // Other shapes picked along with the selected one
+    std::vector<ShapeId> mPicked;
+    // Outline being drawn by the lasso tool, empty otherwise
+    Lasso mLasso;
+    Snapper mSnapper;
+    // Shapes last copied, lowest first, and how often they've been pasted
+    std::vector<std::shared_ptr<const Shape>> mClipboard;
+    int mPasteCount;
+    // Layers from bottom to top; there's always at least one
+    std::vector<std::shared_ptr<Layer>> mLayers;
+    size_t mActiveLayer;
+    std::shared_ptr<DocumentArena> mArena;
+    ImageWriter::Preset mPngPreset;
+    wxRect mCanvasRect;
+    // Image, display bitmap and snapshot copy, as rasters
+    MemoryCharge mRasterCharge;
+    IdleScheduler* mScheduler;
+    UndoTree mHistory;
 
     
 };
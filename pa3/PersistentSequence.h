@@ -0,0 +1,516 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// Returns a number no sequence has used yet
+inline unsigned long NextSequenceEpoch()
+{
+    static std::atomic<unsigned long> next(1);
+    return next++;
+}
+
+// Label for sequences whose items don't carry one
+template <class T>
+struct NoLabel
+{
+    static unsigned long long Of(const T&)
+    {
+        return 0;
+    }
+};
+
+// Ordered sequence stored as a counted B+ tree, so indexing, insert,
+// erase and replace are all O(log n). Snapshots share every node and
+// cost O(1): each node is stamped with the epoch of the sequence that
+// created it, a sequence only modifies nodes carrying its own epoch,
+// and taking a snapshot moves the sequence to a new epoch. After that,
+// a change copies just the nodes on the path to the item it touches.
+//
+// A snapshot is never modified through the sequence it came from, so
+// it can be read from another thread while the original keeps changing.
+//
+// Items may also carry a label (Label::Of) that increases along the
+// sequence, as with order-maintenance labels. Each node then remembers
+// its last label, so LowerBound finds an item's index in O(log n).
+template <class T, class Label = NoLabel<T>>
+class PersistentSequence
+{
+public:
+    PersistentSequence()
+        :mEpoch(NextSequenceEpoch())
+    {
+    }
+    PersistentSequence(PersistentSequence&& other)
+        :mRoot(std::move(other.mRoot))
+        ,mEpoch(other.mEpoch)
+    {
+        other.mEpoch = NextSequenceEpoch();
+    }
+    PersistentSequence& operator=(PersistentSequence&& other)
+    {
+        mRoot = std::move(other.mRoot);
+        mEpoch = other.mEpoch;
+        other.mEpoch = NextSequenceEpoch();
+        return *this;
+    }
+
+    size_t Size() const
+    {
+        return mRoot ? mRoot->count : 0;
+    }
+    bool Empty() const
+    {
+        return !mRoot;
+    }
+
+    // Epoch of the nodes this sequence may change in place. Items can
+    // compare against it to do their own copy-on-write.
+    unsigned long GetEpoch() const
+    {
+        return mEpoch;
+    }
+
+    const T& At(size_t index) const
+    {
+        const Node* node = mRoot.get();
+        while (!node->leaf)
+        {
+            size_t child = FindChild(*node, index);
+            node = node->children[child].get();
+        }
+        return node->items[index];
+    }
+    const T& Back() const
+    {
+        return At(Size() - 1);
+    }
+
+    void PushBack(const T& value)
+    {
+        Insert(Size(), value);
+    }
+
+    void Insert(size_t index, const T& value)
+    {
+        if (!mRoot)
+        {
+            mRoot = NewNode(true);
+        }
+        std::shared_ptr<Node> split = InsertInto(mRoot, index, value);
+        if (split)
+        {
+            std::shared_ptr<Node> root = NewNode(false);
+            root->count = mRoot->count + split->count;
+            root->label = split->label;
+            root->children.push_back(mRoot);
+            root->children.push_back(split);
+            mRoot = root;
+        }
+    }
+
+    void Erase(size_t index)
+    {
+        EraseFrom(mRoot, index);
+        if (mRoot->count == 0)
+        {
+            mRoot.reset();
+        }
+        else if (!mRoot->leaf && mRoot->children.size() == 1)
+        {
+            std::shared_ptr<Node> child = mRoot->children.front();
+            mRoot = child;
+        }
+    }
+
+    // Inserts values, in order, before index. A batch that's large next
+    // to the sequence rebuilds the whole tree bottom up instead, which is
+    // O(n) rather than O(m log n) and leaves every node evenly filled.
+    void InsertRange(size_t index, const std::vector<T>& values)
+    {
+        if (values.size() < Size() / kBulkRatio + kMaxEntries)
+        {
+            for (size_t i = 0; i < values.size(); i++)
+            {
+                Insert(index + i, values[i]);
+            }
+            return;
+        }
+        std::vector<T> items;
+        items.reserve(Size() + values.size());
+        size_t at = 0;
+        ForEach([&](const T& item) {
+            if (at++ == index)
+                items.insert(items.end(), values.begin(), values.end());
+            items.push_back(item);
+        });
+        if (index >= at)
+            items.insert(items.end(), values.begin(), values.end());
+        Build(items);
+    }
+
+    // Erases count items from index, rebuilding the same way when
+    // that's most of the sequence
+    void EraseRange(size_t index, size_t count)
+    {
+        if (count < Size() / kBulkRatio + kMaxEntries)
+        {
+            for (size_t i = 0; i < count; i++)
+            {
+                Erase(index);
+            }
+            return;
+        }
+        std::vector<T> items;
+        items.reserve(Size() - count);
+        size_t at = 0;
+        ForEach([&](const T& item) {
+            if (at < index || at >= index + count)
+                items.push_back(item);
+            at++;
+        });
+        Build(items);
+    }
+
+    // Index of the first item labelled at least label, or Size()
+    size_t LowerBound(unsigned long long label) const
+    {
+        if (!mRoot)
+            return 0;
+        size_t index = 0;
+        const Node* node = mRoot.get();
+        while (!node->leaf)
+        {
+            size_t child = 0;
+            while (child + 1 < node->children.size() && node->children[child]->label < label)
+            {
+                index += node->children[child]->count;
+                child++;
+            }
+            node = node->children[child].get();
+        }
+        size_t item = 0;
+        while (item < node->items.size() && Label::Of(node->items[item]) < label)
+        {
+            item++;
+        }
+        return index + item;
+    }
+
+    // Mutable access to one item. The nodes on its path are copied
+    // first if a snapshot still shares them. The item's label must not
+    // change (use Set for that).
+    T& Edit(size_t index)
+    {
+        Node* node = Writable(mRoot);
+        while (!node->leaf)
+        {
+            size_t child = FindChild(*node, index);
+            node = Writable(node->children[child]);
+        }
+        return node->items[index];
+    }
+
+    void Set(size_t index, const T& value)
+    {
+        std::vector<Node*> path(1, Writable(mRoot));
+        while (!path.back()->leaf)
+        {
+            size_t child = FindChild(*path.back(), index);
+            path.push_back(Writable(path.back()->children[child]));
+        }
+        path.back()->items[index] = value;
+        for (size_t i = path.size(); i > 0; i--)
+        {
+            UpdateLabel(*path[i - 1]);
+        }
+    }
+
+    void Clear()
+    {
+        mRoot.reset();
+    }
+
+    // A read-only copy sharing all nodes with this sequence
+    PersistentSequence Snapshot()
+    {
+        PersistentSequence copy;
+        copy.mRoot = mRoot;
+        mEpoch = NextSequenceEpoch();
+        return copy;
+    }
+
+    // Calls fn(item) for every item, first to last
+    template <class Fn>
+    void ForEach(Fn fn) const
+    {
+        if (mRoot)
+            ForEachIn(*mRoot, fn);
+    }
+
+    // Calls fn(index, item) from last to first until fn returns true.
+    // Returns whether it stopped early.
+    template <class Fn>
+    bool ForEachReverse(Fn fn) const
+    {
+        return mRoot && ForEachReverseIn(*mRoot, Size(), fn);
+    }
+
+    // Disallow copies (use Snapshot)
+    PersistentSequence(const PersistentSequence&) = delete;
+    PersistentSequence& operator=(const PersistentSequence&) = delete;
+private:
+    struct Node
+    {
+        unsigned long epoch;
+        // Number of items in this subtree
+        size_t count;
+        // Label of the last item in this subtree
+        unsigned long long label;
+        bool leaf;
+        std::vector<T> items;
+        std::vector<std::shared_ptr<Node>> children;
+    };
+
+    // Most items or children a node holds before it splits
+    static const size_t kMaxEntries = 64;
+    // Neighbouring nodes are merged when one falls below this
+    static const size_t kMinEntries = kMaxEntries / 4;
+
+    // Bulk loads fill nodes this far, leaving room for inserts
+    static const size_t kBulkEntries = kMaxEntries * 3 / 4;
+    // Ranges under 1/kBulkRatio of the sequence go an item at a time
+    static const size_t kBulkRatio = 8;
+
+    std::shared_ptr<Node> NewNode(bool leaf) const
+    {
+        std::shared_ptr<Node> node = std::make_shared<Node>();
+        node->epoch = mEpoch;
+        node->count = 0;
+        node->label = 0;
+        node->leaf = leaf;
+        return node;
+    }
+
+    // Replaces the tree with one holding items. Nodes on each level
+    // split the entries evenly, so none is left underfull.
+    void Build(const std::vector<T>& items)
+    {
+        mRoot.reset();
+        if (items.empty())
+            return;
+        std::vector<std::shared_ptr<Node>> level;
+        size_t nodes = (items.size() + kBulkEntries - 1) / kBulkEntries;
+        level.reserve(nodes);
+        for (size_t i = 0; i < nodes; i++)
+        {
+            size_t first = items.size() * i / nodes;
+            size_t last = items.size() * (i + 1) / nodes;
+            std::shared_ptr<Node> node = NewNode(true);
+            node->items.assign(items.begin() + first, items.begin() + last);
+            node->count = last - first;
+            UpdateLabel(*node);
+            level.push_back(node);
+        }
+        while (level.size() > 1)
+        {
+            nodes = (level.size() + kBulkEntries - 1) / kBulkEntries;
+            std::vector<std::shared_ptr<Node>> parents;
+            parents.reserve(nodes);
+            for (size_t i = 0; i < nodes; i++)
+            {
+                size_t first = level.size() * i / nodes;
+                size_t last = level.size() * (i + 1) / nodes;
+                std::shared_ptr<Node> node = NewNode(false);
+                node->children.assign(level.begin() + first, level.begin() + last);
+                for (auto& child : node->children)
+                {
+                    node->count += child->count;
+                }
+                UpdateLabel(*node);
+                parents.push_back(node);
+            }
+            level.swap(parents);
+        }
+        mRoot = level.front();
+    }
+
+    // Makes slot safe to modify, copying the node if it's shared
+    Node* Writable(std::shared_ptr<Node>& slot) const
+    {
+        if (slot->epoch != mEpoch)
+        {
+            std::shared_ptr<Node> copy = std::make_shared<Node>(*slot);
+            copy->epoch = mEpoch;
+            slot = copy;
+        }
+        return slot.get();
+    }
+
+    // Finds the child holding index, and makes index relative to it
+    static size_t FindChild(const Node& node, size_t& index)
+    {
+        size_t child = 0;
+        while (child + 1 < node.children.size() && index >= node.children[child]->count)
+        {
+            index -= node.children[child]->count;
+            child++;
+        }
+        return child;
+    }
+
+    static size_t Entries(const Node& node)
+    {
+        return node.leaf ? node.items.size() : node.children.size();
+    }
+
+    static void UpdateLabel(Node& node)
+    {
+        if (node.leaf)
+            node.label = node.items.empty() ? 0 : Label::Of(node.items.back());
+        else
+            node.label = node.children.empty() ? 0 : node.children.back()->label;
+    }
+
+    // Returns the new right half if the node had to split
+    std::shared_ptr<Node> InsertInto(std::shared_ptr<Node>& slot, size_t index, const T& value)
+    {
+        Node* node = Writable(slot);
+        node->count++;
+
+        if (node->leaf)
+        {
+            node->items.insert(node->items.begin() + index, value);
+        }
+        else
+        {
+            // Appending goes to the end of the last child
+            size_t child = 0;
+            while (child + 1 < node->children.size() && index > node->children[child]->count)
+            {
+                index -= node->children[child]->count;
+                child++;
+            }
+            std::shared_ptr<Node> split = InsertInto(node->children[child], index, value);
+            if (split)
+            {
+                node->children.insert(node->children.begin() + child + 1, split);
+            }
+        }
+
+        if (Entries(*node) <= kMaxEntries)
+        {
+            UpdateLabel(*node);
+            return std::shared_ptr<Node>();
+        }
+
+        std::shared_ptr<Node> right = NewNode(node->leaf);
+        size_t half = Entries(*node) / 2;
+        if (node->leaf)
+        {
+            right->items.assign(node->items.begin() + half, node->items.end());
+            node->items.resize(half);
+            right->count = right->items.size();
+        }
+        else
+        {
+            right->children.assign(node->children.begin() + half, node->children.end());
+            node->children.resize(half);
+            for (auto& child : right->children)
+            {
+                right->count += child->count;
+            }
+        }
+        node->count -= right->count;
+        UpdateLabel(*node);
+        UpdateLabel(*right);
+        return right;
+    }
+
+    void EraseFrom(std::shared_ptr<Node>& slot, size_t index)
+    {
+        Node* node = Writable(slot);
+        node->count--;
+
+        if (node->leaf)
+        {
+            node->items.erase(node->items.begin() + index);
+            UpdateLabel(*node);
+            return;
+        }
+
+        size_t child = FindChild(*node, index);
+        EraseFrom(node->children[child], index);
+
+        if (node->children[child]->count == 0)
+        {
+            node->children.erase(node->children.begin() + child);
+            UpdateLabel(*node);
+            return;
+        }
+        UpdateLabel(*node);
+
+        // Merge an underfull child into a neighbour when they fit
+        if (Entries(*node->children[child]) >= kMinEntries || node->children.size() < 2)
+            return;
+        size_t left = (child > 0) ? child - 1 : child;
+        const Node& a = *node->children[left];
+        const Node& b = *node->children[left + 1];
+        if (a.leaf != b.leaf || Entries(a) + Entries(b) > kMaxEntries)
+            return;
+
+        Node* merged = Writable(node->children[left]);
+        const Node& next = *node->children[left + 1];
+        if (merged->leaf)
+            merged->items.insert(merged->items.end(), next.items.begin(), next.items.end());
+        else
+            merged->children.insert(merged->children.end(), next.children.begin(), next.children.end());
+        merged->count += next.count;
+        merged->label = next.label;
+        node->children.erase(node->children.begin() + left + 1);
+    }
+
+    template <class Fn>
+    static void ForEachIn(const Node& node, Fn& fn)
+    {
+        if (node.leaf)
+        {
+            for (auto& item : node.items)
+            {
+                fn(item);
+            }
+            return;
+        }
+        for (auto& child : node.children)
+        {
+            ForEachIn(*child, fn);
+        }
+    }
+
+    // end is the index just past this subtree
+    template <class Fn>
+    static bool ForEachReverseIn(const Node& node, size_t end, Fn& fn)
+    {
+        if (node.leaf)
+        {
+            for (size_t i = node.items.size(); i > 0; i--)
+            {
+                if (fn(end - node.items.size() + i - 1, node.items[i - 1]))
+                    return true;
+            }
+            return false;
+        }
+        for (size_t i = node.children.size(); i > 0; i--)
+        {
+            const Node& child = *node.children[i - 1];
+            if (ForEachReverseIn(child, end, fn))
+                return true;
+            end -= child.count;
+        }
+        return false;
+    }
+
+    std::shared_ptr<Node> mRoot;
+    unsigned long mEpoch;
+};
@@ -0,0 +1,628 @@
+#include "Renderer.h"
+#include "Shape.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <wx/graphics.h>
+#include <wx/dcgraph.h>
+
+namespace
+{
+    // Pixels in a dot-sized shape (see DrawLayer)
+    const double kDotPixels = 1.0;
+
+    // A shape drawn as one pixel
+    struct Dot
+    {
+        wxPoint pixel;
+        wxUint32 color;
+    };
+
+    // Copies the imported image into the frame at the document's top
+    // left, blending over the white background if it has alpha. Scaled
+    // views, and images covering more than their size (imageScale),
+    // sample the nearest image pixel.
+    void BlitImage(const wxImage& image, double imageScale, const ViewTransform& view, wxImage& frame)
+    {
+        int frameWidth = frame.GetWidth();
+        const unsigned char* alpha = image.HasAlpha() ? image.GetAlpha() : nullptr;
+        double scale = view.scale * imageScale;
+
+        // Image column for each frame column, or -1 outside the image
+        std::vector<int> columns(frameWidth);
+        bool identity = scale == 1.0;
+        for (int x = 0; x < frameWidth; x++)
+        {
+            int column = static_cast<int>(std::floor((x - view.origin.x) / scale));
+            columns[x] = (column >= 0 && column < image.GetWidth()) ? column : -1;
+        }
+
+        for (int y = 0; y < frame.GetHeight(); y++)
+        {
+            int row = static_cast<int>(std::floor((y - view.origin.y) / scale));
+            if (row < 0 || row >= image.GetHeight())
+                continue;
+
+            const unsigned char* src = image.GetData() + static_cast<size_t>(row) * image.GetWidth() * 3;
+            const unsigned char* a = alpha ? alpha + static_cast<size_t>(row) * image.GetWidth() : nullptr;
+            unsigned char* dst = frame.GetData() + static_cast<size_t>(y) * frameWidth * 3;
+            if (identity && !a)
+            {
+                // Straight copy of the overlapping run
+                int first = std::max(0, view.origin.x);
+                int last = std::min(frameWidth, view.origin.x + image.GetWidth());
+                if (first < last)
+                {
+                    std::memcpy(dst + first * 3, src + (first - view.origin.x) * 3,
+                        static_cast<size_t>(last - first) * 3);
+                }
+                continue;
+            }
+
+            for (int x = 0; x < frameWidth; x++)
+            {
+                int column = columns[x];
+                if (column < 0)
+                    continue;
+                int weight = a ? a[column] : 255;
+                for (int c = 0; c < 3; c++)
+                {
+                    dst[x * 3 + c] = static_cast<unsigned char>(
+                        (src[column * 3 + c] * weight + 255 * (255 - weight) + 127) / 255);
+                }
+            }
+        }
+    }
+
+    // Sets each dot's pixel, making it opaque if the image has alpha
+    void PlotDots(wxImage& image, const std::vector<Dot>& dots)
+    {
+        int width = image.GetWidth();
+        int height = image.GetHeight();
+        unsigned char* rgb = image.GetData();
+        unsigned char* alpha = image.HasAlpha() ? image.GetAlpha() : nullptr;
+        for (auto& dot : dots)
+        {
+            if (dot.pixel.x < 0 || dot.pixel.y < 0 || dot.pixel.x >= width || dot.pixel.y >= height)
+                continue;
+            size_t i = static_cast<size_t>(dot.pixel.y) * width + dot.pixel.x;
+            rgb[i * 3] = static_cast<unsigned char>(dot.color >> 16);
+            rgb[i * 3 + 1] = static_cast<unsigned char>(dot.color >> 8);
+            rgb[i * 3 + 2] = static_cast<unsigned char>(dot.color);
+            if (alpha)
+                alpha[i] = 255;
+        }
+    }
+
+    // Alpha-blends a layer raster onto the frame with its top left at
+    // (left, top), clipped to the frame
+    void BlendOver(wxImage& frame, const wxImage& layer, int left, int top)
+    {
+        int x0 = std::max(0, left);
+        int y0 = std::max(0, top);
+        int x1 = std::min(frame.GetWidth(), left + layer.GetWidth());
+        int y1 = std::min(frame.GetHeight(), top + layer.GetHeight());
+        for (int y = y0; y < y1; y++)
+        {
+            size_t srcRow = static_cast<size_t>(y - top) * layer.GetWidth() - left;
+            size_t dstRow = static_cast<size_t>(y) * frame.GetWidth();
+            const unsigned char* src = layer.GetData();
+            const unsigned char* alpha = layer.GetAlpha();
+            unsigned char* dst = frame.GetData();
+            for (int x = x0; x < x1; x++)
+            {
+                size_t s = srcRow + x;
+                size_t d = dstRow + x;
+                // Most of a layer is usually either empty or solid
+                int a = alpha[s];
+                if (a == 0)
+                    continue;
+                if (a == 255)
+                {
+                    dst[d * 3] = src[s * 3];
+                    dst[d * 3 + 1] = src[s * 3 + 1];
+                    dst[d * 3 + 2] = src[s * 3 + 2];
+                    continue;
+                }
+                for (int c = 0; c < 3; c++)
+                {
+                    dst[d * 3 + c] = static_cast<unsigned char>((src[s * 3 + c] * a + dst[d * 3 + c] * (255 - a) + 127) / 255);
+                }
+            }
+        }
+    }
+
+    // Rounds towards negative infinity, unlike /
+    int FloorDiv(int value, int divisor)
+    {
+        return (value >= 0) ? value / divisor : -((-value + divisor - 1) / divisor);
+    }
+
+    // Draws the shapes that are in view, except those smaller than a
+    // pixel, which are added to dots for PlotDots instead
+    void DrawLayer(const LayerSnapshot& layer, wxDC& dc, const ViewTransform& view, const wxSize& size,
+        std::vector<Dot>& dots)
+    {
+        wxRect visible = view.VisibleRect(size);
+        double scale = view.scale;
+        layer.shapes.ForEach([&](const std::shared_ptr<Shape>& shape)
+        {
+            if (!ShapeTouches(*shape, visible))
+                return;
+
+            wxPoint topLeft, botRight;
+            shape->GetBounds(topLeft, botRight);
+            int pad = shape->GetWidth();
+            if ((botRight.x - topLeft.x + pad) * scale < kDotPixels &&
+                (botRight.y - topLeft.y + pad) * scale < kDotPixels)
+            {
+                Dot dot;
+                dot.pixel = view.ToPixel(wxPoint((topLeft.x + botRight.x) / 2, (topLeft.y + botRight.y) / 2));
+                dot.color = shape->GetDotColor();
+                dots.push_back(dot);
+                return;
+            }
+            if (SpriteCache::Get().Stamp(*shape, dc, scale))
+                return;
+            shape->DrawVisible(dc, scale, visible);
+        });
+    }
+}
+
+wxPoint ViewTransform::ToPixel(const wxPoint& point) const
+{
+    return wxPoint(static_cast<int>(std::floor(point.x * scale)) + origin.x,
+        static_cast<int>(std::floor(point.y * scale)) + origin.y);
+}
+
+wxPoint ViewTransform::ToDocument(const wxPoint& pixel) const
+{
+    return wxPoint(static_cast<int>(std::floor((pixel.x - origin.x) / scale)),
+        static_cast<int>(std::floor((pixel.y - origin.y) / scale)));
+}
+
+wxRect ViewTransform::VisibleRect(const wxSize& size) const
+{
+    wxPoint topLeft = ToDocument(wxPoint(0, 0));
+    wxPoint botRight = ToDocument(wxPoint(size.GetWidth() - 1, size.GetHeight() - 1));
+    return wxRect(topLeft, botRight);
+}
+
+bool ShapeTouches(const Shape& shape, const wxRect& area)
+{
+    wxPoint topLeft, botRight;
+    shape.GetBounds(topLeft, botRight);
+    // The pen can reach past the bounds by up to its width
+    int pad = shape.GetWidth();
+    return !(botRight.x + pad < area.GetLeft() || topLeft.x - pad > area.GetRight() ||
+        botRight.y + pad < area.GetTop() || topLeft.y - pad > area.GetBottom());
+}
+
+wxImage RasterizeLayer(const wxSize& size, double scale, const wxPoint& origin, double opacity,
+    const std::function<void(wxDC&)>& draw, const std::function<void(wxImage&)>& finish)
+{
+    int width = std::max(1, size.GetWidth());
+    int height = std::max(1, size.GetHeight());
+
+    // Start fully transparent; a graphics context on a wxImage keeps
+    // the alpha channel, unlike a plain memory DC
+    wxImage image(width, height, true);
+    image.InitAlpha();
+    std::memset(image.GetAlpha(), 0, static_cast<size_t>(width) * height);
+    {
+        // No antialiasing, so rasters match shapes drawn straight to a DC
+        wxGraphicsContext* context = wxGraphicsContext::Create(image);
+        context->SetAntialiasMode(wxANTIALIAS_NONE);
+        wxGCDC dc(context);
+        dc.SetUserScale(scale, scale);
+        dc.SetDeviceOrigin(origin.x, origin.y);
+        draw(dc);
+    }
+    if (finish)
+        finish(image);
+
+    if (opacity < 1.0)
+    {
+        unsigned char* alpha = image.GetAlpha();
+        int factor = static_cast<int>(opacity * 256.0);
+        for (size_t i = 0, count = static_cast<size_t>(width) * height; i < count; i++)
+        {
+            alpha[i] = static_cast<unsigned char>((alpha[i] * factor) >> 8);
+        }
+    }
+    return image;
+}
+
+SpriteCache& SpriteCache::Get()
+{
+    static SpriteCache cache;
+    return cache;
+}
+
+SpriteCache::SpriteCache(size_t budget)
+    :mBytes(0)
+    ,mBudget(budget)
+{
+}
+
+bool SpriteCache::Stamp(const Shape& shape, wxDC& dc, double scale)
+{
+    if (!shape.IsExpensive())
+        return false;
+    
+    // Same margin for the pen as DrawLayer's culling
+    wxPoint topLeft, botRight;
+    shape.GetBounds(topLeft, botRight);
+    int pad = shape.GetWidth();
+    wxPoint corner(topLeft.x - pad, topLeft.y - pad);
+    wxSize size(static_cast<int>(std::ceil((botRight.x - topLeft.x + 2 * pad + 1) * scale)),
+        static_cast<int>(std::ceil((botRight.y - topLeft.y + 2 * pad + 1) * scale)));
+    if (size.GetWidth() > kMaxSide || size.GetHeight() > kMaxSide)
+        return false;
+    
+    Key key = { shape.GetContentHash(), scale };
+    bool seen;
+    std::shared_ptr<const wxImage> raster = Find(key, seen);
+    // The raster's first pixel, for a DC with no origin
+    wxPoint pixel(static_cast<int>(std::floor(corner.x * scale)),
+        static_cast<int>(std::floor(corner.y * scale)));
+    if (!raster)
+    {
+        // A shape drawn once isn't worth a raster
+        if (!seen)
+            return false;
+        // Made outside the lock; if two threads race, both are right
+        raster = std::make_shared<wxImage>(RasterizeLayer(size, scale, -pixel, 1.0,
+            [&shape, scale](wxDC& rasterDC) { shape.DrawAtScale(rasterDC, scale); }));
+        Insert(key, raster);
+    }
+    
+    // The raster is already at the DC's scale, so it's copied as is
+    wxGraphicsContext* context = dc.GetGraphicsContext();
+    if (context)
+    {
+        wxGraphicsBitmap bitmap = wxGraphicsRenderer::GetDefaultRenderer()->CreateBitmapFromImage(*raster);
+        context->SetInterpolationQuality(wxINTERPOLATION_NONE);
+        context->DrawBitmap(bitmap, pixel.x / scale, pixel.y / scale,
+            raster->GetWidth() / scale, raster->GetHeight() / scale);
+        return true;
+    }
+    
+    // Plain DCs (exports) take it in device pixels, as
+    // Layer::DrawComposited does
+    double scaleX, scaleY;
+    dc.GetUserScale(&scaleX, &scaleY);
+    wxPoint origin = dc.GetDeviceOrigin();
+    dc.SetUserScale(1.0, 1.0);
+    dc.SetDeviceOrigin(0, 0);
+    dc.DrawBitmap(wxBitmap(*raster), pixel.x + origin.x, pixel.y + origin.y, true);
+    dc.SetUserScale(scaleX, scaleY);
+    dc.SetDeviceOrigin(origin.x, origin.y);
+    return true;
+}
+
+std::shared_ptr<const wxImage> SpriteCache::Find(const Key& key, bool& seen)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto iter = mEntries.find(key);
+    if (iter != mEntries.end())
+    {
+        mLru.splice(mLru.begin(), mLru, iter->second.use);
+        seen = true;
+        return iter->second.raster;
+    }
+    
+    if (mSeen.size() >= kMaxSeen)
+        mSeen.clear();
+    seen = !mSeen.insert(key).second;
+    return std::shared_ptr<const wxImage>();
+}
+
+void SpriteCache::Insert(const Key& key, const std::shared_ptr<const wxImage>& raster)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mEntries.count(key) != 0)
+        return;
+    
+    mSeen.erase(key);
+    mLru.push_front(key);
+    Entry entry = { raster, mLru.begin() };
+    mEntries.insert(std::make_pair(key, entry));
+    mBytes += static_cast<size_t>(raster->GetWidth()) * raster->GetHeight() * 4;
+    Evict(mBudget);
+}
+
+void SpriteCache::SetBudget(size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mBudget = bytes;
+    Evict(mBudget);
+}
+
+size_t SpriteCache::GetBudget() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mBudget;
+}
+
+size_t SpriteCache::GetBytes() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mBytes;
+}
+
+void SpriteCache::Clear()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    Evict(0);
+    mSeen.clear();
+}
+
+void SpriteCache::Evict(size_t budget)
+{
+    while (mBytes > budget && !mLru.empty())
+    {
+        auto iter = mEntries.find(mLru.back());
+        const wxImage& raster = *iter->second.raster;
+        mBytes -= static_cast<size_t>(raster.GetWidth()) * raster.GetHeight() * 4;
+        mEntries.erase(iter);
+        mLru.pop_back();
+    }
+}
+
+FrameRenderer::FrameRenderer(size_t tileBudget)
+    :mTileBytes(0)
+    ,mTileBudget(tileBudget)
+{
+}
+
+void FrameRenderer::SetTileBudget(size_t bytes)
+{
+    mTileBudget = bytes;
+    Evict(mTileBudget);
+}
+
+void FrameRenderer::Render(const DocumentSnapshot& snapshot, const wxSize& size, const ViewTransform& view,
+    wxImage& frame)
+{
+    int width = std::max(1, size.GetWidth());
+    int height = std::max(1, size.GetHeight());
+    if (!frame.IsOk() || frame.GetWidth() != width || frame.GetHeight() != height)
+    {
+        frame.Create(width, height, false);
+    }
+    std::memset(frame.GetData(), 255, static_cast<size_t>(width) * height * 3);
+
+    if (snapshot.image)
+    {
+        BlitImage(*snapshot.image, snapshot.imageScale, view, frame);
+    }
+
+    for (auto& layer : snapshot.layers)
+    {
+        if (!layer->live)
+        {
+            DrawTiles(*layer, view, frame);
+            continue;
+        }
+
+        // The layer being edited changes every frame, so it's drawn
+        // straight to the frame instead
+        std::vector<Dot> dots;
+        auto draw = [&](wxDC& dc) { DrawLayer(*layer, dc, view, frame.GetSize(), dots); };
+        auto finish = [&dots](wxImage& image) { PlotDots(image, dots); };
+        if (layer->opacity >= 1.0)
+        {
+            {
+                wxGraphicsContext* context = wxGraphicsContext::Create(frame);
+                context->SetAntialiasMode(wxANTIALIAS_NONE);
+                wxGCDC dc(context);
+                dc.SetUserScale(view.scale, view.scale);
+                dc.SetDeviceOrigin(view.origin.x, view.origin.y);
+                draw(dc);
+            }
+            finish(frame);
+        }
+        else
+        {
+            BlendOver(frame, RasterizeLayer(frame.GetSize(), view.scale, view.origin, layer->opacity,
+                draw, finish), 0, 0);
+        }
+    }
+    Evict(mTileBudget);
+    Account(snapshot.arena);
+}
+
+void FrameRenderer::DrawTiles(const LayerSnapshot& layer, const ViewTransform& view, wxImage& frame)
+{
+    // Tiles overlapping the frame; tile (x, y) starts at document point
+    // (x, y) * kTileSize / scale
+    int left = FloorDiv(-view.origin.x, kTileSize);
+    int top = FloorDiv(-view.origin.y, kTileSize);
+    int right = FloorDiv(frame.GetWidth() - 1 - view.origin.x, kTileSize);
+    int bottom = FloorDiv(frame.GetHeight() - 1 - view.origin.y, kTileSize);
+
+    // Find the tiles that need drawing and the box around them
+    std::vector<Tile*> visible;
+    std::vector<Tile*> stale;
+    wxRect box;
+    for (int y = top; y <= bottom; y++)
+    {
+        for (int x = left; x <= right; x++)
+        {
+            TileKey key = { layer.id, view.scale, x, y };
+            auto iter = mTiles.find(key);
+            if (iter == mTiles.end())
+            {
+                Tile tile;
+                tile.version = 0;
+                mLru.push_front(key);
+                tile.use = mLru.begin();
+                iter = mTiles.insert(std::make_pair(key, tile)).first;
+            }
+            else
+            {
+                mLru.splice(mLru.begin(), mLru, iter->second.use);
+            }
+
+            Tile& tile = iter->second;
+            wxPoint corner(static_cast<int>(std::floor(x * kTileSize / view.scale)),
+                static_cast<int>(std::floor(y * kTileSize / view.scale)));
+            wxPoint end(static_cast<int>(std::ceil((x + 1) * kTileSize / view.scale)),
+                static_cast<int>(std::ceil((y + 1) * kTileSize / view.scale)));
+            if (!tile.raster.IsOk() || !Refresh(tile, layer, wxRect(corner, end)))
+            {
+                stale.push_back(&tile);
+                wxRect cell(x, y, 1, 1);
+                box = box.IsEmpty() ? cell : box.Union(cell);
+            }
+            visible.push_back(&tile);
+        }
+    }
+
+    if (!stale.empty())
+    {
+        // One pass over the layer for all of them
+        ViewTransform region;
+        region.scale = view.scale;
+        region.origin = wxPoint(-box.x * kTileSize, -box.y * kTileSize);
+        wxSize regionSize(box.width * kTileSize, box.height * kTileSize);
+
+        std::vector<Dot> dots;
+        wxImage raster = RasterizeLayer(regionSize, region.scale, region.origin, layer.opacity,
+            [&](wxDC& dc) { DrawLayer(layer, dc, region, regionSize, dots); },
+            [&dots](wxImage& image) { PlotDots(image, dots); });
+
+        for (auto tile : stale)
+        {
+            const TileKey& key = *tile->use;
+            if (tile->raster.IsOk())
+                mTileBytes -= static_cast<size_t>(kTileSize) * kTileSize * 4;
+            tile->raster = raster.GetSubImage(wxRect((key.x - box.x) * kTileSize, (key.y - box.y) * kTileSize,
+                kTileSize, kTileSize));
+            tile->version = layer.version;
+            mTileBytes += static_cast<size_t>(kTileSize) * kTileSize * 4;
+        }
+    }
+
+    for (auto tile : visible)
+    {
+        const TileKey& key = *tile->use;
+        BlendOver(frame, tile->raster, key.x * kTileSize + view.origin.x, key.y * kTileSize + view.origin.y);
+    }
+}
+
+bool FrameRenderer::Refresh(Tile& tile, const LayerSnapshot& layer, const wxRect& area) const
+{
+    if (tile.version == layer.version)
+        return true;
+    if (tile.version < layer.damageSince)
+        return false;
+
+    for (const LayerDamage* damage = layer.damage.get(); damage && damage->version > tile.version;
+        damage = damage->previous.get())
+    {
+        if (damage->area.Intersects(area))
+            return false;
+    }
+    tile.version = layer.version;
+    return true;
+}
+
+void FrameRenderer::Account(const std::shared_ptr<DocumentArena>& arena)
+{
+    mCharge.Set(arena, MC_Caches, mTileBytes);
+    if (!arena || !arena->IsOverBudget(MC_Caches))
+        return;
+    
+    size_t excess = arena->GetBytes(MC_Caches) - arena->GetBudget(MC_Caches);
+    Evict(mTileBytes - std::min(excess, mTileBytes));
+    mCharge.Set(mTileBytes);
+}
+
+void FrameRenderer::Evict(size_t budget)
+{
+    while (mTileBytes > budget && !mLru.empty())
+    {
+        auto iter = mTiles.find(mLru.back());
+        if (iter->second.raster.IsOk())
+            mTileBytes -= static_cast<size_t>(kTileSize) * kTileSize * 4;
+        mTiles.erase(iter);
+        mLru.pop_back();
+    }
+}
+
+RenderThread::RenderThread(wxEvtHandler* target)
+    :mTarget(target)
+    ,mStopping(false)
+    ,mFresh(false)
+    ,mThread(&RenderThread::Run, this)
+{
+}
+
+RenderThread::~RenderThread()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStopping = true;
+    }
+    mCondition.notify_one();
+    mThread.join();
+}
+
+void RenderThread::Request(std::shared_ptr<const DocumentSnapshot> snapshot, const wxSize& size,
+    const ViewTransform& view)
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mPending = snapshot;
+        mPendingSize = size;
+        mPendingView = view;
+    }
+    mCondition.notify_one();
+}
+
+bool RenderThread::SwapFrame(wxImage& front)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (!mFresh)
+        return false;
+
+    wxImage old = front;
+    front = mReady;
+    mReady = old;
+    mFresh = false;
+    return true;
+}
+
+void RenderThread::Run()
+{
+    for (;;)
+    {
+        std::shared_ptr<const DocumentSnapshot> snapshot;
+        wxSize size;
+        ViewTransform view;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mCondition.wait(lock, [this] { return mStopping || mPending; });
+            if (mStopping)
+                return;
+            snapshot.swap(mPending);
+            size = mPendingSize;
+            view = mPendingView;
+        }
+
+        mRenderer.Render(*snapshot, size, view, mBack);
+        // Release the snapshot's shapes here rather than under the lock
+        snapshot.reset();
+
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            wxImage done = mBack;
+            mBack = mReady;
+            mReady = done;
+            mFresh = true;
+        }
+        wxQueueEvent(mTarget, new wxThreadEvent());
+    }
+}
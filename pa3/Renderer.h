@@ -0,0 +1,304 @@
+#pragma once
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+#include <wx/dc.h>
+#include <wx/event.h>
+#include <wx/image.h>
+#include <wx/graphics.h>
+#include "Shape.h"
+
+// A change to a layer: the document area it touched and the version it
+// produced. Entries are linked newest first and never modified, so
+// snapshots share them.
+struct LayerDamage
+{
+    unsigned long version;
+    wxRect area;
+    // Number of entries in the chain, this one included
+    size_t depth;
+    std::shared_ptr<const LayerDamage> previous;
+};
+
+// Read-only view of one layer. The sequence shares its nodes and shapes
+// with the model, which copies anything shared before changing it, and
+// shapes hold no wx objects, so it can be drawn and released on another
+// thread.
+struct LayerSnapshot
+{
+    // Identifies the layer across snapshots
+    unsigned long id;
+    // Bumped whenever the layer's contents change
+    unsigned long version;
+    // The layer being edited: its version changes on every mouse move,
+    // so it's redrawn every frame instead of cached
+    bool live;
+    double opacity;
+    ShapeSequence shapes;
+    // Every change after damageSince is in damage, so anything drawn
+    // at a version from damageSince on only needs redrawing where a
+    // newer entry overlaps it
+    std::shared_ptr<const LayerDamage> damage;
+    unsigned long damageSince;
+};
+
+// Maps document coordinates to frame pixels, the same way wxDC user
+// scale and device origin do: pixel = point * scale + origin
+struct ViewTransform
+{
+    ViewTransform()
+        :scale(1.0)
+    {
+    }
+    
+    wxPoint ToPixel(const wxPoint& point) const;
+    wxPoint ToDocument(const wxPoint& pixel) const;
+    // Part of the document a frame of this size shows
+    wxRect VisibleRect(const wxSize& size) const;
+    
+    bool operator==(const ViewTransform& other) const
+    {
+        return scale == other.scale && origin == other.origin;
+    }
+    bool operator!=(const ViewTransform& other) const
+    {
+        return !(*this == other);
+    }
+    
+    double scale;
+    wxPoint origin;
+};
+
+// Everything needed to draw the document, as of one moment
+struct DocumentSnapshot
+{
+    // Private copy of the imported image (may be null), and document
+    // pixels per image pixel
+    std::shared_ptr<const wxImage> image;
+    double imageScale;
+    // Visible layers, bottom to top
+    std::vector<std::shared_ptr<const LayerSnapshot>> layers;
+    // Document the renderer's caches are counted against
+    std::shared_ptr<DocumentArena> arena;
+};
+
+// Whether shape can paint anything inside area, its pen included
+bool ShapeTouches(const Shape& shape, const wxRect& area);
+
+// Renders shapes into a transparent image of the given size, with
+// opacity applied to the alpha channel. draw is called with a DC that
+// already has the scale and origin set; finish, if given, is then
+// called on the image before opacity is applied.
+wxImage RasterizeLayer(const wxSize& size, double scale, const wxPoint& origin, double opacity,
+    const std::function<void(wxDC&)>& draw,
+    const std::function<void(wxImage&)>& finish = std::function<void(wxImage&)>());
+
+// Rasters of shapes that are slow to draw (see Shape::IsExpensive),
+// shared by everything that draws in the process: the screen's tiles
+// and live layer, and exports. A raster is found by the shape's content
+// hash and the scale, so copies of a shape, the same shape after a
+// move, and the same document exported again all reuse it. A shape
+// gets one the second time its hash is drawn at a scale, so a stroke
+// that changes every frame never does. Least recently used rasters are
+// dropped once they take more than the budget.
+//
+// Rasters are kept as images that are never copied, only read, so any
+// thread can stamp them.
+class SpriteCache
+{
+public:
+    // Default bytes of rasters kept
+    static const size_t kDefaultBudget = 64 * 1024 * 1024;
+    // Longest side, in pixels, worth keeping a raster of
+    static const int kMaxSide = 1024;
+    // Hashes remembered for second sightings
+    static const size_t kMaxSeen = 4096;
+    
+    // The one shared by the whole process
+    static SpriteCache& Get();
+    
+    explicit SpriteCache(size_t budget = kDefaultBudget);
+    
+    // Draws the shape from its raster if it has one, or makes one if
+    // this is the second time. Returns false if the shape should be
+    // drawn as usual. scale is the DC's user scale.
+    bool Stamp(const Shape& shape, wxDC& dc, double scale);
+    
+    void SetBudget(size_t bytes);
+    size_t GetBudget() const;
+    size_t GetBytes() const;
+    void Clear();
+    
+    // Disallow copy/assignment
+    SpriteCache(const SpriteCache&) = delete;
+    SpriteCache& operator=(const SpriteCache&) = delete;
+private:
+    struct Key
+    {
+        unsigned long long hash;
+        double scale;
+        
+        bool operator<(const Key& other) const
+        {
+            if (hash != other.hash)
+                return hash < other.hash;
+            return scale < other.scale;
+        }
+    };
+    struct Entry
+    {
+        std::shared_ptr<const wxImage> raster;
+        // Position in mLru
+        std::list<Key>::iterator use;
+    };
+    
+    // The raster for key, if any, marked as just used; or null, noting
+    // that key was seen if it wasn't already (seen says which)
+    std::shared_ptr<const wxImage> Find(const Key& key, bool& seen);
+    void Insert(const Key& key, const std::shared_ptr<const wxImage>& raster);
+    // Drops least recently used rasters until they take at most budget;
+    // the lock must be held
+    void Evict(size_t budget);
+    
+    mutable std::mutex mMutex;
+    std::map<Key, Entry> mEntries;
+    // Most recently used first
+    std::list<Key> mLru;
+    std::set<Key> mSeen;
+    size_t mBytes;
+    size_t mBudget;
+};
+
+// Draws snapshots into images. Used directly for one-off renders and by
+// RenderThread for the screen.
+//
+// Layers that aren't live are drawn into square tiles on a grid fixed
+// in document space at each zoom scale, so panning reuses them. A tile
+// is kept until a change newer than it touches its area (see
+// LayerDamage); stale and missing tiles are redrawn together in one
+// pass over the layer. Least recently used tiles are dropped once they
+// take more than the memory budget.
+//
+// Level of detail: shapes outside the view are skipped, shapes smaller
+// than a pixel are plotted as a single pixel without going through the
+// DC, and pencil strokes draw a decimated copy of their points (see
+// Shape::DrawAtScale). Expensive shapes are stamped from shared
+// rasters (see SpriteCache).
+//
+// Tiles are charged to the snapshot's document as caches, and dropped,
+// least recently used first, while the document is over its cache
+// budget. Sprites are shared between documents, so SpriteCache keeps
+// to a budget of its own.
+class FrameRenderer
+{
+public:
+    // Pixels per side of a tile
+    static const int kTileSize = 256;
+    // Default bytes of tiles kept
+    static const size_t kDefaultTileBudget = 256 * 1024 * 1024;
+    
+    explicit FrameRenderer(size_t tileBudget = kDefaultTileBudget);
+    
+    // Renders into frame, reusing its storage when the size matches
+    void Render(const DocumentSnapshot& snapshot, const wxSize& size, const ViewTransform& view,
+        wxImage& frame);
+    
+    void SetTileBudget(size_t bytes);
+    size_t GetTileBytes() const
+    {
+        return mTileBytes;
+    }
+private:
+    struct TileKey
+    {
+        unsigned long layer;
+        double scale;
+        int x;
+        int y;
+        
+        bool operator<(const TileKey& other) const
+        {
+            if (layer != other.layer)
+                return layer < other.layer;
+            if (scale != other.scale)
+                return scale < other.scale;
+            if (y != other.y)
+                return y < other.y;
+            return x < other.x;
+        }
+    };
+    struct Tile
+    {
+        unsigned long version;
+        wxImage raster;
+        // Position in mLru
+        std::list<TileKey>::iterator use;
+    };
+    
+    // Blends one layer onto the frame from its tiles, redrawing any
+    // that are missing or stale
+    void DrawTiles(const LayerSnapshot& layer, const ViewTransform& view, wxImage& frame);
+    // Whether the tile still matches the layer; if so it's brought up
+    // to the layer's version
+    bool Refresh(Tile& tile, const LayerSnapshot& layer, const wxRect& area) const;
+    // Drops least recently used tiles until they take at most budget
+    void Evict(size_t budget);
+    // Charges the caches to the document, trimming them to its budget
+    void Account(const std::shared_ptr<DocumentArena>& arena);
+    
+    std::map<TileKey, Tile> mTiles;
+    // Most recently used first
+    std::list<TileKey> mLru;
+    size_t mTileBytes;
+    size_t mTileBudget;
+    MemoryCharge mCharge;
+};
+
+// Renders frames on a dedicated thread. The UI thread hands it the
+// latest snapshot, and gets a wxThreadEvent on the target handler
+// whenever a new frame is ready. Requests that arrive while a frame is
+// rendering replace each other, so only the newest is drawn.
+class RenderThread
+{
+public:
+    explicit RenderThread(wxEvtHandler* target);
+    ~RenderThread();
+
+    // Queue a frame; never blocks on rendering
+    void Request(std::shared_ptr<const DocumentSnapshot> snapshot, const wxSize& size,
+        const ViewTransform& view);
+
+    // Swaps the newest finished frame into front, handing the old front
+    // back for reuse. Returns false if there's nothing new.
+    bool SwapFrame(wxImage& front);
+
+    // Disallow copy/assignment
+    RenderThread(const RenderThread&) = delete;
+    RenderThread& operator=(const RenderThread&) = delete;
+private:
+    void Run();
+
+    wxEvtHandler* mTarget;
+    FrameRenderer mRenderer;
+
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    std::shared_ptr<const DocumentSnapshot> mPending;
+    wxSize mPendingSize;
+    ViewTransform mPendingView;
+    bool mStopping;
+
+    // Triple buffer: the thread draws into mBack and swaps it with
+    // mReady; the UI swaps mReady with its own front buffer
+    wxImage mBack;
+    wxImage mReady;
+    bool mFresh;
+
+    std::thread mThread;
+};
@@ -1,15 +1,143 @@
 #include "Shape.h"
-#include <iostream>
+#include "SvgWriter.h"
+#include "OpStream.h"
+#include "Lasso.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <map>
+#include <typeinfo>
+#include <utility>
 
-Shape::Shape(const wxPoint& start)
+namespace
+{
+    std::atomic<ShapeId> sNextShapeId(1);
+    
+    // Gap between a shape and its selection box, and the size of the
+    // box's handles, in screen pixels
+    const int kSelectionMargin = 5;
+    const int kHandleSize = 7;
+    // How far above the box the rotate handle sits
+    const int kRotateReach = 20;
+    // Sides of the polygon standing in for a transformed ellipse
+    const int kEllipseSegments = 64;
+    // Shapes past these are worth a raster (see Shape::IsExpensive):
+    // pen width, pencil points, fill rectangles and group children
+    const int kThickPen = 12;
+    const size_t kManyPoints = 512;
+    const size_t kManyRects = 256;
+    const size_t kManyChildren = 16;
+    const double kPi = 3.14159265358979323846;
+    // Stands in for "the whole document" when drawing without culling
+    const int kEverywhere = 1 << 29;
+    // What EncodeChanges says changed, as bits
+    const unsigned char kChangedStyle = 1;
+    const unsigned char kChangedTransform = 2;
+    const unsigned char kChangedGeometry = 4;
+    // How a pencil stroke's change is sent
+    const unsigned char kStrokeReplaced = 0;
+    const unsigned char kStrokeGrown = 1;
+    // Largest transform a peer may send: scale and shear components,
+    // and offsets. Far past anything the handles make, yet small enough
+    // that Affine::Apply stays in int range for any point on the canvas.
+    const double kMaxTransformScale = 1024.0;
+    const double kMaxTransformOffset = kEverywhere;
+    
+    // Area a shape can paint on, pen included
+    wxRect PaintArea(const Shape& shape)
+    {
+        wxPoint topLeft, botRight;
+        shape.GetBounds(topLeft, botRight);
+        return wxRect(topLeft, botRight).Inflate(shape.GetWidth() / 2 + 1);
+    }
+    
+    void WriteStyle(OpWriter& out, const ShapeStyle& style)
+    {
+        out.PutVarint(style.penColor);
+        out.PutSigned(style.penWidth);
+        out.PutVarint(style.brushColor);
+    }
+    
+    // Fails in for a pen width the UI couldn't have set
+    ShapeStyle ReadStyle(OpReader& in)
+    {
+        ShapeStyle style;
+        style.penColor = static_cast<wxUint32>(in.GetVarint());
+        long long width = in.GetSigned();
+        style.brushColor = static_cast<wxUint32>(in.GetVarint());
+        if (width < Shape::kMinPenWidth || width > Shape::kMaxPenWidth)
+        {
+            in.Fail();
+            width = Shape::kMinPenWidth;
+        }
+        style.penWidth = static_cast<int>(width);
+        return style;
+    }
+    
+    bool SameStyle(const ShapeStyle& a, const ShapeStyle& b)
+    {
+        return a.penColor == b.penColor && a.penWidth == b.penWidth && a.brushColor == b.brushColor;
+    }
+    
+    void WriteTransform(OpWriter& out, const Affine& transform)
+    {
+        out.PutDouble(transform.a);
+        out.PutDouble(transform.b);
+        out.PutDouble(transform.c);
+        out.PutDouble(transform.d);
+        out.PutDouble(transform.tx);
+        out.PutDouble(transform.ty);
+    }
+    
+    // Fails in, returning the identity, for a transform with a
+    // component that's NaN, infinite or past the limits above
+    Affine ReadTransform(OpReader& in)
+    {
+        double a = in.GetDouble();
+        double b = in.GetDouble();
+        double c = in.GetDouble();
+        double d = in.GetDouble();
+        double tx = in.GetDouble();
+        double ty = in.GetDouble();
+        // Written so NaN fails every test
+        bool sane = std::fabs(a) <= kMaxTransformScale && std::fabs(b) <= kMaxTransformScale &&
+            std::fabs(c) <= kMaxTransformScale && std::fabs(d) <= kMaxTransformScale &&
+            std::fabs(tx) <= kMaxTransformOffset && std::fabs(ty) <= kMaxTransformOffset;
+        if (!sane)
+        {
+            in.Fail();
+            return Affine();
+        }
+        return Affine(a, b, c, d, tx, ty);
+    }
+}
+
+wxUint32 ShapeStyle::Pack(const wxColour& color)
+{
+    return (static_cast<wxUint32>(color.Alpha()) << 24) |
+        (static_cast<wxUint32>(color.Red()) << 16) |
+        (static_cast<wxUint32>(color.Green()) << 8) |
+        color.Blue();
+}
+
+wxColour ShapeStyle::Unpack(wxUint32 color)
+{
+    return wxColour((color >> 16) & 0xFF, (color >> 8) & 0xFF, color & 0xFF, color >> 24);
+}
+
+Shape::Shape(const wxPoint& start, const ArenaAllocator<Shape>& alloc)
 	:mStartPoint(start)
 	,mEndPoint(start)
 	,mTopLeft(start)
 	,mBotRight(start)
+	,mAlloc(alloc)
+	,mId(sNextShapeId++)
+	,mEpoch(0)
+	,mOrder(0)
 {
-    pen = *wxBLACK_PEN;
-    brush = *wxWHITE_BRUSH;
-    
+    mStyle.penColor = ShapeStyle::Pack(*wxBLACK);
+    mStyle.penWidth = 1;
+    mStyle.brushColor = ShapeStyle::Pack(*wxWHITE);
 }
 
 // Tests whether the provided point intersects
@@ -30,10 +158,41 @@ bool Shape::Intersects(const wxPoint& point) const
 	}
 }
 
+void Shape::GetSnapPoints(std::vector<wxPoint>& points) const
+{
+    size_t first = points.size();
+    GetFeatures(points);
+    for (size_t i = first; i < points.size(); i++)
+    {
+        points[i] = mTransform.Apply(points[i]);
+    }
+}
+
+void Shape::GetFeatures(std::vector<wxPoint>& points) const
+{
+    points.push_back(mTopLeft);
+    points.push_back(wxPoint(mBotRight.x, mTopLeft.y));
+    points.push_back(mBotRight);
+    points.push_back(wxPoint(mTopLeft.x, mBotRight.y));
+    points.push_back(wxPoint((mTopLeft.x + mBotRight.x) / 2, (mTopLeft.y + mBotRight.y) / 2));
+}
+
+bool Shape::IsInside(const Lasso& lasso) const
+{
+    // The bounds rule most shapes out before the outline is built
+    wxPoint topLeft, botRight;
+    GetBounds(topLeft, botRight);
+    if (!lasso.GetBounds().Contains(wxRect(topLeft, botRight)))
+        return false;
+    std::shared_ptr<const Geometry> geometry = GetGeometry();
+    return lasso.ContainsAll(geometry->points.data(), geometry->points.size());
+}
+
 // Update shape with new provided point
 void Shape::Update(const wxPoint& newPoint)
 {
 	mEndPoint = newPoint;
+	ResetGeometry();
 
 	// For most shapes, we only have two points - start and end
 	// So we can figure out the top left/bottom right bounds
@@ -44,6 +203,16 @@ void Shape::Update(const wxPoint& newPoint)
 	mBotRight.y = std::max(mStartPoint.y, mEndPoint.y);
 }
 
+std::shared_ptr<Shape> Shape::Duplicate() const
+{
+    std::shared_ptr<Shape> copy = Clone();
+    copy->mId = sNextShapeId++;
+    // Not on any layer yet
+    copy->mEpoch = 0;
+    copy->mOrder = 0;
+    return copy;
+}
+
 void Shape::Finalize()
 {
 	// Default finalize doesn't do anything
@@ -51,34 +220,275 @@ void Shape::Finalize()
 
 void Shape::GetBounds(wxPoint& topLeft, wxPoint& botRight) const
 {
-    topLeft = mTopLeft + mOffset;
-    botRight = mBotRight + mOffset;
+    if (mTransform.IsTranslation())
+    {
+        topLeft = mTopLeft + mTransform.GetTranslation();
+        botRight = mBotRight + mTransform.GetTranslation();
+        return;
+    }
+    
+    std::shared_ptr<const Geometry> geometry = GetGeometry();
+    topLeft = geometry->topLeft;
+    botRight = geometry->botRight;
 }
 
+void Shape::SetTransform(const Affine& transform)
+{
+    mTransform = transform;
+    ResetGeometry();
+}
 
+std::shared_ptr<const Shape::Geometry> Shape::GetGeometry() const
+{
+    std::shared_ptr<const Geometry> cached = mGeometry.Get();
+    if (cached)
+        return cached;
+    
+    // Two threads may both get here for the same version; they build
+    // the same thing, so whichever is stored last is fine
+    std::shared_ptr<Geometry> geometry = std::make_shared<Geometry>();
+    GetOutline(*geometry);
+    for (auto& point : geometry->points)
+    {
+        point = mTransform.Apply(point);
+    }
+    for (auto& level : geometry->levels)
+    {
+        for (auto& point : level)
+        {
+            point = mTransform.Apply(point);
+        }
+    }
+    
+    geometry->topLeft = geometry->botRight = mTransform.Apply(mTopLeft);
+    for (auto& point : geometry->points)
+    {
+        geometry->topLeft.x = std::min(geometry->topLeft.x, point.x);
+        geometry->topLeft.y = std::min(geometry->topLeft.y, point.y);
+        geometry->botRight.x = std::max(geometry->botRight.x, point.x);
+        geometry->botRight.y = std::max(geometry->botRight.y, point.y);
+    }
+    
+    mGeometry.Set(geometry);
+    return geometry;
+}
 
-int Shape::GetWidth()
+void ContentHash::Add(const void* data, size_t size)
 {
-    return pen.GetWidth();
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; i++)
+    {
+        mValue = (mValue ^ bytes[i]) * 1099511628211ULL;
+    }
 }
 
-wxColour Shape::GetPenColor()
+unsigned long long Shape::GetContentHash() const
 {
+    std::shared_ptr<const unsigned long long> geometry = mGeometryHash.Get();
+    if (!geometry)
+    {
+        ContentHash outline;
+        outline.Add(typeid(*this).hash_code());
+        HashGeometry(outline);
+        geometry = std::make_shared<unsigned long long>(outline.GetValue());
+        mGeometryHash.Set(geometry);
+    }
     
-    return pen.GetColour();
+    // Style and transform are cheap, and change without the outline
+    ContentHash hash;
+    hash.Add(*geometry);
+    hash.Add(mStyle.penColor);
+    hash.Add(mStyle.penWidth);
+    hash.Add(mStyle.brushColor);
+    double linear[] = { mTransform.a, mTransform.b, mTransform.c, mTransform.d,
+        mTransform.tx - std::floor(mTransform.tx), mTransform.ty - std::floor(mTransform.ty) };
+    hash.Add(linear);
+    return hash.GetValue();
+}
+
+bool Shape::IsExpensive() const
+{
+    return mStyle.penWidth >= kThickPen;
 }
 
-wxColour Shape::GetBrushColor()
+void Shape::HashGeometry(ContentHash& hash) const
 {
+    Geometry outline;
+    GetOutline(outline);
+    for (auto& point : outline.points)
+    {
+        hash.Add(point - mTopLeft);
+    }
+}
+
+void Shape::Encode(OpWriter& out) const
+{
+    out.PutVarint(GetKind());
+    out.ResetPoint();
+    EncodeGeometry(out);
+    WriteStyle(out, mStyle);
+    // Most shapes have never been transformed
+    bool transformed = !(mTransform == Affine());
+    out.PutByte(transformed ? 1 : 0);
+    if (transformed)
+        WriteTransform(out, mTransform);
+}
+
+std::shared_ptr<Shape> Shape::Decode(OpReader& in, const ArenaAllocator<Shape>& alloc, ShapeId id, size_t depth)
+{
+    if (depth > kMaxDecodeDepth)
+    {
+        in.Fail();
+        return nullptr;
+    }
     
-    return brush.GetColour();
+    std::shared_ptr<Shape> shape;
+    wxPoint origin(0, 0);
+    switch (in.GetVarint())
+    {
+        case SK_Rect:
+            shape = std::allocate_shared<RectShape>(ArenaAllocator<RectShape>(alloc), origin, alloc);
+            break;
+        case SK_Ellipse:
+            shape = std::allocate_shared<EllipseShape>(ArenaAllocator<EllipseShape>(alloc), origin, alloc);
+            break;
+        case SK_Line:
+            shape = std::allocate_shared<LineShape>(ArenaAllocator<LineShape>(alloc), origin, alloc);
+            break;
+        case SK_Pencil:
+            shape = std::allocate_shared<PencilShape>(ArenaAllocator<PencilShape>(alloc), origin, alloc);
+            break;
+        case SK_Fill:
+            shape = std::allocate_shared<FillShape>(ArenaAllocator<FillShape>(alloc), origin, alloc);
+            break;
+        case SK_Group:
+            shape = std::allocate_shared<GroupShape>(ArenaAllocator<GroupShape>(alloc),
+                std::vector<std::shared_ptr<Shape>>(), alloc);
+            break;
+        default:
+            return nullptr;
+    }
+    
+    if (id != 0)
+        shape->mId = id;
+    in.ResetPoint();
+    shape->DecodeGeometry(in, depth);
+    shape->mStyle = ReadStyle(in);
+    if (in.GetByte() != 0)
+    {
+        Affine transform = ReadTransform(in);
+        if (in.IsOk())
+            shape->SetTransform(transform);
+    }
+    if (!in.IsOk())
+        return nullptr;
+    return shape;
+}
+
+bool Shape::EncodeChanges(const Shape& before, OpWriter& out) const
+{
+    unsigned char changed = 0;
+    if (!SameStyle(mStyle, before.mStyle))
+        changed |= kChangedStyle;
+    if (!(mTransform == before.mTransform))
+        changed |= kChangedTransform;
+    if (!SameGeometry(before))
+        changed |= kChangedGeometry;
+    if (changed == 0)
+        return false;
+    
+    out.PutByte(changed);
+    if (changed & kChangedGeometry)
+    {
+        out.ResetPoint();
+        EncodeGeometryChange(before, out);
+    }
+    if (changed & kChangedStyle)
+        WriteStyle(out, mStyle);
+    if (changed & kChangedTransform)
+        WriteTransform(out, mTransform);
+    return true;
+}
+
+bool Shape::DecodeChanges(OpReader& in)
+{
+    unsigned char changed = in.GetByte();
+    if (changed & kChangedGeometry)
+    {
+        in.ResetPoint();
+        DecodeGeometryChange(in);
+    }
+    // Bad values are left out rather than applied and then reported
+    if (changed & kChangedStyle)
+    {
+        ShapeStyle style = ReadStyle(in);
+        if (in.IsOk())
+            mStyle = style;
+    }
+    if (changed & kChangedTransform)
+    {
+        Affine transform = ReadTransform(in);
+        if (in.IsOk())
+            SetTransform(transform);
+    }
+    return in.IsOk();
+}
+
+void Shape::EncodeGeometry(OpWriter& out) const
+{
+    out.PutPoint(mStartPoint);
+    out.PutPoint(mEndPoint);
+}
+
+void Shape::DecodeGeometry(OpReader& in, size_t depth)
+{
+    mStartPoint = in.GetPoint();
+    Shape::Update(in.GetPoint());
+}
+
+bool Shape::SameGeometry(const Shape& before) const
+{
+    return mStartPoint == before.mStartPoint && mEndPoint == before.mEndPoint;
+}
+
+wxPoint Shape::BeginSvg(SvgWriter& svg) const
+{
+    if (mTransform.IsTranslation())
+        return mTransform.GetTranslation();
+    svg.BeginTransform(mTransform);
+    return wxPoint(0, 0);
+}
+
+void Shape::EndSvg(SvgWriter& svg) const
+{
+    if (!mTransform.IsTranslation())
+        svg.EndGroup();
+}
+
+
+
+int Shape::GetWidth() const
+{
+    return mStyle.penWidth;
+}
+
+wxColour Shape::GetPenColor() const
+{
+    
+    return ShapeStyle::Unpack(mStyle.penColor);
+}
+
+wxColour Shape::GetBrushColor() const
+{
+    
+    return ShapeStyle::Unpack(mStyle.brushColor);
     
 }
 
 
 void Shape::SetBColor(wxColour color)
 {
-    brush.SetColour(color);
+    mStyle.brushColor = ShapeStyle::Pack(color);
 
 }
 
@@ -86,7 +496,7 @@ void Shape::SetBColor(wxColour color)
 void Shape::SetPenColor(wxColour color)
 {
     
-    pen.SetColour(color);
+    mStyle.penColor = ShapeStyle::Pack(color);
     
 }
 
@@ -94,36 +504,112 @@ void Shape::SetPenColor(wxColour color)
 void Shape::SetWidth(int width)
 {
     
-    pen.SetWidth(width);
+    mStyle.penWidth = width;
 }
 
 wxPen Shape::GetPen() const
 {
-    return pen;
+    return wxPen(GetPenColor(), mStyle.penWidth);
 }
 
 wxBrush Shape::GetBrush() const
 {
-    return brush;
+    return wxBrush(GetBrushColor());
 }
 
-void Shape::DrawSelection(wxDC& dc)
+void Shape::DrawSelection(wxDC& dc, bool handles) const
 {
     wxPen dottedPen = *wxBLACK_DASHED_PEN;
     wxBrush dottedB = *wxTRANSPARENT_BRUSH;
     dc.SetPen(dottedPen);
     dc.SetBrush(dottedB);
     
+    double scale, scaleY;
+    dc.GetUserScale(&scale, &scaleY);
+    
     wxPoint x;
     wxPoint y;
     GetBounds(x, y);
 
-    wxRect rect(x - wxPoint(5, 5), y + wxPoint(5, 5));
-    dc.DrawRectangle(rect);
+    wxPoint topLeft = HandlePosition(HD_TopLeft, x, y, scale);
+    wxPoint botRight = HandlePosition(HD_BotRight, x, y, scale);
+    dc.DrawRectangle(wxRect(topLeft, botRight));
+    if (!handles)
+        return;
+    
+    // Stem up to the rotate handle, then the handles themselves
+    dc.DrawLine(HandlePosition(HD_Top, x, y, scale), HandlePosition(HD_Rotate, x, y, scale));
+    
+    int size = std::max(1, static_cast<int>(kHandleSize / scale));
+    dc.SetPen(*wxBLACK_PEN);
+    dc.SetBrush(*wxWHITE_BRUSH);
+    for (int handle = HD_TopLeft; handle <= HD_Rotate; handle++)
+    {
+        wxPoint centre = HandlePosition(static_cast<HandleType>(handle), x, y, scale);
+        if (handle == HD_Rotate)
+            dc.DrawCircle(centre, size / 2 + 1);
+        else
+            dc.DrawRectangle(centre.x - size / 2, centre.y - size / 2, size, size);
+    }
 }
 
+wxPoint Shape::HandlePosition(HandleType handle, const wxPoint& topLeft,
+    const wxPoint& botRight, double scale)
+{
+    int margin = static_cast<int>(std::ceil(kSelectionMargin / scale));
+    int left = topLeft.x - margin;
+    int top = topLeft.y - margin;
+    int right = botRight.x + margin;
+    int bottom = botRight.y + margin;
+    int middleX = left + (right - left) / 2;
+    int middleY = top + (bottom - top) / 2;
+    
+    switch (handle)
+    {
+        case HD_TopLeft:
+            return wxPoint(left, top);
+        case HD_Top:
+            return wxPoint(middleX, top);
+        case HD_TopRight:
+            return wxPoint(right, top);
+        case HD_Right:
+            return wxPoint(right, middleY);
+        case HD_BotRight:
+            return wxPoint(right, bottom);
+        case HD_Bot:
+            return wxPoint(middleX, bottom);
+        case HD_BotLeft:
+            return wxPoint(left, bottom);
+        case HD_Left:
+            return wxPoint(left, middleY);
+        case HD_Rotate:
+            return wxPoint(middleX, top - static_cast<int>(kRotateReach / scale));
+        default:
+            return wxPoint(middleX, middleY);
+    }
+}
 
-RectShape::RectShape(const wxPoint& start) : Shape(start)
+HandleType Shape::HitHandle(const wxPoint& point, double scale) const
+{
+    wxPoint topLeft, botRight;
+    GetBounds(topLeft, botRight);
+    
+    // A pixel of slack around each handle
+    int reach = static_cast<int>(std::ceil((kHandleSize / 2 + 1) / scale));
+    for (int handle = HD_TopLeft; handle <= HD_Rotate; handle++)
+    {
+        wxPoint centre = HandlePosition(static_cast<HandleType>(handle), topLeft, botRight, scale);
+        if (std::abs(point.x - centre.x) <= reach && std::abs(point.y - centre.y) <= reach)
+            return static_cast<HandleType>(handle);
+    }
+    
+    wxRect box(HandlePosition(HD_TopLeft, topLeft, botRight, scale),
+        HandlePosition(HD_BotRight, topLeft, botRight, scale));
+    return box.Contains(point) ? HD_Move : HD_None;
+}
+
+
+RectShape::RectShape(const wxPoint& start, const ArenaAllocator<Shape>& alloc) : Shape(start, alloc)
 {
     
 }
@@ -133,6 +619,13 @@ void RectShape::Draw(wxDC& dc) const{
     dc.SetPen(GetPen());
     dc.SetBrush(GetBrush());
     
+    if (!mTransform.IsTranslation())
+    {
+        std::shared_ptr<const Geometry> geometry = GetGeometry();
+        dc.DrawPolygon(static_cast<int>(geometry->points.size()), geometry->points.data());
+        return;
+    }
+    
     wxPoint a, b;
     GetBounds(a, b);
 
@@ -141,7 +634,38 @@ void RectShape::Draw(wxDC& dc) const{
     
 }
 
-EllipseShape::EllipseShape(const wxPoint& start) : Shape(start)
+void RectShape::DrawSvg(SvgWriter& svg) const
+{
+    wxPoint offset = BeginSvg(svg);
+    svg.Rect(mTopLeft + offset, mBotRight + offset, GetPen(), GetBrush());
+    EndSvg(svg);
+}
+
+void RectShape::GetOutline(Geometry& outline) const
+{
+    outline.points.push_back(mTopLeft);
+    outline.points.push_back(wxPoint(mBotRight.x, mTopLeft.y));
+    outline.points.push_back(mBotRight);
+    outline.points.push_back(wxPoint(mTopLeft.x, mBotRight.y));
+}
+
+void RectShape::GetFeatures(std::vector<wxPoint>& points) const
+{
+    Shape::GetFeatures(points);
+    int midX = (mTopLeft.x + mBotRight.x) / 2;
+    int midY = (mTopLeft.y + mBotRight.y) / 2;
+    points.push_back(wxPoint(midX, mTopLeft.y));
+    points.push_back(wxPoint(mBotRight.x, midY));
+    points.push_back(wxPoint(midX, mBotRight.y));
+    points.push_back(wxPoint(mTopLeft.x, midY));
+}
+
+std::shared_ptr<Shape> RectShape::Clone() const
+{
+    return std::allocate_shared<RectShape>(ArenaAllocator<RectShape>(mAlloc), *this);
+}
+
+EllipseShape::EllipseShape(const wxPoint& start, const ArenaAllocator<Shape>& alloc) : Shape(start, alloc)
 {
     
 }
@@ -151,6 +675,13 @@ void EllipseShape::Draw(wxDC& dc) const{
     dc.SetPen(GetPen());
     dc.SetBrush(GetBrush());
     
+    if (!mTransform.IsTranslation())
+    {
+        std::shared_ptr<const Geometry> geometry = GetGeometry();
+        dc.DrawPolygon(static_cast<int>(geometry->points.size()), geometry->points.data());
+        return;
+    }
+    
     wxPoint top, bot;
     GetBounds(top, bot);
     
@@ -160,7 +691,45 @@ void EllipseShape::Draw(wxDC& dc) const{
 }
 
 
-LineShape::LineShape(const wxPoint& start) : Shape(start)
+void EllipseShape::DrawSvg(SvgWriter& svg) const
+{
+    wxPoint offset = BeginSvg(svg);
+    svg.Ellipse(mTopLeft + offset, mBotRight + offset, GetPen(), GetBrush());
+    EndSvg(svg);
+}
+
+void EllipseShape::GetOutline(Geometry& outline) const
+{
+    double centreX = (mTopLeft.x + mBotRight.x) / 2.0;
+    double centreY = (mTopLeft.y + mBotRight.y) / 2.0;
+    double radiusX = (mBotRight.x - mTopLeft.x) / 2.0;
+    double radiusY = (mBotRight.y - mTopLeft.y) / 2.0;
+    const double step = 2.0 * kPi / kEllipseSegments;
+    for (int i = 0; i < kEllipseSegments; i++)
+    {
+        outline.points.push_back(wxPoint(
+            static_cast<int>(std::floor(centreX + radiusX * std::cos(i * step) + 0.5)),
+            static_cast<int>(std::floor(centreY + radiusY * std::sin(i * step) + 0.5))));
+    }
+}
+
+void EllipseShape::GetFeatures(std::vector<wxPoint>& points) const
+{
+    int midX = (mTopLeft.x + mBotRight.x) / 2;
+    int midY = (mTopLeft.y + mBotRight.y) / 2;
+    points.push_back(wxPoint(midX, mTopLeft.y));
+    points.push_back(wxPoint(mBotRight.x, midY));
+    points.push_back(wxPoint(midX, mBotRight.y));
+    points.push_back(wxPoint(mTopLeft.x, midY));
+    points.push_back(wxPoint(midX, midY));
+}
+
+std::shared_ptr<Shape> EllipseShape::Clone() const
+{
+    return std::allocate_shared<EllipseShape>(ArenaAllocator<EllipseShape>(mAlloc), *this);
+}
+
+LineShape::LineShape(const wxPoint& start, const ArenaAllocator<Shape>& alloc) : Shape(start, alloc)
 {
     
 }
@@ -170,85 +739,767 @@ void LineShape::Draw(wxDC& dc) const{
     dc.SetPen(GetPen());
     dc.SetBrush(GetBrush());
 
-    dc.DrawLine(mStartPoint + mOffset, mEndPoint + mOffset);
+    if (!mTransform.IsTranslation())
+    {
+        std::shared_ptr<const Geometry> geometry = GetGeometry();
+        dc.DrawLine(geometry->points[0], geometry->points[1]);
+        return;
+    }
+    
+    wxPoint offset = mTransform.GetTranslation();
+    dc.DrawLine(mStartPoint + offset, mEndPoint + offset);
     
 }
 
 
-PencilShape::PencilShape(const wxPoint& start) : Shape(start)
+void LineShape::DrawSvg(SvgWriter& svg) const
+{
+    wxPoint offset = BeginSvg(svg);
+    svg.Line(mStartPoint + offset, mEndPoint + offset, GetPen());
+    EndSvg(svg);
+}
+
+void LineShape::GetOutline(Geometry& outline) const
+{
+    outline.points.push_back(mStartPoint);
+    outline.points.push_back(mEndPoint);
+}
+
+void LineShape::GetFeatures(std::vector<wxPoint>& points) const
+{
+    points.push_back(mStartPoint);
+    points.push_back(mEndPoint);
+    points.push_back(wxPoint((mStartPoint.x + mEndPoint.x) / 2, (mStartPoint.y + mEndPoint.y) / 2));
+}
+
+std::shared_ptr<Shape> LineShape::Clone() const
+{
+    return std::allocate_shared<LineShape>(ArenaAllocator<LineShape>(mAlloc), *this);
+}
+
+// std::max takes it by reference, so it needs a definition
+const size_t PencilShape::kInitialPoints;
+
+PencilShape::PencilShape(const wxPoint& start, const ArenaAllocator<Shape>& alloc)
+    : Shape(start, alloc)
+    , mPoints(std::allocate_shared<ArenaVector<wxPoint>>(ArenaAllocator<wxPoint>(alloc, MC_Geometry),
+        ArenaAllocator<wxPoint>(alloc, MC_Geometry)))
+    , mCount(1)
 {
-    points.push_back(start);
+    // Start with a full pool block so short strokes never regrow
+    mPoints->reserve(kInitialPoints);
+    mPoints->push_back(start);
 }
 
 void PencilShape::Draw(wxDC& dc) const{
     
+    if (mTransform.IsTranslation())
+    {
+        DrawPoints(dc, GetPoints(), mCount, mTransform.GetTranslation());
+        return;
+    }
+    
+    std::shared_ptr<const Geometry> geometry = GetGeometry();
+    DrawPoints(dc, geometry->points.data(), geometry->points.size(), wxPoint(0, 0));
+    
+}
+
+void PencilShape::DrawAtScale(wxDC& dc, double scale) const
+{
+    // Coarsest copy whose points are still under a screen pixel apart,
+    // counting what the transform does to the spacing
+    double pixels = scale * mTransform.GetScale();
+    size_t level = 0;
+    if (mLevels)
+    {
+        while (level < mLevels->size() && (*mLevels)[level].tolerance * pixels <= 1.0)
+        {
+            level++;
+        }
+    }
+    
+    if (level == 0)
+    {
+        Draw(dc);
+    }
+    else if (mTransform.IsTranslation())
+    {
+        const ArenaVector<wxPoint>& points = (*mLevels)[level - 1].points;
+        DrawPoints(dc, points.data(), points.size(), mTransform.GetTranslation());
+    }
+    else
+    {
+        const std::vector<wxPoint>& points = GetGeometry()->levels[level - 1];
+        DrawPoints(dc, points.data(), points.size(), wxPoint(0, 0));
+    }
+}
+
+void PencilShape::DrawPoints(wxDC& dc, const wxPoint* ptr, size_t count, const wxPoint& offset) const
+{
     dc.SetPen(GetPen());
     dc.SetBrush(GetBrush());
     
     
-    const wxPoint* ptr = &(points.front()); // or points.data()
-    if(points.size() == 1)
-        dc.DrawPoint(*ptr);
+    if(count == 1)
+        dc.DrawPoint(*ptr + offset);
     else
     {
-        if (mOffset == wxPoint(0, 0))
+        if (offset == wxPoint(0, 0))
         {
             
-            dc.DrawLines(static_cast<int>(points.size()), ptr);
+            dc.DrawLines(static_cast<int>(count), ptr);
             
             
         }
         else
         
         
-            dc.DrawLines(static_cast<int>(points.size()), ptr, mOffset.x, mOffset.y);
+            dc.DrawLines(static_cast<int>(count), ptr, offset.x, offset.y);
         
     }
+}
+
+void PencilShape::DrawSvg(SvgWriter& svg) const
+{
+    wxPoint offset = BeginSvg(svg);
+    svg.Polyline(GetPoints(), mCount, offset, GetPen());
+    EndSvg(svg);
+}
+
+void PencilShape::GetOutline(Geometry& outline) const
+{
+    outline.points.assign(GetPoints(), GetPoints() + mCount);
+    if (mLevels)
+    {
+        for (auto& level : *mLevels)
+        {
+            outline.levels.push_back(std::vector<wxPoint>(level.points.begin(), level.points.end()));
+        }
+    }
+}
+
+void PencilShape::GetFeatures(std::vector<wxPoint>& points) const
+{
+    points.push_back(GetPoints()[0]);
+    if (mCount > 1)
+        points.push_back(GetPoints()[mCount - 1]);
+}
+
+void PencilShape::HashGeometry(ContentHash& hash) const
+{
+    const wxPoint* points = GetPoints();
+    for (size_t i = 0; i < mCount; i++)
+    {
+        hash.Add(points[i] - mTopLeft);
+    }
+}
+
+void PencilShape::EncodeGeometry(OpWriter& out) const
+{
+    const wxPoint* points = GetPoints();
+    out.PutVarint(mCount);
+    for (size_t i = 0; i < mCount; i++)
+    {
+        out.PutPoint(points[i]);
+    }
+}
+
+void PencilShape::DecodeGeometry(OpReader& in, size_t depth)
+{
+    size_t count = in.GetCount();
+    ArenaAllocator<wxPoint> alloc(mAlloc, MC_Geometry);
+    std::shared_ptr<ArenaVector<wxPoint>> points = std::allocate_shared<ArenaVector<wxPoint>>(alloc, alloc);
+    points->reserve(std::max(kInitialPoints, count));
+    for (size_t i = 0; i < count; i++)
+    {
+        points->push_back(in.GetPoint());
+    }
+    if (points->empty())
+        points->push_back(wxPoint(0, 0));
+    Adopt(points);
+}
+
+void PencilShape::SetPoints(const wxPoint* points, size_t count)
+{
+    ArenaAllocator<wxPoint> alloc(mAlloc, MC_Geometry);
+    std::shared_ptr<ArenaVector<wxPoint>> copy = std::allocate_shared<ArenaVector<wxPoint>>(alloc, alloc);
+    if (count == 0)
+        copy->push_back(wxPoint(0, 0));
+    else
+        copy->assign(points, points + count);
+    Adopt(copy);
+}
+
+void PencilShape::Adopt(const std::shared_ptr<ArenaVector<wxPoint>>& points)
+{
+    mPoints = points;
+    mCount = points->size();
+    mLevels.reset();
+    mStartPoint = mTopLeft = mBotRight = points->front();
+    mEndPoint = points->back();
+    for (auto& point : *points)
+    {
+        mTopLeft.x = std::min(mTopLeft.x, point.x);
+        mTopLeft.y = std::min(mTopLeft.y, point.y);
+        mBotRight.x = std::max(mBotRight.x, point.x);
+        mBotRight.y = std::max(mBotRight.y, point.y);
+    }
+    ResetGeometry();
+}
+
+bool PencilShape::SameGeometry(const Shape& before) const
+{
+    const PencilShape& other = static_cast<const PencilShape&>(before);
+    return mCount == other.mCount &&
+        (GetPoints() == other.GetPoints() || std::equal(GetPoints(), GetPoints() + mCount, other.GetPoints()));
+}
+
+void PencilShape::EncodeGeometryChange(const Shape& before, OpWriter& out) const
+{
+    const PencilShape& other = static_cast<const PencilShape&>(before);
+    // Copies that share a buffer agree on the points they both have
+    bool grown = other.mCount <= mCount && (GetPoints() == other.GetPoints() ||
+        std::equal(other.GetPoints(), other.GetPoints() + other.mCount, GetPoints()));
+    if (!grown)
+    {
+        out.PutByte(kStrokeReplaced);
+        EncodeGeometry(out);
+        return;
+    }
+    
+    const wxPoint* points = GetPoints();
+    out.PutByte(kStrokeGrown);
+    out.PutVarint(mCount - other.mCount);
+    out.ResetPoint(points[other.mCount - 1]);
+    for (size_t i = other.mCount; i < mCount; i++)
+    {
+        out.PutPoint(points[i]);
+    }
+}
+
+void PencilShape::DecodeGeometryChange(OpReader& in)
+{
+    if (in.GetByte() != kStrokeGrown)
+    {
+        DecodeGeometry(in, 0);
+        return;
+    }
     
+    size_t count = in.GetCount();
+    in.ResetPoint(GetPoints()[mCount - 1]);
+    for (size_t i = 0; i < count && in.IsOk(); i++)
+    {
+        Update(in.GetPoint());
+    }
+}
+
+bool PencilShape::IsExpensive() const
+{
+    return mCount >= kManyPoints || Shape::IsExpensive();
+}
+
+std::shared_ptr<Shape> PencilShape::Clone() const
+{
+    return std::allocate_shared<PencilShape>(ArenaAllocator<PencilShape>(mAlloc), *this);
 }
 
 void PencilShape::Update(const wxPoint &newPoint)
 {
-    Shape::Update(newPoint);
-    points.push_back(newPoint);
+    mEndPoint = newPoint;
+    mTopLeft.x = std::min(mTopLeft.x, newPoint.x);
+    mTopLeft.y = std::min(mTopLeft.y, newPoint.y);
+    mBotRight.x = std::max(mBotRight.x, newPoint.x);
+    mBotRight.y = std::max(mBotRight.y, newPoint.y);
 
+    // Append in place only while this copy owns the end of the buffer
+    // and there's room, so nothing another copy can see is moved
+    if (mCount != mPoints->size() || mCount == mPoints->capacity())
+    {
+        ArenaAllocator<wxPoint> alloc(mAlloc, MC_Geometry);
+        std::shared_ptr<ArenaVector<wxPoint>> points = std::allocate_shared<ArenaVector<wxPoint>>(alloc, alloc);
+        points->reserve(std::max(kInitialPoints, mCount * 2));
+        points->assign(GetPoints(), GetPoints() + mCount);
+        mPoints = points;
+    }
+    mPoints->push_back(newPoint);
+    mCount++;
+    ResetGeometry();
 }
 
 void PencilShape::Finalize()
 {
-    int top, left, bot, right;
-    std::vector<wxPoint>::iterator it = points.begin();
-    top = it->y;
-    bot = it->y;
-    left = it->x;
-    right = it->x;
-
-    ++it;
-    for (; it != points.end(); ++it)
-    {
-        if (it->x < left)
-            left = it->x;
-        if (it->x > right)
-            right = it->x;
-        if (it->y < top)
-            top = it->y;
-        if (it->y > bot)
-            bot = it->y;
+    // Each level thins the one before it, dropping points closer than
+    // its tolerance to the last point kept; the final point always stays
+    std::shared_ptr<std::vector<Level>> levels = std::make_shared<std::vector<Level>>();
+    const wxPoint* source = GetPoints();
+    size_t count = mCount;
+    double tolerance = 2.0;
+    for (int i = 0; i < kMaxLevels && count > 2; i++, tolerance *= 2.0)
+    {
+        Level level(tolerance, ArenaAllocator<wxPoint>(mAlloc, MC_Caches));
+        double limit = tolerance * tolerance;
+        level.points.push_back(source[0]);
+        for (size_t p = 1; p + 1 < count; p++)
+        {
+            double dx = source[p].x - level.points.back().x;
+            double dy = source[p].y - level.points.back().y;
+            if (dx * dx + dy * dy >= limit)
+                level.points.push_back(source[p]);
+        }
+        level.points.push_back(source[count - 1]);
         
+        if (level.points.size() == count)
+            continue;
+        levels->push_back(std::move(level));
+        source = levels->back().points.data();
+        count = levels->back().points.size();
+    }
+    mLevels = levels;
+    ResetGeometry();
+}
+
+FillShape::FillShape(const wxPoint& start, const ArenaAllocator<Shape>& alloc)
+    : Shape(start, alloc)
+    , mRects(std::allocate_shared<ArenaVector<wxRect>>(ArenaAllocator<wxRect>(alloc, MC_Geometry),
+        ArenaAllocator<wxRect>(alloc, MC_Geometry)))
+{
+    
+}
+
+void FillShape::SetSpans(const std::vector<FillSpan>& fill)
+{
+    ArenaAllocator<wxRect> alloc(mAlloc, MC_Geometry);
+    std::shared_ptr<ArenaVector<wxRect>> rects = std::allocate_shared<ArenaVector<wxRect>>(alloc, alloc);
+    mRects = rects;
+    ResetGeometry();
+    if (fill.empty())
+        return;
+    
+    // Spans come sorted by row, so a span that matches one on the row
+    // above just makes that rectangle a row taller
+    std::map<std::pair<int, int>, size_t> above, current;
+    int row = fill.front().y;
+    for (auto& span : fill)
+    {
+        if (span.y != row)
+        {
+            above.swap(current);
+            current.clear();
+            if (span.y != row + 1)
+                above.clear();
+            row = span.y;
+        }
+        std::pair<int, int> key(span.x1, span.x2);
+        auto iter = above.find(key);
+        if (iter != above.end())
+        {
+            (*rects)[iter->second].height++;
+            current.emplace(key, iter->second);
+        }
+        else
+        {
+            current.emplace(key, rects->size());
+            rects->push_back(wxRect(span.x1, span.y, span.x2 - span.x1, 1));
+        }
+    }
+    
+    int left = fill.front().x1;
+    int right = fill.front().x2;
+    for (auto& rect : *rects)
+    {
+        left = std::min(left, rect.x);
+        right = std::max(right, rect.x + rect.width);
+    }
+    mTopLeft = wxPoint(left, fill.front().y);
+    mBotRight = wxPoint(right - 1, fill.back().y);
+}
+
+void FillShape::Update(const wxPoint &newPoint)
+{
+    
+}
+
+void FillShape::Draw(wxDC& dc) const
+{
+    // Outlined in the fill colour so each rectangle covers exactly its
+    // pixels on every port
+    wxColour colour = GetBrushColor();
+    dc.SetPen(wxPen(colour, 1));
+    dc.SetBrush(wxBrush(colour));
+    
+    if (!mTransform.IsTranslation())
+    {
+        std::shared_ptr<const Geometry> geometry = GetGeometry();
+        for (size_t i = 0; i + 4 <= geometry->points.size(); i += 4)
+        {
+            dc.DrawPolygon(4, &geometry->points[i]);
+        }
+        return;
+    }
+    
+    wxPoint offset = mTransform.GetTranslation();
+    for (auto& rect : *mRects)
+    {
+        dc.DrawRectangle(rect.x + offset.x, rect.y + offset.y, rect.width, rect.height);
+    }
+}
+
+void FillShape::DrawSvg(SvgWriter& svg) const
+{
+    wxPoint offset = BeginSvg(svg);
+    svg.Rects(mRects->data(), mRects->size(), offset, GetBrush());
+    EndSvg(svg);
+}
+
+void FillShape::GetOutline(Geometry& outline) const
+{
+    outline.points.reserve(mRects->size() * 4);
+    for (auto& rect : *mRects)
+    {
+        outline.points.push_back(rect.GetTopLeft());
+        outline.points.push_back(rect.GetTopRight());
+        outline.points.push_back(rect.GetBottomRight());
+        outline.points.push_back(rect.GetBottomLeft());
+    }
+}
+
+void FillShape::HashGeometry(ContentHash& hash) const
+{
+    for (auto& rect : *mRects)
+    {
+        hash.Add(wxRect(rect.GetTopLeft() - mTopLeft, rect.GetSize()));
+    }
+}
+
+void FillShape::EncodeGeometry(OpWriter& out) const
+{
+    out.PutVarint(mRects->size());
+    for (auto& rect : *mRects)
+    {
+        out.PutPoint(rect.GetTopLeft());
+        out.PutVarint(rect.width);
+        out.PutVarint(rect.height);
+    }
+}
+
+void FillShape::DecodeGeometry(OpReader& in, size_t depth)
+{
+    size_t count = in.GetCount();
+    ArenaAllocator<wxRect> alloc(mAlloc, MC_Geometry);
+    std::shared_ptr<ArenaVector<wxRect>> rects = std::allocate_shared<ArenaVector<wxRect>>(alloc, alloc);
+    rects->reserve(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        wxPoint topLeft = in.GetPoint();
+        int width = static_cast<int>(in.GetVarint());
+        int height = static_cast<int>(in.GetVarint());
+        rects->push_back(wxRect(topLeft.x, topLeft.y, width, height));
     }
     
-    mTopLeft.x = left;
-    mTopLeft.y = top;
-    mBotRight.x = right;
-    mBotRight.y = bot;
+    mRects = rects;
+    ResetGeometry();
+    if (rects->empty())
+        return;
+    mTopLeft = rects->front().GetTopLeft();
+    mBotRight = rects->front().GetBottomRight();
+    for (auto& rect : *rects)
+    {
+        mTopLeft.x = std::min(mTopLeft.x, rect.x);
+        mTopLeft.y = std::min(mTopLeft.y, rect.y);
+        mBotRight.x = std::max(mBotRight.x, rect.GetRight());
+        mBotRight.y = std::max(mBotRight.y, rect.GetBottom());
+    }
+}
+
+bool FillShape::SameGeometry(const Shape& before) const
+{
+    // The rectangles are never changed, only replaced
+    return mRects == static_cast<const FillShape&>(before).mRects;
+}
+
+bool FillShape::IsExpensive() const
+{
+    return mRects->size() >= kManyRects || Shape::IsExpensive();
+}
+
+std::shared_ptr<Shape> FillShape::Clone() const
+{
+    return std::allocate_shared<FillShape>(ArenaAllocator<FillShape>(mAlloc), *this);
+}
+
+GroupShape::GroupShape(const std::vector<std::shared_ptr<Shape>>& children, const ArenaAllocator<Shape>& alloc)
+    : Shape(wxPoint(0, 0), alloc)
+{
+    SetChildren(children);
+}
+
+void GroupShape::SetChildren(const std::vector<std::shared_ptr<Shape>>& children)
+{
+    std::shared_ptr<Tree> tree = std::make_shared<Tree>();
+    tree->children = children;
+    for (size_t i = 0; i < children.size(); i++)
+    {
+        tree->order.push_back(i);
+    }
+    if (!children.empty())
+    {
+        tree->nodes.reserve(2 * children.size() / kLeafSize + 1);
+        Build(*tree, 0, children.size());
+        const wxRect& area = tree->nodes.front().area;
+        mTopLeft = mStartPoint = area.GetTopLeft();
+        mBotRight = mEndPoint = area.GetBottomRight();
+    }
+    mTree = tree;
+    mPlaced.Set(std::shared_ptr<const Placed>());
+    ResetGeometry();
+}
+
+size_t GroupShape::Build(Tree& tree, size_t first, size_t count)
+{
+    size_t index = tree.nodes.size();
+    tree.nodes.push_back(Node());
     
+    wxRect area = PaintArea(*tree.children[tree.order[first]]);
+    for (size_t i = first + 1; i < first + count; i++)
+    {
+        area.Union(PaintArea(*tree.children[tree.order[i]]));
+    }
+    
+    Node node;
+    node.area = area;
+    node.first = first;
+    node.count = count;
+    node.right = 0;
+    if (count > kLeafSize)
+    {
+        // Halve along the longer side, by the children's middles
+        bool wide = area.width >= area.height;
+        std::vector<size_t>::iterator begin = tree.order.begin() + first;
+        std::nth_element(begin, begin + count / 2, begin + count,
+            [&tree, wide](size_t a, size_t b)
+            {
+                wxRect ra = PaintArea(*tree.children[a]);
+                wxRect rb = PaintArea(*tree.children[b]);
+                return wide ? ra.x * 2 + ra.width < rb.x * 2 + rb.width
+                    : ra.y * 2 + ra.height < rb.y * 2 + rb.height;
+            });
+        node.count = 0;
+        Build(tree, first, count / 2);
+        node.right = Build(tree, first + count / 2, count - count / 2);
+    }
+    tree.nodes[index] = node;
+    return index;
+}
+
+void GroupShape::Query(const wxRect& area, std::vector<size_t>& found) const
+{
+    const Tree& tree = *mTree;
+    if (tree.nodes.empty())
+        return;
+    
+    std::vector<size_t> stack(1, 0);
+    while (!stack.empty())
+    {
+        const Node& node = tree.nodes[stack.back()];
+        size_t index = stack.back();
+        stack.pop_back();
+        if (!node.area.Intersects(area))
+            continue;
+        if (node.count == 0)
+        {
+            stack.push_back(node.right);
+            stack.push_back(index + 1);
+            continue;
+        }
+        for (size_t i = node.first; i < node.first + node.count; i++)
+        {
+            if (PaintArea(*tree.children[tree.order[i]]).Intersects(area))
+                found.push_back(tree.order[i]);
+        }
+    }
+    std::sort(found.begin(), found.end());
 }
 
-void Shape::UpdateOffset(const wxPoint &offset)
+wxRect GroupShape::ToLocal(const wxRect& area) const
 {
-    mOffset.x = offset.x - mStartPoint.x;
-    mOffset.y = offset.y - mStartPoint.y ;
+    Affine inverse = mTransform.Inverse();
+    double left = 0.0, top = 0.0, right = 0.0, bottom = 0.0;
+    for (int corner = 0; corner < 4; corner++)
+    {
+        double x, y;
+        inverse.Apply((corner & 1) ? area.GetRight() + 1.0 : area.GetLeft(),
+            (corner & 2) ? area.GetBottom() + 1.0 : area.GetTop(), x, y);
+        left = (corner == 0) ? x : std::min(left, x);
+        top = (corner == 0) ? y : std::min(top, y);
+        right = (corner == 0) ? x : std::max(right, x);
+        bottom = (corner == 0) ? y : std::max(bottom, y);
+    }
     
+    // Clamped so huge areas at small scales can't overflow
+    const double limit = kEverywhere;
+    int x0 = static_cast<int>(std::max(-limit, std::floor(left)));
+    int y0 = static_cast<int>(std::max(-limit, std::floor(top)));
+    int x1 = static_cast<int>(std::min(limit, std::ceil(right)));
+    int y1 = static_cast<int>(std::min(limit, std::ceil(bottom)));
+    return wxRect(wxPoint(x0, y0), wxPoint(x1, y1));
+}
+
+std::shared_ptr<const GroupShape::Placed> GroupShape::GetPlaced() const
+{
+    std::shared_ptr<const Placed> cached = mPlaced.Get();
+    if (cached && cached->transform == mTransform)
+        return cached;
     
+    std::shared_ptr<Placed> placed = std::make_shared<Placed>();
+    placed->transform = mTransform;
+    placed->children = Ungroup();
+    mPlaced.Set(placed);
+    return placed;
+}
+
+std::vector<std::shared_ptr<Shape>> GroupShape::Ungroup() const
+{
+    std::vector<std::shared_ptr<Shape>> children;
+    children.reserve(mTree->children.size());
+    for (auto& child : mTree->children)
+    {
+        std::shared_ptr<Shape> copy = child->Clone();
+        copy->SetTransform(mTransform * child->GetTransform());
+        copy->SetEpoch(0);
+        children.push_back(copy);
+    }
+    return children;
 }
 
+void GroupShape::Draw(wxDC& dc) const
+{
+    DrawAtScale(dc, 1.0);
+}
+
+void GroupShape::DrawAtScale(wxDC& dc, double scale) const
+{
+    DrawVisible(dc, scale, wxRect(-kEverywhere, -kEverywhere, 2 * kEverywhere, 2 * kEverywhere));
+}
+
+void GroupShape::DrawVisible(wxDC& dc, double scale, const wxRect& visible) const
+{
+    std::vector<size_t> found;
+    wxRect local = ToLocal(visible);
+    Query(local, found);
+    
+    if (!mTransform.IsTranslation())
+    {
+        std::shared_ptr<const Placed> placed = GetPlaced();
+        for (size_t index : found)
+        {
+            placed->children[index]->DrawVisible(dc, scale, visible);
+        }
+        return;
+    }
+    
+    // A translation is just a shift of the DC's origin, so the
+    // children are drawn as they are
+    wxPoint offset = mTransform.GetTranslation();
+    wxPoint origin = dc.GetLogicalOrigin();
+    dc.SetLogicalOrigin(origin.x - offset.x, origin.y - offset.y);
+    for (size_t index : found)
+    {
+        mTree->children[index]->DrawVisible(dc, scale, local);
+    }
+    dc.SetLogicalOrigin(origin.x, origin.y);
+}
+
+void GroupShape::DrawSvg(SvgWriter& svg) const
+{
+    bool moved = mTransform != Affine();
+    if (moved)
+        svg.BeginTransform(mTransform);
+    for (auto& child : mTree->children)
+    {
+        child->DrawSvg(svg);
+    }
+    if (moved)
+        svg.EndGroup();
+}
+
+std::shared_ptr<Shape> GroupShape::Clone() const
+{
+    return std::allocate_shared<GroupShape>(ArenaAllocator<GroupShape>(mAlloc), *this);
+}
+
+bool GroupShape::Intersects(const wxPoint& point) const
+{
+    if (!Shape::Intersects(point))
+        return false;
+    
+    wxPoint local = mTransform.Inverse().Apply(point);
+    std::vector<size_t> found;
+    Query(wxRect(local, wxSize(1, 1)), found);
+    for (size_t index : found)
+    {
+        if (mTree->children[index]->Intersects(local))
+            return true;
+    }
+    return false;
+}
+
+void GroupShape::Update(const wxPoint &newPoint)
+{
+    
+}
+
+wxUint32 GroupShape::GetDotColor() const
+{
+    return mTree->children.empty() ? mStyle.penColor : mTree->children.back()->GetDotColor();
+}
+
+void GroupShape::GetOutline(Geometry& outline) const
+{
+    outline.points.push_back(mTopLeft);
+    outline.points.push_back(wxPoint(mBotRight.x, mTopLeft.y));
+    outline.points.push_back(mBotRight);
+    outline.points.push_back(wxPoint(mTopLeft.x, mBotRight.y));
+}
+
+void GroupShape::HashGeometry(ContentHash& hash) const
+{
+    for (auto& child : mTree->children)
+    {
+        wxPoint topLeft, botRight;
+        child->GetBounds(topLeft, botRight);
+        hash.Add(child->GetContentHash());
+        hash.Add(topLeft - mTopLeft);
+    }
+}
+
+void GroupShape::EncodeGeometry(OpWriter& out) const
+{
+    out.PutVarint(mTree->children.size());
+    for (auto& child : mTree->children)
+    {
+        child->Encode(out);
+    }
+}
+
+void GroupShape::DecodeGeometry(OpReader& in, size_t depth)
+{
+    size_t count = in.GetCount();
+    std::vector<std::shared_ptr<Shape>> children;
+    for (size_t i = 0; i < count && in.IsOk(); i++)
+    {
+        std::shared_ptr<Shape> child = Decode(in, mAlloc, 0, depth + 1);
+        if (child)
+            children.push_back(child);
+    }
+    SetChildren(children);
+}
+
+bool GroupShape::SameGeometry(const Shape& before) const
+{
+    return mTree == static_cast<const GroupShape&>(before).mTree;
+}
+
+bool GroupShape::IsExpensive() const
+{
+    return mTree->children.size() >= kManyChildren || Shape::IsExpensive();
+}
@@ -1,29 +1,215 @@
 #pragma once
 #include <wx/dc.h>
+#include <wx/gdicmn.h>
+#include <memory>
+#include <vector>
+#include "Affine.h"
+#include "Arena.h"
+#include "FloodFill.h"
+#include "PersistentSequence.h"
 
-// Abstract base class for all Shapes
+class SvgWriter;
+class OpWriter;
+class OpReader;
+class Lasso;
+
+// Identifies a shape across all of its copy-on-write versions
+typedef unsigned long ShapeId;
+
+// Pen and brush as plain values. wxPen and wxBrush share reference
+// counts that aren't thread-safe, so shapes keep this instead and only
+// build the wx objects while drawing.
+struct ShapeStyle
+{
+    // 0xAARRGGBB
+    wxUint32 penColor;
+    int penWidth;
+    wxUint32 brushColor;
+
+    static wxUint32 Pack(const wxColour& color);
+    static wxColour Unpack(wxUint32 color);
+};
+
+// 64-bit FNV-1a over whatever is added to it
+class ContentHash
+{
+public:
+    ContentHash()
+        :mValue(14695981039346656037ULL)
+    {
+    }
+    void Add(const void* data, size_t size);
+    template <class T>
+    void Add(const T& value)
+    {
+        Add(&value, sizeof(value));
+    }
+    unsigned long long GetValue() const
+    {
+        return mValue;
+    }
+private:
+    unsigned long long mValue;
+};
+
+// Pointer to derived data that const methods fill in on either the UI
+// or the render thread, so it's only ever read and written atomically
+template <class T>
+class SharedCache
+{
+public:
+    SharedCache()
+    {
+    }
+    SharedCache(const SharedCache& other)
+        :mPtr(other.Get())
+    {
+    }
+    SharedCache& operator=(const SharedCache& other)
+    {
+        Set(other.Get());
+        return *this;
+    }
+    std::shared_ptr<const T> Get() const
+    {
+        return std::atomic_load(&mPtr);
+    }
+    void Set(const std::shared_ptr<const T>& value) const
+    {
+        std::atomic_store(&mPtr, value);
+    }
+private:
+    mutable std::shared_ptr<const T> mPtr;
+};
+
+// What a shape is, for code that has to say so (see Shape::Encode)
+enum ShapeKind
+{
+    SK_Rect,
+    SK_Ellipse,
+    SK_Line,
+    SK_Pencil,
+    SK_Fill,
+    SK_Group,
+};
+
+// Handles on the selection box. Dragging a side or corner scales the
+// shape about the opposite one; the handle above the top rotates it.
+enum HandleType
+{
+    HD_None,
+    HD_TopLeft,
+    HD_Top,
+    HD_TopRight,
+    HD_Right,
+    HD_BotRight,
+    HD_Bot,
+    HD_BotLeft,
+    HD_Left,
+    HD_Rotate,
+    // Inside the box but not on a handle
+    HD_Move,
+};
+
+// Abstract base class for all Shapes. Shapes reachable from a snapshot
+// are never changed: the layer copies a shape before editing it unless
+// the shape was made under the layer's current epoch (see Layer::Edit).
 class Shape
 {
 public:
-	Shape(const wxPoint& start);
+	// Any per-shape storage is drawn from the allocator's arena
+	Shape(const wxPoint& start, const ArenaAllocator<Shape>& alloc = ArenaAllocator<Shape>());
 	// Tests whether the provided point intersects
 	// with this shape
-	bool Intersects(const wxPoint& point) const;
+	virtual bool Intersects(const wxPoint& point) const;
+	// Points worth snapping to (corners, midpoints, ends, extremes),
+	// in the document
+	void GetSnapPoints(std::vector<wxPoint>& points) const;
+	// Whether the whole outline (after the transform) is inside the
+	// lasso, which must be finished
+	bool IsInside(const Lasso& lasso) const;
 	// Update shape with new provided point
 	virtual void Update(const wxPoint& newPoint);
 	// Finalize the shape -- when the user has finished drawing the shape
 	virtual void Finalize();
-	// Returns the top left/bottom right points of the shape
+	// Returns the top left/bottom right points of the shape, in the
+	// document (after the transform)
 	void GetBounds(wxPoint& topLeft, wxPoint& botRight) const;
 	// Draw the shape
 	virtual void Draw(wxDC& dc) const = 0;
+	// Draw the shape for a view at this scale (screen pixels per
+	// document pixel); shapes with a cheaper version at small scales
+	// override this
+	virtual void DrawAtScale(wxDC& dc, double scale) const
+	{
+		Draw(dc);
+	}
+	// Draw only what's inside visible (document coordinates); groups
+	// use it to skip children that are off screen
+	virtual void DrawVisible(wxDC& dc, double scale, const wxRect& visible) const
+	{
+		DrawAtScale(dc, scale);
+	}
+	// Colour of the shape when it's too small to be more than a pixel
+	virtual wxUint32 GetDotColor() const
+	{
+		return mStyle.penColor;
+	}
+	// Write the shape out as an SVG element
+	virtual void DrawSvg(SvgWriter& svg) const = 0;
+	// Copy with the same id, to be edited in place of this one
+	virtual std::shared_ptr<Shape> Clone() const = 0;
+	// Copy with a new id for paste and duplicate. It shares the
+	// geometry, so only its transform and style cost anything.
+	std::shared_ptr<Shape> Duplicate() const;
+	// Identifies what the shape looks like wherever it is: its outline
+	// relative to its corner, its style, and its transform less any
+	// whole-pixel move. Shapes with the same hash draw the same pixels,
+	// shifted, so a raster of one serves them all (see SpriteCache).
+	unsigned long long GetContentHash() const;
+	// Whether the shape is slow enough to draw to be worth a raster
+	virtual bool IsExpensive() const;
+	virtual ShapeKind GetKind() const = 0;
+	// Writes the shape to a command stream: everything but its id and
+	// where it sits on the layer
+	void Encode(OpWriter& out) const;
+	// Reads a shape Encode wrote, under id or else a new one; null if
+	// the data is bad. depth is how many groups the shape is inside;
+	// groups nested past kMaxDecodeDepth count as bad data, so a peer
+	// can't run the reader out of stack.
+	static std::shared_ptr<Shape> Decode(OpReader& in,
+		const ArenaAllocator<Shape>& alloc = ArenaAllocator<Shape>(), ShapeId id = 0, size_t depth = 0);
+	static const size_t kMaxDecodeDepth = 256;
+	// Pen widths the UI offers; decoded styles outside them are bad data
+	static const int kMinPenWidth = 1;
+	static const int kMaxPenWidth = 10;
+	// Writes how this shape differs from before, an older version of
+	// it. Returns false, writing nothing, if it doesn't.
+	bool EncodeChanges(const Shape& before, OpWriter& out) const;
+	// Applies what EncodeChanges wrote; false if the data is bad
+	bool DecodeChanges(OpReader& in);
 	virtual ~Shape() { }
     
-    int GetWidth();
+    ShapeId GetId() const
+    {
+        return mId;
+    }
     
-    wxColour GetPenColor();
+    // Epoch of the sequence allowed to change this copy in place
+    unsigned long GetEpoch() const
+    {
+        return mEpoch;
+    }
+    void SetEpoch(unsigned long epoch)
+    {
+        mEpoch = epoch;
+    }
     
-    wxColour GetBrushColor();
+    int GetWidth() const;
+    
+    wxColour GetPenColor() const;
+    
+    wxColour GetBrushColor() const;
     
     void SetWidth(int width);
     
@@ -31,22 +217,99 @@ public:
     
     void SetBColor(wxColour color);
     
-    void DrawSelection(wxDC& dc);
+    const ShapeStyle& GetStyle() const
+    {
+        return mStyle;
+    }
+    void SetStyle(const ShapeStyle& style)
+    {
+        mStyle = style;
+    }
     
+    // Bounds box, with its handles unless it's only one of several
+    // shapes picked for grouping, sized for the DC's user scale
+    void DrawSelection(wxDC& dc, bool handles = true) const;
+    // Handle of the selection box at point, for a view at this scale
+    HandleType HitHandle(const wxPoint& point, double scale) const;
+    // Where a handle sits on the selection box of bounds topLeft/botRight
+    static wxPoint HandlePosition(HandleType handle, const wxPoint& topLeft,
+        const wxPoint& botRight, double scale);
+    
+    // Built fresh from the style on every call
     wxPen GetPen() const;
     
     wxBrush GetBrush() const;
     
-    void UpdateOffset(const wxPoint &offset);
-    
-    wxPoint mOffset;
+    // Position label within the layer: larger is higher up. Only the
+    // layer sets it (see Layer::Insert).
+    unsigned long long GetOrder() const
+    {
+        return mOrder;
+    }
+    void SetOrder(unsigned long long order)
+    {
+        mOrder = order;
+    }
     
-    std::vector<wxBrush> undoBrush;
-    std::vector<wxBrush> redoBrush;
-    std::vector<wxPen> undoPen;
-    std::vector<wxPen> redoPen;
+    // Maps the shape's own coordinates into the document
+    const Affine& GetTransform() const
+    {
+        return mTransform;
+    }
+    void SetTransform(const Affine& transform);
 
 protected:
+    // The shape's outline in its own coordinates; with a transform that
+    // isn't a whole-pixel translation, the same run through it
+    struct Geometry
+    {
+        std::vector<wxPoint> points;
+        // Pencil strokes: the decimated copies, matching mLevels
+        std::vector<std::vector<wxPoint>> levels;
+        wxPoint topLeft;
+        wxPoint botRight;
+    };
+    
+    // Fills in the untransformed outline
+    virtual void GetOutline(Geometry& outline) const = 0;
+    // Snap points in the shape's own coordinates; by default the
+    // corners and centre of its box
+    virtual void GetFeatures(std::vector<wxPoint>& points) const;
+    // Transformed outline. Worked out once on first use after the shape
+    // or its transform changes, then shared by every copy and snapshot
+    // of this version, so a drag costs one pass per edit however many
+    // times it's drawn.
+    std::shared_ptr<const Geometry> GetGeometry() const;
+    // Drops the cached outline after the shape's points change
+    void ResetGeometry()
+    {
+        mGeometry.Set(std::shared_ptr<const Geometry>());
+        mGeometryHash.Set(std::shared_ptr<const unsigned long long>());
+    }
+    // Adds the untransformed outline, relative to mTopLeft, to hash
+    virtual void HashGeometry(ContentHash& hash) const;
+    // The untransformed outline for Encode; by default the start and
+    // end points
+    virtual void EncodeGeometry(OpWriter& out) const;
+    // depth is the shape's, as for Decode
+    virtual void DecodeGeometry(OpReader& in, size_t depth);
+    // Whether before, an older version of the shape, has this outline
+    virtual bool SameGeometry(const Shape& before) const;
+    // The outline for EncodeChanges, by default all of it
+    virtual void EncodeGeometryChange(const Shape& before, OpWriter& out) const
+    {
+        EncodeGeometry(out);
+    }
+    virtual void DecodeGeometryChange(OpReader& in)
+    {
+        DecodeGeometry(in, 0);
+    }
+    // SVG elements are written in the shape's own coordinates: a
+    // translation comes back as an offset to add, anything else opens
+    // a group with the matrix that EndSvg closes
+    wxPoint BeginSvg(SvgWriter& svg) const;
+    void EndSvg(SvgWriter& svg) const;
+    
 	// Starting point of shape
 	wxPoint mStartPoint;
 	// Ending point of shape
@@ -56,20 +319,50 @@ protected:
 	// Bottom right point of shape
 	wxPoint mBotRight;
     
-    wxPen pen;
-    wxBrush brush;
-   
+    ShapeStyle mStyle;
+    ArenaAllocator<Shape> mAlloc;
+    ShapeId mId;
+    unsigned long mEpoch;
+    unsigned long long mOrder;
+    Affine mTransform;
+
+private:
+    SharedCache<Geometry> mGeometry;
+    // HashGeometry's result, reset along with mGeometry
+    SharedCache<unsigned long long> mGeometryHash;
+};
+
+// Shapes are kept in a layer by their order label
+struct ShapeOrder
+{
+    static unsigned long long Of(const std::shared_ptr<Shape>& shape)
+    {
+        return shape->GetOrder();
+    }
 };
 
+// The shapes of one layer, bottom to top
+typedef PersistentSequence<std::shared_ptr<Shape>, ShapeOrder> ShapeSequence;
+
 
 
 class RectShape : public Shape
 {
 public:
     
-    RectShape(const wxPoint& start);    
+    RectShape(const wxPoint& start, const ArenaAllocator<Shape>& alloc = ArenaAllocator<Shape>());    
     void Draw(wxDC& dc) const override;
+    void DrawSvg(SvgWriter& svg) const override;
+    std::shared_ptr<Shape> Clone() const override;
+    ShapeKind GetKind() const override
+    {
+        return SK_Rect;
+    }
     
+protected:
+    void GetOutline(Geometry& outline) const override;
+    // Corners, side midpoints and centre
+    void GetFeatures(std::vector<wxPoint>& points) const override;
 };
 
 
@@ -77,10 +370,20 @@ class EllipseShape : public Shape
 {
 public:
     
-    EllipseShape(const wxPoint& start);
+    EllipseShape(const wxPoint& start, const ArenaAllocator<Shape>& alloc = ArenaAllocator<Shape>());
     
     void Draw(wxDC& dc) const override;
+    void DrawSvg(SvgWriter& svg) const override;
+    std::shared_ptr<Shape> Clone() const override;
+    ShapeKind GetKind() const override
+    {
+        return SK_Ellipse;
+    }
     
+protected:
+    void GetOutline(Geometry& outline) const override;
+    // Top, bottom, left and right extremes, and centre
+    void GetFeatures(std::vector<wxPoint>& points) const override;
 };
 
 
@@ -88,10 +391,20 @@ class LineShape : public Shape
 {
 public:
     
-    LineShape(const wxPoint& start);
+    LineShape(const wxPoint& start, const ArenaAllocator<Shape>& alloc = ArenaAllocator<Shape>());
     
     void Draw(wxDC& dc) const override;
+    void DrawSvg(SvgWriter& svg) const override;
+    std::shared_ptr<Shape> Clone() const override;
+    ShapeKind GetKind() const override
+    {
+        return SK_Line;
+    }
     
+protected:
+    void GetOutline(Geometry& outline) const override;
+    // Ends and midpoint
+    void GetFeatures(std::vector<wxPoint>& points) const override;
 };
 
 
@@ -99,14 +412,202 @@ class PencilShape : public Shape
 {
 public:
     
-    PencilShape(const wxPoint& start);
+    PencilShape(const wxPoint& start, const ArenaAllocator<Shape>& alloc = ArenaAllocator<Shape>());
     
     void Draw(wxDC& dc) const override;
+    void DrawSvg(SvgWriter& svg) const override;
+    void DrawAtScale(wxDC& dc, double scale) const override;
+    std::shared_ptr<Shape> Clone() const override;
     void Update(const wxPoint& newPoint) override;
+    // Builds the decimated copies of the points
     void Finalize() override;
+    bool IsExpensive() const override;
+    ShapeKind GetKind() const override
+    {
+        return SK_Pencil;
+    }
+    // Replaces the whole stroke at once, for strokes that weren't drawn
+    // a point at a time; Finalize still has to follow
+    void SetPoints(const wxPoint* points, size_t count);
+    
+    size_t GetPointCount() const
+    {
+        return mCount;
+    }
+    const wxPoint* GetPoints() const
+    {
+        return mPoints->data();
+    }
+    
+private:
+    // 64 points is exactly one 512 byte pool block
+    static const size_t kInitialPoints = 64;
+    // Most decimated copies kept per stroke
+    static const int kMaxLevels = 10;
     
-    std::vector<wxPoint> points;
+    // Points no closer together than tolerance (in document pixels),
+    // for drawing once that's under a screen pixel
+    struct Level
+    {
+        Level(double tol, const ArenaAllocator<wxPoint>& alloc)
+            :tolerance(tol)
+            ,points(alloc)
+        {
+        }
+        double tolerance;
+        ArenaVector<wxPoint> points;
+    };
     
+    void GetOutline(Geometry& outline) const override;
+    // Where the stroke starts and ends
+    void GetFeatures(std::vector<wxPoint>& points) const override;
+    void HashGeometry(ContentHash& hash) const override;
+    void EncodeGeometry(OpWriter& out) const override;
+    void DecodeGeometry(OpReader& in, size_t depth) override;
+    bool SameGeometry(const Shape& before) const override;
+    // Strokes being drawn only grow, so just the new points go
+    void EncodeGeometryChange(const Shape& before, OpWriter& out) const override;
+    void DecodeGeometryChange(OpReader& in) override;
+    void DrawPoints(wxDC& dc, const wxPoint* points, size_t count, const wxPoint& offset) const;
+    // Makes points, which nothing else holds, the stroke's own
+    void Adopt(const std::shared_ptr<ArenaVector<wxPoint>>& points);
+    
+    // Copies of a stroke share one buffer that is only ever appended
+    // to, and never past its capacity, so cloning mid-stroke is O(1)
+    // and older copies never see their points move or change
+    std::shared_ptr<ArenaVector<wxPoint>> mPoints;
+    // Points belonging to this copy
+    size_t mCount;
+    // Coarsest last; empty until the stroke is finished
+    std::shared_ptr<const std::vector<Level>> mLevels;
 };
 
+// Region painted by the bucket tool, kept as rectangles (runs of
+// pixels merged down the rows) rather than a full-size image
+class FillShape : public Shape
+{
+public:
+    
+    FillShape(const wxPoint& start, const ArenaAllocator<Shape>& alloc = ArenaAllocator<Shape>());
+    
+    void Draw(wxDC& dc) const override;
+    void DrawSvg(SvgWriter& svg) const override;
+    std::shared_ptr<Shape> Clone() const override;
+    // The region is fixed once filled, so dragging doesn't change it
+    void Update(const wxPoint& newPoint) override;
+    
+    wxUint32 GetDotColor() const override
+    {
+        return mStyle.brushColor;
+    }
+    bool IsExpensive() const override;
+    ShapeKind GetKind() const override
+    {
+        return SK_Fill;
+    }
+    
+    // Takes the spans from FloodFill and works out the bounds
+    void SetSpans(const std::vector<FillSpan>& fill);
+    
+protected:
+    // Four corners per rectangle
+    void GetOutline(Geometry& outline) const override;
+    void HashGeometry(ContentHash& hash) const override;
+    void EncodeGeometry(OpWriter& out) const override;
+    void DecodeGeometry(OpReader& in, size_t depth) override;
+    bool SameGeometry(const Shape& before) const override;
+    
+private:
+    // Never changed after SetSpans, so copies share it
+    std::shared_ptr<const ArenaVector<wxRect>> mRects;
+};
 
+// Shapes handled as one. The children are fixed when the group is made
+// and shared by every copy, along with a bounding volume hierarchy over
+// them, so drawing and hit tests only look inside boxes that matter.
+// Moving or scaling the group changes nothing but its own transform.
+class GroupShape : public Shape
+{
+public:
+    
+    // children are in the group's coordinates, bottom to top
+    GroupShape(const std::vector<std::shared_ptr<Shape>>& children,
+        const ArenaAllocator<Shape>& alloc = ArenaAllocator<Shape>());
+    
+    void Draw(wxDC& dc) const override;
+    void DrawAtScale(wxDC& dc, double scale) const override;
+    void DrawVisible(wxDC& dc, double scale, const wxRect& visible) const override;
+    void DrawSvg(SvgWriter& svg) const override;
+    std::shared_ptr<Shape> Clone() const override;
+    // Hits only if one of the children does
+    bool Intersects(const wxPoint& point) const override;
+    // The children are fixed
+    void Update(const wxPoint& newPoint) override;
+    wxUint32 GetDotColor() const override;
+    bool IsExpensive() const override;
+    ShapeKind GetKind() const override
+    {
+        return SK_Group;
+    }
+    
+    size_t GetChildCount() const
+    {
+        return mTree->children.size();
+    }
+    // Copies of the children with the group's transform applied, to
+    // put back on the layer in its place
+    std::vector<std::shared_ptr<Shape>> Ungroup() const;
+    
+protected:
+    // Corners of the children's bounds
+    void GetOutline(Geometry& outline) const override;
+    // The children's hashes and where they sit in the group
+    void HashGeometry(ContentHash& hash) const override;
+    // The children, each encoded whole
+    void EncodeGeometry(OpWriter& out) const override;
+    void DecodeGeometry(OpReader& in, size_t depth) override;
+    bool SameGeometry(const Shape& before) const override;
+    
+private:
+    // Most children in a leaf of the hierarchy
+    static const size_t kLeafSize = 8;
+    
+    struct Node
+    {
+        // Area the children below can paint on
+        wxRect area;
+        // Leaves: range of Tree::order; inner nodes: count is 0, the
+        // left child is the next node and right is the other
+        size_t first;
+        size_t count;
+        size_t right;
+    };
+    struct Tree
+    {
+        std::vector<std::shared_ptr<Shape>> children;
+        std::vector<Node> nodes;
+        // Children indices, grouped by leaf
+        std::vector<size_t> order;
+    };
+    // Children carrying the group's transform, for transforms that
+    // aren't plain translations
+    struct Placed
+    {
+        Affine transform;
+        std::vector<std::shared_ptr<Shape>> children;
+    };
+    
+    // Builds the hierarchy over children and takes on its bounds
+    void SetChildren(const std::vector<std::shared_ptr<Shape>>& children);
+    // Builds the node for order[first, first + count) and those below
+    static size_t Build(Tree& tree, size_t first, size_t count);
+    // Indices of the children whose area meets area (group
+    // coordinates), bottom to top
+    void Query(const wxRect& area, std::vector<size_t>& found) const;
+    // Part of the group's coordinates that a document area covers
+    wxRect ToLocal(const wxRect& area) const;
+    std::shared_ptr<const Placed> GetPlaced() const;
+    
+    std::shared_ptr<const Tree> mTree;
+    SharedCache<Placed> mPlaced;
+};
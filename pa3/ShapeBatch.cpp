@@ -0,0 +1,115 @@
+#include "ShapeBatch.h"
+
+ShapeBatch::ShapeBatch()
+{
+}
+
+void ShapeBatch::Reserve(size_t items, size_t points)
+{
+    mItems.reserve(items);
+    mPoints.reserve(points);
+}
+
+size_t ShapeBatch::AddStyle(const ShapeStyle& shapeStyle)
+{
+    ShapeStyle style = shapeStyle;
+    if (style.penWidth < Shape::kMinPenWidth)
+        style.penWidth = Shape::kMinPenWidth;
+    else if (style.penWidth > Shape::kMaxPenWidth)
+        style.penWidth = Shape::kMaxPenWidth;
+    std::tuple<wxUint32, int, wxUint32> key(style.penColor, style.penWidth, style.brushColor);
+    auto iter = mStyleIndex.find(key);
+    if (iter != mStyleIndex.end())
+        return iter->second;
+    mStyles.push_back(style);
+    mStyleIndex[key] = mStyles.size() - 1;
+    return mStyles.size() - 1;
+}
+
+size_t ShapeBatch::AddStyle(const wxColour& pen, int width, const wxColour& brush)
+{
+    ShapeStyle style;
+    style.penColor = ShapeStyle::Pack(pen);
+    style.penWidth = width;
+    style.brushColor = ShapeStyle::Pack(brush);
+    return AddStyle(style);
+}
+
+void ShapeBatch::Add(ShapeKind kind, const wxPoint& start, const wxPoint& end, size_t style)
+{
+    Item item = { kind, style, start, end, 0, 0 };
+    mItems.push_back(item);
+}
+
+void ShapeBatch::AddRect(const wxPoint& start, const wxPoint& end, size_t style)
+{
+    Add(SK_Rect, start, end, style);
+}
+
+void ShapeBatch::AddEllipse(const wxPoint& start, const wxPoint& end, size_t style)
+{
+    Add(SK_Ellipse, start, end, style);
+}
+
+void ShapeBatch::AddLine(const wxPoint& start, const wxPoint& end, size_t style)
+{
+    Add(SK_Line, start, end, style);
+}
+
+void ShapeBatch::AddStroke(const wxPoint* points, size_t count, size_t style)
+{
+    if (count == 0)
+        return;
+    Item item = { SK_Pencil, style, points[0], points[count - 1], mPoints.size(), count };
+    mPoints.insert(mPoints.end(), points, points + count);
+    mItems.push_back(item);
+}
+
+void ShapeBatch::Clear()
+{
+    mItems.clear();
+    mPoints.clear();
+    mStyles.clear();
+    mStyleIndex.clear();
+}
+
+std::vector<std::shared_ptr<Shape>> ShapeBatch::Build(const ArenaAllocator<Shape>& alloc) const
+{
+    std::vector<std::shared_ptr<Shape>> shapes;
+    shapes.reserve(mItems.size());
+    for (const Item& item : mItems)
+    {
+        std::shared_ptr<Shape> shape;
+        switch (item.kind)
+        {
+            case SK_Rect:
+                shape = std::allocate_shared<RectShape>(alloc, item.start, alloc);
+                shape->Update(item.end);
+                break;
+            case SK_Ellipse:
+                shape = std::allocate_shared<EllipseShape>(alloc, item.start, alloc);
+                shape->Update(item.end);
+                break;
+            case SK_Line:
+                shape = std::allocate_shared<LineShape>(alloc, item.start, alloc);
+                shape->Update(item.end);
+                break;
+            case SK_Pencil:
+            {
+                std::shared_ptr<PencilShape> stroke =
+                    std::allocate_shared<PencilShape>(alloc, item.start, alloc);
+                stroke->SetPoints(&mPoints[item.first], item.count);
+                // What drawing a stroke does once the mouse is let go
+                stroke->Finalize();
+                shape = stroke;
+                break;
+            }
+            default:
+                continue;
+        }
+        if (item.style < mStyles.size())
+            shape->SetStyle(mStyles[item.style]);
+        shapes.push_back(shape);
+    }
+    return shapes;
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include <map>
+#include <memory>
+#include <tuple>
+#include <vector>
+#include <wx/colour.h>
+#include <wx/gdicmn.h>
+#include "Shape.h"
+
+// Shapes described as plain arrays, for building a document from code
+// (charts, diagrams, generated art) rather than through the tools.
+// Nothing is allocated per shape until Build, and PaintModel::AddShapes
+// puts the lot on the layer as one undoable step.
+//
+// Styles are interned: each distinct style is stored once, and items
+// name theirs by the index AddStyle returned.
+class ShapeBatch
+{
+public:
+    // One shape. Rectangles and ellipses span start to end, as if
+    // dragged; lines join them. A stroke runs through points
+    // [first, first + count) of the batch's points.
+    struct Item
+    {
+        ShapeKind kind;
+        size_t style;
+        wxPoint start;
+        wxPoint end;
+        size_t first;
+        size_t count;
+    };
+
+    ShapeBatch();
+
+    // Makes room up front, so adding that many items and stroke
+    // points doesn't reallocate
+    void Reserve(size_t items, size_t points = 0);
+
+    // Index of the style, adding it if the batch hasn't seen it. Pen
+    // widths are clamped to the ones the UI offers (Shape::kMinPenWidth
+    // to kMaxPenWidth).
+    size_t AddStyle(const ShapeStyle& style);
+    size_t AddStyle(const wxColour& pen, int width, const wxColour& brush);
+
+    void AddRect(const wxPoint& start, const wxPoint& end, size_t style = 0);
+    void AddEllipse(const wxPoint& start, const wxPoint& end, size_t style = 0);
+    void AddLine(const wxPoint& start, const wxPoint& end, size_t style = 0);
+    // A pencil stroke through count points; empty ones are skipped
+    void AddStroke(const wxPoint* points, size_t count, size_t style = 0);
+
+    size_t GetCount() const
+    {
+        return mItems.size();
+    }
+    const std::vector<Item>& GetItems() const
+    {
+        return mItems;
+    }
+    const std::vector<ShapeStyle>& GetStyles() const
+    {
+        return mStyles;
+    }
+    void Clear();
+
+    // The shapes, bottom to top. Items whose style index is out of
+    // range get the default style.
+    std::vector<std::shared_ptr<Shape>> Build(const ArenaAllocator<Shape>& alloc = ArenaAllocator<Shape>()) const;
+
+private:
+    void Add(ShapeKind kind, const wxPoint& start, const wxPoint& end, size_t style);
+
+    std::vector<Item> mItems;
+    std::vector<wxPoint> mPoints;
+    std::vector<ShapeStyle> mStyles;
+    // Index of each style, keyed on its values
+    std::map<std::tuple<wxUint32, int, wxUint32>, size_t> mStyleIndex;
+};
@@ -0,0 +1,266 @@
+#include "Snapper.h"
+#include "Layer.h"
+#include <algorithm>
+#include <cmath>
+#include <wx/pen.h>
+#include <wx/brush.h>
+
+namespace
+{
+    struct ByX
+    {
+        bool operator()(const SnapFeature& a, const SnapFeature& b) const
+        {
+            return a.point.x < b.point.x;
+        }
+    };
+
+    struct ByY
+    {
+        bool operator()(const SnapFeature& a, const SnapFeature& b) const
+        {
+            return a.point.y < b.point.y;
+        }
+    };
+
+    // Nearest multiple of size, rounding halves up
+    int RoundTo(int value, int size)
+    {
+        return static_cast<int>(std::floor(static_cast<double>(value) / size + 0.5)) * size;
+    }
+}
+
+SnapIndex::SnapIndex()
+{
+}
+
+void SnapIndex::Build(std::vector<SnapFeature>& features)
+{
+    mFeatures.clear();
+    mFeatures.swap(features);
+    Split(0, mFeatures.size(), 0);
+}
+
+void SnapIndex::Clear()
+{
+    mFeatures.clear();
+}
+
+void SnapIndex::Split(size_t first, size_t last, int axis)
+{
+    if (last - first <= kLeafSize)
+        return;
+    size_t middle = first + (last - first) / 2;
+    if (axis == 0)
+        std::nth_element(mFeatures.begin() + first, mFeatures.begin() + middle, mFeatures.begin() + last, ByX());
+    else
+        std::nth_element(mFeatures.begin() + first, mFeatures.begin() + middle, mFeatures.begin() + last, ByY());
+    Split(first, middle, 1 - axis);
+    Split(middle + 1, last, 1 - axis);
+}
+
+void SnapIndex::Nearest(const wxPoint& point, size_t k, double radius, ShapeId exclude,
+    std::vector<SnapFeature>& found) const
+{
+    found.clear();
+    if (k == 0 || mFeatures.empty() || radius < 0.0)
+        return;
+
+    Query query;
+    query.point = point;
+    query.k = k;
+    query.exclude = exclude;
+    query.radius2 = static_cast<long long>(std::floor(radius * radius));
+    query.best.reserve(k + 1);
+    Search(0, mFeatures.size(), 0, query);
+
+    std::sort_heap(query.best.begin(), query.best.end());
+    for (auto& entry : query.best)
+    {
+        found.push_back(mFeatures[entry.second]);
+    }
+}
+
+void SnapIndex::Search(size_t first, size_t last, int axis, Query& query) const
+{
+    if (last - first <= kLeafSize)
+    {
+        for (size_t i = first; i < last; i++)
+        {
+            Consider(i, query);
+        }
+        return;
+    }
+
+    size_t middle = first + (last - first) / 2;
+    Consider(middle, query);
+    const wxPoint& split = mFeatures[middle].point;
+    long long offset = (axis == 0) ? query.point.x - split.x : query.point.y - split.y;
+    // The side the point is on first; the other only if the splitting
+    // line is closer than the worst match so far
+    if (offset < 0)
+    {
+        Search(first, middle, 1 - axis, query);
+        if (offset * offset <= Worst(query))
+            Search(middle + 1, last, 1 - axis, query);
+    }
+    else
+    {
+        Search(middle + 1, last, 1 - axis, query);
+        if (offset * offset <= Worst(query))
+            Search(first, middle, 1 - axis, query);
+    }
+}
+
+void SnapIndex::Consider(size_t index, Query& query) const
+{
+    const SnapFeature& feature = mFeatures[index];
+    if (feature.shape == query.exclude && query.exclude != 0)
+        return;
+    long long dx = feature.point.x - query.point.x;
+    long long dy = feature.point.y - query.point.y;
+    long long distance = dx * dx + dy * dy;
+    if (distance > Worst(query))
+        return;
+    if (query.best.size() == query.k && distance == query.best.front().first)
+        return;
+
+    query.best.push_back(std::make_pair(distance, index));
+    std::push_heap(query.best.begin(), query.best.end());
+    if (query.best.size() > query.k)
+    {
+        std::pop_heap(query.best.begin(), query.best.end());
+        query.best.pop_back();
+    }
+}
+
+long long SnapIndex::Worst(const Query& query)
+{
+    return (query.best.size() < query.k) ? query.radius2 : query.best.front().first;
+}
+
+Snapper::Snapper()
+    :mGridSize(16)
+    ,mSnapToGrid(false)
+    ,mSnapToShapes(false)
+    ,mLayerId(0)
+    ,mLayerVersion(0)
+    ,mGuide(SG_None)
+{
+}
+
+void Snapper::SetGridSize(int size)
+{
+    mGridSize = std::max(1, size);
+}
+
+void Snapper::SetSnapToGrid(bool on)
+{
+    mSnapToGrid = on;
+    ClearGuide();
+}
+
+void Snapper::SetSnapToShapes(bool on)
+{
+    mSnapToShapes = on;
+    ClearGuide();
+    if (!on)
+    {
+        // Nothing to keep up to date until it's back on
+        mIndex.Clear();
+        mLayerId = 0;
+    }
+}
+
+void Snapper::ClearGuide()
+{
+    mGuide = SG_None;
+}
+
+wxPoint Snapper::Snap(const wxPoint& point, double scale, const Layer& layer, ShapeId exclude, bool reindex)
+{
+    mGuide = SG_None;
+    if (mSnapToShapes)
+    {
+        if (layer.GetId() != mLayerId || (reindex && layer.GetVersion() != mLayerVersion))
+            Index(layer);
+        std::vector<SnapFeature> found;
+        mIndex.Nearest(point, 1, kRadius / scale, exclude, found);
+        if (!found.empty())
+        {
+            mGuide = SG_Shape;
+            mGuidePoint = found.front().point;
+            return mGuidePoint;
+        }
+    }
+    if (mSnapToGrid)
+    {
+        mGuide = SG_Grid;
+        mGuidePoint = wxPoint(RoundTo(point.x, mGridSize), RoundTo(point.y, mGridSize));
+        return mGuidePoint;
+    }
+    return point;
+}
+
+void Snapper::Index(const Layer& layer)
+{
+    std::vector<SnapFeature> features;
+    std::vector<wxPoint> points;
+    features.reserve(layer.GetCount() * 5);
+    if (layer.IsVisible())
+    {
+        layer.GetShapes().ForEach([&features, &points](const std::shared_ptr<Shape>& shape)
+        {
+            points.clear();
+            shape->GetSnapPoints(points);
+            for (auto& point : points)
+            {
+                SnapFeature feature = { point, shape->GetId() };
+                features.push_back(feature);
+            }
+        });
+    }
+    mIndex.Build(features);
+    mLayerId = layer.GetId();
+    mLayerVersion = layer.GetVersion();
+}
+
+void Snapper::Draw(wxDC& dc) const
+{
+    double scale, scaleY;
+    dc.GetUserScale(&scale, &scaleY);
+    wxPoint origin = dc.GetDeviceOrigin();
+    wxSize size = dc.GetSize();
+    // Part of the document the DC shows
+    int left = static_cast<int>(std::floor(-origin.x / scale));
+    int top = static_cast<int>(std::floor(-origin.y / scale));
+    int right = static_cast<int>(std::ceil((size.x - origin.x) / scale));
+    int bottom = static_cast<int>(std::ceil((size.y - origin.y) / scale));
+
+    if (mSnapToGrid && mGridSize * scale >= kMinGridPixels)
+    {
+        dc.SetPen(wxPen(wxColour(220, 220, 220)));
+        for (int x = RoundTo(left, mGridSize); x <= right; x += mGridSize)
+        {
+            dc.DrawLine(x, top, x, bottom);
+        }
+        for (int y = RoundTo(top, mGridSize); y <= bottom; y += mGridSize)
+        {
+            dc.DrawLine(left, y, right, y);
+        }
+    }
+
+    if (mGuide == SG_None)
+        return;
+    // Shape snaps get lines right across the view, to line things up by
+    dc.SetBrush(*wxTRANSPARENT_BRUSH);
+    if (mGuide == SG_Shape)
+    {
+        dc.SetPen(wxPen(wxColour(0, 160, 255), 1, wxPENSTYLE_SHORT_DASH));
+        dc.DrawLine(left, mGuidePoint.y, right, mGuidePoint.y);
+        dc.DrawLine(mGuidePoint.x, top, mGuidePoint.x, bottom);
+    }
+    dc.SetPen(wxPen(wxColour(0, 160, 255)));
+    int half = std::max(1, static_cast<int>(kMarkerSize / scale / 2));
+    dc.DrawRectangle(mGuidePoint.x - half, mGuidePoint.y - half, half * 2 + 1, half * 2 + 1);
+}
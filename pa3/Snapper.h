@@ -0,0 +1,133 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+#include <wx/dc.h>
+#include <wx/gdicmn.h>
+#include "Shape.h"
+
+class Layer;
+
+// A point a shape can be snapped to, and whose it is
+struct SnapFeature
+{
+    wxPoint point;
+    ShapeId shape;
+};
+
+// Static 2-d tree over feature points, for nearest-neighbour queries.
+// The features are kept in one array, each range split at its median
+// alternately by x and y, so the tree needs no nodes of its own and
+// building it is a few passes of nth_element.
+class SnapIndex
+{
+public:
+    SnapIndex();
+
+    // Replaces the indexed features with these (the vector is taken)
+    void Build(std::vector<SnapFeature>& features);
+    void Clear();
+
+    size_t GetCount() const
+    {
+        return mFeatures.size();
+    }
+
+    // Up to k features within radius of point, nearest first, leaving
+    // out those belonging to shape exclude
+    void Nearest(const wxPoint& point, size_t k, double radius, ShapeId exclude,
+        std::vector<SnapFeature>& found) const;
+
+private:
+    // Ranges this small are searched straight through
+    static const size_t kLeafSize = 8;
+
+    struct Query
+    {
+        wxPoint point;
+        size_t k;
+        ShapeId exclude;
+        long long radius2;
+        // Max-heap of (squared distance, feature index)
+        std::vector<std::pair<long long, size_t>> best;
+    };
+
+    void Split(size_t first, size_t last, int axis);
+    void Search(size_t first, size_t last, int axis, Query& query) const;
+    void Consider(size_t index, Query& query) const;
+    // Squared distance a feature must beat to be kept
+    static long long Worst(const Query& query);
+
+    std::vector<SnapFeature> mFeatures;
+};
+
+// Pulls the pointer onto the grid and onto nearby shape features while
+// drawing or dragging, and shows where it snapped. Features are taken
+// from the layer being edited and indexed once per version of it; the
+// index is left alone during a drag, when only the dragged shape is
+// changing and its own features are left out anyway.
+class Snapper
+{
+public:
+    Snapper();
+
+    // Distance between grid lines, in document pixels
+    void SetGridSize(int size);
+    int GetGridSize() const
+    {
+        return mGridSize;
+    }
+    void SetSnapToGrid(bool on);
+    bool GetSnapToGrid() const
+    {
+        return mSnapToGrid;
+    }
+    void SetSnapToShapes(bool on);
+    bool GetSnapToShapes() const
+    {
+        return mSnapToShapes;
+    }
+    bool IsOn() const
+    {
+        return mSnapToGrid || mSnapToShapes;
+    }
+
+    // Where point snaps to on a view at scale (screen pixels per
+    // document pixel): the nearest feature of another shape within
+    // kRadius screen pixels, else the nearest grid point, else point
+    // itself. With reindex, the layer's features are indexed again if
+    // it has changed since.
+    wxPoint Snap(const wxPoint& point, double scale, const Layer& layer, ShapeId exclude, bool reindex);
+    // Stops showing where the last snap went
+    void ClearGuide();
+
+    // The grid, if snapping to it, and guides through the last snap
+    void Draw(wxDC& dc) const;
+
+private:
+    enum GuideType
+    {
+        SG_None,
+        SG_Grid,
+        SG_Shape,
+    };
+
+    void Index(const Layer& layer);
+
+    // Snap distance, and size of the guide's marker, in screen pixels
+    static const int kRadius = 8;
+    static const int kMarkerSize = 6;
+    // Grid lines closer than this on screen aren't drawn
+    static const int kMinGridPixels = 8;
+
+    int mGridSize;
+    bool mSnapToGrid;
+    bool mSnapToShapes;
+
+    SnapIndex mIndex;
+    // Layer and version the index was built from
+    unsigned long mLayerId;
+    unsigned long mLayerVersion;
+
+    GuideType mGuide;
+    wxPoint mGuidePoint;
+};
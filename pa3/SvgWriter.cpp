@@ -0,0 +1,391 @@
+#include "SvgWriter.h"
+#include "Affine.h"
+#include <wx/wfstream.h>
+#include <wx/mstream.h>
+#include <wx/image.h>
+#include <wx/base64.h>
+#include <cstdio>
+
+namespace
+{
+    // Output is written whenever this much has been buffered
+    const size_t kBufferSize = 256 * 1024;
+
+    unsigned long PackRGB(const wxColour& colour)
+    {
+        return (static_cast<unsigned long>(colour.Red()) << 16) |
+            (static_cast<unsigned long>(colour.Green()) << 8) |
+            colour.Blue();
+    }
+
+    // Copy of text with the characters that can't appear as is in an
+    // attribute value replaced by entities
+    std::string EscapeAttr(const std::string& text)
+    {
+        std::string escaped;
+        escaped.reserve(text.size());
+        for (char c : text)
+        {
+            switch (c)
+            {
+            case '&': escaped += "&amp;"; break;
+            case '<': escaped += "&lt;"; break;
+            case '"': escaped += "&quot;"; break;
+            default: escaped += c; break;
+            }
+        }
+        return escaped;
+    }
+}
+
+SvgWriter::SvgWriter()
+    :mCollecting(true)
+    ,mOk(true)
+{
+}
+
+SvgWriter::~SvgWriter()
+{
+}
+
+bool SvgWriter::Begin(const wxString& fileName, const wxRect& area)
+{
+    mCollecting = false;
+    mFile.reset(new wxFileOutputStream(fileName));
+    if (!mFile->IsOk())
+    {
+        mFile.reset();
+        return false;
+    }
+    mBuffer.reserve(kBufferSize + 1024);
+
+    Put("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<svg xmlns=\"http://www.w3.org/2000/svg\" "
+        "xmlns:xlink=\"http://www.w3.org/1999/xlink\" version=\"1.1\"");
+    Attr("width", area.width);
+    Attr("height", area.height);
+    Put(" viewBox=\"");
+    PutInt(area.x);
+    Put(" ");
+    PutInt(area.y);
+    Put(" ");
+    PutInt(area.width);
+    Put(" ");
+    PutInt(area.height);
+    Put("\">\n<style>\n"
+        "line,polyline{stroke-linecap:round;stroke-linejoin:round}\n"
+        // Pens keep their width on screen when a shape is scaled
+        "rect,ellipse,line,polyline{vector-effect:non-scaling-stroke}\n");
+    for (size_t i = 0; i < mStyleOrder.size(); i++)
+    {
+        const StyleKey& key = mStyleOrder[i];
+        Put(".s");
+        PutInt(static_cast<int>(i));
+        Put("{stroke:");
+        PutColour(key.stroke);
+        Put(";stroke-width:");
+        PutInt(key.width);
+        Put(";fill:");
+        if (key.fill < 0)
+            Put("none");
+        else
+            PutColour(static_cast<unsigned long>(key.fill));
+        Put("}\n");
+    }
+    Put("</style>\n<rect");
+    Attr("x", area.x);
+    Attr("y", area.y);
+    Attr("width", area.width);
+    Attr("height", area.height);
+    Put(" fill=\"#ffffff\"/>\n");
+    return Flush();
+}
+
+bool SvgWriter::End()
+{
+    if (!mFile)
+        return false;
+
+    Put("</svg>\n");
+    bool ok = Flush() && mFile->Close();
+    mFile.reset();
+    return ok;
+}
+
+void SvgWriter::EmbeddedImage(const wxImage& image, const wxSize& size)
+{
+    if (mCollecting)
+        return;
+
+    wxMemoryOutputStream png;
+    if (!image.SaveFile(png, wxBITMAP_TYPE_PNG))
+    {
+        mOk = false;
+        return;
+    }
+    std::vector<unsigned char> data(png.GetSize());
+    png.CopyTo(data.data(), data.size());
+
+    Put("<image x=\"0\" y=\"0\"");
+    Attr("width", size.GetWidth());
+    Attr("height", size.GetHeight());
+    Put(" xlink:href=\"data:image/png;base64,");
+    Put(std::string(wxBase64Encode(data.data(), data.size()).mb_str()));
+    Put("\"/>\n");
+}
+
+void SvgWriter::LinkedImage(const wxString& href, const wxSize& size)
+{
+    if (mCollecting)
+        return;
+
+    Put("<image x=\"0\" y=\"0\"");
+    Attr("width", size.GetWidth());
+    Attr("height", size.GetHeight());
+    Put(" xlink:href=\"");
+    Put(EscapeAttr(std::string(href.mb_str())));
+    Put("\"/>\n");
+}
+
+void SvgWriter::Rect(const wxPoint& topLeft, const wxPoint& botRight, const wxPen& pen, const wxBrush& brush)
+{
+    int style = StyleIndex(pen, &brush);
+    if (mCollecting)
+        return;
+
+    // Same extent as wxRect(topLeft, botRight)
+    Open("rect", style);
+    Attr("x", topLeft.x);
+    Attr("y", topLeft.y);
+    Attr("width", botRight.x - topLeft.x + 1);
+    Attr("height", botRight.y - topLeft.y + 1);
+    Put("/>\n");
+}
+
+void SvgWriter::Ellipse(const wxPoint& topLeft, const wxPoint& botRight, const wxPen& pen, const wxBrush& brush)
+{
+    int style = StyleIndex(pen, &brush);
+    if (mCollecting)
+        return;
+
+    // Centre and radii can land on half pixels
+    int width = botRight.x - topLeft.x + 1;
+    int height = botRight.y - topLeft.y + 1;
+    Open("ellipse", style);
+    HalfAttr("cx", topLeft.x * 2 + width);
+    HalfAttr("cy", topLeft.y * 2 + height);
+    HalfAttr("rx", width);
+    HalfAttr("ry", height);
+    Put("/>\n");
+}
+
+void SvgWriter::Line(const wxPoint& start, const wxPoint& end, const wxPen& pen)
+{
+    int style = StyleIndex(pen, nullptr);
+    if (mCollecting)
+        return;
+
+    Open("line", style);
+    Attr("x1", start.x);
+    Attr("y1", start.y);
+    Attr("x2", end.x);
+    Attr("y2", end.y);
+    Put("/>\n");
+}
+
+void SvgWriter::Polyline(const wxPoint* points, size_t count, const wxPoint& offset, const wxPen& pen)
+{
+    int style = StyleIndex(pen, nullptr);
+    if (mCollecting || count == 0)
+        return;
+
+    Open("polyline", style);
+    Put(" points=\"");
+    for (size_t i = 0; i < count; i++)
+    {
+        if (i > 0)
+            Put(" ");
+        PutInt(points[i].x + offset.x);
+        Put(",");
+        PutInt(points[i].y + offset.y);
+    }
+    // A single point is drawn as a dot, like wxDC::DrawPoint
+    if (count == 1)
+    {
+        Put(" ");
+        PutInt(points[0].x + offset.x + 1);
+        Put(",");
+        PutInt(points[0].y + offset.y);
+    }
+    Put("\"/>\n");
+}
+
+void SvgWriter::Rects(const wxRect* rects, size_t count, const wxPoint& offset, const wxBrush& brush)
+{
+    // Zero-width pen, so the class has no visible stroke
+    int style = StyleIndex(wxPen(brush.GetColour(), 0), &brush);
+    if (mCollecting || count == 0)
+        return;
+
+    Open("path", style);
+    Put(" d=\"");
+    for (size_t i = 0; i < count; i++)
+    {
+        Put("M");
+        PutInt(rects[i].x + offset.x);
+        Put(",");
+        PutInt(rects[i].y + offset.y);
+        Put("h");
+        PutInt(rects[i].width);
+        Put("v");
+        PutInt(rects[i].height);
+        Put("h");
+        PutInt(-rects[i].width);
+        Put("z");
+    }
+    Put("\"/>\n");
+}
+
+void SvgWriter::BeginGroup(double opacity)
+{
+    if (mCollecting)
+        return;
+
+    Put("<g");
+    if (opacity < 1.0)
+    {
+        // Three decimals is finer than 8-bit alpha
+        char text[16];
+        snprintf(text, sizeof(text), "%.3f", opacity);
+        Put(" opacity=\"");
+        Put(text);
+        Put("\"");
+    }
+    Put(">\n");
+}
+
+void SvgWriter::BeginTransform(const Affine& transform)
+{
+    if (mCollecting)
+        return;
+
+    char text[160];
+    snprintf(text, sizeof(text), "<g transform=\"matrix(%g %g %g %g %g %g)\">\n",
+        transform.a, transform.b, transform.c, transform.d, transform.tx, transform.ty);
+    Put(text);
+}
+
+void SvgWriter::EndGroup()
+{
+    if (mCollecting)
+        return;
+
+    Put("</g>\n");
+}
+
+int SvgWriter::StyleIndex(const wxPen& pen, const wxBrush* brush)
+{
+    StyleKey key;
+    key.stroke = PackRGB(pen.GetColour());
+    key.width = pen.GetWidth();
+    key.fill = brush ? static_cast<long>(PackRGB(brush->GetColour())) : -1;
+
+    auto iter = mStyles.find(key);
+    if (iter != mStyles.end())
+        return iter->second;
+
+    // A style that somehow wasn't seen while collecting still gets a
+    // class, it just won't have a rule
+    int index = static_cast<int>(mStyleOrder.size());
+    mStyles.emplace(key, index);
+    mStyleOrder.push_back(key);
+    return index;
+}
+
+void SvgWriter::Open(const char* tag, int style)
+{
+    Put("<");
+    Put(tag);
+    Put(" class=\"s");
+    PutInt(style);
+    Put("\"");
+}
+
+void SvgWriter::Attr(const char* name, int value)
+{
+    Put(" ");
+    Put(name);
+    Put("=\"");
+    PutInt(value);
+    Put("\"");
+}
+
+void SvgWriter::HalfAttr(const char* name, int twice)
+{
+    Put(" ");
+    Put(name);
+    Put("=\"");
+    if (twice < 0)
+    {
+        Put("-");
+        twice = -twice;
+    }
+    PutInt(twice / 2);
+    if (twice % 2 != 0)
+        Put(".5");
+    Put("\"");
+}
+
+void SvgWriter::Put(const char* text)
+{
+    mBuffer.append(text);
+    if (mBuffer.size() >= kBufferSize)
+        Flush();
+}
+
+void SvgWriter::Put(const std::string& text)
+{
+    mBuffer.append(text);
+    if (mBuffer.size() >= kBufferSize)
+        Flush();
+}
+
+// Hand-rolled so the hot path doesn't go through printf or wxString
+void SvgWriter::PutInt(int value)
+{
+    char digits[12];
+    int length = 0;
+    unsigned int magnitude = (value < 0) ? 0u - static_cast<unsigned int>(value) : static_cast<unsigned int>(value);
+    do
+    {
+        digits[length++] = static_cast<char>('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude > 0);
+    if (value < 0)
+        mBuffer.push_back('-');
+    while (length > 0)
+    {
+        mBuffer.push_back(digits[--length]);
+    }
+}
+
+void SvgWriter::PutColour(unsigned long rgb)
+{
+    static const char hex[] = "0123456789abcdef";
+    mBuffer.push_back('#');
+    for (int shift = 20; shift >= 0; shift -= 4)
+    {
+        mBuffer.push_back(hex[(rgb >> shift) & 0xF]);
+    }
+}
+
+bool SvgWriter::Flush()
+{
+    if (!mFile || mBuffer.empty())
+        return mOk;
+
+    mFile->Write(mBuffer.data(), mBuffer.size());
+    mOk = mOk && mFile->LastWrite() == mBuffer.size();
+    mBuffer.clear();
+    return mOk;
+}
@@ -0,0 +1,94 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <wx/gdicmn.h>
+#include <wx/pen.h>
+#include <wx/brush.h>
+#include <wx/string.h>
+
+struct Affine;
+class wxFileOutputStream;
+class wxImage;
+
+// Streams a drawing out as SVG. Shapes are visited twice: the first
+// pass (before Begin) only collects the distinct pen/brush combinations
+// so they can be written once as CSS classes; the second pass writes
+// the elements straight to the file through a fixed-size buffer.
+class SvgWriter
+{
+public:
+    SvgWriter();
+    ~SvgWriter();
+
+    // Opens the file and writes the header and style sheet; area is
+    // the part of the document the picture shows
+    bool Begin(const wxString& fileName, const wxRect& area);
+    // Writes any buffered output and closes the document
+    bool End();
+
+    // Background image, either embedded as base64 PNG or referenced
+    // by a (relative) file name
+    // Draws the image stretched over size
+    void EmbeddedImage(const wxImage& image, const wxSize& size);
+    void LinkedImage(const wxString& href, const wxSize& size);
+
+    void Rect(const wxPoint& topLeft, const wxPoint& botRight, const wxPen& pen, const wxBrush& brush);
+    void Ellipse(const wxPoint& topLeft, const wxPoint& botRight, const wxPen& pen, const wxBrush& brush);
+    void Line(const wxPoint& start, const wxPoint& end, const wxPen& pen);
+    void Polyline(const wxPoint* points, size_t count, const wxPoint& offset, const wxPen& pen);
+    // Bucket fill, as one path of unstroked rectangles
+    void Rects(const wxRect* rects, size_t count, const wxPoint& offset, const wxBrush& brush);
+
+    // Wraps the following elements in a <g>, with group opacity when
+    // it's below 1
+    void BeginGroup(double opacity);
+    // Wraps the following elements in a <g> with a transform matrix
+    void BeginTransform(const Affine& transform);
+    void EndGroup();
+
+    // Disallow copy/assignment
+    SvgWriter(const SvgWriter&) = delete;
+    SvgWriter& operator=(const SvgWriter&) = delete;
+private:
+    struct StyleKey
+    {
+        unsigned long stroke;
+        int width;
+        // -1 for unfilled shapes
+        long fill;
+        bool operator==(const StyleKey& other) const
+        {
+            return stroke == other.stroke && width == other.width && fill == other.fill;
+        }
+    };
+    struct StyleHash
+    {
+        size_t operator()(const StyleKey& key) const
+        {
+            return std::hash<unsigned long>()(key.stroke) * 31 +
+                std::hash<int>()(key.width) * 7 + std::hash<long>()(key.fill);
+        }
+    };
+
+    // Returns the class index for a style, adding it while collecting
+    int StyleIndex(const wxPen& pen, const wxBrush* brush);
+    // Starts an element: "<tag class="sN""
+    void Open(const char* tag, int style);
+    void Attr(const char* name, int value);
+    // Writes twice / 2, keeping a trailing .5
+    void HalfAttr(const char* name, int twice);
+    void Put(const char* text);
+    void Put(const std::string& text);
+    void PutInt(int value);
+    void PutColour(unsigned long rgb);
+    bool Flush();
+
+    bool mCollecting;
+    std::unordered_map<StyleKey, int, StyleHash> mStyles;
+    std::vector<StyleKey> mStyleOrder;
+    std::unique_ptr<wxFileOutputStream> mFile;
+    std::string mBuffer;
+    bool mOk;
+};
@@ -0,0 +1,115 @@
+#include "ThreadPool.h"
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+ThreadPool::ThreadPool(unsigned threads)
+    :mStopping(false)
+{
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+
+    for (unsigned i = 0; i < threads; i++)
+    {
+        mThreads.emplace_back(&ThreadPool::WorkerLoop, this);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStopping = true;
+    }
+    mCondition.notify_all();
+    for (std::thread& thread : mThreads)
+    {
+        thread.join();
+    }
+}
+
+ThreadPool& ThreadPool::Get()
+{
+    static ThreadPool pool;
+    return pool;
+}
+
+std::future<void> ThreadPool::Submit(std::function<void()> task)
+{
+    // packaged_task is move-only, std::function needs copyable
+    auto packaged = std::make_shared<std::packaged_task<void()>>(task);
+    std::future<void> retVal = packaged->get_future();
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mTasks.emplace_back([packaged]() { (*packaged)(); });
+    }
+    mCondition.notify_one();
+    return retVal;
+}
+
+void ThreadPool::ParallelFor(int count, const std::function<void(int)>& fn)
+{
+    if (count <= 0)
+        return;
+    if (count == 1)
+    {
+        fn(0);
+        return;
+    }
+
+    struct State
+    {
+        std::atomic<int> next;
+        std::atomic<int> done;
+        std::mutex mutex;
+        std::condition_variable finished;
+    };
+    auto state = std::make_shared<State>();
+    state->next = 0;
+    state->done = 0;
+
+    // Each helper (and the caller) keeps pulling indices until none
+    // are left. Helpers that start late simply find nothing to do.
+    std::function<void()> drain = [state, count, &fn]()
+    {
+        int i;
+        while ((i = state->next++) < count)
+        {
+            fn(i);
+            if (++state->done == count)
+            {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                state->finished.notify_all();
+            }
+        }
+    };
+
+    int helpers = std::min(count - 1, static_cast<int>(mThreads.size()));
+    for (int i = 0; i < helpers; i++)
+    {
+        // Helpers capture fn by reference, but only call it while the
+        // caller below is still waiting on the done count
+        Submit(drain);
+    }
+    drain();
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->finished.wait(lock, [&state, count]() { return state->done == count; });
+}
+
+void ThreadPool::WorkerLoop()
+{
+    for (;;)
+    {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mCondition.wait(lock, [this]() { return mStopping || !mTasks.empty(); });
+            if (mStopping && mTasks.empty())
+                return;
+            task = std::move(mTasks.front());
+            mTasks.pop_front();
+        }
+        task();
+    }
+}
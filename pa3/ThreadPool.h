@@ -0,0 +1,46 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed-size pool of worker threads for CPU-bound jobs (encoding,
+// filtering, rendering). Tasks must not touch wx GUI objects.
+class ThreadPool
+{
+public:
+    // A thread count of 0 uses one thread per hardware core
+    explicit ThreadPool(unsigned threads = 0);
+    ~ThreadPool();
+
+    // Queue a task; the future becomes ready once it has run
+    std::future<void> Submit(std::function<void()> task);
+
+    // Runs fn(0) .. fn(count - 1) across the pool and blocks until all
+    // have finished. The calling thread helps out, so this is safe to
+    // call from inside another pool task.
+    void ParallelFor(int count, const std::function<void(int)>& fn);
+
+    unsigned GetThreadCount() const
+    {
+        return static_cast<unsigned>(mThreads.size());
+    }
+
+    // Shared pool used by the rest of the app
+    static ThreadPool& Get();
+
+    // Disallow copy/assignment
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+private:
+    void WorkerLoop();
+
+    std::vector<std::thread> mThreads;
+    std::deque<std::function<void()>> mTasks;
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    bool mStopping;
+};
@@ -0,0 +1,208 @@
+#include "UndoTree.h"
+#include "Command.h"
+#include <algorithm>
+#include <queue>
+#include <set>
+
+UndoTree::UndoTree()
+    :mCurrent(nullptr)
+    ,mNextSequence(0)
+{
+    Clear();
+}
+
+UndoTree::~UndoTree()
+{
+    Destroy(std::move(mRoot));
+}
+
+void UndoTree::Add(const std::shared_ptr<Command>& command)
+{
+    std::unique_ptr<Node> node(new Node);
+    node->command = command;
+    node->parent = mCurrent;
+    node->active = 0;
+    node->sequence = mNextSequence++;
+    node->depth = mCurrent->depth + 1;
+    mBySequence.insert(mBySequence.end(), std::make_pair(node->sequence, node.get()));
+
+    mCurrent->children.push_back(std::move(node));
+    mCurrent->active = mCurrent->children.size() - 1;
+    mCurrent = mCurrent->children.back().get();
+}
+
+void UndoTree::Clear()
+{
+    Destroy(std::move(mRoot));
+    mBySequence.clear();
+    mNextSequence = 0;
+
+    mRoot.reset(new Node);
+    mRoot->parent = nullptr;
+    mRoot->active = 0;
+    mRoot->sequence = mNextSequence++;
+    mRoot->depth = 0;
+    mBySequence[mRoot->sequence] = mRoot.get();
+    mCurrent = mRoot.get();
+}
+
+std::shared_ptr<Command> UndoTree::GetUndo() const
+{
+    return mCurrent->command;
+}
+
+std::shared_ptr<Command> UndoTree::GetRedo() const
+{
+    if (mCurrent->children.empty())
+        return std::shared_ptr<Command>();
+    return mCurrent->children[mCurrent->active]->command;
+}
+
+void UndoTree::StepBack()
+{
+    Node* parent = mCurrent->parent;
+    // Redo comes back the same way
+    parent->active = IndexOf(mCurrent);
+    mCurrent = parent;
+}
+
+void UndoTree::StepForward()
+{
+    mCurrent = mCurrent->children[mCurrent->active].get();
+}
+
+void UndoTree::SetBranch(size_t branch)
+{
+    if (branch < mCurrent->children.size())
+        mCurrent->active = branch;
+}
+
+void UndoTree::SetBranchTo(const Node* node)
+{
+    node->parent->active = IndexOf(node);
+}
+
+const UndoTree::Node* UndoTree::GetEarlier() const
+{
+    auto iter = mBySequence.find(mCurrent->sequence);
+    if (iter == mBySequence.begin())
+        return nullptr;
+    return (--iter)->second;
+}
+
+const UndoTree::Node* UndoTree::GetLater() const
+{
+    auto iter = mBySequence.upper_bound(mCurrent->sequence);
+    return iter == mBySequence.end() ? nullptr : iter->second;
+}
+
+const UndoTree::Node* UndoTree::CommonAncestor(const Node* a, const Node* b) const
+{
+    while (a->depth > b->depth)
+        a = a->parent;
+    while (b->depth > a->depth)
+        b = b->parent;
+    while (a != b)
+    {
+        a = a->parent;
+        b = b->parent;
+    }
+    return a;
+}
+
+void UndoTree::DropOldest(const std::function<bool()>& overBudget)
+{
+    if (!overBudget())
+        return;
+
+    // With no other branches (always the case right after Add, which
+    // leaves nothing to redo) only the oldest steps can go, and finding
+    // that out needn't look at the whole tree
+    size_t line = GetDepth() + 1;
+    for (const Node* node = mCurrent; !node->children.empty(); )
+    {
+        node = node->children[node->active].get();
+        line++;
+    }
+    if (mBySequence.size() > line)
+        DropBranches(overBudget);
+
+    // Only the current line is left, so the root has one child
+    while (overBudget() && GetDepth() > 1)
+    {
+        std::unique_ptr<Node> next = std::move(mRoot->children[mRoot->active]);
+        mBySequence.erase(mRoot->sequence);
+        Destroy(std::move(mRoot));
+        next->parent = nullptr;
+        // Its state is the oldest kept; there's no undoing past it
+        next->command.reset();
+        mRoot = std::move(next);
+    }
+}
+
+void UndoTree::DropBranches(const std::function<bool()>& overBudget)
+{
+    // States that undo and redo can reach without changing branch
+    std::set<const Node*> kept;
+    for (const Node* node = mCurrent; node; node = node->parent)
+    {
+        kept.insert(node);
+    }
+    for (const Node* node = mCurrent; !node->children.empty(); )
+    {
+        node = node->children[node->active].get();
+        kept.insert(node);
+    }
+
+    // Other branches go leaf by leaf, oldest first; a parent left with
+    // no children becomes a leaf in turn
+    typedef std::pair<unsigned long, Node*> Leaf;
+    std::priority_queue<Leaf, std::vector<Leaf>, std::greater<Leaf>> leaves;
+    for (auto& entry : mBySequence)
+    {
+        if (entry.second->children.empty() && kept.count(entry.second) == 0)
+            leaves.push(entry);
+    }
+    while (!leaves.empty() && overBudget())
+    {
+        Node* leaf = leaves.top().second;
+        leaves.pop();
+        Node* parent = leaf->parent;
+        size_t index = IndexOf(leaf);
+        mBySequence.erase(leaf->sequence);
+        parent->children.erase(parent->children.begin() + index);
+        if (parent->active > index || parent->active == parent->children.size())
+            parent->active = parent->active == 0 ? 0 : parent->active - 1;
+
+        if (parent->children.empty() && kept.count(parent) == 0)
+            leaves.push(Leaf(parent->sequence, parent));
+    }
+}
+
+void UndoTree::Destroy(std::unique_ptr<Node> node)
+{
+    std::vector<std::unique_ptr<Node>> pending;
+    if (node)
+        pending.push_back(std::move(node));
+    while (!pending.empty())
+    {
+        std::unique_ptr<Node> next = std::move(pending.back());
+        pending.pop_back();
+        for (auto& child : next->children)
+        {
+            if (child)
+                pending.push_back(std::move(child));
+        }
+    }
+}
+
+size_t UndoTree::IndexOf(const Node* child) const
+{
+    const std::vector<std::unique_ptr<Node>>& siblings = child->parent->children;
+    for (size_t i = 0; i < siblings.size(); i++)
+    {
+        if (siblings[i].get() == child)
+            return i;
+    }
+    return 0;
+}
@@ -0,0 +1,117 @@
+#pragma once
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
+
+class Command;
+
+// Every state the document has been in, as a tree. Each node is the
+// command that led to it from its parent's state, so the tree costs
+// no more than the commands themselves, and they share their shapes
+// with the document. Doing something after an undo starts a new branch
+// alongside the steps that could have been redone, instead of dropping
+// them.
+//
+// The tree only keeps track of where the document is. Commands apply
+// themselves and then call StepBack or StepForward (through
+// PaintModel::Undo and Redo), so getting between two states is up to
+// where their branches meet and back down (see PaintModel::JumpTo).
+class UndoTree
+{
+public:
+    struct Node
+    {
+        // The change from the parent's state to this one; null at the root
+        std::shared_ptr<Command> command;
+        Node* parent;
+        std::vector<std::unique_ptr<Node>> children;
+        // Child that redo goes to: the one made or left last
+        size_t active;
+        // Order the states were made in
+        unsigned long sequence;
+        // Steps below the first root; see GetDepth
+        size_t depth;
+    };
+
+    UndoTree();
+    ~UndoTree();
+
+    // Adds command as a new branch from the current state and moves
+    // to it
+    void Add(const std::shared_ptr<Command>& command);
+    // Forgets everything, leaving only an empty root
+    void Clear();
+
+    // Commands that undo and redo would run, or null
+    std::shared_ptr<Command> GetUndo() const;
+    std::shared_ptr<Command> GetRedo() const;
+    // Moves to the parent, or to the active child
+    void StepBack();
+    void StepForward();
+
+    const Node* GetCurrent() const
+    {
+        return mCurrent;
+    }
+    // Steps from the oldest state kept to node
+    size_t GetDepth(const Node* node) const
+    {
+        return node->depth - mRoot->depth;
+    }
+    size_t GetDepth() const
+    {
+        return GetDepth(mCurrent);
+    }
+    // States other than the oldest
+    size_t GetSize() const
+    {
+        return mBySequence.size() - 1;
+    }
+
+    // Branches redo could take from the current state, and the one it
+    // will take
+    size_t GetBranchCount() const
+    {
+        return mCurrent->children.size();
+    }
+    size_t GetBranch() const
+    {
+        return mCurrent->active;
+    }
+    void SetBranch(size_t branch);
+    // Makes node the branch redo takes from its parent
+    void SetBranchTo(const Node* node);
+
+    // States made just before and after the current one, whatever
+    // branch they're on, or null
+    const Node* GetEarlier() const;
+    const Node* GetLater() const;
+    // Last state both a and b come from
+    const Node* CommonAncestor(const Node* a, const Node* b) const;
+
+    // Drops the oldest states while overBudget says so: first branches
+    // that are neither behind the current state nor ahead of it on the
+    // redo branch, oldest first, then steps from the start, always
+    // keeping the latest undo
+    void DropOldest(const std::function<bool()>& overBudget);
+
+    // Disallow copy/assignment
+    UndoTree(const UndoTree&) = delete;
+    UndoTree& operator=(const UndoTree&) = delete;
+private:
+    // Frees a subtree without recursing, so long histories can't
+    // overflow the stack
+    void Destroy(std::unique_ptr<Node> node);
+    // The first part of DropOldest: drops states off the current line,
+    // oldest leaf first, while overBudget says so. This walks the whole
+    // tree, so it's only for when there are such states.
+    void DropBranches(const std::function<bool()>& overBudget);
+    size_t IndexOf(const Node* child) const;
+
+    std::unique_ptr<Node> mRoot;
+    Node* mCurrent;
+    // Every state kept, root included
+    std::map<unsigned long, Node*> mBySequence;
+    unsigned long mNextSequence;
+};